@@ -7,56 +7,34 @@ require_relative "soundbuffer"
 filename = Window.open_filename([["WAV File(*.wav)", "*.wav"]], "WAV File")
 exit if filename.nil?
 
-channels, samples_per_sec, bits_per_sample = 0, 0, 0
-wave = File.open(filename, binmode: true) { |f|
-  e_not_wav   = "this file may not be in the WAV format"
-  e_unsupport = "unsupported WAV file"
-  e_broken    = "broken WAV file"
-  header_size = 44
-  head = f.read(header_size)
-  data = head.unpack("a4Va4a4VvvVVvva4V")
-  raise e_not_wav   if data[0] != "RIFF"
-  _body_size        =  data[1]
-  raise e_not_wav   if data[2] != "WAVE"
-  raise e_not_wav   if data[3] != "fmt "
-  raise e_unsupport if data[4] != 16     # fmt chunk size
-  raise e_unsupport if data[5] != 1      # liner PCM fromat
-  channels          =  data[6]
-  raise e_unsupport unless channels == 1 || channels == 2
-  samples_per_sec   =  data[7]
-  _bytes_per_sec    =  data[8]
-  bytes_per_sample  =  data[9]
-  bits_per_sample   =  data[10]
-  raise e_unsupport if bits_per_sample != 16
-  raise e_broken    if bytes_per_sample != bits_per_sample / 8 * channels
-  raise e_broken    if data[11] != "data"
-  data_size         =  data[12]
-  raise e_broken    unless (data_size % bytes_per_sample).zero?
-  #raise e_unsupport unless 4 + _body_size == header_size + data_size
-  total = data_size / bytes_per_sample
-  f.read(data_size)
-}
-#
-# SoundBuffer object create
-#
-sound = SoundBuffer.new(wave, channels, samples_per_sec, bits_per_sample, effect: true).tap { |s|
+sound = SoundBuffer.load(filename, effect: true, loop: false).tap { |s|
   s.loop_start = 0
   s.loop_end   = 0
   s.loop_count = 0
 }
-puts "Create Reverce wave data"
-r_sound = SoundBuffer.new(
-  sound.size,
-  sound.channels,
-  sound.samples_per_sec,
-  sound.bits_per_sample,
-  effect: sound.effectable?
-).tap { |s|
-  r_wave = (wave.size / 4).downto(0).inject(""){ |w, i| w << wave[i * 4, 4] }
-  s.write(r_wave)
+samples_per_sec = sound.samples_per_sec
+#
+# 巻き戻し。逆再生できるバックエンドならdirectionで、できなければPCMを反転する
+#
+reversed = false
+reverse  = lambda { |s, dir|
+  begin
+    s.direction = dir
+  rescue NotImplementedError
+    pos = s.pcm_pos
+    s.reverse!
+    s.pcm_pos = s.total - 1 - pos
+    reversed  = dir < 0
+  end
 }
 
-fx = [SoundBuffer::FXWavesReverb.new]
+#
+# エフェクトは止まっているうちに並べておき、Xキーではバイパスを切り替えるだけにする
+#
+if sound.effectable?
+  sound.effect = [SoundBuffer::FXWavesReverb.new]
+  sound.set_effect_bypass(0, true)
+end
 font = Font.default
 
 play_sound = sound
@@ -102,17 +80,13 @@ Window.loop do
       speed = -4
       played = play_sound.playing?
       play_sound.pause
-      pos = play_sound.pcm_pos
-      play_sound = r_sound
-      play_sound.pcm_pos = play_sound.total - pos
+      reverse[play_sound, -1]
       play_sound.play #unless played
     end
     if Input.key_release?(K_LEFT)
       speed = 1
       play_sound.pause
-      pos = play_sound.pcm_pos
-      play_sound = sound
-      play_sound.pcm_pos = play_sound.total - pos
+      reverse[play_sound, 1]
       played ? play_sound.play : play_sound.pause ;
     end
   end
@@ -160,10 +134,9 @@ Window.loop do
   #
   # FX Control
   #
-  if Input.key_down?(K_X)
-    play_sound.effect = fx if     play_sound.effectable? && play_sound.effect.empty?
-  else
-    play_sound.effect = [] unless play_sound.effectable? && play_sound.effect.empty?
+  if play_sound.effectable?
+    bypass = !Input.key_down?(K_X)
+    play_sound.set_effect_bypass(0, bypass) unless play_sound.get_effect_bypass(0) == bypass
   end
   #
   # Refrect Parameters
@@ -183,7 +156,7 @@ Window.loop do
   Window.draw_font(  0,  50, "Pitch: #{pitch >= 0 ? '+' : '';}#{pitch} Freq:#{play_sound.frequency}Hz",  font)
   Window.draw_font(  0,  75, "Volume: #{play_sound.volume}",  font)
   Window.draw_line(  0, 120, 639, 120, C_WHITE)
-  cur_x = Window.width * (speed > 0 ? play_sound.pcm_pos : play_sound.total - play_sound.pcm_pos) / play_sound.total - font.size / 2
+  cur_x = Window.width * (reversed ? play_sound.total - 1 - play_sound.pcm_pos : play_sound.pcm_pos) / play_sound.total - font.size / 2
   Window.draw_font(cur_x, 120, '↑',  font, color:C_GREEN)
   cur_A = Window.width * sound.loop_start / play_sound.total - font.size / 2
   Window.draw_font(cur_A, 120, '↑',  font, color:C_YELLOW) unless sound.loop_start.zero?
@@ -26,53 +26,48 @@
  */
 #include "ruby.h"
 #include "ruby/thread.h"
+#include "ruby/encoding.h"
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include "ruby/io/buffer.h"
+#endif
+#include <stdlib.h>
 #include <string.h>
+#include <math.h>
 /*
- * DirectSoundではGUIDを引数に使用することがある。
- * GUID_NULLの定義が必要になる。このためks.hファイルとlibuuidをリンクする必要がある。
+ * DirectSoundなどのオーディオAPIはsb_backend.hのインターフェースを通して使う。
+ * DirectSound固有のヘッダーの扱いについてはsb_backend.hを参照。
  */
-#include "ks.h"
-/*
- * MSから配布されている開発キットをインストールしてdsound.hとsal.hを入手する必要がある。
- * MinGW付属のdsound.hはDirectXで使用できる全ての機能をサポートしていない。
- * また、MinGWが提供するdsound.hはWineプロジェクトのものであり、そのライセンスはGPLである。
- *
- * MSのsdound.hはsal.hを内部でインクルードしている。
- * このままコンパイルすると__nullが定義されないためエラーが出る。
- * そのため__nullを自前で定義する必要がある。
- */
-#define __null
-#define DIRECTSOUND_VERSION 0x0900
-#include <dsound.h>
-
-// Ruby側のエフェクト指定用の定数
-// クラス定義のセクションでRuby定数定義を行っている。
-#define FX_GARGLE       0
-#define FX_CHORUS       1
-#define FX_FLANGER      2
-#define FX_ECHO         3
-#define FX_DISTORTION   4
-#define FX_COMPRESSOR   5
-#define FX_PARAM_EQ     6
-#define FX_I3DL2_REVERB 7
-#define FX_WAVES_REVERB 8
+#include "sb_backend.h"
+#include "sb_fx.h"
+#include "sb_mix.h"
+#include "sb_wav.h"
+
+// Ruby 3.2以降にはtaintが無い
+#ifndef HAVE_RB_OBJ_TAINT
+#define rb_obj_taint(obj)   (obj)
+#define rb_obj_tainted(obj) Qfalse
+#endif
 
 // 通知イベントの固定ハンドル数
 #define EVENT_PRESET    3
+// 固定ハンドルはevent_handlesの末尾にこの順で並ぶ。notify_indexが番号の代わりに返す
+#define EVENT_INDEX_LOOP_POINT ((DWORD)-3)
+#define EVENT_INDEX_OFFSETSTOP ((DWORD)-2)
+#define EVENT_INDEX_WAIT_BREAK ((DWORD)-1)
 
 // RubyのSoundTestクラス
 static VALUE cSoundBuffer;
+static VALUE cStream;
 
 // Rubyの例外オブジェクト
 static VALUE eSoundBufferError;
 
-// COMのDirectSoundオブジェクト
-static LPDIRECTSOUND8       g_pDSound;
-static LPDIRECTSOUNDBUFFER  g_pDSBuffer;
+// オーディオ・デバイス（DirectSoundオブジェクト＋プライマリーバッファー）
+static LPSBDEVICE           g_pDevice;
 
 // RubyのSoundTestオブジェクトが持つC構造体
 struct SoundBuffer {
-  LPDIRECTSOUNDBUFFER8  pDSBuffer8;
+  LPSBBUFFER            pBuffer;
   VALUE                 origin;
   DWORD                 copy_flag;
   size_t                buffer_bytes;
@@ -81,9 +76,22 @@ struct SoundBuffer {
   WORD                  bits_per_sample;
   WORD                  block_align;
   DWORD                 avg_bytes_per_sec;
+  WORD                  format_tag;       // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+  DWORD                 channel_mask;     // 0なら既定のスピーカー配置
   DWORD                 effect_flag;
+  DWORD                 seamless_flag;    // ループ区間のつなぎ目をサンプル単位で合わせる
+  LPSBSTATS             stats;            // 統計を有効にしてから使ったときに作る
+  DWORD                 shared_flag;      // dupされたことがある。メモリーを共有するのでPoolに戻せない
+  LONG                  volume;           // 音量・パン・周波数の写し。読むときはデバイスに聞かない
+  LONG                  pan;
+  DWORD                 frequency;        // DSBFREQUENCY_ORIGINALではなく実際の周波数
+  DWORD                 param_dirty;      // 写しだけ変えて、まだデバイスに送っていないもの（PARAM_*）
+  DWORD                 param_auto;       // 自動変化させているもの（PARAM_*）。写しが古いので読むときはデバイスに聞く
+  DWORD                 param_sched;      // 予定表で変えるもの（PARAM_*）。済むまでは読むときにデバイスに聞く
+  DWORD                 sched_flag;       // 予定表に再生・停止を積んだ。済んだら再生状態を読み直す
   DWORD                 effect_count;
   LPDWORD               effect_nums;
+  LPBYTE                effect_bypass;    // effect_numsと同じ並びで、素通しにしているもの
   DWORD                 play_flag;
   DWORD                 repeat_flag;
   DWORD                 loop_flag;
@@ -93,17 +101,22 @@ struct SoundBuffer {
   DWORD                 loop_counter;
   DWORD                 event_count;
   LPDWORD               event_offsets;
-  LPHANDLE              event_handles;
-  HANDLE                event_loop_point;
-  HANDLE                event_offsetstop;
-  HANDLE                event_wait_break;
+  SBEVENT              *event_handles;
+  SBEVENT               event_loop_point;
+  SBEVENT               event_offsetstop;
+  SBEVENT               event_wait_break;
+  struct SBStream      *stream;
+  DWORD                 busy;             // GVLを外してpBufferを使っている呼び出しの数。0でなければ解放できない
 };
 
 // notify_wait_blockingの引数に与えるための型データ
 struct NotifyData {
+  VALUE     self;
   DWORD     result;
   DWORD     timeout;
-  struct SoundBuffer* st;
+  DWORD     count;      // handlesのうち参照を取ったものの数。その後ろに中止用を置く
+  SBEVENT  *handles;
+  SBEVENT   cancel;
 };
 
 // プロトタイプ宣言
@@ -122,6 +135,12 @@ static VALUE  row2pcmnum(struct SoundBuffer*, DWORD);
 static DWORD  pcmnum2row(struct SoundBuffer*, VALUE);
 static VALUE  SoundBuffer_set_notify(int, VALUE*, VALUE);
 static void   create_st_event(struct SoundBuffer*, DWORD, LPDWORD);
+static void   sync_loop(struct SoundBuffer*);
+static void   param_flush(struct SoundBuffer*);
+static void   refresh_st_params(struct SoundBuffer*, DWORD);
+static void   sched_sync(struct SoundBuffer*);
+static VALUE  SoundBuffer_fill_silence(int, VALUE*, VALUE);
+static void   stream_release(struct SoundBuffer*);
 // TypedData用の型データ
 const rb_data_type_t SoundBuffer_data_type = {
   "SoundBuffer",
@@ -158,7 +177,7 @@ clear_st_event(struct SoundBuffer *st)
       if (!(st->event_handles[i] == st->event_loop_point
          || st->event_handles[i] == st->event_offsetstop
          || st->event_handles[i] == st->event_wait_break))
-      CloseHandle(st->event_handles[i]);
+      sb_event_close(st->event_handles[i]);
     }
     xfree(st->event_handles);
     st->event_handles = NULL;
@@ -174,15 +193,15 @@ static void
 create_st_event_presets(struct SoundBuffer *st)
 {
   if (!st->event_loop_point) {
-    st->event_loop_point = CreateEvent(NULL, FALSE, FALSE, NULL);
+    st->event_loop_point = sb_event_create(FALSE);
     if (!st->event_loop_point) rb_raise(eSoundBufferError, "create_st_event_presets error");
   }
   if (!st->event_offsetstop) {
-    st->event_offsetstop = CreateEvent(NULL, TRUE,  FALSE, NULL);
+    st->event_offsetstop = sb_event_create(TRUE);
     if (!st->event_offsetstop) rb_raise(eSoundBufferError, "create_st_event_presets error");
   }
   if (!st->event_wait_break) {
-    st->event_wait_break = CreateEvent(NULL, TRUE,  FALSE, NULL);
+    st->event_wait_break = sb_event_create(TRUE);
     if (!st->event_wait_break) rb_raise(eSoundBufferError, "create_st_event_presets error");
   }
 }
@@ -191,15 +210,15 @@ static void
 clear_st_event_presets(struct SoundBuffer *st)
 {
   if (st->event_loop_point) {
-    CloseHandle(st->event_loop_point);
+    sb_event_close(st->event_loop_point);
     st->event_loop_point = NULL;
   }
   if (st->event_offsetstop) {
-    CloseHandle(st->event_offsetstop);
+    sb_event_close(st->event_offsetstop);
     st->event_offsetstop = NULL;
   }
   if (st->event_wait_break) {
-    CloseHandle(st->event_wait_break);
+    sb_event_close(st->event_wait_break);
     st->event_wait_break = NULL;
   }
 }
@@ -211,29 +230,50 @@ clear_st_effect(struct SoundBuffer *st)
     xfree(st->effect_nums);
     st->effect_nums = NULL;
   }
+  if (st->effect_bypass) {
+    xfree(st->effect_bypass);
+    st->effect_bypass = NULL;
+  }
   st->effect_count = 0;
 }
 
+// バックエンドのバッファーを手放した後の片付け。stは解放済みの状態になる
+static void
+clear_st(struct SoundBuffer *st)
+{
+  st->pBuffer       = NULL;
+  // 待っているwait・wait_anyを起こす。待つ側がハンドルの参照を持っているので、閉じても待ち終わるまで残る
+  if (st->event_wait_break) sb_event_set(st->event_wait_break);
+  // バックエンドはもう統計に書かない
+  if (st->stats) {
+    xfree(st->stats);
+    st->stats = NULL;
+  }
+  st->buffer_bytes  = 0;
+  st->origin        = Qnil;
+  clear_st_effect(st);
+  clear_st_event(st);
+  clear_st_event_presets(st);
+}
+
+// デバイスを使っているバッファーの数を減らす。shutduwn+すべてのSoundTestが解放されたらデバイス解放
+static void
+release_device_ref(void)
+{
+  g_refcount--;
+  if (g_refcount == 0) g_pDevice->lpVtbl->Release(g_pDevice);
+}
+
 // DirectSoundバッファを開放する内部用関数
 static void
 SoundBuffer_release(struct SoundBuffer *st)
 {
-  if (st->pDSBuffer8) {
-    st->pDSBuffer8->lpVtbl->Stop(st->pDSBuffer8);
-    st->pDSBuffer8->lpVtbl->Release(st->pDSBuffer8);
-    st->pDSBuffer8    = NULL;
-    st->buffer_bytes  = 0;
-    st->origin        = Qnil;
-    clear_st_effect(st);
-    clear_st_event(st);
-    clear_st_event_presets(st);
-
-    // shutduwn+すべてのSoundTestが解放されたらDirectSound解放
-    g_refcount--;
-    if (g_refcount == 0) {
-      g_pDSound->lpVtbl->Release(g_pDSound);
-      CoUninitialize();
-    }
+  if (st->pBuffer) {
+    // フィーダー・スレッドを先に止める
+    stream_release(st);
+    st->pBuffer->lpVtbl->Release(st->pBuffer);
+    clear_st(st);
+    release_device_ref();
   }
 }
 
@@ -247,6 +287,8 @@ SoundBuffer_free(void *s)
   xfree(st);
 }
 
+static size_t stream_memsize(const struct SBStream*);
+
 static size_t
 SoundBuffer_memsize(const void *s)
 {
@@ -254,18 +296,53 @@ SoundBuffer_memsize(const void *s)
 
   return sizeof(struct SoundBuffer)
        + (st->copy_flag ? 0 : st->buffer_bytes)
-       + st->effect_count * sizeof(DWORD)
-       + st->event_count  * (sizeof(HANDLE) + sizeof(DWORD));
+       + st->effect_count * (sizeof(DWORD) + sizeof(BYTE))
+       + st->event_count  * (sizeof(SBEVENT) + sizeof(DWORD))
+       + (st->stats ? sizeof(SBSTATS) : 0)
+       + stream_memsize(st->stream);
 }
 
 static struct SoundBuffer *
 get_st(VALUE self)
 {
   struct SoundBuffer *st = (struct SoundBuffer *)RTYPEDDATA_DATA(self);
-  if (!st->pDSBuffer8) rb_raise(eSoundBufferError, "disposed object");
+  if (!st->pBuffer) rb_raise(eSoundBufferError, "disposed object");
   return st;
 }
 
+/*
+ * GVLを外してpBufferを使う間は、ほかのスレッドがdispose・splice!・Pool#releaseで
+ * バッファーを解放できないようにする。pinしたstのVALUEは呼び出しが終わるまで保持しておくこと
+ */
+static void
+pin_st(struct SoundBuffer *st)
+{
+  st->busy++;
+}
+
+static void
+unpin_st(struct SoundBuffer *st)
+{
+  st->busy--;
+}
+
+static void
+check_st_idle(struct SoundBuffer *st)
+{
+  if (st->busy) rb_raise(eSoundBufferError, "buffer is in use by another thread");
+}
+
+// バッファーごとの統計。無ければ作ってバックエンドのバッファーにも渡す。統計が有効なときに呼ぶ
+static LPSBSTATS
+get_st_stats(struct SoundBuffer *st)
+{
+  if (!st->stats) {
+    st->stats = ZALLOC(SBSTATS);
+    st->pBuffer->lpStats = st->stats;
+  }
+  return st->stats;
+}
+
 static VALUE
 SoundBuffer_allocate(VALUE klass)
 {
@@ -276,7 +353,7 @@ SoundBuffer_allocate(VALUE klass)
   obj = TypedData_Make_Struct(klass, struct SoundBuffer, &SoundBuffer_data_type, st);
 
   // allocate時点ではバッファサイズが不明なのでバッファは作らない
-  st->pDSBuffer8        = NULL;
+  st->pBuffer           = NULL;
   st->origin            = obj;
   st->copy_flag         = 0;
   st->buffer_bytes      = 0;
@@ -285,9 +362,22 @@ SoundBuffer_allocate(VALUE klass)
   st->bits_per_sample   = 0;
   st->block_align       = 0;
   st->avg_bytes_per_sec = 0;
+  st->format_tag        = WAVE_FORMAT_PCM;
+  st->channel_mask      = 0;
   st->effect_flag       = 0;
+  st->seamless_flag     = 0;
+  st->stats             = NULL;
+  st->shared_flag       = 0;
+  st->volume            = 0;
+  st->pan               = 0;
+  st->frequency         = 0;
+  st->param_dirty       = 0;
+  st->param_auto        = 0;
+  st->param_sched       = 0;
+  st->sched_flag        = 0;
   st->effect_count      = 0;
   st->effect_nums       = NULL;
+  st->effect_bypass     = NULL;
   st->play_flag         = 0;
   st->repeat_flag       = 0;
   st->loop_flag         = 0;
@@ -300,6 +390,7 @@ SoundBuffer_allocate(VALUE klass)
   st->event_loop_point  = NULL;
   st->event_offsets     = NULL;
   st->event_wait_break  = NULL;
+  st->stream            = NULL;
   return obj;
 }
 
@@ -320,7 +411,7 @@ SoundBuffer_initialize_copy(VALUE dst, VALUE src)
   /*
    *    struct SoundBuffer members & object status
    *    +-----------+-------+-----------------+-----+-----+
-   *    |pDSBuffer8 |origin |status           |dst? |src? |
+   *    |pBuffer    |origin |status           |dst? |src? |
    *    +-----------+-------+-----------------+-----+-----+
    *    |ptr        |self   |origin object    | NG  | OK  |
    *    |ptr        |origin |copied object    | NG  | OK  |
@@ -328,10 +419,16 @@ SoundBuffer_initialize_copy(VALUE dst, VALUE src)
    *    |NULL       |Qnil   |disposed object  | NG  | NG  |
    *    +-----------+-------+-----------------+-----+-----+
    */
-  if (dst_st->pDSBuffer8 == NULL && dst_st->origin == dst && src_st->pDSBuffer8) {
-    hr = g_pDSound->lpVtbl->DuplicateSoundBuffer(g_pDSound, (LPDIRECTSOUNDBUFFER)src_st->pDSBuffer8, (LPDIRECTSOUNDBUFFER *)&dst_st->pDSBuffer8);
+  if (dst_st->pBuffer == NULL && dst_st->origin == dst && src_st->pBuffer) {
+    // 複製は元の音量・パン・周波数を引き継ぐので、送っていない値を先に送る
+    param_flush(src_st);
+    refresh_st_params(src_st, src_st->param_auto);
+    hr = g_pDevice->lpVtbl->DuplicateBuffer(g_pDevice, src_st->pBuffer, &dst_st->pBuffer);
     if (FAILED(hr)) to_raise_an_exception(hr);
     g_refcount++;
+    if (SB_STATS_ON) get_st_stats(dst_st);
+    src_st->shared_flag = 1;
+    ((struct SoundBuffer *)RTYPEDDATA_DATA(src_st->origin))->shared_flag = 1;
     // object state members
     dst_st->origin            = src_st->origin;
     dst_st->copy_flag         = 1;
@@ -342,12 +439,19 @@ SoundBuffer_initialize_copy(VALUE dst, VALUE src)
     dst_st->bits_per_sample   = src_st->bits_per_sample;
     dst_st->block_align       = src_st->block_align;
     dst_st->avg_bytes_per_sec = src_st->avg_bytes_per_sec;
+    dst_st->format_tag        = src_st->format_tag;
+    dst_st->channel_mask      = src_st->channel_mask;
+    dst_st->seamless_flag     = src_st->seamless_flag;
+    dst_st->volume            = src_st->volume;
+    dst_st->pan               = src_st->pan;
+    dst_st->frequency         = src_st->frequency;
     // loop members
     dst_st->loop_flag         = src_st->loop_flag;
     dst_st->loop_start        = src_st->loop_start;
     dst_st->loop_end          = src_st->loop_end;
     dst_st->loop_count        = src_st->loop_count;
     dst_st->loop_counter      = 0;
+    sync_loop(dst_st);
     // event members
     // new notify handles setup from src_st->event_offsets
     create_st_event_presets(dst_st);
@@ -385,10 +489,196 @@ DSBcpy(LPVOID ptrA, DWORD lenA, LPVOID ptrB, DWORD lenB, char* ptrS, DWORD lenS,
   return result;
 }
 
+/*
+ * PCMのフォーマット変換
+ * :u8 :s16 :s24 :s32 :f32 から、SoundBufferが扱える:u8か:s16へ変換する。
+ */
+enum pcm_format { PCM_U8, PCM_S16, PCM_S24, PCM_S32, PCM_F32 };
+
+static const DWORD pcm_format_bytes[] = { 1, 2, 3, 4, 4 };
+
+static enum pcm_format
+get_pcm_format(VALUE vformat)
+{
+  ID id = rb_sym2id(vformat);
+
+  if (id == rb_intern("u8"))  return PCM_U8;
+  if (id == rb_intern("s16")) return PCM_S16;
+  if (id == rb_intern("s24")) return PCM_S24;
+  if (id == rb_intern("s32")) return PCM_S32;
+  if (id == rb_intern("f32")) return PCM_F32;
+  rb_raise(rb_eArgError, "unknown sample format: %"PRIsVALUE, vformat);
+  return PCM_S16;
+}
+
+static VALUE
+pcm_str(long len)
+{
+  VALUE str = rb_str_new(NULL, len);
+
+  rb_enc_associate(str, rb_ascii8bit_encoding());
+  return str;
+}
+
+static VALUE
+convert_pcm(VALUE vsrc, enum pcm_format from, DWORD from_ch, enum pcm_format to, DWORD to_ch, BOOL dither)
+{
+  SBDITHER    state;
+  LPSBDITHER  pdither = dither ? &state : NULL;
+  DWORD       frame_bytes, frames, n;
+  VALUE       work, dst;
+  const BYTE *src;
+
+  StringValue(vsrc);
+  if (from == to && from_ch == to_ch) return rb_str_dup(vsrc);
+  if (to != PCM_U8 && to != PCM_S16) rb_raise(rb_eArgError, "output format can be only :u8 or :s16");
+  if (from_ch < 1 || from_ch > 2 || to_ch < 1 || to_ch > 2) rb_raise(rb_eRangeError, "channels can be only 1 or 2");
+  frame_bytes = pcm_format_bytes[from] * from_ch;
+  if (RSTRING_LEN(vsrc) % frame_bytes) rb_raise(rb_eArgError, "string length is not a multiple of frame size");
+  frames = (DWORD)(RSTRING_LEN(vsrc) / frame_bytes);
+  n      = frames * from_ch;
+  src    = (const BYTE *)RSTRING_PTR(vsrc);
+  sb_dither_init(&state, 0x5342u);
+
+  // 元のチャンネル数のまま、8bitのままか16bitにする
+  if (from == PCM_U8 && to == PCM_U8) work = vsrc;
+  else {
+    work = pcm_str((long)n * 2);
+    switch (from) {
+    case PCM_U8:  sb_conv_u8_s16((BYTE *)RSTRING_PTR(work), src, n);          break;
+    case PCM_S16: memcpy(RSTRING_PTR(work), src, (size_t)n * 2);              break;
+    case PCM_S24: sb_conv_s24_s16((BYTE *)RSTRING_PTR(work), src, n, pdither); break;
+    case PCM_S32: sb_conv_s32_s16((BYTE *)RSTRING_PTR(work), src, n, pdither); break;
+    case PCM_F32: sb_conv_f32_s16((BYTE *)RSTRING_PTR(work), src, n, pdither); break;
+    }
+    from = PCM_S16;
+  }
+  // チャンネル数をそろえる
+  if (from_ch != to_ch) {
+    dst = pcm_str((long)frames * to_ch * pcm_format_bytes[from]);
+    if (to_ch == 2) sb_conv_mono_stereo((BYTE *)RSTRING_PTR(dst), (const BYTE *)RSTRING_PTR(work), frames, pcm_format_bytes[from]);
+    else            sb_conv_stereo_mono((BYTE *)RSTRING_PTR(dst), (const BYTE *)RSTRING_PTR(work), frames, pcm_format_bytes[from]);
+    work = dst;
+  }
+  if (from != to) {
+    dst = pcm_str((long)frames * to_ch);
+    sb_conv_s16_u8((BYTE *)RSTRING_PTR(dst), (const BYTE *)RSTRING_PTR(work), frames * to_ch);
+    work = dst;
+  }
+  if (work == vsrc) work = rb_str_dup(vsrc);
+  RB_GC_GUARD(vsrc);
+  return work;
+}
+
+// バッファーのサンプル形式
+static enum pcm_format
+get_st_pcm_format(struct SoundBuffer *st)
+{
+  if (st->format_tag == WAVE_FORMAT_IEEE_FLOAT) return PCM_F32;
+  switch (st->bits_per_sample) {
+  case 8:  return PCM_U8;
+  case 24: return PCM_S24;
+  case 32: return PCM_S32;
+  default: return PCM_S16;
+  }
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.convert(str, from, to = :s16, channels: 1, to_channels: channels, dither: false) -> str
+ */
+static VALUE
+SoundBuffer_c_convert(int argc, VALUE *argv, VALUE self)
+{
+  VALUE vsrc, vfrom, vto, vopt, v;
+  DWORD from_ch = 1, to_ch;
+  BOOL  dither = FALSE;
+
+  rb_scan_args(argc, argv, "21:", &vsrc, &vfrom, &vto, &vopt);
+  if (!NIL_P(vopt)) {
+    v = rb_hash_aref(vopt, ID2SYM(rb_intern("channels")));
+    if (!NIL_P(v)) from_ch = NUM2UINT(v);
+  }
+  to_ch = from_ch;
+  if (!NIL_P(vopt)) {
+    v = rb_hash_aref(vopt, ID2SYM(rb_intern("to_channels")));
+    if (!NIL_P(v)) to_ch = NUM2UINT(v);
+    dither = RTEST(rb_hash_aref(vopt, ID2SYM(rb_intern("dither")))) ? TRUE : FALSE;
+  }
+  return convert_pcm(vsrc, get_pcm_format(vfrom), from_ch,
+                     NIL_P(vto) ? PCM_S16 : get_pcm_format(vto), to_ch, dither);
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.interleave([left, right, ...], format = :s16) -> str
+ */
+static VALUE
+SoundBuffer_c_interleave(int argc, VALUE *argv, VALUE self)
+{
+  VALUE        vplanes, vformat, dst;
+  DWORD        channels, bytes, frames, c;
+  const BYTE **planes;
+
+  rb_scan_args(argc, argv, "11", &vplanes, &vformat);
+  Check_Type(vplanes, T_ARRAY);
+  bytes    = pcm_format_bytes[NIL_P(vformat) ? PCM_S16 : get_pcm_format(vformat)];
+  channels = (DWORD)RARRAY_LEN(vplanes);
+  if (channels == 0) rb_raise(rb_eArgError, "no channel");
+  planes = ALLOCA_N(const BYTE *, channels);
+  for (c = 0; c < channels; c++) {
+    VALUE plane = RARRAY_AREF(vplanes, c);
+
+    StringValue(plane);
+    if (RSTRING_LEN(plane) != RSTRING_LEN(RARRAY_AREF(vplanes, 0))) rb_raise(rb_eArgError, "channel length mismatch");
+    planes[c] = (const BYTE *)RSTRING_PTR(plane);
+  }
+  frames = (DWORD)(RSTRING_LEN(RARRAY_AREF(vplanes, 0)) / bytes);
+  dst    = pcm_str((long)frames * channels * bytes);
+  sb_conv_interleave((BYTE *)RSTRING_PTR(dst), planes, channels, frames, bytes);
+  RB_GC_GUARD(vplanes);
+  return dst;
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.deinterleave(str, channels, format = :s16) -> [str, ...]
+ */
+static VALUE
+SoundBuffer_c_deinterleave(int argc, VALUE *argv, VALUE self)
+{
+  VALUE  vsrc, vchannels, vformat, result;
+  DWORD  channels, bytes, frames, c;
+  BYTE **planes;
+
+  rb_scan_args(argc, argv, "21", &vsrc, &vchannels, &vformat);
+  StringValue(vsrc);
+  bytes    = pcm_format_bytes[NIL_P(vformat) ? PCM_S16 : get_pcm_format(vformat)];
+  channels = NUM2UINT(vchannels);
+  if (channels == 0) rb_raise(rb_eArgError, "no channel");
+  if (RSTRING_LEN(vsrc) % (bytes * channels)) rb_raise(rb_eArgError, "string length is not a multiple of frame size");
+  frames = (DWORD)(RSTRING_LEN(vsrc) / (bytes * channels));
+  result = rb_ary_new_capa(channels);
+  planes = ALLOCA_N(BYTE *, channels);
+  for (c = 0; c < channels; c++) {
+    VALUE plane = pcm_str((long)frames * bytes);
+
+    rb_ary_push(result, plane);
+    planes[c] = (BYTE *)RSTRING_PTR(plane);
+  }
+  sb_conv_deinterleave(planes, (const BYTE *)RSTRING_PTR(vsrc), channels, frames, bytes);
+  RB_GC_GUARD(vsrc);
+  return result;
+}
+
 /*
  * call-seq:
  *    sb.write(str) ->  fixnum
  *    sb.write(str, offset) ->  fixnum
+ *    sb.write(str, offset, format: :f32, channels: 1, dither: true) ->  fixnum
+ *
+ * formatかchannelsを指定すると、strをバッファーのフォーマットに変換してから書き込む。
+ * 変換先にできるのは8bitか16bitのモノラルかステレオのバッファーだけ。同じフォーマットならそのまま書く。
  */
 static VALUE
 SoundBuffer_write(int argc, VALUE *argv, VALUE self)
@@ -396,14 +686,32 @@ SoundBuffer_write(int argc, VALUE *argv, VALUE self)
   LPVOID   ptr1,  ptr2;
   DWORD    size1, size2;
   DWORD    bytes, offset, write_size1 = 0, write_size2 = 0, loopying = FALSE, from_write_cursor = FALSE;
+  uint64_t start;
   char    *strptr;
   HRESULT  hr;
-  VALUE    vbuffer, voffset, vopt;
+  VALUE    vbuffer, voffset, vopt, vformat, vchannels;
+  enum pcm_format from, to;
+  DWORD    from_ch;
   struct SoundBuffer *st = get_st(self);
 
 // taint check & reflect
 
   rb_scan_args(argc, argv, "11:", &vbuffer, &voffset, &vopt);
+  // opt format, channels, dither
+  if (!NIL_P(vopt)) {
+    vformat   = rb_hash_aref(vopt, ID2SYM(rb_intern("format")));
+    vchannels = rb_hash_aref(vopt, ID2SYM(rb_intern("channels")));
+    if (!NIL_P(vformat) || !NIL_P(vchannels)) {
+      to      = get_st_pcm_format(st);
+      from    = NIL_P(vformat)   ? to           : get_pcm_format(vformat);
+      from_ch = NIL_P(vchannels) ? st->channels : NUM2UINT(vchannels);
+      if ((from != to || from_ch != st->channels) && ((to != PCM_U8 && to != PCM_S16) || st->channels > 2)) {
+        rb_raise(rb_eArgError, "format: conversion only targets 8/16-bit mono/stereo buffers");
+      }
+      vbuffer = convert_pcm(vbuffer, from, from_ch, to, st->channels,
+                            RTEST(rb_hash_aref(vopt, ID2SYM(rb_intern("dither")))) ? TRUE : FALSE);
+    }
+  }
   // arg1 buffer
   Check_Type(vbuffer, T_STRING);
   bytes  = RSTRING_LEN(vbuffer);
@@ -420,7 +728,8 @@ SoundBuffer_write(int argc, VALUE *argv, VALUE self)
   if (!loopying && offset + bytes > st->buffer_bytes) rb_raise(rb_eRangeError, "this method is nolap mode");
   // buffer write
   if (bytes) {
-    hr = st->pDSBuffer8->lpVtbl->Lock(st->pDSBuffer8, offset, bytes, &ptr1, &size1, &ptr2, &size2,
+    start = SB_STATS_ON ? sb_clock_ns() : 0;
+    hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, offset, bytes, &ptr1, &size1, &ptr2, &size2,
                                       from_write_cursor ? DSBLOCK_FROMWRITECURSOR : DSBLOCK_ENTIREBUFFER);
     if (FAILED(hr)) to_raise_an_exception(hr);
 
@@ -429,26 +738,61 @@ SoundBuffer_write(int argc, VALUE *argv, VALUE self)
 
     if (RTEST(rb_obj_tainted(vbuffer))) rb_obj_taint(self);
 
-    hr = st->pDSBuffer8->lpVtbl->Unlock(st->pDSBuffer8, ptr1, write_size1, ptr2, 0);
+    hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, write_size1, ptr2, 0);
     if (FAILED(hr)) rb_raise(eSoundBufferError, "Unlock error");
+    if (SB_STATS_ON) sb_stats_write(get_st_stats(st), write_size1 + write_size2, sb_clock_ns() - start);
   }
+  RB_GC_GUARD(vbuffer);
   return UINT2NUM(write_size1 + write_size2);
 }
 
 /*
- * SoundTest#initialize
+ * 8/16bitのモノラルとステレオはWAVEFORMATEX、それ以外はWAVEFORMATEXTENSIBLEにする。
  */
-static VALUE
-SoundBuffer_initialize(int argc, VALUE *argv, VALUE self)
+static DWORD
+get_channel_mask(struct SoundBuffer *st)
 {
-  DSBUFFERDESC          desc;
-  WAVEFORMATEX          pcmwf;
-  LPDIRECTSOUNDBUFFER   pDSBuffer;
-  HRESULT hr;
-  VALUE   vbuffer, vsamples_per_sec, vbits_per_sample, vchannels, vopt;
-  struct SoundBuffer *st = (struct SoundBuffer *)RTYPEDDATA_DATA(self);
+  static const DWORD masks[SB_MIX_MAX_CHANNELS + 1] = {
+    0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F  // mono stereo 3.0 quad 5.0 5.1 6.1 7.1
+  };
 
-  if (st->pDSBuffer8) rb_raise(eSoundBufferError, "object is already initialized");
+  return st->channel_mask ? st->channel_mask : masks[st->channels];
+}
+
+static void
+set_wave_format(struct SoundBuffer *st, WAVEFORMATEXTENSIBLE *wfx)
+{
+  static const BYTE guid_tail[8] = { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+
+  memset(wfx, 0, sizeof(*wfx));
+  wfx->Format.wFormatTag      = st->format_tag;
+  wfx->Format.nChannels       = st->channels;
+  wfx->Format.nSamplesPerSec  = st->samples_per_sec;
+  wfx->Format.nAvgBytesPerSec = st->avg_bytes_per_sec;
+  wfx->Format.nBlockAlign     = st->block_align;
+  wfx->Format.wBitsPerSample  = st->bits_per_sample;
+  wfx->Format.cbSize          = 0;
+  if (st->format_tag == WAVE_FORMAT_PCM && st->channels <= 2 && st->bits_per_sample <= 16) return;
+
+  wfx->Format.wFormatTag           = WAVE_FORMAT_EXTENSIBLE;
+  wfx->Format.cbSize               = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+  wfx->Samples.wValidBitsPerSample = st->bits_per_sample;
+  wfx->dwChannelMask               = get_channel_mask(st);
+  // KSDATAFORMAT_SUBTYPE_PCM / KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+  wfx->SubFormat.Data1             = st->format_tag;
+  wfx->SubFormat.Data2             = 0x0000;
+  wfx->SubFormat.Data3             = 0x0010;
+  memcpy(wfx->SubFormat.Data4, guid_tail, sizeof(guid_tail));
+}
+
+/*
+ * SoundBuffer.newとSoundBuffer::Pool#acquireの引数を読んで、形式をstに入れる。
+ * 戻り値は第1引数（大きさか初期内容の文字列）
+ */
+static VALUE
+init_st_format(struct SoundBuffer *st, int argc, VALUE *argv)
+{
+  VALUE   vbuffer, vsamples_per_sec, vbits_per_sample, vchannels, vopt, vmask;
 
   rb_scan_args(argc, argv, "13:", &vbuffer, &vchannels, &vsamples_per_sec, &vbits_per_sample, &vopt);
   switch (TYPE(vbuffer)) {
@@ -465,51 +809,91 @@ SoundBuffer_initialize(int argc, VALUE *argv, VALUE self)
   if (st->buffer_bytes < DSBSIZE_MIN || DSBSIZE_MAX < st->buffer_bytes) rb_raise(rb_eRangeError, "buffer size error");
 
   st->channels        = NIL_P(vchannels)        ? 1     : (WORD)NUM2UINT(vchannels);
-  if (st->channels != 1 && st->channels != 2) rb_raise(rb_eRangeError, "channels arguments 1 and 2 only possible");
+  if (st->channels < 1 || SB_MIX_MAX_CHANNELS < st->channels) rb_raise(rb_eRangeError, "channels argument can be only 1-%d", SB_MIX_MAX_CHANNELS);
 
   st->samples_per_sec = NIL_P(vsamples_per_sec) ? 48000 :       NUM2UINT(vsamples_per_sec);
   if (st->samples_per_sec < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < st->samples_per_sec) rb_raise(rb_eRangeError, "samples_per_sec argument can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX");
 
-  st->bits_per_sample = NIL_P(vbits_per_sample) ? 16    : (WORD)NUM2UINT(vbits_per_sample);
-  if (st->bits_per_sample != 8 && st->bits_per_sample != 16) rb_raise(rb_eRangeError, "bits_per_sample arguments 8 and 16 only possible");
+  // float: trueなら32bit浮動小数点
+  st->format_tag      = !NIL_P(vopt) && RTEST(rb_hash_aref(vopt, ID2SYM(rb_intern("float")))) ? WAVE_FORMAT_IEEE_FLOAT : WAVE_FORMAT_PCM;
+  st->bits_per_sample = NIL_P(vbits_per_sample) ? (st->format_tag == WAVE_FORMAT_IEEE_FLOAT ? 32 : 16) : (WORD)NUM2UINT(vbits_per_sample);
+  if (st->format_tag == WAVE_FORMAT_IEEE_FLOAT && st->bits_per_sample != 32) rb_raise(rb_eRangeError, "float buffer is 32 bit only");
+  if (st->bits_per_sample != 8 && st->bits_per_sample != 16 && st->bits_per_sample != 24 && st->bits_per_sample != 32) {
+    rb_raise(rb_eRangeError, "bits_per_sample arguments 8, 16, 24 and 32 only possible");
+  }
+  vmask = NIL_P(vopt) ? Qnil : rb_hash_aref(vopt, ID2SYM(rb_intern("channel_mask")));
+  st->channel_mask    = NIL_P(vmask) ? 0 : NUM2UINT(vmask);
 
   st->effect_flag = !NIL_P(vopt) && RTEST(rb_hash_aref(vopt, ID2SYM(rb_intern("effect")))) ? 1 : 0;
-  if (st->effect_flag && st->bits_per_sample == 8) rb_raise(rb_eRangeError, "do not use FX, when bits per sample is 8 bit");
+  if (st->effect_flag && st->bits_per_sample != 16 && st->format_tag != WAVE_FORMAT_IEEE_FLOAT) rb_raise(rb_eRangeError, "use FX, only when 16 bit or float");
+  if (st->effect_flag && st->channels > 2) rb_raise(rb_eRangeError, "do not use FX, when channels is 3 or more");
   // 切捨て判定でOKか、あとで調べる。
   if (st->effect_flag && st->buffer_bytes < st->samples_per_sec * DSBSIZE_FX_MIN / 1000) rb_raise(rb_eRangeError, "buffer is small, when use FX");
+  // seamless: trueならループ区間の終端から始端へサンプル単位でつなぐ
+  st->seamless_flag = !NIL_P(vopt) && RTEST(rb_hash_aref(vopt, ID2SYM(rb_intern("seamless")))) ? 1 : 0;
 
   st->block_align       = st->channels * st->bits_per_sample / 8;
   st->avg_bytes_per_sec = st->samples_per_sec * st->block_align;
+  if (st->buffer_bytes % st->block_align) rb_raise(rb_eRangeError, "buffer size must be a multiple of block_align (%u)", (unsigned)st->block_align);
+  return vbuffer;
+}
+
+// 作ったバッファーに初期内容を書いて、通知を用意する
+static void
+init_st_buffer(VALUE self, struct SoundBuffer *st, VALUE vbuffer)
+{
+  if (SB_STATS_ON) get_st_stats(st);
+  // 作ったばかりのバッファーとPoolから戻したバッファーは既定値になっている
+  st->volume      = DSBVOLUME_MAX;
+  st->pan         = DSBPAN_CENTER;
+  st->frequency   = st->samples_per_sec;
+  st->param_dirty = 0;
+  st->param_auto  = 0;
+  st->param_sched = 0;
+  st->sched_flag  = 0;
+
+  // writeはキーワード引数を取るので、initializeのキーワードが渡らないようにメソッドとして呼ぶ
+  if (TYPE(vbuffer) == T_STRING) rb_funcall(self, rb_intern("write"), 1, vbuffer);
+  create_st_event_presets(st);
+  SoundBuffer_set_notify(0, NULL, self);
+}
+
+// stの形式でバックエンドのバッファーを作る
+static void
+create_st_buffer(struct SoundBuffer *st)
+{
+  SBBUFFERDESC          desc;
+  WAVEFORMATEXTENSIBLE  pcmwf;
+  HRESULT hr;
+
   // フォーマット設定
-  pcmwf.wFormatTag      = WAVE_FORMAT_PCM;
-  pcmwf.nChannels       = st->channels;
-  pcmwf.nSamplesPerSec  = st->samples_per_sec;
-  pcmwf.nAvgBytesPerSec = st->avg_bytes_per_sec;
-  pcmwf.nBlockAlign     = st->block_align;
-  pcmwf.wBitsPerSample  = st->bits_per_sample;
-  pcmwf.cbSize          = 0;
-  // DirectSoundバッファ設定
-  desc.dwSize           = sizeof(desc);
-  desc.dwFlags          = DSBCAPS_CTRLFREQUENCY | DSBCAPS_CTRLPAN | DSBCAPS_CTRLVOLUME | (st->effect_flag ? DSBCAPS_CTRLFX : 0)
-                        | DSBCAPS_LOCSOFTWARE | DSBCAPS_CTRLPOSITIONNOTIFY | DSBCAPS_GETCURRENTPOSITION2 | DSBCAPS_GLOBALFOCUS;
+  set_wave_format(st, &pcmwf);
+  // バッファ設定
+  desc.dwFlags          = (st->effect_flag ? SBBCAPS_CTRLFX : 0) | (st->seamless_flag ? SBBCAPS_SEAMLESS : 0);
   desc.dwBufferBytes    = st->buffer_bytes;
-  desc.dwReserved       = 0;
-  desc.lpwfxFormat      = &pcmwf;
-  desc.guid3DAlgorithm  = DS3DALG_DEFAULT;
+  desc.lpwfxFormat      = &pcmwf.Format;
 
-  // DirectSoundバッファ生成
-  hr = g_pDSound->lpVtbl->CreateSoundBuffer(g_pDSound, &desc, &pDSBuffer, NULL);
+  // バッファ生成
+  hr = g_pDevice->lpVtbl->CreateBuffer(g_pDevice, &desc, &st->pBuffer);
   if (FAILED(hr)) rb_raise(eSoundBufferError, "CreateSoundBuffer error");
-  hr = pDSBuffer->lpVtbl->QueryInterface(pDSBuffer, &IID_IDirectSoundBuffer8, (void**)&(st->pDSBuffer8));
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "QueryInterface error");
-  pDSBuffer->lpVtbl->Release(pDSBuffer);
 
   g_refcount++;
+}
 
-  if (TYPE(vbuffer) == T_STRING) SoundBuffer_write(1, &vbuffer, self);
-  create_st_event_presets(st);
-  SoundBuffer_set_notify(0, NULL, self);
+/*
+ * SoundTest#initialize
+ */
+static VALUE
+SoundBuffer_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE   vbuffer;
+  struct SoundBuffer *st = (struct SoundBuffer *)RTYPEDDATA_DATA(self);
+
+  if (st->pBuffer) rb_raise(eSoundBufferError, "object is already initialized");
 
+  vbuffer = init_st_format(st, argc, argv);
+  create_st_buffer(st);
+  init_st_buffer(self, st, vbuffer);
   return self;
 }
 
@@ -547,7 +931,7 @@ get_play_position(struct SoundBuffer *st)
   DWORD     dwCurrentPlayCursor;
   DWORD     dwCurrentWriteCursor;
 
-  hr = st->pDSBuffer8->lpVtbl->GetCurrentPosition(st->pDSBuffer8, &dwCurrentPlayCursor, &dwCurrentWriteCursor);
+  hr = st->pBuffer->lpVtbl->GetCurrentPosition(st->pBuffer, &dwCurrentPlayCursor, &dwCurrentWriteCursor);
   if (FAILED(hr)) to_raise_an_exception(hr);
   return dwCurrentPlayCursor;
 }
@@ -557,7 +941,7 @@ set_play_position(struct SoundBuffer *st, DWORD dwNewPosition)
 {
   HRESULT   hr;
 
-  hr = st->pDSBuffer8->lpVtbl->SetCurrentPosition(st->pDSBuffer8, dwNewPosition);
+  hr = st->pBuffer->lpVtbl->SetCurrentPosition(st->pBuffer, dwNewPosition);
   if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
   if (FAILED(hr)) to_raise_an_exception(hr);
 }
@@ -624,27 +1008,102 @@ SoundBuffer_to_s(VALUE self)
 
 // 再生中にto_sできるようにするか？
   if (get_playing(st)) rb_raise(eSoundBufferError, "now playing, plz stop");
-  hr = st->pDSBuffer8->lpVtbl->Lock(st->pDSBuffer8, 0, 0, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, 0, 0, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
   if (FAILED(hr)) to_raise_an_exception(hr);
   if (size1 != st->buffer_bytes) {
-    hr = st->pDSBuffer8->lpVtbl->Unlock(st->pDSBuffer8, ptr1, 0, ptr2, 0);
+    hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, 0, ptr2, 0);
     if (FAILED(hr)) to_raise_an_exception(hr);
     rb_raise(eSoundBufferError, "can not full size lock");
   }
   str = rb_str_new(ptr1, size1);
   if (rb_obj_tainted(self)) rb_obj_taint(str);
-  hr = st->pDSBuffer8->lpVtbl->Unlock(st->pDSBuffer8, ptr1, 0, ptr2, 0);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, 0, ptr2, 0);
   if (FAILED(hr)) to_raise_an_exception(hr);
   return str;
 }
 
+/*
+ * call-seq:
+ *    sb.read_into(str) -> fixnum
+ *    sb.read_into(io_buffer, offset: 0, length: nil) -> fixnum
+ *    sb.read_into(str, offset: :play_cursor, length: 4096) -> fixnum
+ *    sb.read_into(str, :play_cursor, 4096) -> fixnum
+ *
+ * バッファーの内容を呼び出し側の文字列かIO::Bufferへコピーし、コピーしたバイト数を返す。
+ * to_sと違って再生中でも読めて、毎回文字列を作らない。
+ * lengthを省略すると書き込み先の大きさぶん読む。文字列が短いときだけ伸ばす。
+ * offset: :play_cursorなら再生位置から読み、末尾を越えたぶんは先頭から続けて読む。
+ * offsetとlengthは位置引数でも渡せる。毎フレーム呼ぶならこちらはハッシュも作らない。
+ */
+static VALUE
+SoundBuffer_read_into(int argc, VALUE *argv, VALUE self)
+{
+  LPVOID   ptr1,  ptr2;
+  DWORD    size1, size2, offset = 0, length, wrap = FALSE;
+  char    *dst;
+  size_t   capacity;
+  HRESULT  hr;
+  VALUE    vdst, vopt, voffset = Qnil, vlength = Qnil;
+  struct SoundBuffer *st = get_st(self);
+
+  rb_scan_args(argc, argv, "12:", &vdst, &voffset, &vlength, &vopt);
+  if (!NIL_P(vopt)) {
+    voffset = rb_hash_lookup2(vopt, ID2SYM(rb_intern("offset")), voffset);
+    vlength = rb_hash_lookup2(vopt, ID2SYM(rb_intern("length")), vlength);
+  }
+  if (SYMBOL_P(voffset)) {
+    if (SYM2ID(voffset) != rb_intern("play_cursor")) rb_raise(rb_eArgError, "offset can be only integer or :play_cursor");
+    offset = get_play_position(st);
+    wrap   = TRUE;
+  }
+  else if (!NIL_P(voffset)) {
+    offset = NUM2UINT(voffset);
+    if (offset > st->buffer_bytes) rb_raise(rb_eRangeError, "offset");
+  }
+  // 書き込み先
+  if (RB_TYPE_P(vdst, T_STRING)) {
+    rb_str_modify(vdst);
+    capacity = RSTRING_LEN(vdst);
+    if (!NIL_P(vlength) && NUM2UINT(vlength) > capacity) {
+      capacity = NUM2UINT(vlength);
+      rb_str_resize(vdst, capacity);
+    }
+    dst = RSTRING_PTR(vdst);
+  }
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  else if (rb_obj_is_kind_of(vdst, rb_cIOBuffer)) {
+    void *base;
+    rb_io_buffer_get_bytes_for_writing(vdst, &base, &capacity);
+    dst = base;
+  }
+#endif
+  else rb_raise(rb_eTypeError, "not valid value");
+  length = NIL_P(vlength) ? (DWORD)(capacity < st->buffer_bytes ? capacity : st->buffer_bytes) : NUM2UINT(vlength);
+  if (length > capacity) rb_raise(rb_eRangeError, "length is larger than the destination");
+  if (length > st->buffer_bytes) rb_raise(rb_eRangeError, "length");
+  if (!wrap && offset + length > st->buffer_bytes) length = (DWORD)st->buffer_bytes - offset;
+  if (!length) return UINT2NUM(0);
+
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, offset, length, &ptr1, &size1, &ptr2, &size2, 0);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  memcpy(dst, ptr1, size1);
+  if (ptr2 && size2) memcpy(dst + size1, ptr2, size2);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, 0, ptr2, 0);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  RB_GC_GUARD(vdst);
+  return UINT2NUM(size1 + size2);
+}
+
 /*
  *
  */
 static VALUE
 SoundBuffer_dispose(VALUE self)
 {
-  SoundBuffer_release(get_st(self));
+  struct SoundBuffer *st = get_st(self);
+
+  check_st_idle(st);
+  SoundBuffer_release(st);
   return self;
 }
 
@@ -652,7 +1111,7 @@ static VALUE
 SoundBuffer_disposed(VALUE self)
 {
   struct SoundBuffer *st = (struct SoundBuffer *)RTYPEDDATA_DATA(self);
-  return st->pDSBuffer8 ? Qfalse : Qtrue;
+  return st->pBuffer ? Qfalse : Qtrue;
 }
 
 /*
@@ -676,6 +1135,18 @@ SoundBuffer_get_bits_per_sample(VALUE self)
   return UINT2NUM((DWORD)(get_st(self)->bits_per_sample));
 }
 
+static VALUE
+SoundBuffer_is_float(VALUE self)
+{
+  return get_st(self)->format_tag == WAVE_FORMAT_IEEE_FLOAT ? Qtrue : Qfalse;
+}
+
+static VALUE
+SoundBuffer_get_channel_mask(VALUE self)
+{
+  return UINT2NUM(get_channel_mask(get_st(self)));
+}
+
 static VALUE
 SoundBuffer_get_block_align(VALUE self)
 {
@@ -693,6 +1164,12 @@ SoundBuffer_get_effectable(VALUE self)
 {
   return get_st(self)->effect_flag ? Qtrue : Qfalse;
 }
+
+static VALUE
+SoundBuffer_get_seamless(VALUE self)
+{
+  return get_st(self)->seamless_flag ? Qtrue : Qfalse;
+}
 /*
  * エフェクトパラメーター反映のためのメソッド
  * エフェクトのパラメーターは再生中に変更しても反映されない。
@@ -706,13 +1183,33 @@ SoundBuffer_flash(VALUE self)
   DWORD   size1, size2;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->Lock(st->pDSBuffer8, 0, 4, &ptr1, &size1, &ptr2, &size2, DSBLOCK_FROMWRITECURSOR);
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, 0, 4, &ptr1, &size1, &ptr2, &size2, DSBLOCK_FROMWRITECURSOR);
   if (FAILED(hr)) to_raise_an_exception(hr);
-  hr = st->pDSBuffer8->lpVtbl->Unlock(st->pDSBuffer8, ptr1, 0, ptr2, 0);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, 0, ptr2, 0);
   if (FAILED(hr)) rb_raise(eSoundBufferError, "unlock error");
   return self;
 }
 
+/*
+ * ループ区間をバックエンドに渡す。
+ * バックエンドが処理しない場合はwaitがループ位置の通知を受けてnotify_set_loopで戻す。
+ */
+static void
+sync_loop(struct SoundBuffer *st)
+{
+  SBLOOP  loop;
+  HRESULT hr;
+
+  if (!(g_pDevice->dwCaps & SBCAPS_NATIVELOOP)) return;
+  loop.dwFlags   = st->loop_flag ? SBLOOP_ENABLE : 0;
+  loop.dwStart   = st->loop_start;
+  loop.dwEnd     = st->loop_end;
+  loop.dwCount   = st->loop_count;
+  loop.dwCounter = st->loop_counter;
+  hr = st->pBuffer->lpVtbl->SetLoop(st->pBuffer, &loop);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+}
+
 /*
  * nortify
  */
@@ -723,131 +1220,376 @@ notify_set_loop(struct SoundBuffer *st)
 
   if (st->loop_flag) {
     if ( st->loop_count && st->loop_count > st->loop_counter) st->loop_counter += 1;
-    if (!st->loop_count || st->loop_count > st->loop_counter) hr = st->pDSBuffer8->lpVtbl->SetCurrentPosition(st->pDSBuffer8, st->loop_start);
+    if (!st->loop_count || st->loop_count > st->loop_counter) hr = st->pBuffer->lpVtbl->SetCurrentPosition(st->pBuffer, st->loop_start);
   }
   return hr;
 }
 
+/*
+ * 通知から起床までの遅れ。起きた時点の再生カーソルが通知位置をどれだけ過ぎているかで測る。
+ * GVLを取り直すまでの時間も含まれる。
+ */
+static void
+stats_wakeup(struct SoundBuffer *st, DWORD index)
+{
+  DWORD   offset, play, frequency = st->frequency, late;
+  LONG    direction = 1;
+  HRESULT hr;
+
+  if (index + EVENT_PRESET >= st->event_count) return;
+  offset = st->event_offsets[index];
+  if (offset == DSBPN_OFFSETSTOP) return;
+  hr = st->pBuffer->lpVtbl->GetCurrentPosition(st->pBuffer, &play, NULL);
+  if (FAILED(hr) || frequency == 0) return;
+  st->pBuffer->lpVtbl->GetDirection(st->pBuffer, &direction);
+  if (direction < 0) late = (offset + st->buffer_bytes - play) % st->buffer_bytes;
+  else               late = (play + st->buffer_bytes - offset) % st->buffer_bytes;
+  sb_stats_wakeup(get_st_stats(st), (uint64_t)(late / st->block_align) * 1000000000 / frequency);
+}
+
+// event_handlesの番号を、set_notifyの何番目かか固定ハンドルのEVENT_INDEX_*にする
+static DWORD
+notify_index(DWORD i, DWORD count)
+{
+  return i + EVENT_PRESET < count ? i : i - count;
+}
+
+/*
+ * stのevent_handlesの参照を取ってhandlesに写し、その数を返す。
+ * GVLを外して待つ間にset_notifyやdisposeでハンドルが閉じられても、写したほうは残る
+ */
+static DWORD
+notify_retain_handles(struct SoundBuffer *st, SBEVENT *handles)
+{
+  DWORD i;
+
+  for (i = 0; i < st->event_count; i++) {
+    handles[i] = sb_event_retain(st->event_handles[i]);
+    if (!handles[i]) {
+      while (i--) sb_event_close(handles[i]);
+      rb_raise(eSoundBufferError, "notify_retain_handles error");
+    }
+  }
+  return st->event_count;
+}
+
+static void
+notify_release_handles(SBEVENT *handles, DWORD count)
+{
+  DWORD i;
+
+  for (i = 0; i < count; i++) sb_event_close(handles[i]);
+  xfree(handles);
+}
+
 static void*
 notify_wait_blocking(void *data)
 {
   struct NotifyData  *nd = data;
-  struct SoundBuffer *st = nd->st;
 
-  while (1) {
-    nd->result = WaitForMultipleObjects(st->event_count, st->event_handles, FALSE, nd->timeout);
-    /* DEBUG CODE
-    if      (st->event_handles[nd->result - WAIT_OBJECT_0] == st->event_wait_break) printf("[WAIT_Break:%lu]", nd->result);
-    else if (st->event_handles[nd->result - WAIT_OBJECT_0] == st->event_offsetstop) printf("[OFFSETSTOP:%lu]", nd->result);
-    else if (st->event_handles[nd->result - WAIT_OBJECT_0] == st->event_loop_point) printf("[LOOP_Point:%lu]", nd->result);
-    else printf("[USER_Event:%lu]", nd->result);
-    */
-    if (st->event_handles[nd->result - WAIT_OBJECT_0] == st->event_loop_point) notify_set_loop(st);
-    else return NULL;
-  }
+  nd->result = sb_event_wait(nd->count + 1, nd->handles, nd->timeout);
+  /* DEBUG CODE
+  printf("[%s:%lu]", notify_index(nd->result - WAIT_OBJECT_0, nd->count) == EVENT_INDEX_WAIT_BREAK ? "WAIT_Break"
+                   : notify_index(nd->result - WAIT_OBJECT_0, nd->count) == EVENT_INDEX_OFFSETSTOP ? "OFFSETSTOP"
+                   : notify_index(nd->result - WAIT_OBJECT_0, nd->count) == EVENT_INDEX_LOOP_POINT ? "LOOP_Point" : "USER_Event", nd->result);
+  */
+  return NULL;
 }
 
 static void
 notify_wait_unblocking(void *data)
 {
-  struct NotifyData  *nd = data;
-  struct SoundBuffer *st = nd->st;
-
-  SetEvent(st->event_wait_break);
+  sb_event_set(((struct NotifyData *)data)->cancel);
 }
 
 static VALUE
-SoundBuffer_wait(int argc, VALUE *argv, VALUE self)
+notify_wait_body(VALUE arg)
 {
-  struct NotifyData  data;
-  struct SoundBuffer *st = get_st(self);
-
-  if (argc > 1) rb_raise(rb_eArgError, "wrong number of arguments");
+  struct NotifyData  *nd = (struct NotifyData *)arg;
+  struct SoundBuffer *st;
+  DWORD  index;
 
-  data.result  = 0;
-  data.st      = st;
-  data.timeout = argc ? NUM2UINT(argv[0]) : INFINITE;
   while (1) {
-    rb_thread_call_without_gvl(notify_wait_blocking, (void*)(&data), notify_wait_unblocking, (void*)(&data));
-    if (st->event_handles[data.result - WAIT_OBJECT_0] != st->event_wait_break) break;
+    // set_notifyでハンドルが変わるので、起こされるたびに取り直す。disposeされていれば例外
+    st = get_st(nd->self);
+    notify_release_handles(nd->handles, nd->count);
+    nd->count   = 0;
+    nd->handles = ALLOC_N(SBEVENT, st->event_count + 1);
+    nd->count   = notify_retain_handles(st, nd->handles);
+    nd->handles[nd->count] = nd->cancel;
+    rb_thread_call_without_gvl(notify_wait_blocking, (void*)nd, notify_wait_unblocking, (void*)nd);
+    if (nd->result == WAIT_FAILED)  rb_raise(eSoundBufferError, "[BUG]sb_event_wait error in notify_wait_blocking C function");
+    if (nd->result == WAIT_TIMEOUT) return Qnil;
+    // 中止用で起きたのに割り込みが無かったときと、set_notifyかdisposeで起こされたときは待ち直す
+    if (nd->result - WAIT_OBJECT_0 == nd->count) continue;
+    index = notify_index(nd->result - WAIT_OBJECT_0, nd->count);
+    // ループ位置の通知はバックエンドがループを処理しないときだけ来る。GVLを持ったまま戻して待ち直す
+    if (index == EVENT_INDEX_LOOP_POINT) notify_set_loop(get_st(nd->self));
+    else if (index != EVENT_INDEX_WAIT_BREAK) break;
   }
-  if (data.result == WAIT_FAILED)  rb_raise(eSoundBufferError, "[BUG]WaitForMultipleObjects error in notify_wait_blocking C function");
-  if (data.result == WAIT_TIMEOUT) return Qnil;
-  ResetEvent(st->event_handles[data.result - WAIT_OBJECT_0]);
+  st = get_st(nd->self);
+  sb_event_reset(nd->handles[nd->result - WAIT_OBJECT_0]);
   // OFFSETSTOP
-  if (st->event_handles[data.result - WAIT_OBJECT_0] == st->event_offsetstop) {
-    if (st->repeat_flag == 0 && get_play_position(st) == 0) SoundBuffer_stop(self);
+  if (index == EVENT_INDEX_OFFSETSTOP) {
+    if (st->repeat_flag == 0 && get_play_position(st) == 0) SoundBuffer_stop(nd->self);
     rb_raise(rb_eStopIteration, "OFFSETSTOP");
   }
   // User event
-  return UINT2NUM(data.result - WAIT_OBJECT_0);
+  if (SB_STATS_ON) stats_wakeup(st, index);
+  return UINT2NUM(index);
 }
 
-static LPHANDLE
-notify_create_handles(struct SoundBuffer *st, DWORD count)
+static VALUE
+notify_wait_ensure(VALUE arg)
 {
-  LPHANDLE  handles;
-  DWORD     i, j;
+  struct NotifyData *nd = (struct NotifyData *)arg;
 
-  handles = ALLOC_N(HANDLE, count);
-  for (i = 0; i < count; i++) {
-    if      (i == count - 1)  handles[i] = st->event_wait_break;
-    else if (i == count - 2)  handles[i] = st->event_offsetstop;
-    else if (i == count - 3)  handles[i] = st->event_loop_point;
-    else                      handles[i] = CreateEvent(NULL, TRUE, FALSE, NULL);
-    if (handles[i] == NULL) break;
-  }
-  if (i < count) {
-    for (j = 0; j < i; j++) CloseHandle(handles[j]);
-    xfree(handles);
-    rb_raise(eSoundBufferError, "notify_create_handles error");
-  }
-  return handles;
+  notify_release_handles(nd->handles, nd->count);
+  nd->handles = NULL;
+  nd->count   = 0;
+  sb_event_close(nd->cancel);
+  return Qnil;
 }
 
-static LPDWORD
-notify_create_offsets(struct SoundBuffer *st, DWORD count, DWORD *dwoffsets)
+static VALUE
+SoundBuffer_wait(int argc, VALUE *argv, VALUE self)
 {
-  LPDWORD   offsets;
-  DWORD     i;
+  struct NotifyData  data;
 
-  offsets = ALLOC_N(DWORD, count);
-  for (i = 0; i < count; i++) {
-    if      (i == count - 1)  offsets[i] = 0; // DUMMY
-    else if (i == count - 2)  offsets[i] = DSBPN_OFFSETSTOP;
-    else if (i == count - 3)  offsets[i] = st->loop_end;
-    else                      offsets[i] = dwoffsets[i];
-  }
-  return offsets;
-}
+  if (argc > 1) rb_raise(rb_eArgError, "wrong number of arguments");
+  get_st(self);
 
-static HRESULT
-notify_SetNotificationPositions(struct SoundBuffer *st, DWORD count, LPDWORD offsets, LPHANDLE handles)
+  data.self    = self;
+  data.result  = 0;
+  data.count   = 0;
+  data.handles = NULL;
+  data.timeout = argc ? NUM2UINT(argv[0]) : INFINITE;
+  data.cancel  = sb_event_create(FALSE);
+  if (!data.cancel) rb_raise(eSoundBufferError, "wait error");
+  return rb_ensure(notify_wait_body, (VALUE)&data, notify_wait_ensure, (VALUE)&data);
+}
+
+/*
+ * SoundBuffer.wait_any
+ * すべてのバッファーのイベントをまとめて、GVLを外した1回の呼び出しで待つ。
+ * ハンドルが64個を越えるとsb_event_wait_manyが待機スレッドのプールに分けて待たせる。
+ */
+struct WaitAnyData {
+  VALUE                buffers;
+  DWORD                count;
+  DWORD                retained;  // handlesのうち参照を取ったものの数。最後の中止用は含まない
+  SBEVENT             *handles;
+  struct SoundBuffer **owners;    // handles[i]を持つバッファー。最後の中止用はNULL
+  LPDWORD              buffer_index;
+  LPDWORD              event_index;  // set_notifyの何番目か。固定ハンドルはEVENT_INDEX_*
+  DWORD                timeout;
+  DWORD                nfired;
+  LPDWORD              fired;
+  SBEVENT              cancel;
+};
+
+static void*
+wait_any_blocking(void *data)
 {
-  LPDIRECTSOUNDNOTIFY8  lpDsNotify;
-  LPDSBPOSITIONNOTIFY   PositionNotify;
-  DWORD                 i, notify_count;
-  HRESULT               hr;
+  struct WaitAnyData *wd = data;
 
-  hr = st->pDSBuffer8->lpVtbl->QueryInterface(st->pDSBuffer8, &IID_IDirectSoundNotify8, (LPVOID*)&lpDsNotify);
-  if (SUCCEEDED(hr)) {
-    // event_wait_breakはセットしない。よってcount - 1。また、サンプル位置０にnortifyをセットできる。
-    notify_count = count - 1;
-    PositionNotify = ALLOCA_N(DSBPOSITIONNOTIFY, notify_count);
-    for (i = 0; i < notify_count; i++) {
-      PositionNotify[i].dwOffset     = offsets[i];
-      PositionNotify[i].hEventNotify = handles[i];
+  wd->nfired = sb_event_wait_many(wd->count, wd->handles, wd->timeout, wd->fired);
+  return NULL;
+}
+
+static void
+wait_any_unblocking(void *data)
+{
+  sb_event_set(((struct WaitAnyData *)data)->cancel);
+}
+
+static void
+wait_any_free(struct WaitAnyData *wd)
+{
+  DWORD i;
+
+  for (i = 0; i < wd->retained; i++) sb_event_close(wd->handles[i]);
+  wd->retained = 0;
+  xfree(wd->handles);
+  xfree(wd->owners);
+  xfree(wd->buffer_index);
+  xfree(wd->event_index);
+  xfree(wd->fired);
+  wd->handles      = NULL;
+  wd->owners       = NULL;
+  wd->buffer_index = NULL;
+  wd->event_index  = NULL;
+  wd->fired        = NULL;
+}
+
+static VALUE
+wait_any_body(VALUE arg)
+{
+  struct WaitAnyData *wd = (struct WaitAnyData *)arg;
+  struct SoundBuffer *st;
+  DWORD   i, j, n, h;
+  VALUE   vbuffer;
+
+  n = (DWORD)RARRAY_LEN(wd->buffers);
+  while (1) {
+    // 通知位置が変わるとハンドルも変わるので、起こされるたびに集め直す
+    wait_any_free(wd);
+    for (i = 0, wd->count = 1; i < n; i++) wd->count += get_st(RARRAY_AREF(wd->buffers, i))->event_count;
+    wd->handles      = ALLOC_N(SBEVENT, wd->count);
+    wd->owners       = ALLOC_N(struct SoundBuffer *, wd->count);
+    wd->buffer_index = ALLOC_N(DWORD, wd->count);
+    wd->event_index  = ALLOC_N(DWORD, wd->count);
+    wd->fired        = ALLOC_N(DWORD, wd->count);
+    for (i = 0, h = 0; i < n; i++) {
+      st = get_st(RARRAY_AREF(wd->buffers, i));
+      wd->retained += notify_retain_handles(st, wd->handles + h);
+      for (j = 0; j < st->event_count; j++, h++) {
+        wd->owners[h]       = st;
+        wd->buffer_index[h] = i;
+        wd->event_index[h]  = notify_index(j, st->event_count);
+      }
+    }
+    wd->handles[h] = wd->cancel;
+    wd->owners[h]  = NULL;
+
+    rb_thread_call_without_gvl(wait_any_blocking, wd, wait_any_unblocking, wd);
+    if (wd->nfired == WAIT_FAILED) rb_raise(eSoundBufferError, "[BUG]sb_event_wait_many error in wait_any_blocking C function");
+    if (wd->nfired == 0) return Qnil;
+    // 同時に起きたものは、ユーザーのイベントならシグナルのまま残るので次の呼び出しで返す
+    for (i = 0; i < wd->nfired; i++) {
+      h  = wd->fired[i];
+      st = wd->owners[h];
+      if (!st) continue;
+      if (wd->event_index[h] == EVENT_INDEX_WAIT_BREAK) continue;
+      // 待っている間にdisposeされたものは、集め直すときに例外になる
+      if (!st->pBuffer) continue;
+      // ループ位置の通知はバックエンドがループを処理しないときだけ来る。戻して待ち直す
+      if (wd->event_index[h] == EVENT_INDEX_LOOP_POINT) {
+        notify_set_loop(st);
+        continue;
+      }
+      sb_event_reset(wd->handles[h]);
+      vbuffer = RARRAY_AREF(wd->buffers, wd->buffer_index[h]);
+      // OFFSETSTOP
+      if (wd->event_index[h] == EVENT_INDEX_OFFSETSTOP) {
+        if (st->repeat_flag == 0 && get_play_position(st) == 0) SoundBuffer_stop(vbuffer);
+        return rb_assoc_new(vbuffer, ID2SYM(rb_intern("stop")));
+      }
+      // User event
+      if (SB_STATS_ON) stats_wakeup(st, wd->event_index[h]);
+      return rb_assoc_new(vbuffer, UINT2NUM(wd->event_index[h]));
     }
-    hr = lpDsNotify->lpVtbl->SetNotificationPositions(lpDsNotify, notify_count, PositionNotify);
   }
-  lpDsNotify->lpVtbl->Release(lpDsNotify);
-  return hr;
+}
+
+static VALUE
+wait_any_ensure(VALUE arg)
+{
+  struct WaitAnyData *wd = (struct WaitAnyData *)arg;
+
+  wait_any_free(wd);
+  sb_event_close(wd->cancel);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.wait_any(buffers) -> [sb, index]
+ *    SoundBuffer.wait_any(buffers, timeout) -> [sb, index] or nil
+ *
+ * buffersのどれかの通知を待つ。indexはそのバッファーのset_notifyの何番目か。
+ * 末尾まで再生して止まったときは[sb, :stop]を返す（waitではStopIterationになる）。
+ * timeoutはミリ秒で、タイムアウトしたらnil。
+ */
+static VALUE
+SoundBuffer_c_wait_any(int argc, VALUE *argv, VALUE klass)
+{
+  struct WaitAnyData wd;
+  VALUE   vbuffers, vtimeout, result;
+  long    i;
+
+  rb_scan_args(argc, argv, "11", &vbuffers, &vtimeout);
+  vbuffers = rb_ary_dup(rb_convert_type(vbuffers, T_ARRAY, "Array", "to_ary"));
+  if (RARRAY_LEN(vbuffers) == 0) rb_raise(rb_eArgError, "no buffers");
+  for (i = 0; i < RARRAY_LEN(vbuffers); i++) {
+    if (!rb_typeddata_is_kind_of(RARRAY_AREF(vbuffers, i), &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "not valid value");
+    get_st(RARRAY_AREF(vbuffers, i));
+  }
+  memset(&wd, 0, sizeof(wd));
+  wd.timeout = NIL_P(vtimeout) ? INFINITE : NUM2UINT(vtimeout);
+  wd.cancel  = sb_event_create(FALSE);
+  if (!wd.cancel) rb_raise(eSoundBufferError, "wait_any error");
+  wd.buffers = vbuffers;
+  result = rb_ensure(wait_any_body, (VALUE)&wd, wait_any_ensure, (VALUE)&wd);
+  RB_GC_GUARD(vbuffers);
+  return result;
+}
+
+static SBEVENT *
+notify_create_handles(struct SoundBuffer *st, DWORD count)
+{
+  SBEVENT  *handles;
+  DWORD     i, j;
+
+  handles = ALLOC_N(SBEVENT, count);
+  for (i = 0; i < count; i++) {
+    if      (i == count - 1)  handles[i] = st->event_wait_break;
+    else if (i == count - 2)  handles[i] = st->event_offsetstop;
+    else if (i == count - 3)  handles[i] = st->event_loop_point;
+    else                      handles[i] = sb_event_create(TRUE);
+    if (handles[i] == NULL) break;
+  }
+  if (i < count) {
+    for (j = 0; j < i; j++) sb_event_close(handles[j]);
+    xfree(handles);
+    rb_raise(eSoundBufferError, "notify_create_handles error");
+  }
+  return handles;
+}
+
+static LPDWORD
+notify_create_offsets(struct SoundBuffer *st, DWORD count, DWORD *dwoffsets)
+{
+  LPDWORD   offsets;
+  DWORD     i;
+
+  offsets = ALLOC_N(DWORD, count);
+  for (i = 0; i < count; i++) {
+    if      (i == count - 1)  offsets[i] = 0; // DUMMY
+    else if (i == count - 2)  offsets[i] = DSBPN_OFFSETSTOP;
+    else if (i == count - 3)  offsets[i] = st->loop_end;
+    else                      offsets[i] = dwoffsets[i];
+  }
+  return offsets;
+}
+
+static DWORD stream_segments(const struct SBStream*);
+static DWORD stream_notify_positions(const struct SBStream*, LPSBPOSITIONNOTIFY);
+
+static HRESULT
+notify_SetNotificationPositions(struct SoundBuffer *st, DWORD count, LPDWORD offsets, SBEVENT *handles)
+{
+  LPSBPOSITIONNOTIFY    PositionNotify;
+  DWORD                 i, n;
+
+  // event_wait_breakはセットしない。よってcount - 1。また、サンプル位置０にnortifyをセットできる。
+  // Streamは区画の境目の通知を後ろに足す
+  PositionNotify = ALLOCA_N(SBPOSITIONNOTIFY, count - 1 + (st->stream ? stream_segments(st->stream) : 0));
+  for (i = n = 0; i < count - 1; i++) {
+    // バックエンドがループを処理するなら、ループ位置で起こしても何もすることが無い
+    if (i == count - 3 && (g_pDevice->dwCaps & SBCAPS_NATIVELOOP)) continue;
+    PositionNotify[n].dwOffset     = offsets[i];
+    PositionNotify[n].hEventNotify = handles[i];
+    n++;
+  }
+  if (st->stream) n += stream_notify_positions(st->stream, PositionNotify + n);
+  return st->pBuffer->lpVtbl->SetNotificationPositions(st->pBuffer, n, PositionNotify);
 }
 
 static void
 create_st_event(struct SoundBuffer *st, DWORD argc, LPDWORD dwoffsets)
 {
-  LPHANDLE handles;
+  SBEVENT *handles;
   LPDWORD  offsets;
   DWORD    i, count;
   HRESULT  hr;
@@ -857,6 +1599,8 @@ create_st_event(struct SoundBuffer *st, DWORD argc, LPDWORD dwoffsets)
   handles = notify_create_handles(st, count);
   hr = notify_SetNotificationPositions(st, count, offsets, handles);
   if (SUCCEEDED(hr)) {
+    // 待っている者を先に起こす。古いハンドルは待つ側が参照を返すまで残る
+    sb_event_pulse(st->event_wait_break);
     clear_st_event(st);
     st->event_count   = count;
     st->event_offsets = offsets;
@@ -864,11 +1608,10 @@ create_st_event(struct SoundBuffer *st, DWORD argc, LPDWORD dwoffsets)
   }
   else {
     xfree(offsets);
-    for (i = 0; i < count - EVENT_PRESET; i++) CloseHandle(handles[i]);
+    for (i = 0; i < count - EVENT_PRESET; i++) sb_event_close(handles[i]);
     xfree(handles);
     to_raise_an_exception(hr);
   }
-  PulseEvent(st->event_wait_break);
 }
 
 static VALUE
@@ -907,7 +1650,8 @@ play_sound(struct SoundBuffer *st)
 {
   HRESULT hr;
 
-  hr = st->pDSBuffer8->lpVtbl->Play(st->pDSBuffer8, 0, 0, 0);
+  param_flush(st);
+  hr = st->pBuffer->lpVtbl->Play(st->pBuffer, 0);
   if (FAILED(hr)) to_raise_an_exception(hr);
 }
 
@@ -916,7 +1660,8 @@ repeat_sound(struct SoundBuffer *st)
 {
   HRESULT hr;
 
-  hr = st->pDSBuffer8->lpVtbl->Play(st->pDSBuffer8, 0, 0, DSBPLAY_LOOPING);
+  param_flush(st);
+  hr = st->pBuffer->lpVtbl->Play(st->pBuffer, DSBPLAY_LOOPING);
   if (FAILED(hr)) to_raise_an_exception(hr);
 }
 
@@ -925,7 +1670,7 @@ stop_sound(struct SoundBuffer *st)
 {
   HRESULT hr;
 
-  hr = st->pDSBuffer8->lpVtbl->Stop(st->pDSBuffer8);
+  hr = st->pBuffer->lpVtbl->Stop(st->pBuffer);
   if (FAILED(hr)) to_raise_an_exception(hr);
 }
 
@@ -961,6 +1706,7 @@ SoundBuffer_stop(VALUE self)
   st->play_flag    = 0;
   st->repeat_flag  = 0;
   st->loop_counter = 0;
+  sync_loop(st);
   return self;
 }
 
@@ -983,7 +1729,7 @@ get_play_status(struct SoundBuffer *st)
   HRESULT hr;
   DWORD   dwStatus;
 
-  hr = st->pDSBuffer8->lpVtbl->GetStatus(st->pDSBuffer8, &dwStatus);
+  hr = st->pBuffer->lpVtbl->GetStatus(st->pBuffer, &dwStatus);
   if (FAILED(hr)) to_raise_an_exception(hr);
   return dwStatus;
 }
@@ -1010,6 +1756,7 @@ SoundBuffer_pausing(VALUE self)
 {
   struct SoundBuffer *st = get_st(self);
 
+  sched_sync(st);
   return !st->play_flag && get_play_position(st) > 0 ? Qtrue : Qfalse;
 }
 
@@ -1018,6 +1765,7 @@ SoundBuffer_playing(VALUE self)
 {// 組み合わせ技でいく。
   struct SoundBuffer *st = get_st(self);
 
+  sched_sync(st);
   return st->play_flag && get_playing(st) ? Qtrue : Qfalse;
 }
 
@@ -1026,6 +1774,7 @@ SoundBuffer_repeating(VALUE self)
 {
   struct SoundBuffer *st = get_st(self);
 
+  sched_sync(st);
   return st->repeat_flag ? Qtrue : Qfalse;
 }
 
@@ -1041,7 +1790,10 @@ SoundBuffer_get_loop(VALUE self)
 static VALUE
 SoundBuffer_set_loop(VALUE self, VALUE v)
 {
-  get_st(self)->loop_flag = RTEST(v);
+  struct SoundBuffer *st = get_st(self);
+
+  st->loop_flag = RTEST(v);
+  sync_loop(st);
   return self;
 }
 
@@ -1054,6 +1806,7 @@ SoundBuffer_set_loop_start(VALUE self, VALUE v)
   n = pcmnum2row(st, v);
   if (n > st->buffer_bytes) rb_raise(rb_eRangeError, "buffer_size");
   st->loop_start = n;
+  sync_loop(st);
   return self;
 }
 
@@ -1068,10 +1821,14 @@ SoundBuffer_set_loop_end(VALUE self, VALUE v)
   if (n > st->buffer_bytes) rb_raise(rb_eRangeError, "buffer_size");
   st->loop_end = n;
 
-  argc = st->event_count - EVENT_PRESET;
-  offsets = ALLOCA_N(DWORD, argc);
-  MEMCPY(offsets, st->event_offsets, DWORD, argc);
-  create_st_event(st, argc, offsets);
+  // ループ位置の通知を付け直すのは、バックエンドがループを処理しないときだけ
+  if (!(g_pDevice->dwCaps & SBCAPS_NATIVELOOP)) {
+    argc = st->event_count - EVENT_PRESET;
+    offsets = ALLOCA_N(DWORD, argc);
+    MEMCPY(offsets, st->event_offsets, DWORD, argc);
+    create_st_event(st, argc, offsets);
+  }
+  sync_loop(st);
 
   return self;
 }
@@ -1079,14 +1836,20 @@ SoundBuffer_set_loop_end(VALUE self, VALUE v)
 static VALUE
 SoundBuffer_set_loop_count(VALUE self, VALUE v)
 {
-  get_st(self)->loop_count = NUM2UINT(v);
+  struct SoundBuffer *st = get_st(self);
+
+  st->loop_count = NUM2UINT(v);
+  sync_loop(st);
   return self;
 }
 
 static VALUE
 SoundBuffer_set_loop_counter(VALUE self, VALUE v)
 {
-  get_st(self)->loop_counter = NUM2UINT(v);
+  struct SoundBuffer *st = get_st(self);
+
+  st->loop_counter = NUM2UINT(v);
+  sync_loop(st);
   return self;
 }
 
@@ -1115,7 +1878,17 @@ SoundBuffer_get_loop_count(VALUE self)
 static VALUE
 SoundBuffer_get_loop_counter(VALUE self)
 {
-  return UINT2NUM(get_st(self)->loop_counter);
+  SBLOOP  loop;
+  HRESULT hr;
+  struct SoundBuffer *st = get_st(self);
+
+  // バックエンドがループを処理しているなら、数えているのはバックエンド
+  if (g_pDevice->dwCaps & SBCAPS_NATIVELOOP) {
+    hr = st->pBuffer->lpVtbl->GetLoop(st->pBuffer, &loop);
+    if (FAILED(hr)) to_raise_an_exception(hr);
+    st->loop_counter = loop.dwCounter;
+  }
+  return UINT2NUM(st->loop_counter);
 }
 /*
  *
@@ -1134,19 +1907,184 @@ SoundBuffer_stop_and_play(VALUE self)
   return result;
 }
 
+/*
+ * 音量・パン・周波数の設定。範囲はprepareで調べ、写しと同じものはmaskから外す。
+ * 止まっているバッファーはdeferで写しだけ変え、playの前にparam_flushで送る。
+ * runはGVLを外して呼べる。commitで設定できた値を写しに入れ、失敗があれば例外にする。
+ */
+#define PARAM_VOLUME    (1 << SBPARAM_VOLUME)
+#define PARAM_PAN       (1 << SBPARAM_PAN)
+#define PARAM_FREQUENCY (1 << SBPARAM_FREQUENCY)
+#define PARAM_KEEP      INT32_MIN   // packedで「変えない」
+
+struct ParamUpdate {
+  struct SoundBuffer *st;
+  LPSBBUFFER          buf;
+  LONG                volume;
+  LONG                pan;
+  DWORD               frequency;
+  DWORD               mask;   // 送るもの
+  DWORD               done;   // 送れたもの
+  HRESULT             hr;
+};
+
+static void
+param_update_prepare(struct ParamUpdate *u, struct SoundBuffer *st, VALUE vvolume, VALUE vpan, VALUE vfrequency)
+{
+  u->st   = st;
+  u->buf  = st->pBuffer;
+  u->mask = u->done = 0;
+  u->hr   = DS_OK;
+  if (!NIL_P(vvolume)) {
+    u->volume = NUM2INT(vvolume);
+    if (u->volume < DSBVOLUME_MIN || DSBVOLUME_MAX < u->volume) rb_raise(rb_eRangeError, "volume can be only DSBVOLUME_MIN-DSBVOLUME_MAX");
+    if (st->volume != u->volume || ((st->param_auto | st->param_sched) & PARAM_VOLUME)) u->mask |= PARAM_VOLUME;
+  }
+  if (!NIL_P(vpan)) {
+    u->pan = NUM2INT(vpan);
+    if (u->pan < DSBPAN_LEFT || DSBPAN_RIGHT < u->pan) rb_raise(rb_eRangeError, "pan can be only DSBPAN_LEFT-DSBPAN_RIGHT");
+    if (st->pan != u->pan || ((st->param_auto | st->param_sched) & PARAM_PAN)) u->mask |= PARAM_PAN;
+  }
+  if (!NIL_P(vfrequency)) {
+    u->frequency = NUM2UINT(vfrequency);
+    if (u->frequency != DSBFREQUENCY_ORIGINAL && (u->frequency < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < u->frequency)) {
+      rb_raise(rb_eRangeError, "frequency can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX or DSBFREQUENCY_ORIGINAL");
+    }
+    if (u->frequency == DSBFREQUENCY_ORIGINAL) u->frequency = st->samples_per_sec;
+    if (st->frequency != u->frequency || ((st->param_auto | st->param_sched) & PARAM_FREQUENCY)) u->mask |= PARAM_FREQUENCY;
+  }
+}
+
+// 止まっていれば写しだけ変えて、送るものを無くす
+static void
+param_update_defer(struct ParamUpdate *u)
+{
+  struct SoundBuffer *st = u->st;
+
+  if (st->play_flag || !u->mask) return;
+  if (u->mask & PARAM_VOLUME)    st->volume    = u->volume;
+  if (u->mask & PARAM_PAN)       st->pan       = u->pan;
+  if (u->mask & PARAM_FREQUENCY) st->frequency = u->frequency;
+  st->param_dirty |= u->mask;
+  // 自動変化はplayで送るときに止まる。それまでは写しの値を返す
+  st->param_auto  &= ~u->mask;
+  u->mask = 0;
+}
+
+static void
+param_update_run(struct ParamUpdate *u)
+{
+  LPSBBUFFER buf = u->buf;
+
+  if (u->mask & PARAM_VOLUME) {
+    u->hr = buf->lpVtbl->SetVolume(buf, u->volume);
+    if (FAILED(u->hr)) return;
+    u->done |= PARAM_VOLUME;
+  }
+  if (u->mask & PARAM_PAN) {
+    u->hr = buf->lpVtbl->SetPan(buf, u->pan);
+    if (FAILED(u->hr)) return;
+    u->done |= PARAM_PAN;
+  }
+  if (u->mask & PARAM_FREQUENCY) {
+    u->hr = buf->lpVtbl->SetFrequency(buf, u->frequency);
+    if (FAILED(u->hr)) return;
+    u->done |= PARAM_FREQUENCY;
+  }
+}
+
+static void
+param_update_store(struct ParamUpdate *u)
+{
+  struct SoundBuffer *st = u->st;
+
+  // GVLを外している間にsplice!などで入れ替わっていたら覚えない
+  if (st->pBuffer != u->buf) return;
+  if (u->done & PARAM_VOLUME)    st->volume    = u->volume;
+  if (u->done & PARAM_PAN)       st->pan       = u->pan;
+  if (u->done & PARAM_FREQUENCY) st->frequency = u->frequency;
+  st->param_dirty &= ~u->done;
+  // バックエンドは直接の設定で自動変化を止める
+  st->param_auto  &= ~u->done;
+}
+
+static void
+param_update_raise(struct ParamUpdate *u)
+{
+  if (u->hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
+  if (FAILED(u->hr)) to_raise_an_exception(u->hr);
+}
+
+static void
+param_update_commit(struct ParamUpdate *u)
+{
+  param_update_store(u);
+  param_update_raise(u);
+}
+
+// 1つのバッファーの設定。止まっていれば送らない
+static void
+param_update_apply(struct ParamUpdate *u)
+{
+  param_update_defer(u);
+  param_update_run(u);
+  param_update_commit(u);
+}
+
+/*
+ * 自動変化中のパラメーター（maskのPARAM_*）の写しをデバイスから読み直す。
+ * 自動変化が終わっていれば、その値を最後にして写しに戻す
+ */
+static void
+refresh_st_params(struct SoundBuffer *st, DWORD mask)
+{
+  LPSBBUFFER buf = st->pBuffer;
+  DWORD   param, remaining;
+  HRESULT hr = DS_OK;
+
+  for (param = 0; param < SBPARAM_COUNT; param++) {
+    if (!(mask & (1 << param))) continue;
+    switch (param) {
+    case SBPARAM_VOLUME:    hr = buf->lpVtbl->GetVolume(buf, &st->volume);       break;
+    case SBPARAM_PAN:       hr = buf->lpVtbl->GetPan(buf, &st->pan);             break;
+    case SBPARAM_FREQUENCY: hr = buf->lpVtbl->GetFrequency(buf, &st->frequency); break;
+    }
+    if (SUCCEEDED(hr)) hr = buf->lpVtbl->GetAutomation(buf, param, &remaining);
+    if (FAILED(hr)) to_raise_an_exception(hr);
+    if (!remaining) st->param_auto &= ~(1 << param);
+  }
+}
+
+// 写しだけ変えていた値をデバイスに送る
+static void
+param_flush(struct SoundBuffer *st)
+{
+  struct ParamUpdate u;
+
+  if (!st->param_dirty) return;
+  u.st        = st;
+  u.buf       = st->pBuffer;
+  u.volume    = st->volume;
+  u.pan       = st->pan;
+  u.frequency = st->frequency;
+  u.mask      = st->param_dirty;
+  u.done      = 0;
+  u.hr        = DS_OK;
+  param_update_run(&u);
+  param_update_commit(&u);
+}
+
 /*
  * SoundBuffer#get_volume
  */
 static VALUE
 SoundBuffer_get_volume(VALUE self)
 {
-  HRESULT hr;
-  long    volume;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetVolume(st->pDSBuffer8, &volume);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return INT2NUM(volume);
+  sched_sync(st);
+  refresh_st_params(st, (st->param_auto | st->param_sched) & PARAM_VOLUME);
+  return INT2NUM(st->volume);
 }
 /*
  * SoundBuffer#set_volume
@@ -1154,12 +2092,10 @@ SoundBuffer_get_volume(VALUE self)
 static VALUE
 SoundBuffer_set_volume(VALUE self, VALUE vvolume)
 {
-  HRESULT hr;
-  struct SoundBuffer *st = get_st(self);
+  struct ParamUpdate u;
 
-  hr = st->pDSBuffer8->lpVtbl->SetVolume(st->pDSBuffer8, NUM2INT(vvolume));
-  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
-  if (FAILED(hr)) to_raise_an_exception(hr);
+  param_update_prepare(&u, get_st(self), vvolume, Qnil, Qnil);
+  param_update_apply(&u);
   return vvolume;
 }
 /*
@@ -1168,13 +2104,11 @@ SoundBuffer_set_volume(VALUE self, VALUE vvolume)
 static VALUE
 SoundBuffer_get_pan(VALUE self)
 {
-  HRESULT hr;
-  long    pan;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetPan(st->pDSBuffer8, &pan);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return INT2NUM(pan);
+  sched_sync(st);
+  refresh_st_params(st, (st->param_auto | st->param_sched) & PARAM_PAN);
+  return INT2NUM(st->pan);
 }
 /*
  * SoundBuffer#set_pan
@@ -1182,12 +2116,10 @@ SoundBuffer_get_pan(VALUE self)
 static VALUE
 SoundBuffer_set_pan(VALUE self, VALUE vpan)
 {
-  HRESULT hr;
-  struct SoundBuffer *st = get_st(self);
+  struct ParamUpdate u;
 
-  hr = st->pDSBuffer8->lpVtbl->SetPan(st->pDSBuffer8, NUM2INT(vpan));
-  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
-  if (FAILED(hr)) to_raise_an_exception(hr);
+  param_update_prepare(&u, get_st(self), Qnil, vpan, Qnil);
+  param_update_apply(&u);
   return vpan;
 }
 /*
@@ -1196,14 +2128,11 @@ SoundBuffer_set_pan(VALUE self, VALUE vpan)
 static VALUE
 SoundBuffer_get_frequency(VALUE self)
 {
-  HRESULT hr;
-  unsigned long frequency;
-
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetFrequency(st->pDSBuffer8, &frequency);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return UINT2NUM(frequency);
+  sched_sync(st);
+  refresh_st_params(st, (st->param_auto | st->param_sched) & PARAM_FREQUENCY);
+  return UINT2NUM(st->frequency);
 }
 /*
  * SoundBuffer#set_frequency
@@ -1211,665 +2140,3350 @@ SoundBuffer_get_frequency(VALUE self)
 static VALUE
 SoundBuffer_set_frequency(VALUE self, VALUE vfrequency)
 {
-  HRESULT hr;
-  struct SoundBuffer *st = get_st(self);
+  struct ParamUpdate u;
 
-  hr = st->pDSBuffer8->lpVtbl->SetFrequency(st->pDSBuffer8, NUM2UINT(vfrequency));
-  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
-  if (FAILED(hr)) to_raise_an_exception(hr);
+  param_update_prepare(&u, get_st(self), Qnil, Qnil, vfrequency);
+  param_update_apply(&u);
   return vfrequency;
 }
+
 /*
+ * call-seq:
+ *    sb.set_params(volume: nil, pan: nil, frequency: nil) -> self
  *
+ * 渡したものだけをまとめて設定する。前に設定した値と同じものはデバイスに送らない。
+ * 止まっているバッファーは覚えておくだけで、次のplayかrepeatでまとめて送る。
  */
 static VALUE
-SoundBuffer_get_effect(VALUE self)
+SoundBuffer_set_params(int argc, VALUE *argv, VALUE self)
 {
-  DWORD i;
-  VALUE ary;
-  struct SoundBuffer *st = get_st(self);
-
-  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
-  ary = rb_ary_new();
-  for (i = 0; i < st->effect_count; i++) rb_ary_store(ary, i, UINT2NUM(st->effect_nums[i]));
-  return ary;
+  struct ParamUpdate u;
+  VALUE vopt;
+
+  rb_scan_args(argc, argv, "0:", &vopt);
+  if (NIL_P(vopt)) return self;
+  param_update_prepare(&u, get_st(self),
+                       rb_hash_aref(vopt, ID2SYM(rb_intern("volume"))),
+                       rb_hash_aref(vopt, ID2SYM(rb_intern("pan"))),
+                       rb_hash_aref(vopt, ID2SYM(rb_intern("frequency"))));
+  param_update_apply(&u);
+  return self;
 }
 
-/*
- * set_effect
- * 再生中のエフェクトリスト変更はエラーになる
- */
-static VALUE
-SoundBuffer_set_effect(int argc, VALUE *argv, VALUE self)
-{
-  DWORD          i, count;
-  GUID           guid;
-  LPDSEFFECTDESC pDSFXDesc;
-  HRESULT        hr;
-  struct SoundBuffer *st = get_st(self);
-
-  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+struct ApplyData {
+  DWORD               count;
+  struct ParamUpdate *updates;
+};
 
-  count = (DWORD)argc;
-  if (count > 0) {
-    pDSFXDesc = ALLOCA_N(DSEFFECTDESC, count);
-    for (i = 0; i < count; i++) {
-      switch (NUM2UINT(argv[i])) {
-        case FX_GARGLE:
-          guid = GUID_DSFX_STANDARD_GARGLE;
-          break;
-        case FX_CHORUS:
-          guid = GUID_DSFX_STANDARD_CHORUS;
-          break;
-        case FX_FLANGER:
-          guid = GUID_DSFX_STANDARD_FLANGER;
-          break;
-        case FX_ECHO:
-          guid = GUID_DSFX_STANDARD_ECHO;
-          break;
-        case FX_DISTORTION:
-          guid = GUID_DSFX_STANDARD_DISTORTION;
-          break;
-        case FX_COMPRESSOR:
-          guid = GUID_DSFX_STANDARD_COMPRESSOR;
-          break;
-        case FX_PARAM_EQ:
-          guid = GUID_DSFX_STANDARD_PARAMEQ;
-          break;
-        case FX_I3DL2_REVERB:
-          guid = GUID_DSFX_STANDARD_I3DL2REVERB;
-          break;
-        case FX_WAVES_REVERB:
-          guid = GUID_DSFX_WAVES_REVERB;
-          break;
-        default:
-          rb_raise(rb_eTypeError, "not valid value");
-          break;
-      }
-      pDSFXDesc[i].dwSize        = sizeof(DSEFFECTDESC);
-      pDSFXDesc[i].dwFlags       = DSFX_LOCSOFTWARE;      // dwFlagは強制的にソフトウェアー配置
-      pDSFXDesc[i].guidDSFXClass = guid;
-      pDSFXDesc[i].dwReserved1   = 0;
-      pDSFXDesc[i].dwReserved2   = 0;
-    }
-    hr = st->pDSBuffer8->lpVtbl->SetFX(st->pDSBuffer8, count, pDSFXDesc, NULL);
-  }
-  else hr = st->pDSBuffer8->lpVtbl->SetFX(st->pDSBuffer8,  0,      NULL, NULL);
+static void*
+apply_blocking(void *data)
+{
+  struct ApplyData *ad = data;
+  DWORD i;
 
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  clear_st_effect(st);
-  st->effect_nums  = count ? ALLOC_N(DWORD, count) : NULL;
-  for (i = 0; i < count; i++) st->effect_nums[i] = NUM2UINT(argv[i]);
-  st->effect_count = count;
-  return self;
+  for (i = 0; i < ad->count; i++) param_update_run(&ad->updates[i]);
+  return NULL;
 }
 
 static VALUE
-SoundBuffer_GetAllParameters_DSFXGargle(VALUE self, VALUE nth)
+apply_body(VALUE data)
 {
-  HRESULT     hr;
-  LPVOID      pObject;
-  DSFXGargle  dsfx;
-  struct SoundBuffer *st = get_st(self);
-
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_GARGLE,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXGargle8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXGargle8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXGargle8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(2,  UINT2NUM(dsfx.dwRateHz),
-                                  UINT2NUM(dsfx.dwWaveShape));
+  rb_thread_call_without_gvl(apply_blocking, (void*)data, NULL, NULL);
+  return Qnil;
 }
 
 static VALUE
-SoundBuffer_SetAllParameters_DSFXGargle(int argc, VALUE *argv, VALUE self)
+apply_ensure(VALUE data)
 {
-  HRESULT     hr;
-  LPVOID      pObject;
-  DSFXGargle  dsfx;
-  struct SoundBuffer *st = get_st(self);
+  struct ApplyData *ad = (struct ApplyData *)data;
+  DWORD i;
 
-  if (argc != 3) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.dwRateHz    = NUM2UINT(argv[1]);
-  dsfx.dwWaveShape = NUM2UINT(argv[2]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_GARGLE,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXGargle8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXGargle8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXGargle8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+  for (i = 0; i < ad->count; i++) unpin_st(ad->updates[i].st);
+  return Qnil;
 }
 
+// packedの1つ分（符号付き32bitリトル・エンディアン）
 static VALUE
-SoundBuffer_GetAllParameters_DSFXChorus(VALUE self, VALUE nth)
+packed_param(const BYTE *p)
 {
-  HRESULT     hr;
-  LPVOID      pObject;
-  DSFXChorus  dsfx;
-  struct SoundBuffer *st = get_st(self);
+  int32_t v = (int32_t)((DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24);
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_CHORUS,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXChorus8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXChorus8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXChorus8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(7,  rb_float_new(dsfx.fWetDryMix),
-                                  rb_float_new(dsfx.fDepth),
-                                  rb_float_new(dsfx.fFeedback),
-                                  rb_float_new(dsfx.fFrequency),
-                                  INT2NUM(dsfx.lWaveform),
-                                  rb_float_new(dsfx.fDelay),
-                                  INT2NUM(dsfx.lPhase));
+  return v == PARAM_KEEP ? Qnil : INT2NUM(v);
 }
 
+/*
+ * call-seq:
+ *    SoundBuffer.apply([[sb, volume, pan, frequency], ...]) -> Integer
+ *    SoundBuffer.apply(buffers, packed) -> Integer
+ *
+ * 多くのバッファーの音量・パン・周波数を、GVLを外した1回の呼び出しで設定する。
+ * nil（packedではSoundBuffer::PARAM_KEEP）の値と、前に設定した値と同じものは送らない。
+ * 止まっているバッファーへの値は覚えておき、次のplayかrepeatで送る。
+ * packedはバッファーごとに符号付き32bitリトル・エンディアンを3つ（pack("l<3" * n)）並べた文字列。
+ * 範囲外の値があれば何も設定せずにRangeErrorになる。戻り値はデバイスに送った値の数。
+ * GVLを外している間にほかのスレッドが解放しないよう、送るバッファーはpinしておく。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXChorus(int argc, VALUE *argv, VALUE self)
+SoundBuffer_c_apply(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT     hr;
-  LPVOID      pObject;
-  DSFXChorus  dsfx;
-  struct SoundBuffer *st = get_st(self);
+  VALUE            vupdates, vpacked, entry, sb, vkeep, vtmp;
+  struct ApplyData ad;
+  const BYTE      *packed = NULL;
+  DWORD            i, sent = 0, bit;
+  long             len;
+
+  rb_scan_args(argc, argv, "11", &vupdates, &vpacked);
+  vupdates = rb_Array(vupdates);
+  len = RARRAY_LEN(vupdates);
+  if (!NIL_P(vpacked)) {
+    StringValue(vpacked);
+    if (RSTRING_LEN(vpacked) != len * 12) rb_raise(rb_eArgError, "packed size must be buffers.size * 12 bytes");
+    packed = (const BYTE *)RSTRING_PTR(vpacked);
+  }
+  ad.count   = 0;
+  ad.updates = ALLOCV_N(struct ParamUpdate, vtmp, len ? len : 1);
+  // 渡された配列は書き換えられるかもしれないので、バッファーは別に持っておく
+  vkeep = rb_ary_new_capa(len);
+  for (i = 0; i < (DWORD)len; i++) {
+    entry = RARRAY_AREF(vupdates, i);
+    if (packed) {
+      sb = entry;
+      if (!rb_typeddata_is_kind_of(sb, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+      param_update_prepare(&ad.updates[i], get_st(sb),
+                           packed_param(packed + i * 12),
+                           packed_param(packed + i * 12 + 4),
+                           packed_param(packed + i * 12 + 8));
+    }
+    else {
+      entry = rb_Array(entry);
+      if (RARRAY_LEN(entry) < 1 || 4 < RARRAY_LEN(entry)) rb_raise(rb_eArgError, "update must be [sb, volume, pan, frequency]");
+      sb = RARRAY_AREF(entry, 0);
+      if (!rb_typeddata_is_kind_of(sb, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+      param_update_prepare(&ad.updates[i], get_st(sb), rb_ary_entry(entry, 1), rb_ary_entry(entry, 2), rb_ary_entry(entry, 3));
+    }
+    rb_ary_push(vkeep, sb);
+  }
+  // 範囲を全部調べてから、止まっているものは写しだけ変える
+  for (i = 0; i < (DWORD)len; i++) {
+    param_update_defer(&ad.updates[i]);
+    if (ad.updates[i].mask) ad.updates[ad.count++] = ad.updates[i];
+  }
+  if (ad.count) {
+    for (i = 0; i < ad.count; i++) pin_st(ad.updates[i].st);
+    rb_ensure(apply_body, (VALUE)&ad, apply_ensure, (VALUE)&ad);
+  }
+  // 成功したものは全部覚えてから、最初の失敗を例外にする
+  for (i = 0; i < ad.count; i++) {
+    param_update_store(&ad.updates[i]);
+    for (bit = ad.updates[i].done; bit; bit &= bit - 1) sent++;
+  }
+  for (i = 0; i < ad.count; i++) param_update_raise(&ad.updates[i]);
+  ALLOCV_END(vtmp);
+  RB_GC_GUARD(vupdates);
+  RB_GC_GUARD(vkeep);
+  return UINT2NUM(sent);
+}
 
-  if (argc != 8) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fWetDryMix = (float)NUM2DBL(argv[1]);
-  dsfx.fDepth     = (float)NUM2DBL(argv[2]);
-  dsfx.fFeedback  = (float)NUM2DBL(argv[3]);
-  dsfx.fFrequency = (float)NUM2DBL(argv[4]);
-  dsfx.lWaveform  = NUM2INT(argv[5]);
-  dsfx.fDelay     = (float)NUM2DBL(argv[6]);
-  dsfx.lPhase     = NUM2INT(argv[7]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_CHORUS,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXChorus8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXChorus8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXChorus8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+/*
+ * ランプとエンベロープ
+ * 値の変化はバックエンドが出力のフレーム単位で進めるので、Rubyのスレッドは関わらない。
+ * softとofflineはSOFT_AUTO_FRAMESごと、dsoundはサービス・スレッドが数ミリ秒ごとに値を更新する。
+ */
+static DWORD
+param_index(VALUE vparam)
+{
+  ID id = SYM2ID(rb_to_symbol(vparam));
+
+  if (id == rb_intern("volume"))    return SBPARAM_VOLUME;
+  if (id == rb_intern("pan"))       return SBPARAM_PAN;
+  if (id == rb_intern("frequency")) return SBPARAM_FREQUENCY;
+  rb_raise(rb_eArgError, "parameter can be only :volume, :pan or :frequency");
+  return 0;
+}
+
+static DWORD
+curve_index(VALUE vcurve)
+{
+  ID id;
+
+  if (NIL_P(vcurve)) return SBCURVE_LINEAR;
+  id = SYM2ID(rb_to_symbol(vcurve));
+  if (id == rb_intern("linear"))      return SBCURVE_LINEAR;
+  if (id == rb_intern("exponential")) return SBCURVE_EXPONENTIAL;
+  if (id == rb_intern("smooth"))      return SBCURVE_SMOOTH;
+  rb_raise(rb_eArgError, "curve can be only :linear, :exponential or :smooth");
+  return 0;
+}
+
+// 秒をデバイスの出力のフレーム数にする
+static DWORD
+seconds_to_device_frames(VALUE vsec)
+{
+  WAVEFORMATEX wfx;
+  double  sec = NUM2DBL(vsec);
+  HRESULT hr;
+
+  if (!(sec >= 0.0) || sec > 86400.0) rb_raise(rb_eRangeError, "duration can be only 0-86400 seconds");
+  hr = g_pDevice->lpVtbl->GetFormat(g_pDevice, &wfx);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return (DWORD)(sec * wfx.nSamplesPerSec + 0.5);
+}
+
+// [duration, value(, curve)]を折れ点にする
+static void
+set_breakpoint(struct SoundBuffer *st, DWORD param, LPSBBREAKPOINT p, VALUE vduration, VALUE vvalue, DWORD curve)
+{
+  static const char *const names[SBPARAM_COUNT] = { "volume", "pan", "frequency" };
+  static const LONG lo[SBPARAM_COUNT] = { DSBVOLUME_MIN, DSBPAN_LEFT,  DSBFREQUENCY_MIN };
+  static const LONG hi[SBPARAM_COUNT] = { DSBVOLUME_MAX, DSBPAN_RIGHT, DSBFREQUENCY_MAX };
+
+  p->dwFrames = seconds_to_device_frames(vduration);
+  p->lValue   = NUM2INT(vvalue);
+  p->dwCurve  = curve;
+  if (param == SBPARAM_FREQUENCY && p->lValue == DSBFREQUENCY_ORIGINAL) p->lValue = st->samples_per_sec;
+  if (p->lValue < lo[param] || hi[param] < p->lValue) rb_raise(rb_eRangeError, "%s can be only %ld-%ld", names[param], (long)lo[param], (long)hi[param]);
+  if (curve == SBCURVE_EXPONENTIAL && param != SBPARAM_FREQUENCY) rb_raise(rb_eArgError, "exponential curve is for frequency only");
+}
+
+// 折れ点を渡す。0個なら止める。送っていない値があれば先に送り、そこから始める
+static void
+set_st_automation(struct SoundBuffer *st, DWORD param, DWORD count, LPCSBBREAKPOINT points)
+{
+  HRESULT hr;
+
+  param_flush(st);
+  hr = st->pBuffer->lpVtbl->SetAutomation(st->pBuffer, param, count, points);
+  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  // 止めたときも、止まった値を次に読むときに写しへ入れる
+  st->param_auto |= 1 << param;
 }
 
+/*
+ * call-seq:
+ *    sb.ramp(param, target, duration, curve: :linear) -> self
+ *
+ * paramは:volume、:pan、:frequencyのどれか。今の値からtargetまでduration秒で動かす。
+ * curveは:linear（1/100dB・パン・Hzで直線）、:smooth（両端がなめらかなS字）、:exponential（周波数だけ。比が一定）。
+ * 再生中だけ進む。同じパラメーターに新しいランプを置くか、値を直接設定すると、それまでの変化は止まる。
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXFlanger(VALUE self, VALUE nth)
+SoundBuffer_ramp(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT      hr;
-  LPVOID       pObject;
-  DSFXFlanger  dsfx;
   struct SoundBuffer *st = get_st(self);
+  VALUE         vparam, vtarget, vduration, vopt;
+  SBBREAKPOINT  point;
+  DWORD         param;
+
+  rb_scan_args(argc, argv, "3:", &vparam, &vtarget, &vduration, &vopt);
+  param = param_index(vparam);
+  set_breakpoint(st, param, &point, vduration, vtarget,
+                 curve_index(NIL_P(vopt) ? Qnil : rb_hash_aref(vopt, ID2SYM(rb_intern("curve")))));
+  set_st_automation(st, param, 1, &point);
+  return self;
+}
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_FLANGER,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXFlanger8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXFlanger8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXFlanger8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(7,  rb_float_new(dsfx.fWetDryMix),
-                                  rb_float_new(dsfx.fDepth),
-                                  rb_float_new(dsfx.fFeedback),
-                                  rb_float_new(dsfx.fFrequency),
-                                  INT2NUM(dsfx.lWaveform),
-                                  rb_float_new(dsfx.fDelay),
-                                  INT2NUM(dsfx.lPhase));
+/*
+ * call-seq:
+ *    sb.envelope(param, [[duration, value], [duration, value, curve], ...], curve: :linear) -> self
+ *
+ * 折れ点を順にたどる。各折れ点は前の折れ点からの秒数と値で、curveを省くとキーワードのcurveになる。
+ * たとえば sb.envelope(:volume, [[0, -10000], [0.01, 0], [0.2, -600], [1.0, -10000]]) で
+ * 無音から10ミリ秒で立ち上がり、0.2秒で-6dBまで下がって、1秒かけて消える。
+ */
+static VALUE
+SoundBuffer_envelope(int argc, VALUE *argv, VALUE self)
+{
+  struct SoundBuffer *st = get_st(self);
+  VALUE          vparam, vpoints, vopt, entry;
+  LPSBBREAKPOINT points;
+  DWORD          param, curve, i;
+  long           len;
+
+  rb_scan_args(argc, argv, "2:", &vparam, &vpoints, &vopt);
+  param   = param_index(vparam);
+  curve   = curve_index(NIL_P(vopt) ? Qnil : rb_hash_aref(vopt, ID2SYM(rb_intern("curve"))));
+  vpoints = rb_Array(vpoints);
+  len     = RARRAY_LEN(vpoints);
+  if (len == 0) rb_raise(rb_eArgError, "no breakpoints");
+  points = ALLOCA_N(SBBREAKPOINT, len);
+  for (i = 0; i < (DWORD)len; i++) {
+    entry = rb_Array(RARRAY_AREF(vpoints, i));
+    if (RARRAY_LEN(entry) < 2 || 3 < RARRAY_LEN(entry)) rb_raise(rb_eArgError, "breakpoint must be [duration, value] or [duration, value, curve]");
+    set_breakpoint(st, param, &points[i], RARRAY_AREF(entry, 0), RARRAY_AREF(entry, 1),
+                   RARRAY_LEN(entry) == 3 ? curve_index(RARRAY_AREF(entry, 2)) : curve);
+  }
+  set_st_automation(st, param, (DWORD)len, points);
+  return self;
 }
 
+/*
+ * call-seq:
+ *    sb.cancel_ramp(param = nil) -> self
+ *
+ * 自動変化をその時点の値で止める。paramを省くとすべて。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXFlanger(int argc, VALUE *argv, VALUE self)
+SoundBuffer_cancel_ramp(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT      hr;
-  LPVOID       pObject;
-  DSFXFlanger  dsfx;
   struct SoundBuffer *st = get_st(self);
+  VALUE vparam;
+  DWORD param;
 
-  if (argc != 8) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fWetDryMix = (float)NUM2DBL(argv[1]);
-  dsfx.fDepth     = (float)NUM2DBL(argv[2]);
-  dsfx.fFeedback  = (float)NUM2DBL(argv[3]);
-  dsfx.fFrequency = (float)NUM2DBL(argv[4]);
-  dsfx.lWaveform  = NUM2INT(argv[5]);
-  dsfx.fDelay     = (float)NUM2DBL(argv[6]);
-  dsfx.lPhase     = NUM2INT(argv[7]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_FLANGER,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXFlanger8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXFlanger8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXFlanger8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  rb_scan_args(argc, argv, "01", &vparam);
+  for (param = 0; param < SBPARAM_COUNT; param++) {
+    if (!NIL_P(vparam) && param != param_index(vparam)) continue;
+    set_st_automation(st, param, 0, NULL);
+  }
   return self;
 }
 
+/*
+ * call-seq:
+ *    sb.ramping?(param = nil) -> bool
+ *
+ * まだ最後の折れ点に着いていない自動変化があればtrue。
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXEcho(VALUE self, VALUE nth)
+SoundBuffer_ramping(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT   hr;
-  LPVOID    pObject;
-  DSFXEcho  dsfx;
   struct SoundBuffer *st = get_st(self);
+  VALUE   vparam;
+  DWORD   param, remaining;
+  HRESULT hr;
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_ECHO,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXEcho8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXEcho8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXEcho8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(5,  rb_float_new(dsfx.fWetDryMix),
-                                  rb_float_new(dsfx.fFeedback),
-                                  rb_float_new(dsfx.fLeftDelay),
-                                  rb_float_new(dsfx.fRightDelay),
-                                  INT2NUM(dsfx.lPanDelay));
+  rb_scan_args(argc, argv, "01", &vparam);
+  for (param = 0; param < SBPARAM_COUNT; param++) {
+    if (!NIL_P(vparam) && param != param_index(vparam)) continue;
+    hr = st->pBuffer->lpVtbl->GetAutomation(st->pBuffer, param, &remaining);
+    if (FAILED(hr)) to_raise_an_exception(hr);
+    if (remaining) return Qtrue;
+  }
+  return Qfalse;
+}
+
+/*
+ * サンプル・クロックの予定表
+ * デバイスのサンプル・クロック（出力したフレームの数）で時刻を決めて、再生・停止・パラメーターの
+ * 変更を積んでおく。バックエンドがその時刻のフレームを出す前に済ませるので、Rubyのスレッドや
+ * GVLの都合で遅れない。soft・offline・mixとseamlessのバッファーはサンプル単位、dsoundは1ms程度で合う。
+ * 予定が済むまで、写しは古いかもしれないので、読むときはsched_syncでデバイスに聞く。
+ */
+static void
+sched_sync(struct SoundBuffer *st)
+{
+  SBLOOP  loop;
+  DWORD   count, status;
+  HRESULT hr;
+
+  if (!st->sched_flag && !st->param_sched) return;
+  hr = g_pDevice->lpVtbl->GetScheduled(g_pDevice, st->pBuffer, &count);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  if (count) return;
+  // すべて済んだので、予定で変わったものを写しに入れる
+  if (st->sched_flag) {
+    status = get_play_status(st);
+    st->play_flag   = status & DSBSTATUS_PLAYING ? 1 : 0;
+    st->repeat_flag = status & DSBSTATUS_LOOPING ? 1 : 0;
+    if (g_pDevice->dwCaps & SBCAPS_NATIVELOOP) {
+      hr = st->pBuffer->lpVtbl->GetLoop(st->pBuffer, &loop);
+      if (FAILED(hr)) to_raise_an_exception(hr);
+      st->loop_counter = loop.dwCounter;
+    }
+  }
+  refresh_st_params(st, st->param_sched);
+  st->param_sched = 0;
+  st->sched_flag  = 0;
+}
+
+static DWORD
+sched_action(VALUE vaction, LPLONG flags)
+{
+  ID id = SYM2ID(rb_to_symbol(vaction));
+
+  *flags = 0;
+  if (id == rb_intern("play"))      return SBSCHED_PLAY;
+  if (id == rb_intern("repeat"))    { *flags = DSBPLAY_LOOPING; return SBSCHED_PLAY; }
+  if (id == rb_intern("stop"))      return SBSCHED_STOP;
+  if (id == rb_intern("pause"))     return SBSCHED_PAUSE;
+  if (id == rb_intern("volume"))    return SBSCHED_VOLUME;
+  if (id == rb_intern("pan"))       return SBSCHED_PAN;
+  if (id == rb_intern("frequency")) return SBSCHED_FREQUENCY;
+  if (id == rb_intern("pcm_pos"))   return SBSCHED_POSITION;
+  rb_raise(rb_eArgError, "action can be only :play, :repeat, :stop, :pause, :volume, :pan, :frequency or :pcm_pos");
+  return 0;
+}
+
+// argsの値を調べてバックエンドに渡す形にする。値を取らないactionなら空でなければならない
+static void
+sched_value(struct SoundBuffer *st, LPSBSCHEDULE ev, VALUE vargs)
+{
+  VALUE vvalue;
+  LONG  value;
+  DWORD frame;
+
+  vargs = NIL_P(vargs) ? rb_ary_new() : rb_Array(vargs);
+  if (ev->dwAction == SBSCHED_PLAY || ev->dwAction == SBSCHED_STOP || ev->dwAction == SBSCHED_PAUSE) {
+    if (RARRAY_LEN(vargs)) rb_raise(rb_eArgError, "this action takes no args");
+    return;
+  }
+  if (RARRAY_LEN(vargs) != 1) rb_raise(rb_eArgError, "this action takes one value in args");
+  vvalue = RARRAY_AREF(vargs, 0);
+  switch (ev->dwAction) {
+  case SBSCHED_VOLUME:
+    value = NUM2INT(vvalue);
+    if (value < DSBVOLUME_MIN || DSBVOLUME_MAX < value) rb_raise(rb_eRangeError, "volume can be only DSBVOLUME_MIN-DSBVOLUME_MAX");
+    break;
+  case SBSCHED_PAN:
+    value = NUM2INT(vvalue);
+    if (value < DSBPAN_LEFT || DSBPAN_RIGHT < value) rb_raise(rb_eRangeError, "pan can be only DSBPAN_LEFT-DSBPAN_RIGHT");
+    break;
+  case SBSCHED_FREQUENCY:
+    value = (LONG)NUM2UINT(vvalue);
+    if (value == DSBFREQUENCY_ORIGINAL) value = (LONG)st->samples_per_sec;
+    if (value < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < value) {
+      rb_raise(rb_eRangeError, "frequency can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX or DSBFREQUENCY_ORIGINAL");
+    }
+    break;
+  default:
+    frame = NUM2UINT(vvalue);
+    if (frame >= st->buffer_bytes / st->block_align) rb_raise(rb_eRangeError, "pcm_pos out of buffer");
+    value = (LONG)pcm2row(st, frame);
+    break;
+  }
+  ev->lValue = value;
 }
 
+/*
+ * call-seq:
+ *    SoundBuffer.sample_clock -> integer
+ *
+ * デバイスのサンプル・クロック。出力したフレームの数で、set_formatをしても戻らない。
+ * scheduleのat_sampleはこれに先の秒数×周波数を足して決める。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXEcho(int argc, VALUE *argv, VALUE self)
+SoundBuffer_c_sample_clock(VALUE self)
 {
-  HRESULT   hr;
-  LPVOID    pObject;
-  DSFXEcho  dsfx;
-  struct SoundBuffer *st = get_st(self);
+  uint64_t clock;
+  HRESULT  hr;
 
-  if (argc != 6) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fWetDryMix   = (float)NUM2DBL(argv[1]);
-  dsfx.fFeedback    = (float)NUM2DBL(argv[2]);
-  dsfx.fLeftDelay   = (float)NUM2DBL(argv[3]);
-  dsfx.fRightDelay  = (float)NUM2DBL(argv[4]);
-  dsfx.lPanDelay    = NUM2INT(argv[5]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_ECHO,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXEcho8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXEcho8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXEcho8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+  hr = g_pDevice->lpVtbl->GetClock(g_pDevice, &clock);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return ULL2NUM(clock);
 }
 
+/*
+ * call-seq:
+ *    SoundBuffer.schedule(at_sample:, buffer:, action:, args: []) -> at_sample
+ *
+ * sample_clockがat_sampleになったときにactionを行う。過ぎた時刻なら次の区切りで行う。
+ * actionは:play, :repeat, :stop, :pause, :volume, :pan, :frequency, :pcm_posで、
+ * 値を取るものはargsに1つ渡す（:pcm_posはフレーム）。同じ時刻の予定は積んだ順に行う。
+ * 止まっているバッファーの送っていない音量などは、ここで先に送る。
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXDistortion(VALUE self, VALUE nth)
+SoundBuffer_c_schedule(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT         hr;
-  LPVOID          pObject;
-  DSFXDistortion  dsfx;
-  struct SoundBuffer *st = get_st(self);
+  struct SoundBuffer *st;
+  SBSCHEDULE ev;
+  VALUE   vopt, vat, vbuffer, vaction;
+  HRESULT hr;
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_DISTORTION,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXDistortion8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXDistortion8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXDistortion8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(5,  rb_float_new(dsfx.fGain),
-                                  rb_float_new(dsfx.fEdge),
-                                  rb_float_new(dsfx.fPostEQCenterFrequency),
-                                  rb_float_new(dsfx.fPostEQBandwidth),
-                                  rb_float_new(dsfx.fPreLowpassCutoff));
+  rb_scan_args(argc, argv, "0:", &vopt);
+  if (NIL_P(vopt)) vopt = rb_hash_new();
+  vat     = rb_hash_aref(vopt, ID2SYM(rb_intern("at_sample")));
+  vbuffer = rb_hash_aref(vopt, ID2SYM(rb_intern("buffer")));
+  vaction = rb_hash_aref(vopt, ID2SYM(rb_intern("action")));
+  if (NIL_P(vat) || NIL_P(vbuffer) || NIL_P(vaction)) rb_raise(rb_eArgError, "at_sample:, buffer: and action: are required");
+  if (!rb_typeddata_is_kind_of(vbuffer, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+  st = get_st(vbuffer);
+  ev.qwFrame  = NUM2ULL(vat);
+  ev.lpBuffer = st->pBuffer;
+  ev.dwAction = sched_action(vaction, &ev.lValue);
+  sched_value(st, &ev, rb_hash_aref(vopt, ID2SYM(rb_intern("args"))));
+
+  // 予定がplayより先に済んでも、写しの値で上書きされないようにする
+  param_flush(st);
+  hr = g_pDevice->lpVtbl->Schedule(g_pDevice, &ev);
+  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  switch (ev.dwAction) {
+  case SBSCHED_VOLUME:    st->param_sched |= PARAM_VOLUME;    break;
+  case SBSCHED_PAN:       st->param_sched |= PARAM_PAN;       break;
+  case SBSCHED_FREQUENCY: st->param_sched |= PARAM_FREQUENCY; break;
+  case SBSCHED_POSITION:  break;
+  case SBSCHED_PLAY:
+    // 鳴らす予定のバッファーの設定は止めておかずにすぐ送る
+    st->play_flag = 1;
+    /* FALLTHROUGH */
+  default:
+    st->sched_flag = 1;
+    break;
+  }
+  return vat;
 }
 
+/*
+ * call-seq:
+ *    SoundBuffer.unschedule(buffer = nil) -> integer
+ *
+ * bufferの予定を取り消して、その数を返す。nilならすべての予定を取り消す。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXDistortion(int argc, VALUE *argv, VALUE self)
+SoundBuffer_c_unschedule(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT         hr;
-  LPVOID          pObject;
-  DSFXDistortion  dsfx;
+  VALUE   vbuffer;
+  DWORD   count;
+  HRESULT hr;
+
+  rb_scan_args(argc, argv, "01", &vbuffer);
+  if (!NIL_P(vbuffer) && !rb_typeddata_is_kind_of(vbuffer, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+  hr = g_pDevice->lpVtbl->Unschedule(g_pDevice, NIL_P(vbuffer) ? NULL : get_st(vbuffer)->pBuffer, &count);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return UINT2NUM(count);
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.scheduled(buffer = nil) -> integer
+ *
+ * まだ済んでいない予定の数。
+ */
+static VALUE
+SoundBuffer_c_scheduled(int argc, VALUE *argv, VALUE self)
+{
+  VALUE   vbuffer;
+  DWORD   count;
+  HRESULT hr;
+
+  rb_scan_args(argc, argv, "01", &vbuffer);
+  if (!NIL_P(vbuffer) && !rb_typeddata_is_kind_of(vbuffer, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+  hr = g_pDevice->lpVtbl->GetScheduled(g_pDevice, NIL_P(vbuffer) ? NULL : get_st(vbuffer)->pBuffer, &count);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return UINT2NUM(count);
+}
+
+/*
+ * 再生方向。1なら順方向、-1なら逆方向（softなどSBCAPS_REVERSEのあるバックエンドのみ）
+ */
+static VALUE
+SoundBuffer_get_direction(VALUE self)
+{
+  LONG    direction;
+  HRESULT hr;
   struct SoundBuffer *st = get_st(self);
 
-  if (argc != 6) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fGain                  = (float)NUM2DBL(argv[1]);
-  dsfx.fEdge                  = (float)NUM2DBL(argv[2]);
-  dsfx.fPostEQCenterFrequency = (float)NUM2DBL(argv[3]);
-  dsfx.fPostEQBandwidth       = (float)NUM2DBL(argv[4]);
-  dsfx.fPreLowpassCutoff      = (float)NUM2DBL(argv[5]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_DISTORTION,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXDistortion8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXDistortion8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXDistortion8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+  hr = st->pBuffer->lpVtbl->GetDirection(st->pBuffer, &direction);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return INT2NUM(direction);
 }
 
 static VALUE
-SoundBuffer_GetAllParameters_DSFXCompressor(VALUE self, VALUE nth)
+SoundBuffer_set_direction(VALUE self, VALUE vdirection)
 {
-  HRESULT         hr;
-  LPVOID          pObject;
-  DSFXCompressor  dsfx;
+  HRESULT hr;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_COMPRESSOR,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXCompressor8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXCompressor8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXCompressor8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(6,  rb_float_new(dsfx.fGain),
-                                  rb_float_new(dsfx.fAttack),
-                                  rb_float_new(dsfx.fRelease),
-                                  rb_float_new(dsfx.fThreshold),
-                                  rb_float_new(dsfx.fRatio),
-                                  rb_float_new(dsfx.fPredelay));
+  if (NUM2INT(vdirection) != 1 && NUM2INT(vdirection) != -1) rb_raise(rb_eRangeError, "direction can be only 1 or -1");
+  if (NUM2INT(vdirection) < 0 && !(g_pDevice->dwCaps & SBCAPS_REVERSE)) {
+    rb_raise(rb_eNotImpError, "%s backend can not play backwards (use reverse!)", g_pDevice->name);
+  }
+  hr = st->pBuffer->lpVtbl->SetDirection(st->pBuffer, NUM2INT(vdirection));
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return vdirection;
 }
 
+/*
+ * PCMをその場でフレーム単位の逆順にする。再生位置・ループ区間・通知位置はそのまま。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXCompressor(int argc, VALUE *argv, VALUE self)
+SoundBuffer_reverse_bang(VALUE self)
 {
-  HRESULT         hr;
-  LPVOID          pObject;
-  DSFXCompressor  dsfx;
+  LPVOID  ptr1, ptr2;
+  DWORD   size1, size2;
+  HRESULT hr;
   struct SoundBuffer *st = get_st(self);
 
-  if (argc != 7) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fGain      = (float)NUM2DBL(argv[1]);
-  dsfx.fAttack    = (float)NUM2DBL(argv[2]);
-  dsfx.fRelease   = (float)NUM2DBL(argv[3]);
-  dsfx.fThreshold = (float)NUM2DBL(argv[4]);
-  dsfx.fRatio     = (float)NUM2DBL(argv[5]);
-  dsfx.fPredelay  = (float)NUM2DBL(argv[6]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_COMPRESSOR,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXCompressor8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXCompressor8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXCompressor8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, 0, 0, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  sb_reverse_frames(ptr1, size1 / st->block_align, st->block_align);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, size1, ptr2, 0);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "Unlock error");
   return self;
 }
+/*
+ *
+ */
+static VALUE
+SoundBuffer_get_effect(VALUE self)
+{
+  DWORD i;
+  VALUE ary;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  ary = rb_ary_new();
+  for (i = 0; i < st->effect_count; i++) rb_ary_store(ary, i, UINT2NUM(st->effect_nums[i]));
+  return ary;
+}
 
+/*
+ * set_effect
+ * 再生中のエフェクトリスト変更は、SBCAPS_LIVEFXのあるバックエンド（soft・offline）なら
+ * 前の並びから移り変わる。それ以外はエラーになる。バイパスはすべて外れる
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXParamEq(VALUE self, VALUE nth)
+SoundBuffer_set_effect(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT      hr;
-  LPVOID       pObject;
-  DSFXParamEq  dsfx;
+  DWORD          i, count;
+  LPDWORD        fx_nums;
+  HRESULT        hr;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_PARAMEQ,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXParamEq8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXParamEq8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXParamEq8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(3,  rb_float_new(dsfx.fCenter),
-                                  rb_float_new(dsfx.fBandwidth),
-                                  rb_float_new(dsfx.fGain));
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+
+  count   = (DWORD)argc;
+  fx_nums = ALLOCA_N(DWORD, count);
+  for (i = 0; i < count; i++) {
+    fx_nums[i] = NUM2UINT(argv[i]);
+    if (fx_nums[i] > FX_WAVES_REVERB) rb_raise(rb_eTypeError, "not valid value");
+  }
+  hr = st->pBuffer->lpVtbl->SetFX(st->pBuffer, count, fx_nums);
+
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  clear_st_effect(st);
+  st->effect_nums   = count ? ALLOC_N(DWORD, count) : NULL;
+  st->effect_bypass = count ? ZALLOC_N(BYTE, count) : NULL;
+  for (i = 0; i < count; i++) st->effect_nums[i] = fx_nums[i];
+  st->effect_count  = count;
+  return self;
+}
+
+/*
+ * call-seq:
+ *    sb.set_effect_bypass(idx, flag) -> self
+ *
+ * idx番目のエフェクトを素通しにする（true）か戻す（false）。再生中でも音は途切れない。
+ * softとofflineでは10msかけて移り、パラメーターもエフェクトの並びもそのまま残る。
+ * dsoundでは効きの無いパラメーターに入れ替えて代わりにするので、ガーグルとディストーションはできない
+ */
+static VALUE
+SoundBuffer_set_effect_bypass(VALUE self, VALUE vidx, VALUE flag)
+{
+  DWORD   idx;
+  HRESULT hr;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  idx = NUM2UINT(vidx);
+  if (idx >= st->effect_count) rb_raise(rb_eRangeError, "effect index error");
+  hr = st->pBuffer->lpVtbl->SetFXBypass(st->pBuffer, idx, RTEST(flag));
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  st->effect_bypass[idx] = RTEST(flag) ? 1 : 0;
+  return self;
+}
+
+static VALUE
+SoundBuffer_get_effect_bypass(VALUE self, VALUE vidx)
+{
+  DWORD idx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  idx = NUM2UINT(vidx);
+  if (idx >= st->effect_count) rb_raise(rb_eRangeError, "effect index error");
+  return st->effect_bypass[idx] ? Qtrue : Qfalse;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXGargle(VALUE self, VALUE nth)
+{
+  HRESULT     hr;
+  DSFXGargle  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_GARGLE, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(2,  UINT2NUM(dsfx.dwRateHz),
+                                  UINT2NUM(dsfx.dwWaveShape));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXGargle(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT     hr;
+  DSFXGargle  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 3) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.dwRateHz    = NUM2UINT(argv[1]);
+  dsfx.dwWaveShape = NUM2UINT(argv[2]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_GARGLE, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXChorus(VALUE self, VALUE nth)
+{
+  HRESULT     hr;
+  DSFXChorus  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_CHORUS, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(7,  rb_float_new(dsfx.fWetDryMix),
+                                  rb_float_new(dsfx.fDepth),
+                                  rb_float_new(dsfx.fFeedback),
+                                  rb_float_new(dsfx.fFrequency),
+                                  INT2NUM(dsfx.lWaveform),
+                                  rb_float_new(dsfx.fDelay),
+                                  INT2NUM(dsfx.lPhase));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXChorus(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT     hr;
+  DSFXChorus  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 8) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fWetDryMix = (float)NUM2DBL(argv[1]);
+  dsfx.fDepth     = (float)NUM2DBL(argv[2]);
+  dsfx.fFeedback  = (float)NUM2DBL(argv[3]);
+  dsfx.fFrequency = (float)NUM2DBL(argv[4]);
+  dsfx.lWaveform  = NUM2INT(argv[5]);
+  dsfx.fDelay     = (float)NUM2DBL(argv[6]);
+  dsfx.lPhase     = NUM2INT(argv[7]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_CHORUS, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXFlanger(VALUE self, VALUE nth)
+{
+  HRESULT      hr;
+  DSFXFlanger  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_FLANGER, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(7,  rb_float_new(dsfx.fWetDryMix),
+                                  rb_float_new(dsfx.fDepth),
+                                  rb_float_new(dsfx.fFeedback),
+                                  rb_float_new(dsfx.fFrequency),
+                                  INT2NUM(dsfx.lWaveform),
+                                  rb_float_new(dsfx.fDelay),
+                                  INT2NUM(dsfx.lPhase));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXFlanger(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT      hr;
+  DSFXFlanger  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 8) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fWetDryMix = (float)NUM2DBL(argv[1]);
+  dsfx.fDepth     = (float)NUM2DBL(argv[2]);
+  dsfx.fFeedback  = (float)NUM2DBL(argv[3]);
+  dsfx.fFrequency = (float)NUM2DBL(argv[4]);
+  dsfx.lWaveform  = NUM2INT(argv[5]);
+  dsfx.fDelay     = (float)NUM2DBL(argv[6]);
+  dsfx.lPhase     = NUM2INT(argv[7]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_FLANGER, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXEcho(VALUE self, VALUE nth)
+{
+  HRESULT   hr;
+  DSFXEcho  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_ECHO, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(5,  rb_float_new(dsfx.fWetDryMix),
+                                  rb_float_new(dsfx.fFeedback),
+                                  rb_float_new(dsfx.fLeftDelay),
+                                  rb_float_new(dsfx.fRightDelay),
+                                  INT2NUM(dsfx.lPanDelay));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXEcho(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT   hr;
+  DSFXEcho  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 6) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fWetDryMix   = (float)NUM2DBL(argv[1]);
+  dsfx.fFeedback    = (float)NUM2DBL(argv[2]);
+  dsfx.fLeftDelay   = (float)NUM2DBL(argv[3]);
+  dsfx.fRightDelay  = (float)NUM2DBL(argv[4]);
+  dsfx.lPanDelay    = NUM2INT(argv[5]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_ECHO, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXDistortion(VALUE self, VALUE nth)
+{
+  HRESULT         hr;
+  DSFXDistortion  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_DISTORTION, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(5,  rb_float_new(dsfx.fGain),
+                                  rb_float_new(dsfx.fEdge),
+                                  rb_float_new(dsfx.fPostEQCenterFrequency),
+                                  rb_float_new(dsfx.fPostEQBandwidth),
+                                  rb_float_new(dsfx.fPreLowpassCutoff));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXDistortion(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT         hr;
+  DSFXDistortion  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 6) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fGain                  = (float)NUM2DBL(argv[1]);
+  dsfx.fEdge                  = (float)NUM2DBL(argv[2]);
+  dsfx.fPostEQCenterFrequency = (float)NUM2DBL(argv[3]);
+  dsfx.fPostEQBandwidth       = (float)NUM2DBL(argv[4]);
+  dsfx.fPreLowpassCutoff      = (float)NUM2DBL(argv[5]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_DISTORTION, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXCompressor(VALUE self, VALUE nth)
+{
+  HRESULT         hr;
+  DSFXCompressor  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_COMPRESSOR, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(6,  rb_float_new(dsfx.fGain),
+                                  rb_float_new(dsfx.fAttack),
+                                  rb_float_new(dsfx.fRelease),
+                                  rb_float_new(dsfx.fThreshold),
+                                  rb_float_new(dsfx.fRatio),
+                                  rb_float_new(dsfx.fPredelay));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXCompressor(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT         hr;
+  DSFXCompressor  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 7) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fGain      = (float)NUM2DBL(argv[1]);
+  dsfx.fAttack    = (float)NUM2DBL(argv[2]);
+  dsfx.fRelease   = (float)NUM2DBL(argv[3]);
+  dsfx.fThreshold = (float)NUM2DBL(argv[4]);
+  dsfx.fRatio     = (float)NUM2DBL(argv[5]);
+  dsfx.fPredelay  = (float)NUM2DBL(argv[6]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_COMPRESSOR, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXParamEq(VALUE self, VALUE nth)
+{
+  HRESULT      hr;
+  DSFXParamEq  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_PARAM_EQ, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(3,  rb_float_new(dsfx.fCenter),
+                                  rb_float_new(dsfx.fBandwidth),
+                                  rb_float_new(dsfx.fGain));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXParamEq(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT      hr;
+  DSFXParamEq  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 4) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fCenter    = (float)NUM2DBL(argv[1]);
+  dsfx.fBandwidth = (float)NUM2DBL(argv[2]);
+  dsfx.fGain      = (float)NUM2DBL(argv[3]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_PARAM_EQ, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXI3DL2Reverb(VALUE self, VALUE nth)
+{
+  HRESULT          hr;
+  DSFXI3DL2Reverb  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_I3DL2_REVERB, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(12, INT2NUM(dsfx.lRoom),
+                                  INT2NUM(dsfx.lRoomHF),
+                                  rb_float_new(dsfx.flRoomRolloffFactor),
+                                  rb_float_new(dsfx.flDecayTime),
+                                  rb_float_new(dsfx.flDecayHFRatio),
+                                  INT2NUM(dsfx.lReflections),
+                                  rb_float_new(dsfx.flReflectionsDelay),
+                                  INT2NUM(dsfx.lReverb),
+                                  rb_float_new(dsfx.flReverbDelay),
+                                  rb_float_new(dsfx.flDiffusion),
+                                  rb_float_new(dsfx.flDensity),
+                                  rb_float_new(dsfx.flHFReference));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXI3DL2Reverb(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT          hr;
+  DSFXI3DL2Reverb  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 13) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.lRoom               = NUM2INT(argv[1]);
+  dsfx.lRoomHF             = NUM2INT(argv[2]);
+  dsfx.flRoomRolloffFactor = (float)NUM2DBL(argv[3]);
+  dsfx.flDecayTime         = (float)NUM2DBL(argv[4]);
+  dsfx.flDecayHFRatio      = (float)NUM2DBL(argv[5]);
+  dsfx.lReflections        = NUM2INT(argv[6]);
+  dsfx.flReflectionsDelay  = (float)NUM2DBL(argv[7]);
+  dsfx.lReverb             = NUM2INT(argv[8]);
+  dsfx.flReverbDelay       = (float)NUM2DBL(argv[9]);
+  dsfx.flDiffusion         = (float)NUM2DBL(argv[10]);
+  dsfx.flDensity           = (float)NUM2DBL(argv[11]);
+  dsfx.flHFReference       = (float)NUM2DBL(argv[12]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_I3DL2_REVERB, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+static VALUE
+SoundBuffer_GetAllParameters_DSFXWavesReverb(VALUE self, VALUE nth)
+{
+  HRESULT          hr;
+  DSFXWavesReverb  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, NUM2UINT(nth), FX_WAVES_REVERB, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+  return rb_ary_new_from_args(4,  rb_float_new(dsfx.fInGain),
+                                  rb_float_new(dsfx.fReverbMix),
+                                  rb_float_new(dsfx.fReverbTime),
+                                  rb_float_new(dsfx.fHighFreqRTRatio));
+}
+
+static VALUE
+SoundBuffer_SetAllParameters_DSFXWavesReverb(int argc, VALUE *argv, VALUE self)
+{
+  HRESULT          hr;
+  DSFXWavesReverb  dsfx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (argc != 5) rb_raise(rb_eArgError, "Number of arguments does not match");
+  dsfx.fInGain          = (float)NUM2DBL(argv[1]);
+  dsfx.fReverbMix       = (float)NUM2DBL(argv[2]);
+  dsfx.fReverbTime      = (float)NUM2DBL(argv[3]);
+  dsfx.fHighFreqRTRatio = (float)NUM2DBL(argv[4]);
+  hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, NUM2UINT(argv[0]), FX_WAVES_REVERB, &dsfx);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  return self;
+}
+
+//
+//
+//
+static VALUE
+SoundBuffer_get_effect_param(VALUE self, VALUE nth)
+{
+  DWORD idx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  idx = NUM2UINT(nth);
+  if (idx >= st->effect_count) rb_raise(rb_eRangeError, "effect index error");
+  switch (st->effect_nums[idx]) {
+    case FX_GARGLE:
+      return SoundBuffer_GetAllParameters_DSFXGargle(self, nth);
+      break;
+    case FX_CHORUS:
+      return SoundBuffer_GetAllParameters_DSFXChorus(self, nth);
+      break;
+    case FX_FLANGER:
+      return SoundBuffer_GetAllParameters_DSFXFlanger(self, nth);
+      break;
+    case FX_ECHO:
+      return SoundBuffer_GetAllParameters_DSFXEcho(self, nth);
+      break;
+    case FX_DISTORTION:
+      return SoundBuffer_GetAllParameters_DSFXDistortion(self, nth);
+      break;
+    case FX_COMPRESSOR:
+      return SoundBuffer_GetAllParameters_DSFXCompressor(self, nth);
+      break;
+    case FX_PARAM_EQ:
+      return SoundBuffer_GetAllParameters_DSFXParamEq(self, nth);
+      break;
+    case FX_I3DL2_REVERB:
+      return SoundBuffer_GetAllParameters_DSFXI3DL2Reverb(self, nth);
+      break;
+    case FX_WAVES_REVERB:
+      return SoundBuffer_GetAllParameters_DSFXWavesReverb(self, nth);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "not valid value");
+      break;
+  }
+}
+//
+//
+//
+static VALUE
+SoundBuffer_set_effect_param(int argc, VALUE *argv, VALUE self)
+{
+  DWORD idx;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  idx = NUM2UINT(argv[0]);
+  if (idx >= st->effect_count) rb_raise(rb_eRangeError, "effect index error");
+  switch (st->effect_nums[idx]) {
+    case FX_GARGLE:
+      return SoundBuffer_SetAllParameters_DSFXGargle(argc, argv, self);
+      break;
+    case FX_CHORUS:
+      return SoundBuffer_SetAllParameters_DSFXChorus(argc, argv, self);
+      break;
+    case FX_FLANGER:
+      return SoundBuffer_SetAllParameters_DSFXFlanger(argc, argv, self);
+      break;
+    case FX_ECHO:
+      return SoundBuffer_SetAllParameters_DSFXEcho(argc, argv, self);
+      break;
+    case FX_DISTORTION:
+      return SoundBuffer_SetAllParameters_DSFXDistortion(argc, argv, self);
+      break;
+    case FX_COMPRESSOR:
+      return SoundBuffer_SetAllParameters_DSFXCompressor(argc, argv, self);
+      break;
+    case FX_PARAM_EQ:
+      return SoundBuffer_SetAllParameters_DSFXParamEq(argc, argv, self);
+      break;
+    case FX_I3DL2_REVERB:
+      return SoundBuffer_SetAllParameters_DSFXI3DL2Reverb(argc, argv, self);
+      break;
+    case FX_WAVES_REVERB:
+      return SoundBuffer_SetAllParameters_DSFXWavesReverb(argc, argv, self);
+      break;
+    default:
+      rb_raise(rb_eTypeError, "not valid value");
+      break;
+  }
+}
+
+/*
+ * エフェクト・パラメーターをまとめて読み書きする。
+ * 並びのDSFX*構造体をそのまま詰めて並べたバイナリー（各構造体の詰め方はsoundbuffer.rbのFX*::PACK）。
+ * 配列もFloatも作らないので、毎フレーム動かしてもGCを起こさない
+ */
+static DWORD
+effect_params_size(struct SoundBuffer *st)
+{
+  DWORD i, size = 0;
+
+  for (i = 0; i < st->effect_count; i++) size += sb_fx_param_size(st->effect_nums[i]);
+  return size;
+}
+
+// 文字列かIO::Bufferの中身。書くなら文字列はsizeまで伸ばす
+static char *
+effect_params_bytes(VALUE vbuf, DWORD size, int writing)
+{
+  const void *base;
+  size_t      capacity;
+
+  if (RB_TYPE_P(vbuf, T_STRING)) {
+    if (writing) {
+      rb_str_modify(vbuf);
+      if ((size_t)RSTRING_LEN(vbuf) < size) rb_str_resize(vbuf, size);
+    }
+    if ((size_t)RSTRING_LEN(vbuf) < size) rb_raise(rb_eRangeError, "effect params are %u bytes", (unsigned int)size);
+    return RSTRING_PTR(vbuf);
+  }
+#ifdef HAVE_RUBY_IO_BUFFER_H
+  if (rb_obj_is_kind_of(vbuf, rb_cIOBuffer)) {
+    if (writing) {
+      void *ptr;
+      rb_io_buffer_get_bytes_for_writing(vbuf, &ptr, &capacity);
+      base = ptr;
+    }
+    else rb_io_buffer_get_bytes_for_reading(vbuf, &base, &capacity);
+    if (capacity < size) rb_raise(rb_eRangeError, "effect params are %u bytes", (unsigned int)size);
+    return (char *)base;
+  }
+#endif
+  rb_raise(rb_eTypeError, "not valid value");
+  return NULL;
+}
+
+/*
+ * call-seq:
+ *    sb.effect_params_size -> fixnum
+ *    sb.get_effect_params -> str
+ *    sb.get_effect_params(buffer) -> buffer
+ *    sb.set_effect_params(buffer) -> self
+ *
+ * 並びのすべてのエフェクトのパラメーターを1回で読み書きする。bufferは文字列かIO::Buffer。
+ * getはbufferを渡すとそこへ書き、新しい文字列を作らない。
+ * setは先にすべての値の範囲を調べるので、範囲外があれば何も変えずにSoundBufferErrorになる
+ */
+static VALUE
+SoundBuffer_get_effect_params_size(VALUE self)
+{
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  return UINT2NUM(effect_params_size(st));
+}
+
+static VALUE
+SoundBuffer_get_effect_params(int argc, VALUE *argv, VALUE self)
+{
+  DWORD   i, size;
+  char   *ptr;
+  HRESULT hr;
+  VALUE   vbuf;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  rb_scan_args(argc, argv, "01", &vbuf);
+  size = effect_params_size(st);
+  if (NIL_P(vbuf)) vbuf = rb_str_buf_new(size);
+  ptr = effect_params_bytes(vbuf, size, TRUE);
+  for (i = 0; i < st->effect_count; i++) {
+    hr = st->pBuffer->lpVtbl->GetFXParameters(st->pBuffer, i, st->effect_nums[i], ptr);
+    if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
+    ptr += sb_fx_param_size(st->effect_nums[i]);
+  }
+  RB_GC_GUARD(vbuf);
+  return vbuf;
+}
+
+static VALUE
+SoundBuffer_set_effect_params(VALUE self, VALUE vbuf)
+{
+  DWORD       i, size;
+  const char *ptr, *p;
+  HRESULT     hr;
+  struct SoundBuffer *st = get_st(self);
+
+  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
+  size = effect_params_size(st);
+  ptr  = effect_params_bytes(vbuf, size, FALSE);
+  for (i = 0, p = ptr; i < st->effect_count; p += sb_fx_param_size(st->effect_nums[i++])) {
+    if (!sb_fx_valid(st->effect_nums[i], p)) rb_raise(eSoundBufferError, "effect %u parameter out of range", (unsigned int)i);
+  }
+  for (i = 0, p = ptr; i < st->effect_count; p += sb_fx_param_size(st->effect_nums[i++])) {
+    hr = st->pBuffer->lpVtbl->SetFXParameters(st->pBuffer, i, st->effect_nums[i], p);
+    if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  }
+  RB_GC_GUARD(vbuf);
+  return self;
+}
+
+/*
+ * class singleton methods
+ */
+static VALUE
+SoundBuffer_c_get_format(VALUE self)
+{
+  WAVEFORMATEX  pcmwf;
+  HRESULT       hr;
+
+  hr = g_pDevice->lpVtbl->GetFormat(g_pDevice, &pcmwf);
+  if (hr == DSERR_BADFORMAT) rb_raise(eSoundBufferError, "not support foramt");
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return rb_ary_new_from_args(3,  UINT2NUM((DWORD)pcmwf.nChannels),
+                                  UINT2NUM(       pcmwf.nSamplesPerSec),
+                                  UINT2NUM((DWORD)pcmwf.wBitsPerSample));
+}
+
+static VALUE
+SoundBuffer_c_set_format(VALUE self, VALUE vchannels, VALUE vsamples_per_sec, VALUE vbits_per_sample)
+{
+  WAVEFORMATEX  pcmwf;
+  HRESULT       hr;
+  WORD          channels, bits_per_sample;
+  DWORD         samples_per_sec;
+
+  channels        = (WORD)NUM2UINT(vchannels);
+  if (channels != 1 && channels != 2) rb_raise(rb_eRangeError, "channels arguments 1 and 2 only possible");
+  samples_per_sec =       NUM2UINT(vsamples_per_sec);
+  if (samples_per_sec < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < samples_per_sec) rb_raise(rb_eRangeError, "samples_per_sec argument can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX");
+  bits_per_sample = (WORD)NUM2UINT(vbits_per_sample);
+  if (bits_per_sample != 8 && bits_per_sample != 16) rb_raise(rb_eRangeError, "bits_per_sample arguments 8 and 16 only possible");
+
+  pcmwf.wFormatTag      = WAVE_FORMAT_PCM;
+  pcmwf.nChannels       = channels;
+  pcmwf.nSamplesPerSec  = samples_per_sec;
+  pcmwf.wBitsPerSample  = bits_per_sample;
+  pcmwf.nBlockAlign     = bits_per_sample / 8 * channels;
+  pcmwf.nAvgBytesPerSec = samples_per_sec * pcmwf.nBlockAlign;
+  pcmwf.cbSize          = 0;
+  hr = g_pDevice->lpVtbl->SetFormat(g_pDevice, &pcmwf);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return self;
+}
+
+static VALUE
+SoundBuffer_c_get_volume(VALUE self)
+{
+  HRESULT hr;
+  LONG    volume;
+
+  hr = g_pDevice->lpVtbl->GetVolume(g_pDevice, &volume);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return INT2NUM(volume);
+}
+
+static VALUE
+SoundBuffer_c_set_volume(VALUE self, VALUE vvolume)
+{
+  HRESULT hr;
+
+  hr = g_pDevice->lpVtbl->SetVolume(g_pDevice, NUM2INT(vvolume));
+  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  return vvolume;
+}
+
+/*
+ * SoundBuffer::Stream
+ * バッファーを通知位置でsegments個の区画に分けてリピート再生する。
+ * 再生カーソルが次の区画に入ったら、ネイティブのフィーダー・スレッドが
+ * 再生し終わった区画をキューから埋め直す。キューは固定長なので
+ * 長い曲でもメモリー使用量は変わらない。
+ */
+struct SBStream {
+  LPSBBUFFER    pBuffer;
+  sb_mutex_t    lock;
+  sb_cond_t     cond;
+  sb_thread_t   thread;
+  SBEVENT      *events;         // 区画ごとの通知＋終了用
+  DWORD         segments;
+  DWORD         segment_bytes;
+  DWORD         buffer_bytes;
+  LPDWORD       filled;         // 区画ごとの実データのバイト数
+  DWORD         write_seg;      // 次に埋める区画
+  BYTE          silence;
+  LPBYTE        queue;
+  DWORD         queue_size;
+  DWORD         queue_head;
+  DWORD         queue_len;
+  DWORD         underruns;
+  int           primed;
+  int           closed;
+  int           quit;
+};
+
+// Stream#pushの待ち合わせ用
+struct StreamPush {
+  struct SoundBuffer *st;
+  struct SBStream    *s;
+  int                 interrupted;
+};
+
+static size_t
+stream_memsize(const struct SBStream *s)
+{
+  return s ? sizeof(struct SBStream) + s->queue_size + s->segments * (sizeof(SBEVENT) + sizeof(DWORD)) : 0;
+}
+
+static DWORD
+stream_segments(const struct SBStream *s)
+{
+  return s->segments;
+}
+
+static DWORD
+stream_notify_positions(const struct SBStream *s, LPSBPOSITIONNOTIFY notify)
+{
+  DWORD i;
+
+  for (i = 0; i < s->segments; i++) {
+    notify[i].dwOffset     = i * s->segment_bytes;
+    notify[i].hEventNotify = s->events[i];
+  }
+  return s->segments;
+}
+
+static DWORD
+stream_segment_size(const struct SBStream *s, DWORD n)
+{
+  // 端数は最後の区画に含める
+  return n == s->segments - 1 ? s->buffer_bytes - n * s->segment_bytes : s->segment_bytes;
+}
+
+// 区画nをキューから埋める。足りなければ無音で埋める。s->lockを取ってから呼ぶ
+static void
+stream_fill(struct SBStream *s, DWORD n)
+{
+  LPVOID   ptr1, ptr2;
+  DWORD    size1, size2, bytes, head;
+  uint64_t start;
+  HRESULT  hr;
+
+  start = SB_STATS_ON ? sb_clock_ns() : 0;
+  hr = s->pBuffer->lpVtbl->Lock(s->pBuffer, n * s->segment_bytes, stream_segment_size(s, n), &ptr1, &size1, &ptr2, &size2, 0);
+  if (FAILED(hr)) return;
+  bytes = size1 < s->queue_len ? size1 : s->queue_len;
+  head  = s->queue_size - s->queue_head;
+  if (bytes <= head) memcpy(ptr1, s->queue + s->queue_head, bytes);
+  else {
+    memcpy(ptr1, s->queue + s->queue_head, head);
+    memcpy((LPBYTE)ptr1 + head, s->queue, bytes - head);
+  }
+  memset((LPBYTE)ptr1 + bytes, s->silence, size1 - bytes);
+  s->queue_head = (s->queue_head + bytes) % s->queue_size;
+  s->queue_len -= bytes;
+  s->filled[n]  = bytes;
+  if (bytes < size1 && s->primed && !s->closed) {
+    s->underruns++;
+    if (SB_STATS_ON) sb_stats_underrun(s->pBuffer->lpStats);
+  }
+  s->pBuffer->lpVtbl->Unlock(s->pBuffer, ptr1, size1, ptr2, 0);
+  if (SB_STATS_ON) sb_stats_write(s->pBuffer->lpStats, size1, sb_clock_ns() - start);
+  sb_cond_broadcast(&s->cond);
+}
+
+static void*
+stream_thread(void *data)
+{
+  struct SBStream *s = data;
+  DWORD   result, play, current, i, total;
+  HRESULT hr;
+
+  while (1) {
+    result = sb_event_wait(s->segments + 1, s->events, INFINITE);
+    if (result == WAIT_FAILED || result - WAIT_OBJECT_0 == s->segments) break;
+    sb_mutex_lock(&s->lock);
+    if (s->primed) {
+      // 通知が溜まっていても、実際のカーソル位置の手前までだけ埋める
+      hr = s->pBuffer->lpVtbl->GetCurrentPosition(s->pBuffer, &play, NULL);
+      if (SUCCEEDED(hr)) {
+        current = play / s->segment_bytes;
+        if (current >= s->segments) current = s->segments - 1;
+        while (s->write_seg != current) {
+          stream_fill(s, s->write_seg);
+          s->write_seg = (s->write_seg + 1) % s->segments;
+        }
+        // closeの後、最後のデータを再生し終えたら止める
+        if (s->closed && s->queue_len == 0) {
+          for (i = 0, total = 0; i < s->segments; i++) total += s->filled[i];
+          if (total == 0) {
+            s->pBuffer->lpVtbl->Stop(s->pBuffer);
+            s->primed = 0;
+          }
+        }
+      }
+    }
+    sb_mutex_unlock(&s->lock);
+  }
+  return NULL;
+}
+
+static void
+stream_free(struct SBStream *s)
+{
+  DWORD i;
+
+  for (i = 0; i <= s->segments; i++) {
+    if (s->events[i]) sb_event_close(s->events[i]);
+  }
+  sb_cond_destroy(&s->cond);
+  sb_mutex_destroy(&s->lock);
+  xfree(s->events);
+  xfree(s->filled);
+  xfree(s->queue);
+  xfree(s);
+}
+
+static void
+stream_release(struct SoundBuffer *st)
+{
+  struct SBStream *s = st->stream;
+
+  if (!s) return;
+  sb_mutex_lock(&s->lock);
+  s->quit = 1;
+  sb_cond_broadcast(&s->cond);
+  sb_mutex_unlock(&s->lock);
+  sb_event_set(s->events[s->segments]);
+  sb_thread_join(s->thread);
+  stream_free(s);
+  st->stream = NULL;
+}
+
+static struct SBStream *
+get_stream(struct SoundBuffer *st)
+{
+  if (!st->stream) rb_raise(eSoundBufferError, "not initialized stream");
+  return st->stream;
+}
+
+static VALUE
+Stream_initialize(int argc, VALUE *argv, VALUE self)
+{
+  VALUE   vbuffer, vchannels, vsamples_per_sec, vbits_per_sample, vopt, v;
+  DWORD   i, argc2, segments = 4, queue_size = 0;
+  LPDWORD offsets;
+  struct SoundBuffer *st;
+  struct SBStream    *s;
+
+  rb_scan_args(argc, argv, "13:", &vbuffer, &vchannels, &vsamples_per_sec, &vbits_per_sample, &vopt);
+  SoundBuffer_initialize(argc, argv, self);
+  st = get_st(self);
+
+  if (!NIL_P(vopt)) {
+    v = rb_hash_aref(vopt, ID2SYM(rb_intern("segments")));
+    if (!NIL_P(v)) segments = NUM2UINT(v);
+    v = rb_hash_aref(vopt, ID2SYM(rb_intern("queue")));
+    if (!NIL_P(v)) queue_size = NUM2UINT(v);
+  }
+  if (segments < 2) rb_raise(rb_eRangeError, "segments must be 2 or more");
+  if (st->buffer_bytes / segments / st->block_align == 0) rb_raise(rb_eRangeError, "buffer is small for segments");
+  if (queue_size == 0) queue_size = (DWORD)st->buffer_bytes;
+
+  s = ZALLOC(struct SBStream);
+  s->pBuffer       = st->pBuffer;
+  s->segments      = segments;
+  s->segment_bytes = (DWORD)st->buffer_bytes / segments / st->block_align * st->block_align;
+  s->buffer_bytes  = (DWORD)st->buffer_bytes;
+  s->silence       = st->bits_per_sample == 8 ? 0x80 : 0;
+  s->queue_size    = queue_size;
+  s->queue         = ALLOC_N(BYTE, queue_size);
+  s->filled        = ZALLOC_N(DWORD, segments);
+  s->events        = ZALLOC_N(SBEVENT, segments + 1);
+  sb_mutex_init(&s->lock);
+  sb_cond_init(&s->cond);
+  for (i = 0; i < segments; i++) {
+    s->events[i] = sb_event_create(FALSE);
+    if (!s->events[i]) break;
+  }
+  if (i == segments) s->events[segments] = sb_event_create(TRUE);
+  if (i < segments || !s->events[segments]) {
+    stream_free(s);
+    rb_raise(eSoundBufferError, "Stream_initialize error");
+  }
+  if (sb_thread_create(&s->thread, stream_thread, s)) {
+    stream_free(s);
+    rb_raise(eSoundBufferError, "Stream_initialize error");
+  }
+  st->stream = s;
+
+  // 区画の通知を登録し直す
+  argc2 = st->event_count - EVENT_PRESET;
+  offsets = ALLOCA_N(DWORD, argc2);
+  MEMCPY(offsets, st->event_offsets, DWORD, argc2);
+  create_st_event(st, argc2, offsets);
+  return self;
+}
+
+static void*
+stream_push_blocking(void *data)
+{
+  struct StreamPush *pd = data;
+  struct SBStream   *s  = pd->s;
+
+  // 止まっている間は空かないので、stopかcloseされたら待つのをやめる
+  sb_mutex_lock(&s->lock);
+  while (s->queue_len == s->queue_size && s->primed && !s->closed && !pd->interrupted && !s->quit) {
+    sb_cond_wait(&s->cond, &s->lock, INFINITE);
+  }
+  sb_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+static void
+stream_push_unblocking(void *data)
+{
+  struct StreamPush *pd = data;
+
+  sb_mutex_lock(&pd->s->lock);
+  pd->interrupted = 1;
+  sb_cond_broadcast(&pd->s->cond);
+  sb_mutex_unlock(&pd->s->lock);
+}
+
+static VALUE
+stream_push_wait(VALUE data)
+{
+  rb_thread_call_without_gvl(stream_push_blocking, (void*)data, stream_push_unblocking, (void*)data);
+  return Qnil;
+}
+
+static VALUE
+stream_push_ensure(VALUE data)
+{
+  unpin_st(((struct StreamPush *)data)->st);
+  return Qnil;
+}
+
+/*
+ * キューに積む。再生中でいっぱいならGVLを外して空くのを待つ。
+ * 再生していなければキューは空かないので、入りきらないときは何も積まずに例外にする。
+ * 待っている間にstopかcloseされたら、それまでに積んだバイト数を添えて例外にする。
+ */
+static VALUE
+Stream_push(VALUE self, VALUE vbuffer)
+{
+  struct SoundBuffer *st = get_st(self);
+  struct SBStream    *s  = get_stream(st);
+  struct StreamPush   pd;
+  long   n = 0;
+  DWORD  bytes, tail, first;
+  int    closed, primed;
+
+  StringValue(vbuffer);
+  sb_mutex_lock(&s->lock);
+  closed = s->closed;
+  primed = s->primed;
+  bytes  = s->queue_size - s->queue_len;
+  sb_mutex_unlock(&s->lock);
+  if (closed) rb_raise(eSoundBufferError, "closed stream");
+  if (!primed && RSTRING_LEN(vbuffer) > (long)bytes) {
+    rb_raise(eSoundBufferError, "stream queue is full before play (%lu bytes free)", (unsigned long)bytes);
+  }
+  while (n < RSTRING_LEN(vbuffer)) {
+    sb_mutex_lock(&s->lock);
+    closed = s->closed;
+    if (closed || (!s->primed && s->queue_len == s->queue_size)) {
+      sb_mutex_unlock(&s->lock);
+      rb_raise(eSoundBufferError, "%s stream (%ld bytes pushed)", closed ? "closed" : "stopped", n);
+    }
+    bytes = s->queue_size - s->queue_len;
+    if ((long)bytes > RSTRING_LEN(vbuffer) - n) bytes = (DWORD)(RSTRING_LEN(vbuffer) - n);
+    tail  = (s->queue_head + s->queue_len) % s->queue_size;
+    first = bytes < s->queue_size - tail ? bytes : s->queue_size - tail;
+    memcpy(s->queue + tail, RSTRING_PTR(vbuffer) + n, first);
+    memcpy(s->queue, RSTRING_PTR(vbuffer) + n + first, bytes - first);
+    s->queue_len += bytes;
+    sb_mutex_unlock(&s->lock);
+    n += bytes;
+    if (n < RSTRING_LEN(vbuffer)) {
+      pd.st          = st;
+      pd.s           = s;
+      pd.interrupted = 0;
+      pin_st(st);
+      rb_ensure(stream_push_wait, (VALUE)&pd, stream_push_ensure, (VALUE)&pd);
+      rb_thread_check_ints();
+    }
+  }
+  RB_GC_GUARD(vbuffer);
+  return self;
+}
+
+/*
+ * 区画をすべてキューから埋めてからリピート再生する。
+ * 一時停止からの再開ではそのまま続ける。
+ */
+static VALUE
+Stream_play(VALUE self)
+{
+  DWORD i;
+  struct SoundBuffer *st = get_st(self);
+  struct SBStream    *s  = get_stream(st);
+
+  sb_mutex_lock(&s->lock);
+  if (!s->primed) {
+    set_play_position(st, 0);
+    for (i = 0; i < s->segments; i++) stream_fill(s, i);
+    s->write_seg = 0;
+    s->primed    = 1;
+  }
+  sb_mutex_unlock(&s->lock);
+  repeat_sound(st);
+  st->play_flag   = 1;
+  st->repeat_flag = 0;
+  return self;
+}
+
+// 区画に残っていたデータは捨てる。キューは残る
+static VALUE
+Stream_stop(VALUE self)
+{
+  struct SBStream *s = get_stream(get_st(self));
+
+  SoundBuffer_stop(self);
+  sb_mutex_lock(&s->lock);
+  s->primed = 0;
+  sb_cond_broadcast(&s->cond);
+  sb_mutex_unlock(&s->lock);
+  return self;
+}
+
+static VALUE
+Stream_close(VALUE self)
+{
+  struct SBStream *s = get_stream(get_st(self));
+
+  sb_mutex_lock(&s->lock);
+  s->closed = 1;
+  sb_cond_broadcast(&s->cond);
+  sb_mutex_unlock(&s->lock);
+  return self;
+}
+
+static VALUE
+Stream_closed(VALUE self)
+{
+  return get_stream(get_st(self))->closed ? Qtrue : Qfalse;
+}
+
+static VALUE
+Stream_queued(VALUE self)
+{
+  DWORD bytes;
+  struct SBStream *s = get_stream(get_st(self));
+
+  sb_mutex_lock(&s->lock);
+  bytes = s->queue_len;
+  sb_mutex_unlock(&s->lock);
+  return UINT2NUM(bytes);
+}
+
+static VALUE
+Stream_queue_size(VALUE self)
+{
+  return UINT2NUM(get_stream(get_st(self))->queue_size);
+}
+
+static VALUE
+Stream_segments(VALUE self)
+{
+  return UINT2NUM(get_stream(get_st(self))->segments);
+}
+
+static VALUE
+Stream_underruns(VALUE self)
+{
+  return UINT2NUM(get_stream(get_st(self))->underruns);
+}
+
+/*
+ * SoundBuffer::VoicePool
+ * 1つの音源からcount個のボイスを前もって複製しておき、発音のたびにdupしない。
+ * 空いているボイスはスタックに、鳴っているボイスは優先度ごとの古い順のリストに置く。
+ * 空きが無ければ、要求以下の優先度で最も古いボイスを奪う。どちらも優先度の段数で済む。
+ */
+#define VOICE_PRIORITY_LEVELS 16
+#define VOICE_NONE            ((DWORD)-1)
+
+struct VoiceLink {
+  DWORD prev;
+  DWORD next;
+  DWORD priority;
+  DWORD busy;
+};
+
+struct VoicePool {
+  VALUE             source;
+  VALUE             voices;   // SoundBufferの配列
+  VALUE             index;    // ボイス => 番号
+  DWORD             count;
+  LPDWORD           free;     // 空きボイスのスタック
+  DWORD             free_count;
+  struct VoiceLink *link;
+  DWORD             head[VOICE_PRIORITY_LEVELS];
+  DWORD             tail[VOICE_PRIORITY_LEVELS];
+  DWORD             steals;
+};
+
+static VALUE cVoicePool;
+
+static void
+VoicePool_mark(void *p)
+{
+  struct VoicePool *pool = p;
+
+  rb_gc_mark(pool->source);
+  rb_gc_mark(pool->voices);
+  rb_gc_mark(pool->index);
+}
+
+static void
+VoicePool_free(void *p)
+{
+  struct VoicePool *pool = p;
+
+  xfree(pool->free);
+  xfree(pool->link);
+  xfree(pool);
+}
+
+static size_t
+VoicePool_memsize(const void *p)
+{
+  const struct VoicePool *pool = p;
+
+  return sizeof(struct VoicePool) + pool->count * (sizeof(DWORD) + sizeof(struct VoiceLink));
+}
+
+static const rb_data_type_t VoicePool_data_type = {
+  "SoundBuffer::VoicePool",
+  {
+    VoicePool_mark,
+    VoicePool_free,
+    VoicePool_memsize,
+  },
+  NULL,
+  NULL
+};
+
+static VALUE
+VoicePool_allocate(VALUE klass)
+{
+  struct VoicePool *pool;
+  VALUE obj = TypedData_Make_Struct(klass, struct VoicePool, &VoicePool_data_type, pool);
+
+  pool->source = Qnil;
+  pool->voices = Qnil;
+  pool->index  = Qnil;
+  return obj;
+}
+
+static struct VoicePool *
+get_pool(VALUE self)
+{
+  struct VoicePool *pool = rb_check_typeddata(self, &VoicePool_data_type);
+
+  if (!pool->link) rb_raise(eSoundBufferError, "not initialized voice pool");
+  return pool;
+}
+
+static void
+voice_unlink(struct VoicePool *pool, DWORD i)
+{
+  struct VoiceLink *v = &pool->link[i];
+
+  if (v->prev != VOICE_NONE) pool->link[v->prev].next = v->next;
+  else                       pool->head[v->priority]  = v->next;
+  if (v->next != VOICE_NONE) pool->link[v->next].prev = v->prev;
+  else                       pool->tail[v->priority]  = v->prev;
+  v->busy = 0;
+}
+
+static void
+voice_push_busy(struct VoicePool *pool, DWORD i, DWORD priority)
+{
+  struct VoiceLink *v = &pool->link[i];
+
+  v->priority = priority;
+  v->busy     = 1;
+  v->next     = VOICE_NONE;
+  v->prev     = pool->tail[priority];
+  if (v->prev != VOICE_NONE) pool->link[v->prev].next = i;
+  else                       pool->head[priority]     = i;
+  pool->tail[priority] = i;
+}
+
+static VALUE
+voice_at(struct VoicePool *pool, DWORD i)
+{
+  return RARRAY_AREF(pool->voices, i);
+}
+
+/*
+ * 空きボイスの番号を返す。空きが無ければVOICE_NONE。
+ * 各優先度の先頭（最も古いボイス）が鳴り終わっていれば、それも空きとして使う。
+ * 状態を問い合わせるのは1段に1回までなので、先頭より後ろで先に鳴り終わったものは
+ * 先頭まで来るかreleaseされるまで空きにならない。
+ */
+static DWORD
+voice_take(struct VoicePool *pool, DWORD priority)
+{
+  DWORD i, p;
+
+  if (pool->free_count) return pool->free[--pool->free_count];
+  for (p = 0; p < VOICE_PRIORITY_LEVELS; p++) {
+    i = pool->head[p];
+    if (i != VOICE_NONE && !get_playing(get_st(voice_at(pool, i)))) {
+      voice_unlink(pool, i);
+      return i;
+    }
+  }
+  // 要求以下の優先度から、低い順・古い順に奪う
+  for (p = 0; p <= priority; p++) {
+    i = pool->head[p];
+    if (i != VOICE_NONE) {
+      voice_unlink(pool, i);
+      pool->steals++;
+      return i;
+    }
+  }
+  return VOICE_NONE;
+}
+
+static VALUE
+VoicePool_initialize(VALUE self, VALUE source, VALUE vcount)
+{
+  struct VoicePool *pool = rb_check_typeddata(self, &VoicePool_data_type);
+  DWORD i, count;
+  VALUE voice;
+
+  if (pool->link) rb_raise(eSoundBufferError, "object is already initialized");
+  if (!rb_typeddata_is_kind_of(source, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+  get_st(source);
+  count = NUM2UINT(vcount);
+  if (count == 0) rb_raise(rb_eRangeError, "count must be 1 or more");
+
+  pool->source = source;
+  pool->voices = rb_ary_new_capa(count);
+  pool->index  = rb_hash_new();
+  rb_funcall(pool->index, rb_intern("compare_by_identity"), 0);
+  pool->free   = ALLOC_N(DWORD, count);
+  pool->link   = ALLOC_N(struct VoiceLink, count);
+  pool->count  = 0;
+  for (i = 0; i < VOICE_PRIORITY_LEVELS; i++) pool->head[i] = pool->tail[i] = VOICE_NONE;
+  for (i = 0; i < count; i++) {
+    voice = rb_obj_dup(source);
+    rb_ary_push(pool->voices, voice);
+    rb_hash_aset(pool->index, voice, UINT2NUM(i));
+    pool->link[i].busy = 0;
+    pool->count++;
+  }
+  // 0番から順に使われるように積む
+  for (i = 0; i < count; i++) pool->free[i] = count - 1 - i;
+  pool->free_count = count;
+  return self;
+}
+
+static DWORD
+voice_priority(int argc, VALUE *argv)
+{
+  VALUE vpriority;
+  DWORD priority;
+
+  rb_scan_args(argc, argv, "01", &vpriority);
+  priority = NIL_P(vpriority) ? 0 : NUM2UINT(vpriority);
+  if (priority >= VOICE_PRIORITY_LEVELS) rb_raise(rb_eRangeError, "priority can be only 0-%d", VOICE_PRIORITY_LEVELS - 1);
+  return priority;
+}
+
+// 止めて先頭に戻したボイスを返す。鳴らすのは呼び出し側
+static VALUE
+VoicePool_acquire(int argc, VALUE *argv, VALUE self)
+{
+  struct VoicePool *pool = get_pool(self);
+  DWORD priority = voice_priority(argc, argv), i;
+  VALUE voice;
+
+  i = voice_take(pool, priority);
+  if (i == VOICE_NONE) return Qnil;
+  voice = voice_at(pool, i);
+  SoundBuffer_stop(voice);
+  voice_push_busy(pool, i, priority);
+  return voice;
+}
+
+static VALUE
+VoicePool_play(int argc, VALUE *argv, VALUE self)
+{
+  VALUE voice = VoicePool_acquire(argc, argv, self);
+
+  if (!NIL_P(voice)) SoundBuffer_play(voice);
+  return voice;
+}
+
+static VALUE
+VoicePool_release(VALUE self, VALUE voice)
+{
+  struct VoicePool *pool = get_pool(self);
+  VALUE vi = rb_hash_lookup2(pool->index, voice, Qnil);
+  DWORD i;
+
+  if (NIL_P(vi)) rb_raise(rb_eArgError, "voice of other pool");
+  i = NUM2UINT(vi);
+  SoundBuffer_stop(voice);
+  if (pool->link[i].busy) {
+    voice_unlink(pool, i);
+    pool->free[pool->free_count++] = i;
+  }
+  return self;
+}
+
+static VALUE
+VoicePool_stop_all(VALUE self)
+{
+  struct VoicePool *pool = get_pool(self);
+  DWORD i;
+
+  for (i = 0; i < pool->count; i++) {
+    SoundBuffer_stop(voice_at(pool, i));
+    if (pool->link[i].busy) {
+      voice_unlink(pool, i);
+      pool->free[pool->free_count++] = i;
+    }
+  }
+  return self;
+}
+
+static VALUE
+VoicePool_dispose(VALUE self)
+{
+  struct VoicePool *pool = get_pool(self);
+  DWORD i;
+
+  for (i = 0; i < pool->count; i++) check_st_idle((struct SoundBuffer *)RTYPEDDATA_DATA(voice_at(pool, i)));
+  for (i = 0; i < pool->count; i++) SoundBuffer_release((struct SoundBuffer *)RTYPEDDATA_DATA(voice_at(pool, i)));
+  return self;
+}
+
+static VALUE
+VoicePool_get_source(VALUE self)
+{
+  return get_pool(self)->source;
+}
+
+static VALUE
+VoicePool_get_voices(VALUE self)
+{
+  return rb_ary_dup(get_pool(self)->voices);
+}
+
+static VALUE
+VoicePool_size(VALUE self)
+{
+  return UINT2NUM(get_pool(self)->count);
+}
+
+static VALUE
+VoicePool_free_count(VALUE self)
+{
+  return UINT2NUM(get_pool(self)->free_count);
+}
+
+static VALUE
+VoicePool_steals(VALUE self)
+{
+  return UINT2NUM(get_pool(self)->steals);
+}
+
+/*
+ * SoundBuffer::Pool
+ * 捨てるバッファーを形式と大きさごとにしまっておき、同じ形式のacquireで作り直さずに返す。
+ * DirectSoundのバッファーは末尾まで鳴るので、大きさはブロック境界のバイト数そのものを区分にする。
+ * しまってある分のバイト数がmax_bytesを超えたら、古いものから解放する。
+ */
+#define POOL_HASH_SIZE        64
+#define POOL_DEFAULT_MAX_BYTES (16 * 1024 * 1024)
+
+struct PoolEntry {
+  struct PoolEntry *prev;     // 古い順のリスト
+  struct PoolEntry *next;
+  struct PoolEntry *hnext;    // 同じハッシュのリスト
+  LPSBBUFFER        buf;
+  size_t            buffer_bytes;
+  WORD              channels;
+  DWORD             samples_per_sec;
+  WORD              bits_per_sample;
+  WORD              format_tag;
+  DWORD             channel_mask;
+  DWORD             effect_flag;
+  DWORD             seamless_flag;
+};
+
+struct BufferPool {
+  struct PoolEntry *head;     // 最も古い
+  struct PoolEntry *tail;
+  struct PoolEntry *buckets[POOL_HASH_SIZE];
+  DWORD             count;
+  size_t            bytes;
+  size_t            max_bytes;
+  DWORD             hits;
+  DWORD             misses;
+  DWORD             evictions;
+  DWORD             discards;
+};
+
+static VALUE cBufferPool;
+
+static DWORD
+pool_hash(const struct PoolEntry *e)
+{
+  DWORD h = (DWORD)e->buffer_bytes;
+
+  h = h * 31 + e->channels;
+  h = h * 31 + e->samples_per_sec;
+  h = h * 31 + e->bits_per_sample;
+  h = h * 31 + e->format_tag;
+  h = h * 31 + e->channel_mask;
+  h = h * 31 + (e->effect_flag << 1 | e->seamless_flag);
+  return h % POOL_HASH_SIZE;
+}
+
+static int
+pool_same_key(const struct PoolEntry *a, const struct PoolEntry *b)
+{
+  return a->buffer_bytes    == b->buffer_bytes
+      && a->channels        == b->channels
+      && a->samples_per_sec == b->samples_per_sec
+      && a->bits_per_sample == b->bits_per_sample
+      && a->format_tag      == b->format_tag
+      && a->channel_mask    == b->channel_mask
+      && a->effect_flag     == b->effect_flag
+      && a->seamless_flag   == b->seamless_flag;
+}
+
+static void
+pool_set_key(struct PoolEntry *e, const struct SoundBuffer *st)
+{
+  e->buffer_bytes    = st->buffer_bytes;
+  e->channels        = st->channels;
+  e->samples_per_sec = st->samples_per_sec;
+  e->bits_per_sample = st->bits_per_sample;
+  e->format_tag      = st->format_tag;
+  e->channel_mask    = st->channel_mask;
+  e->effect_flag     = st->effect_flag;
+  e->seamless_flag   = st->seamless_flag;
+}
+
+// 両方のリストから外す。バッファーはそのまま
+static void
+pool_unlink(struct BufferPool *pool, struct PoolEntry *e)
+{
+  struct PoolEntry **p = &pool->buckets[pool_hash(e)];
+
+  while (*p != e) p = &(*p)->hnext;
+  *p = e->hnext;
+  if (e->prev) e->prev->next = e->next;
+  else         pool->head    = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else         pool->tail    = e->prev;
+  pool->count--;
+  pool->bytes -= e->buffer_bytes;
+}
+
+static void
+pool_entry_release(struct PoolEntry *e)
+{
+  e->buf->lpVtbl->Release(e->buf);
+  release_device_ref();
+  xfree(e);
+}
+
+// 合計がlimit以下になるまで古いものから解放する
+static void
+pool_trim(struct BufferPool *pool, size_t limit)
+{
+  struct PoolEntry *e;
+
+  while (pool->head && pool->bytes > limit) {
+    e = pool->head;
+    pool_unlink(pool, e);
+    pool_entry_release(e);
+    pool->evictions++;
+  }
+}
+
+static void
+BufferPool_free(void *p)
+{
+  struct BufferPool *pool = p;
+
+  pool_trim(pool, 0);
+  xfree(pool);
+}
+
+static size_t
+BufferPool_memsize(const void *p)
+{
+  const struct BufferPool *pool = p;
+
+  return sizeof(struct BufferPool) + pool->count * sizeof(struct PoolEntry) + pool->bytes;
+}
+
+static const rb_data_type_t BufferPool_data_type = {
+  "SoundBuffer::Pool",
+  {
+    NULL,
+    BufferPool_free,
+    BufferPool_memsize,
+  },
+  NULL,
+  NULL
+};
+
+static VALUE
+BufferPool_allocate(VALUE klass)
+{
+  struct BufferPool *pool;
+  VALUE obj = TypedData_Make_Struct(klass, struct BufferPool, &BufferPool_data_type, pool);
+
+  pool->max_bytes = POOL_DEFAULT_MAX_BYTES;
+  return obj;
+}
+
+static struct BufferPool *
+get_buffer_pool(VALUE self)
+{
+  return rb_check_typeddata(self, &BufferPool_data_type);
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer::Pool.new(max_bytes: 16 * 1024 * 1024)
+ *
+ * max_bytesはしまっておくバッファーの合計バイト数の上限。
+ */
+static VALUE
+BufferPool_initialize(int argc, VALUE *argv, VALUE self)
+{
+  struct BufferPool *pool = get_buffer_pool(self);
+  VALUE vopt, vmax;
+
+  rb_scan_args(argc, argv, "0:", &vopt);
+  vmax = NIL_P(vopt) ? Qnil : rb_hash_aref(vopt, ID2SYM(rb_intern("max_bytes")));
+  if (!NIL_P(vmax)) pool->max_bytes = NUM2SIZET(vmax);
+  return self;
+}
+
+/*
+ * 次に使うときの状態に戻す。停止して先頭へ、音量・パン・周波数は既定値、
+ * エフェクト・通知・ループは無し。失敗したらFALSE（しまわずに解放する）
+ */
+static BOOL
+pool_reset_st(struct SoundBuffer *st)
+{
+  LPSBBUFFER buf = st->pBuffer;
+  SBLOOP     loop;
+
+  memset(&loop, 0, sizeof(loop));
+  if (FAILED(g_pDevice->lpVtbl->Unschedule(g_pDevice, buf, NULL)))         return FALSE;
+  if (FAILED(buf->lpVtbl->Stop(buf)))                                      return FALSE;
+  if (FAILED(buf->lpVtbl->SetCurrentPosition(buf, 0)))                     return FALSE;
+  if (FAILED(buf->lpVtbl->SetVolume(buf, DSBVOLUME_MAX)))                  return FALSE;
+  if (FAILED(buf->lpVtbl->SetPan(buf, DSBPAN_CENTER)))                     return FALSE;
+  if (FAILED(buf->lpVtbl->SetFrequency(buf, DSBFREQUENCY_ORIGINAL)))       return FALSE;
+  if (st->effect_count && FAILED(buf->lpVtbl->SetFX(buf, 0, NULL)))        return FALSE;
+  if ((g_pDevice->dwCaps & SBCAPS_NATIVELOOP) && FAILED(buf->lpVtbl->SetLoop(buf, &loop))) return FALSE;
+  if (FAILED(buf->lpVtbl->SetNotificationPositions(buf, 0, NULL)))         return FALSE;
+  if ((g_pDevice->dwCaps & SBCAPS_REVERSE) && FAILED(buf->lpVtbl->SetDirection(buf, 1))) return FALSE;
+  return TRUE;
+}
+
+/*
+ * call-seq:
+ *    pool.acquire(buffer, channels = 1, samples_per_sec = 48000, bits_per_sample = 16, **opt) -> SoundBuffer
+ *
+ * 引数はSoundBuffer.newと同じ。同じ形式・大きさのバッファーがしまってあればそれを使う。
+ * 初期内容を渡さなければ無音にしてから返す。
+ */
+static VALUE
+BufferPool_acquire(int argc, VALUE *argv, VALUE self)
+{
+  struct BufferPool  *pool = get_buffer_pool(self);
+  struct PoolEntry    key, *e;
+  struct SoundBuffer *st;
+  VALUE obj, vbuffer;
+
+  obj = rb_obj_alloc(cSoundBuffer);
+  st  = (struct SoundBuffer *)RTYPEDDATA_DATA(obj);
+  vbuffer = init_st_format(st, argc, argv);
+  pool_set_key(&key, st);
+  for (e = pool->buckets[pool_hash(&key)]; e; e = e->hnext) {
+    if (pool_same_key(e, &key)) break;
+  }
+  if (e) {
+    // デバイスの参照はしまっていたときのものを引き継ぐ
+    pool_unlink(pool, e);
+    st->pBuffer = e->buf;
+    xfree(e);
+    pool->hits++;
+    if (TYPE(vbuffer) != T_STRING) SoundBuffer_fill_silence(0, NULL, obj);
+  }
+  else {
+    create_st_buffer(st);
+    pool->misses++;
+  }
+  init_st_buffer(obj, st, vbuffer);
+  return obj;
+}
+
+/*
+ * call-seq:
+ *    pool.release(sb) -> true or false
+ *
+ * sbを使えなくして、バッファーをしまう。しまえたらtrue。
+ * dupしたことがあるもの・dupで作ったもの・Streamはメモリーを共有しているのでしまわずに解放し、falseを返す。
+ */
+static VALUE
+BufferPool_release(VALUE self, VALUE sb)
+{
+  struct BufferPool  *pool = get_buffer_pool(self);
+  struct SoundBuffer *st;
+  struct PoolEntry   *e, **bucket;
+
+  if (!rb_typeddata_is_kind_of(sb, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+  st = get_st(sb);
+  check_st_idle(st);
+  if (st->copy_flag || st->shared_flag || st->stream || st->origin != sb
+      || st->buffer_bytes > pool->max_bytes || !pool_reset_st(st)) {
+    SoundBuffer_release(st);
+    pool->discards++;
+    return Qfalse;
+  }
+  e = ALLOC(struct PoolEntry);
+  pool_set_key(e, st);
+  e->buf = st->pBuffer;
+  e->buf->lpStats = NULL;
+  clear_st(st);
+
+  // 古いものを追い出してから新しい方として入れる
+  pool_trim(pool, pool->max_bytes - e->buffer_bytes);
+  bucket       = &pool->buckets[pool_hash(e)];
+  e->hnext     = *bucket;
+  *bucket      = e;
+  e->next      = NULL;
+  e->prev      = pool->tail;
+  if (e->prev) e->prev->next = e;
+  else         pool->head    = e;
+  pool->tail   = e;
+  pool->count++;
+  pool->bytes += e->buffer_bytes;
+  return Qtrue;
+}
+
+static VALUE
+BufferPool_clear(VALUE self)
+{
+  struct BufferPool *pool = get_buffer_pool(self);
+  DWORD evictions = pool->evictions;
+
+  // 自分で消したものは追い出しに数えない
+  pool_trim(pool, 0);
+  pool->evictions = evictions;
+  return self;
+}
+
+static VALUE
+BufferPool_size(VALUE self)
+{
+  return UINT2NUM(get_buffer_pool(self)->count);
+}
+
+static VALUE
+BufferPool_bytes(VALUE self)
+{
+  return SIZET2NUM(get_buffer_pool(self)->bytes);
+}
+
+static VALUE
+BufferPool_get_max_bytes(VALUE self)
+{
+  return SIZET2NUM(get_buffer_pool(self)->max_bytes);
+}
+
+static VALUE
+BufferPool_set_max_bytes(VALUE self, VALUE vmax)
+{
+  struct BufferPool *pool = get_buffer_pool(self);
+
+  pool->max_bytes = NUM2SIZET(vmax);
+  pool_trim(pool, pool->max_bytes);
+  return vmax;
+}
+
+static VALUE
+BufferPool_hits(VALUE self)
+{
+  return UINT2NUM(get_buffer_pool(self)->hits);
+}
+
+static VALUE
+BufferPool_misses(VALUE self)
+{
+  return UINT2NUM(get_buffer_pool(self)->misses);
+}
+
+static VALUE
+BufferPool_evictions(VALUE self)
+{
+  return UINT2NUM(get_buffer_pool(self)->evictions);
+}
+
+static VALUE
+BufferPool_discards(VALUE self)
+{
+  return UINT2NUM(get_buffer_pool(self)->discards);
+}
+
+/*
+ * offline render
+ * 再生中のバッファーを実時間を待たずに進め、ミックス結果をPCMの文字列で返す。
+ * 形式はSoundBuffer.get_formatと同じ。GVLは一定フレームごとに外す。
+ * 外している間にほかのスレッドが解放しないよう、終わるまでバッファーをpinしておく。
+ */
+#define RENDER_CHUNK_FRAMES 65536
+
+struct RenderData {
+  DWORD         count;
+  LPSBBUFFER   *buffers;
+  DWORD         st_count;
+  struct SoundBuffer **sts;
+  DWORD         frames;
+  WAVEFORMATEX  wfx;
+  LPBYTE        ptr;
+  VALUE         out;
+  HRESULT       hr;
+};
+
+static void*
+render_blocking(void *data)
+{
+  struct RenderData *rd = data;
+
+  rd->hr = g_pDevice->lpVtbl->Render(g_pDevice, rd->count, rd->buffers, rd->frames, &rd->wfx, rd->ptr);
+  return NULL;
+}
+
+static VALUE
+render_body(VALUE data)
+{
+  struct RenderData *rd = (struct RenderData *)data;
+  DWORD   n, total = rd->frames;
+  LPBYTE  ptr = (LPBYTE)RSTRING_PTR(rd->out);
+
+  for (n = 0; n < total; n += rd->frames) {
+    rd->frames = total - n < RENDER_CHUNK_FRAMES ? total - n : RENDER_CHUNK_FRAMES;
+    rd->ptr    = ptr + (size_t)n * rd->wfx.nBlockAlign;
+    rb_thread_call_without_gvl(render_blocking, (void*)rd, NULL, NULL);
+    if (FAILED(rd->hr)) break;
+    rb_thread_check_ints();
+  }
+  return Qnil;
+}
+
+static VALUE
+render_ensure(VALUE data)
+{
+  struct RenderData *rd = (struct RenderData *)data;
+  DWORD i;
+
+  for (i = 0; i < rd->st_count; i++) unpin_st(rd->sts[i]);
+  return rb_str_unlocktmp(rd->out);
+}
+
+// stsはbuffersの持ち主。呼び出し側はそのVALUEを終わるまで保持する
+static VALUE
+render_buffers(DWORD count, LPSBBUFFER *buffers, DWORD st_count, struct SoundBuffer **sts, VALUE vframes, VALUE out)
+{
+  struct RenderData rd;
+  HRESULT hr;
+  size_t  bytes;
+  DWORD   i;
+
+  if (!(g_pDevice->dwCaps & SBCAPS_RENDER)) rb_raise(rb_eNotImpError, "%s backend can not render", g_pDevice->name);
+  hr = g_pDevice->lpVtbl->GetFormat(g_pDevice, &rd.wfx);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  rd.count    = count;
+  rd.buffers  = buffers;
+  rd.st_count = st_count;
+  rd.sts      = sts;
+  rd.frames   = NUM2UINT(vframes);
+  rd.hr      = DS_OK;
+  bytes = (size_t)rd.frames * rd.wfx.nBlockAlign;
+  if (bytes > LONG_MAX) rb_raise(rb_eRangeError, "too many frames");
+
+  if (NIL_P(out)) out = rb_str_new(NULL, (long)bytes);
+  else {
+    StringValue(out);
+    rb_str_modify(out);
+    rb_str_resize(out, (long)bytes);
+  }
+  rd.out = out;
+  rb_str_locktmp(out);
+  for (i = 0; i < st_count; i++) pin_st(sts[i]);
+  rb_ensure(render_body, (VALUE)&rd, render_ensure, (VALUE)&rd);
+  if (rd.hr == DSERR_BADFORMAT) rb_raise(eSoundBufferError, "primary format changed while rendering");
+  if (FAILED(rd.hr)) to_raise_an_exception(rd.hr);
+  return out;
+}
+
+/*
+ * SoundBuffer.render_mix(buffers, frames, out = nil)
+ * 同じバッファーが複数回あっても一度だけ進める。
+ */
+static VALUE
+SoundBuffer_c_render_mix(int argc, VALUE *argv, VALUE self)
+{
+  VALUE       vbuffers, vframes, out, vtmp1, vtmp2;
+  LPSBBUFFER *buffers;
+  struct SoundBuffer **sts;
+  DWORD       i, j, count = 0;
+  long        len;
+
+  rb_scan_args(argc, argv, "21", &vbuffers, &vframes, &out);
+  // 渡された配列をほかのスレッドが書き換えても、要素が回収されないように写しを持つ
+  vbuffers = rb_ary_dup(rb_Array(vbuffers));
+  len = RARRAY_LEN(vbuffers);
+  buffers = ALLOCV_N(LPSBBUFFER, vtmp1, len ? len : 1);
+  sts     = ALLOCV_N(struct SoundBuffer *, vtmp2, len ? len : 1);
+  for (i = 0; i < (DWORD)len; i++) {
+    VALUE v = RARRAY_AREF(vbuffers, i);
+    LPSBBUFFER buf;
+
+    if (!rb_typeddata_is_kind_of(v, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "SoundBuffer only");
+    sts[i] = get_st(v);
+    buf    = sts[i]->pBuffer;
+    for (j = 0; j < count && buffers[j] != buf; j++);
+    if (j == count) buffers[count++] = buf;
+  }
+  out = render_buffers(count, buffers, (DWORD)len, sts, vframes, out);
+  ALLOCV_END(vtmp1);
+  ALLOCV_END(vtmp2);
+  RB_GC_GUARD(vbuffers);
+  return out;
+}
+
+/*
+ * SoundBuffer#render(frames, out = nil)
+ */
+static VALUE
+SoundBuffer_render(int argc, VALUE *argv, VALUE self)
+{
+  VALUE       vframes, out;
+  LPSBBUFFER  buffer;
+  struct SoundBuffer *st;
+
+  rb_scan_args(argc, argv, "11", &vframes, &out);
+  st     = get_st(self);
+  buffer = st->pBuffer;
+  return render_buffers(1, &buffer, 1, &st, vframes, out);
+}
+
+/*
+ * ソフトウェアー・ミキサーが使っている命令セット（"scalar" "sse2" "avx2"）
+ */
+static VALUE
+SoundBuffer_c_get_mixer_isa(VALUE self)
+{
+  return rb_str_new2(sb_mix_isa());
+}
+
+static VALUE
+SoundBuffer_c_get_backend(VALUE self)
+{
+  return rb_str_new_cstr(g_pDevice->name);
+}
+
+/*
+ * 再生中にset_effectでき、前の並びから途切れずに移るならtrue
+ */
+static VALUE
+SoundBuffer_c_get_live_effect(VALUE self)
+{
+  return g_pDevice->dwCaps & SBCAPS_LIVEFX ? Qtrue : Qfalse;
+}
+
+/*
+ * WAVファイルの読み込み
+ * ファイルをメモリーに割り当て、dataチャンクからバッファーへ1回だけコピーする。
+ */
+struct LoadData {
+  VALUE     klass;
+  VALUE     path;
+  VALUE     opt;
+  sb_map_t  map;
+};
+
+static VALUE
+load_body(VALUE arg)
+{
+  struct LoadData *data = (struct LoadData *)arg;
+  SBWAV       wav;
+  const char *err;
+  char        id[5];
+  const char *text;
+  LPVOID      ptr1, ptr2;
+  DWORD       size1, size2, i, cue_id, frame, pos = 0, len;
+  HRESULT     hr;
+  VALUE       args[5], opt, obj, cues, info;
+  struct SoundBuffer *st;
+
+  err = sb_wav_parse(&wav, data->map.ptr, data->map.size);
+  if (err) rb_raise(eSoundBufferError, "%s: %"PRIsVALUE, err, data->path);
+  if (wav.dwDataBytes < DSBSIZE_MIN) rb_raise(eSoundBufferError, "data chunk is too small: %"PRIsVALUE, data->path);
+
+  opt = rb_hash_new();
+  if (!NIL_P(data->opt)) {
+    rb_hash_aset(opt, ID2SYM(rb_intern("effect")),   rb_hash_aref(data->opt, ID2SYM(rb_intern("effect"))));
+    rb_hash_aset(opt, ID2SYM(rb_intern("seamless")), rb_hash_aref(data->opt, ID2SYM(rb_intern("seamless"))));
+  }
+  if (wav.wFormatTag == WAVE_FORMAT_IEEE_FLOAT) rb_hash_aset(opt, ID2SYM(rb_intern("float")), Qtrue);
+  if (wav.dwChannelMask) rb_hash_aset(opt, ID2SYM(rb_intern("channel_mask")), UINT2NUM(wav.dwChannelMask));
+  args[0] = UINT2NUM(wav.dwDataBytes);
+  args[1] = UINT2NUM(wav.nChannels);
+  args[2] = UINT2NUM(wav.nSamplesPerSec);
+  args[3] = UINT2NUM(wav.wBitsPerSample);
+  args[4] = opt;
+  obj = rb_class_new_instance_kw(5, args, data->klass, RB_PASS_KEYWORDS);
+  st  = get_st(obj);
+
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, 0, wav.dwDataBytes, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  memcpy(ptr1, wav.pData, size1);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, size1, ptr2, 0);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "Unlock error");
+
+  // smplの最初のループをループ区間にする
+  if (wav.dwLoops && (NIL_P(data->opt) || rb_hash_lookup2(data->opt, ID2SYM(rb_intern("loop")), Qtrue) != Qfalse)) {
+    if (wav.loop.dwEnd > wav.dwDataBytes / wav.nBlockAlign) wav.loop.dwEnd = wav.dwDataBytes / wav.nBlockAlign;
+    if (wav.loop.dwStart < wav.loop.dwEnd) {
+      SoundBuffer_set_loop_start(obj, UINT2NUM(wav.loop.dwStart));
+      SoundBuffer_set_loop_end(obj,   UINT2NUM(wav.loop.dwEnd));
+      SoundBuffer_set_loop_count(obj, UINT2NUM(wav.loop.dwPlayCount));
+      SoundBuffer_set_loop(obj, Qtrue);
+    }
+  }
+  cues = rb_ary_new_capa(wav.dwCues);
+  for (i = 0; i < wav.dwCues; i++) {
+    sb_wav_cue(&wav, i, &cue_id, &frame);
+    rb_ary_push(cues, rb_assoc_new(UINT2NUM(cue_id), UINT2NUM(frame)));
+  }
+  rb_ivar_set(obj, rb_intern("@cue_points"), cues);
+  info = rb_hash_new();
+  while ((text = sb_wav_info(&wav, &pos, id, &len)) != NULL) rb_hash_aset(info, rb_str_new_cstr(id), rb_str_new(text, len));
+  rb_ivar_set(obj, rb_intern("@info"), info);
+  return obj;
+}
+
+static VALUE
+load_ensure(VALUE arg)
+{
+  sb_map_close(&((struct LoadData *)arg)->map);
+  return Qnil;
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.load(path, effect: false, seamless: false, loop: true) -> sb
+ *
+ * PCM（8/16/24/32bit）とfloatのWAVファイルを読み込む。
+ * smplチャンクにループがあればループ区間にする。loop: falseなら使わない。
+ * cueチャンクは[ID, フレーム]の配列でcue_points、LIST INFOはinfoで取り出せる。
+ */
+static VALUE
+SoundBuffer_c_load(int argc, VALUE *argv, VALUE klass)
+{
+  struct LoadData data;
+  VALUE vpath, vopt;
+
+  rb_scan_args(argc, argv, "1:", &vpath, &vopt);
+  FilePathValue(vpath);
+  data.klass = klass;
+  data.path  = rb_str_encode_ospath(vpath);
+  data.opt   = vopt;
+  if (sb_map_open(&data.map, StringValueCStr(data.path)) != 0) rb_sys_fail_str(vpath);
+  return rb_ensure(load_body, (VALUE)&data, load_ensure, (VALUE)&data);
+}
+
+/*
+ * 信号の生成
+ * 音符の並びをsb_osc_renderで描いて新しいバッファーに書き込む。
+ * 音符の境目では音量をfadeフレームかけて直線で動かし、位相はつなげたままにするのでクリックが出ない。
+ * 音符の開始フレームは先頭からの秒数の合計から求めるので、長い並びでもずれない。描くときはGVLを外す。
+ */
+#define TONE_VOICES 8    // 和音の最大数
+#define TONE_CHUNK  512  // 1回に描くフレーム数
+
+struct ToneNote {
+  DWORD  start;               // 開始フレーム
+  DWORD  frames;
+  DWORD  voices;              // 0なら休符
+  float  gain;                // 1音あたりの音量。和音は音数で割ってある
+  double inc[TONE_VOICES];    // 周波数÷サンプリング周波数
+  double ratio;               // 音符の終わりのincは始めのratio倍。1なら変わらない
+};
+
+struct ToneData {
+  struct ToneNote *notes;
+  DWORD            count;
+  DWORD            wave;
+  DWORD            fade;      // 0なら音量をすぐに変える
+  DWORD            channels;
+  enum pcm_format  format;
+  LPBYTE           ptr;
+};
+
+static DWORD
+osc_wave_index(VALUE vwave)
+{
+  ID id = SYM2ID(rb_to_symbol(vwave));
+
+  if (id == rb_intern("sine"))     return SB_OSC_SINE;
+  if (id == rb_intern("square"))   return SB_OSC_SQUARE;
+  if (id == rb_intern("saw"))      return SB_OSC_SAW;
+  if (id == rb_intern("triangle")) return SB_OSC_TRIANGLE;
+  if (id == rb_intern("noise"))    return SB_OSC_NOISE;
+  rb_raise(rb_eArgError, "wave can be only :sine, :square, :saw, :triangle or :noise");
+  return 0;
+}
+
+// floatの列を1〜8チャンネルに広げてバッファーの形式で書き出す
+static void
+tone_store(LPBYTE out, const float *acc, float *wide, DWORD frames, DWORD channels, enum pcm_format format)
+{
+  const float *src = acc;
+  DWORD        i, c, n = frames * channels;
+  double       v;
+  int32_t      x;
+
+  if (channels > 1) {
+    for (i = 0; i < frames; i++) for (c = 0; c < channels; c++) wide[i * channels + c] = acc[i];
+    src = wide;
+  }
+  switch (format) {
+  case PCM_U8:  sb_mix_store_u8(out, src, n);                    break;
+  case PCM_S16: sb_mix_store_s16(out, src, n);                   break;
+  case PCM_F32: memcpy(out, src, (size_t)n * sizeof(float));     break;
+  default:
+    for (i = 0; i < n; i++) {
+      v = src[i] < -1.0f ? -1.0 : src[i] > 1.0f ? 1.0 : src[i];
+      x = (int32_t)lrint(v * 2147483647.0);
+      if (format == PCM_S32) memcpy(out + i * 4, &x, sizeof(x));
+      else {
+        out[i * 3]     = (BYTE)(x >> 8);
+        out[i * 3 + 1] = (BYTE)(x >> 16);
+        out[i * 3 + 2] = (BYTE)(x >> 24);
+      }
+    }
+    break;
+  }
+}
+
+/*
+ * 音符1つを描く。音量は先頭headフレームで前の音符の値から動かし、
+ * 最後の音符なら末尾tailフレームで0へ下げる。
+ * 周波数が動くときは、SB_OSC_BLOCKフレームごとにincを指数で求め直す。
+ */
+static void
+tone_render_note(struct ToneData *td, const struct ToneNote *note, BOOL last, LPSBOSC oscs, float *cur,
+                 float *acc, float *wide)
+{
+  DWORD block = td->channels * pcm_format_bytes[td->format];
+  DWORD head, tail, body, pos, len, v;
+  float target, g, dg;
+
+  head = td->fade < note->frames ? td->fade : note->frames;
+  tail = last ? (td->fade < note->frames - head ? td->fade : note->frames - head) : 0;
+  body = note->frames - tail;
+  for (pos = 0; pos < note->frames; pos += len) {
+    // 音量が直線で変わる区間をまたがないように切る
+    len = (pos < head ? head : pos < body ? body : note->frames) - pos;
+    if (len > TONE_CHUNK) len = TONE_CHUNK;
+    if (note->ratio != 1.0 && len > SB_OSC_BLOCK) len = SB_OSC_BLOCK;
+    memset(acc, 0, len * sizeof(float));
+    for (v = 0; v < TONE_VOICES; v++) {
+      target = v < note->voices ? note->gain : 0.0f;
+      if (pos < head) {
+        dg = (target - cur[v]) / head;
+        g  = cur[v] + dg * pos;
+      }
+      else if (pos < body) {
+        dg = 0.0f;
+        g  = target;
+      }
+      else {
+        dg = -target / tail;
+        g  = target + dg * (pos - body);
+      }
+      if (g == 0.0f && dg == 0.0f) continue;
+      // 消えていく音は前の音符の周波数のまま鳴らす
+      if (v < note->voices) {
+        oscs[v].inc = note->inc[v];
+        if (note->ratio != 1.0) oscs[v].inc *= pow(note->ratio, (double)pos / note->frames);
+      }
+      if (oscs[v].inc > 0.0) sb_osc_render(acc, &oscs[v], g, dg, len);
+    }
+    tone_store(td->ptr + (size_t)(note->start + pos) * block, acc, wide, len, td->channels, td->format);
+  }
+  for (v = 0; v < TONE_VOICES; v++) cur[v] = v < note->voices ? note->gain : 0.0f;
+}
+
+static void*
+tone_render_blocking(void *data)
+{
+  struct ToneData *td = data;
+  SBOSC  oscs[TONE_VOICES];
+  float  cur[TONE_VOICES], acc[TONE_CHUNK], wide[TONE_CHUNK * SB_MIX_MAX_CHANNELS];
+  DWORD  i, v;
+
+  for (v = 0; v < TONE_VOICES; v++) {
+    sb_osc_init(&oscs[v], td->wave, 0x5342u + v);
+    cur[v] = 0.0f;
+  }
+  for (i = 0; i < td->count; i++) tone_render_note(td, &td->notes[i], i + 1 == td->count, oscs, cur, acc, wide);
+  return NULL;
+}
+
+static VALUE
+tone_opt(VALUE vopt, const char *name)
+{
+  return NIL_P(vopt) ? Qnil : rb_hash_aref(vopt, ID2SYM(rb_intern(name)));
+}
+
+// SoundBuffer.newへ渡す形式の引数をキーワードから作る。戻り値はサンプリング周波数
+static DWORD
+tone_format_args(VALUE vopt, VALUE *args, LPDWORD block)
+{
+  static const char *const keys[] = { "float", "channel_mask", "effect", "seamless" };
+  VALUE opt = rb_hash_new(), v;
+  DWORD rate, channels, bits;
+  int   i;
+
+  args[1] = tone_opt(vopt, "channels");
+  args[2] = tone_opt(vopt, "samples_per_sec");
+  args[3] = tone_opt(vopt, "bits_per_sample");
+  for (i = 0; i < 4; i++) {
+    v = tone_opt(vopt, keys[i]);
+    if (!NIL_P(v)) rb_hash_aset(opt, ID2SYM(rb_intern(keys[i])), v);
+  }
+  args[4] = opt;
+  rate = NIL_P(args[2]) ? 48000 : NUM2UINT(args[2]);
+  if (rate < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < rate) rb_raise(rb_eRangeError, "samples_per_sec argument can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX");
+  channels = NIL_P(args[1]) ? 1 : NUM2UINT(args[1]);
+  bits     = NIL_P(args[3]) ? (RTEST(tone_opt(vopt, "float")) ? 32 : 16) : NUM2UINT(args[3]);
+  *block   = channels * bits / 8 ? channels * bits / 8 : 1;
+  return rate;
+}
+
+static DWORD
+tone_fade(VALUE vopt, DWORD rate)
+{
+  VALUE  vfade = tone_opt(vopt, "fade");
+  double sec   = NIL_P(vfade) ? 0.002 : NUM2DBL(vfade);
+
+  if (!(sec >= 0.0 && sec <= 1.0)) rb_raise(rb_eRangeError, "fade can be only 0-1 sec");
+  return (DWORD)lround(sec * rate);
+}
+
+// 周波数（1つか和音の配列）をincにする。0かnilなら休符で、戻り値は0
+static DWORD
+tone_voices(VALUE vhz, DWORD rate, double *inc)
+{
+  VALUE  list = RB_TYPE_P(vhz, T_ARRAY) ? vhz : rb_ary_new_from_values(1, &vhz), v;
+  DWORD  voices = 0;
+  long   i;
+  double hz;
+
+  if (RARRAY_LEN(list) > TONE_VOICES) rb_raise(rb_eRangeError, "chord can be only 1-%d notes", TONE_VOICES);
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    v = RARRAY_AREF(list, i);
+    if (NIL_P(v) || (hz = NUM2DBL(v)) == 0.0) continue;
+    if (!(hz > 0.0 && hz < rate / 2.0)) rb_raise(rb_eRangeError, "hz can be only 0 < hz < samples_per_sec / 2");
+    inc[voices++] = hz / rate;
+  }
+  return voices;
+}
+
+// 音量は1/100dB（0が最大）で、1音あたりの振幅にする
+static float
+tone_gain(VALUE vvol, DWORD voices)
+{
+  LONG vol = NIL_P(vvol) ? DSBVOLUME_MAX : NUM2LONG(vvol);
+
+  if (vol < DSBVOLUME_MIN || DSBVOLUME_MAX < vol) rb_raise(rb_eRangeError, "volume can be only DSBVOLUME_MIN-DSBVOLUME_MAX");
+  if (!voices || vol == DSBVOLUME_MIN) return 0.0f;
+  return (float)(pow(10.0, vol / 2000.0) / voices);
+}
+
+// 秒数の合計をフレーム位置にする
+static DWORD
+tone_frames(double sec, DWORD rate)
+{
+  if (!(sec >= 0.0)) rb_raise(rb_eRangeError, "sec can be only 0 or more");
+  if (sec * rate > DSBSIZE_MAX) rb_raise(rb_eRangeError, "buffer size error");
+  return (DWORD)lround(sec * rate);
+}
+
+// バッファーの最小サイズに足りなければ、末尾に休符を足す。戻り値は足した音符の数
+static DWORD
+tone_pad(struct ToneNote *note, DWORD end, DWORD block)
+{
+  if ((size_t)end * block >= DSBSIZE_MIN) return 0;
+  note->start  = end;
+  note->frames = (DSBSIZE_MIN + block - 1) / block - end;
+  note->voices = 0;
+  note->gain   = 0.0f;
+  note->ratio  = 1.0;
+  return 1;
+}
+
+static VALUE
+tone_build(VALUE klass, VALUE *args, DWORD block, struct ToneData *td)
+{
+  const struct ToneNote *last = &td->notes[td->count - 1];
+  LPVOID  ptr1, ptr2;
+  DWORD   size1, size2;
+  HRESULT hr;
+  VALUE   obj;
+  struct SoundBuffer *st;
+
+  args[0] = ULL2NUM((unsigned LONG_LONG)(last->start + last->frames) * block);
+  obj = rb_class_new_instance_kw(5, args, klass, RB_PASS_KEYWORDS);
+  st  = get_st(obj);
+  td->channels = st->channels;
+  td->format   = get_st_pcm_format(st);
+
+  hr = st->pBuffer->lpVtbl->Lock(st->pBuffer, 0, (DWORD)st->buffer_bytes, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+  if (FAILED(hr)) to_raise_an_exception(hr);
+  td->ptr = ptr1;
+  rb_thread_call_without_gvl(tone_render_blocking, (void*)td, NULL, NULL);
+  hr = st->pBuffer->lpVtbl->Unlock(st->pBuffer, ptr1, size1, ptr2, 0);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "Unlock error");
+  return obj;
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.tone(wave, hz, sec, volume: 0, to: nil, loop: false, fade: 0.002,
+ *                     channels: 1, samples_per_sec: 48000, bits_per_sample: 16, float: false) -> sb
+ *
+ * waveは:sine :square :saw :triangle :noise。hzは配列なら和音になる。
+ * to:を指定すると、sec秒かけて周波数をtoへ指数で動かす。
+ * loop: trueならrepeatでつなぎ目が出ないように、sec秒にちょうど整数周期が入る周波数へ丸める。
+ */
+static VALUE
+SoundBuffer_c_tone(int argc, VALUE *argv, VALUE klass)
+{
+  struct ToneNote notes[2];
+  struct ToneData td;
+  VALUE  vwave, vhz, vsec, vopt, vto, args[5];
+  DWORD  rate, block, v;
+  double cycles, to;
+  BOOL   loop;
+
+  rb_scan_args(argc, argv, "3:", &vwave, &vhz, &vsec, &vopt);
+  rate  = tone_format_args(vopt, args, &block);
+  loop  = RTEST(tone_opt(vopt, "loop"));
+  td.wave  = osc_wave_index(vwave);
+  td.fade  = loop ? 0 : tone_fade(vopt, rate);
+  td.notes = notes;
+  notes[0].start  = 0;
+  notes[0].frames = tone_frames(NUM2DBL(vsec), rate);
+  notes[0].voices = tone_voices(vhz, rate, notes[0].inc);
+  notes[0].gain   = tone_gain(tone_opt(vopt, "volume"), notes[0].voices);
+  notes[0].ratio  = 1.0;
+  vto = tone_opt(vopt, "to");
+  if (!NIL_P(vto)) {
+    if (loop) rb_raise(rb_eArgError, "to: can not be used with loop: true");
+    if (!notes[0].voices) rb_raise(rb_eArgError, "to: needs hz");
+    to = NUM2DBL(vto);
+    if (!(to > 0.0 && to < rate / 2.0)) rb_raise(rb_eRangeError, "hz can be only 0 < hz < samples_per_sec / 2");
+    notes[0].ratio = to / rate / notes[0].inc[0];
+  }
+  if (loop) {
+    for (v = 0; v < notes[0].voices; v++) {
+      cycles = floor(notes[0].inc[v] * notes[0].frames + 0.5);
+      if (cycles < 1.0) cycles = 1.0;
+      if (cycles * 2 >= notes[0].frames) rb_raise(rb_eRangeError, "sec is too short to loop");
+      notes[0].inc[v] = cycles / notes[0].frames;
+    }
+  }
+  td.count = 1 + tone_pad(&notes[1], notes[0].frames, block);
+  return tone_build(klass, args, block, &td);
+}
+
+/*
+ * call-seq:
+ *    SoundBuffer.sequence([sec, hz, volume, sec, hz, volume, ...], wave: :square, fade: 0.002,
+ *                         channels: 1, samples_per_sec: 48000, bits_per_sample: 16, float: false) -> sb
+ *
+ * Beep.beepsと同じ並びの音符を1本のバッファーに描く。hzが0かnilなら休符、配列なら和音。
+ * 同じ高さの音符が続くときは区切らずにつながる。区切るには間に休符を入れる。
+ */
+static VALUE
+SoundBuffer_c_sequence(int argc, VALUE *argv, VALUE klass)
+{
+  struct ToneNote *note;
+  struct ToneData  td;
+  VALUE  vnotes, vopt, vwave, args[5], tmp, obj;
+  DWORD  rate, block, i, count, end = 0;
+  double sec = 0.0, s;
+
+  rb_scan_args(argc, argv, "1:", &vnotes, &vopt);
+  Check_Type(vnotes, T_ARRAY);
+  rate  = tone_format_args(vopt, args, &block);
+  vwave = tone_opt(vopt, "wave");
+  td.wave  = osc_wave_index(NIL_P(vwave) ? ID2SYM(rb_intern("square")) : vwave);
+  td.fade  = tone_fade(vopt, rate);
+  count    = (DWORD)((RARRAY_LEN(vnotes) + 2) / 3);
+  td.notes = ALLOCV_N(struct ToneNote, tmp, count + 1);
+  for (i = 0; i < count; i++) {
+    note = &td.notes[i];
+    s = NUM2DBL(rb_ary_entry(vnotes, i * 3));
+    if (!(s >= 0.0)) rb_raise(rb_eRangeError, "sec can be only 0 or more");
+    sec += s;
+    note->start  = end;
+    end          = tone_frames(sec, rate);
+    note->frames = end - note->start;
+    note->voices = tone_voices(rb_ary_entry(vnotes, i * 3 + 1), rate, note->inc);
+    note->gain   = tone_gain(rb_ary_entry(vnotes, i * 3 + 2), note->voices);
+    note->ratio  = 1.0;
+  }
+  td.count = count + tone_pad(&td.notes[count], end, block);
+  obj      = tone_build(klass, args, block, &td);
+  ALLOCV_END(tmp);
+  return obj;
+}
+
+/*
+ * バッファーの内容の編集
+ * 範囲はフレーム単位（pcm_posと同じ）。Lockした領域どうしをmemcpy/memmoveでコピーする。
+ * 同じoriginのバッファー（dupしたもの）はメモリーを共有しているので1回だけLockする。
+ */
+static void
+get_frame_range(struct SoundBuffer *st, int argc, VALUE *argv, LPDWORD start, LPDWORD frames)
+{
+  long beg, len, total = (long)(st->buffer_bytes / st->block_align);
+
+  if (argc == 0 || (argc == 1 && NIL_P(argv[0]))) {
+    beg = 0;
+    len = total;
+  }
+  else if (argc == 2) {
+    beg = NUM2LONG(argv[0]);
+    len = NUM2LONG(argv[1]);
+    if (beg < 0) beg += total;
+    if (beg < 0 || beg > total || len < 0) rb_raise(rb_eRangeError, "frame range");
+    if (len > total - beg) len = total - beg;
+  }
+  else if (rb_range_beg_len(argv[0], &beg, &len, total, 1) == Qfalse) {
+    rb_raise(rb_eTypeError, "not valid value");
+  }
+  *start  = (DWORD)beg;
+  *frames = (DWORD)len;
+}
+
+static struct SoundBuffer *
+get_edit_st(struct SoundBuffer *st, VALUE vother)
+{
+  struct SoundBuffer *other;
+
+  if (!rb_typeddata_is_kind_of(vother, &SoundBuffer_data_type)) rb_raise(rb_eTypeError, "not valid value");
+  other = get_st(vother);
+  if (other->channels != st->channels || other->bits_per_sample != st->bits_per_sample || other->format_tag != st->format_tag) {
+    rb_raise(eSoundBufferError, "different format");
+  }
+  return other;
+}
+
+static BOOL
+edit_shared(struct SoundBuffer **sts, DWORD i, DWORD *j)
+{
+  for (*j = 0; *j < i; (*j)++) if (sts[*j]->origin == sts[i]->origin) return TRUE;
+  return FALSE;
+}
+
+static void
+edit_unlock(DWORD count, struct SoundBuffer **sts, LPBYTE *ptrs)
+{
+  DWORD i, j;
+
+  for (i = 0; i < count; i++) {
+    if (!edit_shared(sts, i, &j)) sts[i]->pBuffer->lpVtbl->Unlock(sts[i]->pBuffer, ptrs[i], (DWORD)sts[i]->buffer_bytes, NULL, 0);
+  }
+}
+
+static void
+edit_lock(DWORD count, struct SoundBuffer **sts, LPBYTE *ptrs)
+{
+  LPVOID  ptr1, ptr2;
+  DWORD   size1, size2, i, j;
+  HRESULT hr;
+
+  for (i = 0; i < count; i++) {
+    if (edit_shared(sts, i, &j)) {
+      ptrs[i] = ptrs[j];
+      continue;
+    }
+    hr = sts[i]->pBuffer->lpVtbl->Lock(sts[i]->pBuffer, 0, 0, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+    if (SUCCEEDED(hr) && size1 != sts[i]->buffer_bytes) {
+      sts[i]->pBuffer->lpVtbl->Unlock(sts[i]->pBuffer, ptr1, 0, ptr2, 0);
+      hr = DSERR_GENERIC;
+    }
+    if (FAILED(hr)) {
+      edit_unlock(i, sts, ptrs);
+      if (hr == DSERR_GENERIC) rb_raise(eSoundBufferError, "can not full size lock");
+      to_raise_an_exception(hr);
+    }
+    ptrs[i] = ptr1;
+  }
 }
 
+// 同じ形式で大きさだけ違うバッファーを作る。小さすぎてFXが使えないときはFXなしにする。
 static VALUE
-SoundBuffer_SetAllParameters_DSFXParamEq(int argc, VALUE *argv, VALUE self)
+new_buffer_like(VALUE self, struct SoundBuffer *st, DWORD frames)
 {
-  HRESULT      hr;
-  LPVOID       pObject;
-  DSFXParamEq  dsfx;
-  struct SoundBuffer *st = get_st(self);
-
-  if (argc != 4) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fCenter    = (float)NUM2DBL(argv[1]);
-  dsfx.fBandwidth = (float)NUM2DBL(argv[2]);
-  dsfx.fGain      = (float)NUM2DBL(argv[3]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_PARAMEQ,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXParamEq8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXParamEq8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXParamEq8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+  DWORD bytes = frames * st->block_align;
+  VALUE args[5], opt;
+
+  opt = rb_hash_new();
+  if (st->format_tag == WAVE_FORMAT_IEEE_FLOAT) rb_hash_aset(opt, ID2SYM(rb_intern("float")), Qtrue);
+  if (st->channel_mask) rb_hash_aset(opt, ID2SYM(rb_intern("channel_mask")), UINT2NUM(st->channel_mask));
+  if (st->effect_flag && bytes >= st->samples_per_sec * DSBSIZE_FX_MIN / 1000) rb_hash_aset(opt, ID2SYM(rb_intern("effect")), Qtrue);
+  if (st->seamless_flag) rb_hash_aset(opt, ID2SYM(rb_intern("seamless")), Qtrue);
+  args[0] = UINT2NUM(bytes);
+  args[1] = UINT2NUM(st->channels);
+  args[2] = UINT2NUM(st->samples_per_sec);
+  args[3] = UINT2NUM(st->bits_per_sample);
+  args[4] = opt;
+  return rb_class_new_instance_kw(5, args, rb_obj_class(self), RB_PASS_KEYWORDS);
 }
 
+/*
+ * call-seq:
+ *    sb.slice(range) -> new_sb
+ *    sb.slice(start, frames) -> new_sb
+ *
+ * 指定したフレームを同じ形式の新しいバッファーにコピーする。再生中でもよい。
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXI3DL2Reverb(VALUE self, VALUE nth)
+SoundBuffer_slice(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT          hr;
-  LPVOID           pObject;
-  DSFXI3DL2Reverb  dsfx;
+  DWORD  start, frames;
+  LPBYTE ptrs[2];
+  VALUE  obj;
+  struct SoundBuffer *sts[2];
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_STANDARD_I3DL2REVERB,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXI3DL2Reverb8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXI3DL2Reverb8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXI3DL2Reverb8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(12, INT2NUM(dsfx.lRoom),
-                                  INT2NUM(dsfx.lRoomHF),
-                                  rb_float_new(dsfx.flRoomRolloffFactor),
-                                  rb_float_new(dsfx.flDecayTime),
-                                  rb_float_new(dsfx.flDecayHFRatio),
-                                  INT2NUM(dsfx.lReflections),
-                                  rb_float_new(dsfx.flReflectionsDelay),
-                                  INT2NUM(dsfx.lReverb),
-                                  rb_float_new(dsfx.flReverbDelay),
-                                  rb_float_new(dsfx.flDiffusion),
-                                  rb_float_new(dsfx.flDensity),
-                                  rb_float_new(dsfx.flHFReference));
+  rb_check_arity(argc, 1, 2);
+  get_frame_range(st, argc, argv, &start, &frames);
+  obj    = new_buffer_like(self, st, frames);
+  sts[0] = st;
+  sts[1] = get_st(obj);
+  edit_lock(2, sts, ptrs);
+  memcpy(ptrs[1], ptrs[0] + start * st->block_align, frames * st->block_align);
+  edit_unlock(2, sts, ptrs);
+  return obj;
 }
 
+/*
+ * call-seq:
+ *    sb.concat(other, ...) -> new_sb
+ *
+ * selfの後ろにotherをつないだ新しいバッファーを返す。大きさは変えられないのでselfはそのまま。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXI3DL2Reverb(int argc, VALUE *argv, VALUE self)
+SoundBuffer_concat(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT          hr;
-  LPVOID           pObject;
-  DSFXI3DL2Reverb  dsfx;
+  DWORD   i, frames, total;
+  LPBYTE *ptrs, dst;
+  VALUE   obj;
+  struct SoundBuffer **sts;
   struct SoundBuffer *st = get_st(self);
 
-  if (argc != 13) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.lRoom               = NUM2INT(argv[1]);
-  dsfx.lRoomHF             = NUM2INT(argv[2]);
-  dsfx.flRoomRolloffFactor = (float)NUM2DBL(argv[3]);
-  dsfx.flDecayTime         = (float)NUM2DBL(argv[4]);
-  dsfx.flDecayHFRatio      = (float)NUM2DBL(argv[5]);
-  dsfx.lReflections        = NUM2INT(argv[6]);
-  dsfx.flReflectionsDelay  = (float)NUM2DBL(argv[7]);
-  dsfx.lReverb             = NUM2INT(argv[8]);
-  dsfx.flReverbDelay       = (float)NUM2DBL(argv[9]);
-  dsfx.flDiffusion         = (float)NUM2DBL(argv[10]);
-  dsfx.flDensity           = (float)NUM2DBL(argv[11]);
-  dsfx.flHFReference       = (float)NUM2DBL(argv[12]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_STANDARD_I3DL2REVERB,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXI3DL2Reverb8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXI3DL2Reverb8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXI3DL2Reverb8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
-  return self;
+  sts    = ALLOCA_N(struct SoundBuffer *, argc + 2);
+  ptrs   = ALLOCA_N(LPBYTE, argc + 2);
+  sts[0] = st;
+  total  = (DWORD)(st->buffer_bytes / st->block_align);
+  for (i = 0; i < (DWORD)argc; i++) {
+    sts[i + 1] = get_edit_st(st, argv[i]);
+    frames = (DWORD)(sts[i + 1]->buffer_bytes / st->block_align);
+    if (frames > DSBSIZE_MAX / st->block_align - total) rb_raise(rb_eRangeError, "buffer size error");
+    total += frames;
+  }
+  obj = new_buffer_like(self, st, total);
+  sts[argc + 1] = get_st(obj);
+  edit_lock(argc + 2, sts, ptrs);
+  dst = ptrs[argc + 1];
+  for (i = 0; i <= (DWORD)argc; i++) {
+    memcpy(dst, ptrs[i], sts[i]->buffer_bytes);
+    dst += sts[i]->buffer_bytes;
+  }
+  edit_unlock(argc + 2, sts, ptrs);
+  return obj;
 }
 
+/*
+ * call-seq:
+ *    sb.fill_silence -> self
+ *    sb.fill_silence(range) -> self
+ *    sb.fill_silence(start, frames) -> self
+ *
+ * 指定したフレームを無音にする（8bitは0x80、それ以外は0）。
+ */
 static VALUE
-SoundBuffer_GetAllParameters_DSFXWavesReverb(VALUE self, VALUE nth)
+SoundBuffer_fill_silence(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT          hr;
-  LPVOID           pObject;
-  DSFXWavesReverb  dsfx;
+  DWORD  start, frames;
+  LPBYTE ptr;
   struct SoundBuffer *st = get_st(self);
 
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8, &GUID_DSFX_WAVES_REVERB,
-                                                NUM2UINT(nth),  &IID_IDirectSoundFXWavesReverb8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXWavesReverb8 *)pObject)->lpVtbl->GetAllParameters((struct IDirectSoundFXWavesReverb8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetAllParameters error");
-  return rb_ary_new_from_args(4,  rb_float_new(dsfx.fInGain),
-                                  rb_float_new(dsfx.fReverbMix),
-                                  rb_float_new(dsfx.fReverbTime),
-                                  rb_float_new(dsfx.fHighFreqRTRatio));
+  rb_check_arity(argc, 0, 2);
+  get_frame_range(st, argc, argv, &start, &frames);
+  if (!frames) return self;
+  edit_lock(1, &st, &ptr);
+  memset(ptr + start * st->block_align, st->bits_per_sample == 8 ? 0x80 : 0, frames * st->block_align);
+  edit_unlock(1, &st, &ptr);
+  return self;
 }
 
+/*
+ * call-seq:
+ *    sb.copy_from(other, src_range = nil, dst_offset = 0) -> self
+ *
+ * otherのsrc_rangeのフレームを、selfのdst_offsetフレーム目からに上書きする。
+ * otherはself自身や同じoriginのバッファーでもよい（重なっていてもかまわない）。
+ */
 static VALUE
-SoundBuffer_SetAllParameters_DSFXWavesReverb(int argc, VALUE *argv, VALUE self)
+SoundBuffer_copy_from(int argc, VALUE *argv, VALUE self)
 {
-  HRESULT          hr;
-  LPVOID           pObject;
-  DSFXWavesReverb  dsfx;
+  DWORD  start, frames, offset;
+  LPBYTE ptrs[2];
+  VALUE  vother, vrange, voffset;
+  struct SoundBuffer *sts[2];
   struct SoundBuffer *st = get_st(self);
 
-  if (argc != 5) rb_raise(rb_eArgError, "Number of arguments does not match");
-  dsfx.fInGain          = (float)NUM2DBL(argv[1]);
-  dsfx.fReverbMix       = (float)NUM2DBL(argv[2]);
-  dsfx.fReverbTime      = (float)NUM2DBL(argv[3]);
-  dsfx.fHighFreqRTRatio = (float)NUM2DBL(argv[4]);
-  hr = st->pDSBuffer8->lpVtbl->GetObjectInPath( st->pDSBuffer8,     &GUID_DSFX_WAVES_REVERB,
-                                                NUM2UINT(argv[0]),  &IID_IDirectSoundFXWavesReverb8,
-                                                &pObject);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "GetObjectInPath error");
-  hr = ((struct IDirectSoundFXWavesReverb8 *)pObject)->lpVtbl->SetAllParameters((struct IDirectSoundFXWavesReverb8 *)pObject, &dsfx);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetAllParameters error");
+  rb_scan_args(argc, argv, "12", &vother, &vrange, &voffset);
+  sts[0] = st;
+  sts[1] = get_edit_st(st, vother);
+  get_frame_range(sts[1], 1, &vrange, &start, &frames);
+  offset = NIL_P(voffset) ? 0 : NUM2UINT(voffset);
+  if (offset > st->buffer_bytes / st->block_align || frames > st->buffer_bytes / st->block_align - offset) rb_raise(rb_eRangeError, "frame range");
+  if (!frames) return self;
+  edit_lock(2, sts, ptrs);
+  memmove(ptrs[0] + offset * st->block_align, ptrs[1] + start * st->block_align, frames * st->block_align);
+  edit_unlock(2, sts, ptrs);
   return self;
 }
 
-//
-//
-//
+/*
+ * call-seq:
+ *    sb.splice!(range) -> removed_sb or nil
+ *    sb.splice!(range, other) -> removed_sb or nil
+ *
+ * rangeのフレームを取り除き、そこにotherの内容を入れる。取り除いた部分を新しいバッファーで返す。
+ * バッファーを作り直すので、止まっているoriginのバッファーでしか使えない。
+ * 音量、パン、周波数、ループ区間、通知位置、エフェクトの並びとバイパスは引き継ぐ（エフェクトのパラメーターは初期値に戻る）。
+ */
 static VALUE
-SoundBuffer_get_effect_param(VALUE self, VALUE nth)
+SoundBuffer_splice_bang(int argc, VALUE *argv, VALUE self)
 {
-  DWORD idx;
+  DWORD   start, frames, total, insert = 0, i, count, argn;
+  DWORD   effect_flag;
+  LPBYTE  ptrs[4], dst;
+  LPDWORD offsets;
+  LPSBBUFFER pBuffer;
+  HRESULT hr;
+  VALUE   vrange, vother, removed, vtmp;
+  struct SoundBuffer *sts[4];
+  struct SoundBuffer *tmp;
   struct SoundBuffer *st = get_st(self);
 
-  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
-  idx = NUM2UINT(nth);
-  if (idx > st->effect_count) rb_raise(rb_eRangeError, "effect index error");
-  switch (st->effect_nums[idx]) {
-    case FX_GARGLE:
-      return SoundBuffer_GetAllParameters_DSFXGargle(self, nth);
-      break;
-    case FX_CHORUS:
-      return SoundBuffer_GetAllParameters_DSFXChorus(self, nth);
-      break;
-    case FX_FLANGER:
-      return SoundBuffer_GetAllParameters_DSFXFlanger(self, nth);
-      break;
-    case FX_ECHO:
-      return SoundBuffer_GetAllParameters_DSFXEcho(self, nth);
-      break;
-    case FX_DISTORTION:
-      return SoundBuffer_GetAllParameters_DSFXDistortion(self, nth);
-      break;
-    case FX_COMPRESSOR:
-      return SoundBuffer_GetAllParameters_DSFXCompressor(self, nth);
-      break;
-    case FX_PARAM_EQ:
-      return SoundBuffer_GetAllParameters_DSFXParamEq(self, nth);
-      break;
-    case FX_I3DL2_REVERB:
-      return SoundBuffer_GetAllParameters_DSFXI3DL2Reverb(self, nth);
-      break;
-    case FX_WAVES_REVERB:
-      return SoundBuffer_GetAllParameters_DSFXWavesReverb(self, nth);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "not valid value");
-      break;
+  rb_scan_args(argc, argv, "11", &vrange, &vother);
+  if (st->copy_flag || st->origin != self) rb_raise(eSoundBufferError, "copied object can not be resized");
+  if (st->stream) rb_raise(eSoundBufferError, "stream can not be resized");
+  check_st_idle(st);
+  if (get_playing(st)) rb_raise(eSoundBufferError, "now playing, plz stop");
+  get_frame_range(st, 1, &vrange, &start, &frames);
+  total = (DWORD)(st->buffer_bytes / st->block_align);
+  count = 2;
+  sts[0] = st;
+  if (!NIL_P(vother)) {
+    sts[count++] = get_edit_st(st, vother);
+    insert = (DWORD)(sts[2]->buffer_bytes / st->block_align);
+    if (insert > DSBSIZE_MAX / st->block_align - (total - frames)) rb_raise(rb_eRangeError, "buffer size error");
+  }
+  vtmp    = new_buffer_like(self, st, total - frames + insert);
+  sts[1]  = tmp = get_st(vtmp);
+  removed = frames ? new_buffer_like(self, st, frames) : Qnil;
+  if (frames) sts[count++] = get_st(removed);
+  // 自動変化で動いた値を写しに入れてから引き継ぐ
+  refresh_st_params(st, st->param_auto);
+
+  edit_lock(count, sts, ptrs);
+  dst = ptrs[1];
+  memcpy(dst, ptrs[0], start * st->block_align);
+  dst += start * st->block_align;
+  if (insert) {
+    memcpy(dst, ptrs[2], insert * st->block_align);
+    dst += insert * st->block_align;
+  }
+  memcpy(dst, ptrs[0] + (start + frames) * st->block_align, (total - start - frames) * st->block_align);
+  if (frames) memcpy(ptrs[count - 1], ptrs[0] + start * st->block_align, frames * st->block_align);
+  edit_unlock(count, sts, ptrs);
+
+  // 作ったバッファーと入れ替えて、古いほうを解放する
+  pBuffer           = st->pBuffer;
+  st->pBuffer       = tmp->pBuffer;
+  tmp->pBuffer      = pBuffer;
+  st->pBuffer->lpStats  = st->stats;
+  tmp->pBuffer->lpStats = tmp->stats;
+  tmp->buffer_bytes = st->buffer_bytes;
+  st->buffer_bytes  = (total - frames + insert) * st->block_align;
+  effect_flag       = st->effect_flag;
+  st->effect_flag   = tmp->effect_flag;
+  tmp->effect_flag  = effect_flag;
+  SoundBuffer_release(tmp);
+
+  // 新しいバッファーは既定値なので、写しの音量・パン・周波数は次のplayで送る。自動変化は引き継がない
+  st->param_dirty   = PARAM_VOLUME | PARAM_PAN | PARAM_FREQUENCY;
+  st->param_auto    = 0;
+  // 予定は古いバッファーと一緒に消えた
+  st->param_sched   = 0;
+  st->sched_flag    = 0;
+  if (!st->effect_flag) clear_st_effect(st);
+  else if (st->effect_count) {
+    hr = st->pBuffer->lpVtbl->SetFX(st->pBuffer, st->effect_count, st->effect_nums);
+    for (i = 0; SUCCEEDED(hr) && i < st->effect_count; i++) {
+      if (st->effect_bypass[i]) hr = st->pBuffer->lpVtbl->SetFXBypass(st->pBuffer, i, TRUE);
+    }
+    if (FAILED(hr)) {
+      clear_st_effect(st);
+      to_raise_an_exception(hr);
+    }
   }
+  // ループ区間と通知位置は新しい大きさに収める
+  if (st->loop_end  >= st->buffer_bytes) st->loop_end   = (DWORD)st->buffer_bytes - st->block_align;
+  if (st->loop_start > st->loop_end)     st->loop_start = 0;
+  offsets = ALLOCA_N(DWORD, st->event_count);
+  for (i = argn = 0; i + EVENT_PRESET < st->event_count; i++) {
+    if (st->event_offsets[i] < st->buffer_bytes) offsets[argn++] = st->event_offsets[i];
+  }
+  create_st_event(st, argn, offsets);
+  sync_loop(st);
+  return removed;
 }
-//
-//
-//
+
+/*
+ * 統計
+ * SoundBuffer.stats_enabled = trueにすると、書き込み時間、通知から起床までの遅れ、
+ * ループのつなぎ目の誤差、アンダーラン、バックエンドの呼び出し回数を数える。
+ * 時間はナノ秒、つなぎ目はフレーム。ヒストグラムのbuckets[i]は2**(i-1)以上2**i未満（buckets[0]は0）。
+ */
 static VALUE
-SoundBuffer_set_effect_param(int argc, VALUE *argv, VALUE self)
+histogram_to_hash(const SBHISTOGRAM *h)
 {
-  DWORD idx;
-  struct SoundBuffer *st = get_st(self);
+  VALUE hash = rb_hash_new(), buckets;
+  DWORD i, n;
+
+  // 後ろの0は省く
+  for (n = SB_STATS_BUCKETS; n > 0 && h->buckets[n - 1] == 0; n--);
+  buckets = rb_ary_new_capa(n);
+  for (i = 0; i < n; i++) rb_ary_push(buckets, ULL2NUM(h->buckets[i]));
+  rb_hash_aset(hash, ID2SYM(rb_intern("count")),   ULL2NUM(h->count));
+  rb_hash_aset(hash, ID2SYM(rb_intern("min")),     ULL2NUM(h->min));
+  rb_hash_aset(hash, ID2SYM(rb_intern("max")),     ULL2NUM(h->max));
+  rb_hash_aset(hash, ID2SYM(rb_intern("mean")),    DBL2NUM(h->count ? (double)h->sum / h->count : 0.0));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p50")),     ULL2NUM(sb_histogram_percentile(h, 50.0)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p90")),     ULL2NUM(sb_histogram_percentile(h, 90.0)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("p99")),     ULL2NUM(sb_histogram_percentile(h, 99.0)));
+  rb_hash_aset(hash, ID2SYM(rb_intern("buckets")), buckets);
+  return hash;
+}
 
-  if (!st->effect_flag) rb_raise(rb_eNotImpError, "this object is not effect support");
-  idx = NUM2UINT(argv[0]);
-  if (idx > st->effect_count) rb_raise(rb_eRangeError, "effect index error");
-  switch (st->effect_nums[idx]) {
-    case FX_GARGLE:
-      return SoundBuffer_SetAllParameters_DSFXGargle(argc, argv, self);
-      break;
-    case FX_CHORUS:
-      return SoundBuffer_SetAllParameters_DSFXChorus(argc, argv, self);
-      break;
-    case FX_FLANGER:
-      return SoundBuffer_SetAllParameters_DSFXFlanger(argc, argv, self);
-      break;
-    case FX_ECHO:
-      return SoundBuffer_SetAllParameters_DSFXEcho(argc, argv, self);
-      break;
-    case FX_DISTORTION:
-      return SoundBuffer_SetAllParameters_DSFXDistortion(argc, argv, self);
-      break;
-    case FX_COMPRESSOR:
-      return SoundBuffer_SetAllParameters_DSFXCompressor(argc, argv, self);
-      break;
-    case FX_PARAM_EQ:
-      return SoundBuffer_SetAllParameters_DSFXParamEq(argc, argv, self);
-      break;
-    case FX_I3DL2_REVERB:
-      return SoundBuffer_SetAllParameters_DSFXI3DL2Reverb(argc, argv, self);
-      break;
-    case FX_WAVES_REVERB:
-      return SoundBuffer_SetAllParameters_DSFXWavesReverb(argc, argv, self);
-      break;
-    default:
-      rb_raise(rb_eTypeError, "not valid value");
-      break;
-  }
+static VALUE
+stats_to_hash(LPSBSTATS stats)
+{
+  SBSTATS s;
+  VALUE   hash = rb_hash_new();
+
+  sb_stats_snapshot(stats, &s);
+  rb_hash_aset(hash, ID2SYM(rb_intern("writes")),      ULL2NUM(s.write_ns.count));
+  rb_hash_aset(hash, ID2SYM(rb_intern("write_bytes")), ULL2NUM(s.write_bytes));
+  rb_hash_aset(hash, ID2SYM(rb_intern("write_ns")),    histogram_to_hash(&s.write_ns));
+  rb_hash_aset(hash, ID2SYM(rb_intern("wakeup_ns")),   histogram_to_hash(&s.wakeup_ns));
+  rb_hash_aset(hash, ID2SYM(rb_intern("seam_frames")), histogram_to_hash(&s.seam_frames));
+  rb_hash_aset(hash, ID2SYM(rb_intern("underruns")),   ULL2NUM(s.underruns));
+  rb_hash_aset(hash, ID2SYM(rb_intern("calls")),       ULL2NUM(s.calls));
+  return hash;
 }
 
 /*
- * class singleton methods
+ * SoundBuffer.stats_enabled = true or false
+ * 有効にした後に作ったバッファーと、有効にした後でwrite・wait・statsを呼んだバッファーを数える。
  */
 static VALUE
-SoundBuffer_c_get_format(VALUE self)
+SoundBuffer_c_set_stats_enabled(VALUE self, VALUE flag)
 {
-  WAVEFORMATEX  pcmwf;
-  DWORD         wSizeWritten;
-  HRESULT       hr;
-
-  hr = g_pDSBuffer->lpVtbl->GetFormat(g_pDSBuffer, NULL, 0, &wSizeWritten);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  if (wSizeWritten != sizeof(WAVEFORMATEX)) rb_raise(eSoundBufferError, "not support foramt");
-  hr = g_pDSBuffer->lpVtbl->GetFormat(g_pDSBuffer, &pcmwf, sizeof(WAVEFORMATEX), NULL);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return rb_ary_new_from_args(3,  UINT2NUM((DWORD)pcmwf.nChannels),
-                                  UINT2NUM(       pcmwf.nSamplesPerSec),
-                                  UINT2NUM((DWORD)pcmwf.wBitsPerSample));
+  sb_stats_enabled = RTEST(flag) ? 1 : 0;
+  return flag;
 }
 
 static VALUE
-SoundBuffer_c_set_format(VALUE self, VALUE vchannels, VALUE vsamples_per_sec, VALUE vbits_per_sample)
+SoundBuffer_c_get_stats_enabled(VALUE self)
 {
-  WAVEFORMATEX  pcmwf;
-  HRESULT       hr;
-  WORD          channels, bits_per_sample;
-  DWORD         samples_per_sec;
+  return sb_stats_enabled ? Qtrue : Qfalse;
+}
 
-  channels        = (WORD)NUM2UINT(vchannels);
-  if (channels != 1 && channels != 2) rb_raise(rb_eRangeError, "channels arguments 1 and 2 only possible");
-  samples_per_sec =       NUM2UINT(vsamples_per_sec);
-  if (samples_per_sec < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < samples_per_sec) rb_raise(rb_eRangeError, "samples_per_sec argument can be only DSBFREQUENCY_MIN-DSBFREQUENCY_MAX");
-  bits_per_sample = (WORD)NUM2UINT(vbits_per_sample);
-  if (bits_per_sample != 8 && bits_per_sample != 16) rb_raise(rb_eRangeError, "bits_per_sample arguments 8 and 16 only possible");
+/*
+ * SoundBuffer.stats -> hash
+ * すべてのバッファーとミキサーのシンクを合わせた統計
+ */
+static VALUE
+SoundBuffer_c_stats(VALUE self)
+{
+  return stats_to_hash(NULL);
+}
 
-  pcmwf.wFormatTag      = WAVE_FORMAT_PCM;
-  pcmwf.nChannels       = channels;
-  pcmwf.nSamplesPerSec  = samples_per_sec;
-  pcmwf.wBitsPerSample  = bits_per_sample;
-  pcmwf.nBlockAlign     = bits_per_sample / 8 * channels;
-  pcmwf.nAvgBytesPerSec = samples_per_sec * pcmwf.nBlockAlign;
-  pcmwf.cbSize          = 0;
-  hr = g_pDSBuffer->lpVtbl->SetFormat(g_pDSBuffer, &pcmwf);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return self;
+static VALUE
+SoundBuffer_c_reset_stats(VALUE self)
+{
+  sb_stats_reset(NULL);
+  return Qnil;
 }
 
+/*
+ * SoundBuffer#stats -> hash
+ * dupしたバッファーはそれぞれ別に数える
+ */
 static VALUE
-SoundBuffer_c_get_volume(VALUE self)
+SoundBuffer_stats(VALUE self)
 {
-  HRESULT hr;
-  long    volume;
+  struct SoundBuffer *st = get_st(self);
 
-  hr = g_pDSBuffer->lpVtbl->GetVolume(g_pDSBuffer, &volume);
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return INT2NUM(volume);
+  if (SB_STATS_ON) get_st_stats(st);
+  if (!st->stats) {
+    SBSTATS empty;
+
+    memset(&empty, 0, sizeof(empty));
+    return stats_to_hash(&empty);
+  }
+  return stats_to_hash(st->stats);
 }
 
 static VALUE
-SoundBuffer_c_set_volume(VALUE self, VALUE vvolume)
+SoundBuffer_reset_stats(VALUE self)
 {
-  HRESULT hr;
+  struct SoundBuffer *st = get_st(self);
 
-  hr = g_pDSBuffer->lpVtbl->SetVolume(g_pDSBuffer, NUM2INT(vvolume));
-  if (hr == DSERR_INVALIDPARAM) rb_raise(rb_eRangeError, "DSERR_INVALIDPARAM error");
-  if (FAILED(hr)) to_raise_an_exception(hr);
-  return vvolume;
+  if (st->stats) sb_stats_reset(st->stats);
+  return self;
 }
 
 // Rubyのクラス定義
@@ -1885,6 +5499,26 @@ Init_SoundBuffer(void)
   rb_define_singleton_method(cSoundBuffer, "set_format", SoundBuffer_c_set_format,   3);
   rb_define_singleton_method(cSoundBuffer, "get_volume", SoundBuffer_c_get_volume,   0);
   rb_define_singleton_method(cSoundBuffer, "set_volume", SoundBuffer_c_set_volume,   1);
+  rb_define_singleton_method(cSoundBuffer, "backend",    SoundBuffer_c_get_backend,  0);
+  rb_define_singleton_method(cSoundBuffer, "live_effect?", SoundBuffer_c_get_live_effect, 0);
+  rb_define_singleton_method(cSoundBuffer, "render_mix", SoundBuffer_c_render_mix,  -1);
+  rb_define_singleton_method(cSoundBuffer, "apply",      SoundBuffer_c_apply,       -1);
+  rb_define_singleton_method(cSoundBuffer, "sample_clock", SoundBuffer_c_sample_clock, 0);
+  rb_define_singleton_method(cSoundBuffer, "schedule",     SoundBuffer_c_schedule,    -1);
+  rb_define_singleton_method(cSoundBuffer, "unschedule",   SoundBuffer_c_unschedule,  -1);
+  rb_define_singleton_method(cSoundBuffer, "scheduled",    SoundBuffer_c_scheduled,   -1);
+  rb_define_singleton_method(cSoundBuffer, "mixer_isa",  SoundBuffer_c_get_mixer_isa, 0);
+  rb_define_singleton_method(cSoundBuffer, "load",         SoundBuffer_c_load,         -1);
+  rb_define_singleton_method(cSoundBuffer, "tone",         SoundBuffer_c_tone,         -1);
+  rb_define_singleton_method(cSoundBuffer, "sequence",     SoundBuffer_c_sequence,     -1);
+  rb_define_singleton_method(cSoundBuffer, "wait_any",     SoundBuffer_c_wait_any,     -1);
+  rb_define_singleton_method(cSoundBuffer, "stats_enabled=", SoundBuffer_c_set_stats_enabled, 1);
+  rb_define_singleton_method(cSoundBuffer, "stats_enabled?", SoundBuffer_c_get_stats_enabled, 0);
+  rb_define_singleton_method(cSoundBuffer, "stats",          SoundBuffer_c_stats,             0);
+  rb_define_singleton_method(cSoundBuffer, "reset_stats",    SoundBuffer_c_reset_stats,       0);
+  rb_define_singleton_method(cSoundBuffer, "convert",      SoundBuffer_c_convert,      -1);
+  rb_define_singleton_method(cSoundBuffer, "interleave",   SoundBuffer_c_interleave,   -1);
+  rb_define_singleton_method(cSoundBuffer, "deinterleave", SoundBuffer_c_deinterleave, -1);
 
   rb_define_method(cSoundBuffer, "initialize",        SoundBuffer_initialize,       -1);
   rb_define_method(cSoundBuffer, "initialize_copy",   SoundBuffer_initialize_copy,   1);
@@ -1902,6 +5536,7 @@ Init_SoundBuffer(void)
   rb_define_method(cSoundBuffer, "play",              SoundBuffer_play,              0);
   rb_define_method(cSoundBuffer, "playing?",          SoundBuffer_playing,           0);
   rb_define_method(cSoundBuffer, "repeat",            SoundBuffer_repeat,            0);
+  rb_define_method(cSoundBuffer, "render",            SoundBuffer_render,           -1);
   rb_define_method(cSoundBuffer, "repeating?",        SoundBuffer_repeating,         0);
   rb_define_method(cSoundBuffer, "size",              SoundBuffer_size,              0);
   rb_define_method(cSoundBuffer, "stop",              SoundBuffer_stop,              0);
@@ -1910,11 +5545,18 @@ Init_SoundBuffer(void)
   rb_define_method(cSoundBuffer, "total",             SoundBuffer_total,             0);
   rb_define_method(cSoundBuffer, "write",             SoundBuffer_write,            -1);
   rb_define_method(cSoundBuffer, "effectable?",       SoundBuffer_get_effectable,    0);
+  rb_define_method(cSoundBuffer, "seamless?",         SoundBuffer_get_seamless,      0);
+  rb_define_method(cSoundBuffer, "stats",             SoundBuffer_stats,             0);
+  rb_define_method(cSoundBuffer, "reset_stats",       SoundBuffer_reset_stats,       0);
 
   rb_define_method(cSoundBuffer, "channels",          SoundBuffer_get_channels,          0);
   rb_define_method(cSoundBuffer, "samples_per_sec",   SoundBuffer_get_samples_per_sec,   0);
   rb_define_method(cSoundBuffer, "bits_per_sample",   SoundBuffer_get_bits_per_sample,   0);
   rb_define_method(cSoundBuffer, "block_align",       SoundBuffer_get_block_align,       0);
+  rb_define_method(cSoundBuffer, "float?",            SoundBuffer_is_float,              0);
+  rb_define_method(cSoundBuffer, "channel_mask",      SoundBuffer_get_channel_mask,      0);
+  rb_define_attr(cSoundBuffer, "cue_points", 1, 0);
+  rb_define_attr(cSoundBuffer, "info",       1, 0);
   rb_define_method(cSoundBuffer, "avg_bytes_per_sec", SoundBuffer_get_avg_bytes_per_sec, 0);
 
   rb_define_method(cSoundBuffer, "loop?",             SoundBuffer_get_loop,          0);
@@ -1938,10 +5580,29 @@ Init_SoundBuffer(void)
   rb_define_method(cSoundBuffer, "set_pan",           SoundBuffer_set_pan,           1);
   rb_define_method(cSoundBuffer, "get_frequency",     SoundBuffer_get_frequency,     0);
   rb_define_method(cSoundBuffer, "set_frequency",     SoundBuffer_set_frequency,     1);
+  rb_define_method(cSoundBuffer, "set_params",        SoundBuffer_set_params,       -1);
+  rb_define_method(cSoundBuffer, "ramp",              SoundBuffer_ramp,             -1);
+  rb_define_method(cSoundBuffer, "envelope",          SoundBuffer_envelope,         -1);
+  rb_define_method(cSoundBuffer, "cancel_ramp",       SoundBuffer_cancel_ramp,      -1);
+  rb_define_method(cSoundBuffer, "ramping?",          SoundBuffer_ramping,          -1);
+  rb_define_method(cSoundBuffer, "direction",         SoundBuffer_get_direction,     0);
+  rb_define_method(cSoundBuffer, "direction=",        SoundBuffer_set_direction,     1);
+  rb_define_method(cSoundBuffer, "reverse!",          SoundBuffer_reverse_bang,      0);
+  rb_define_method(cSoundBuffer, "slice",             SoundBuffer_slice,            -1);
+  rb_define_method(cSoundBuffer, "concat",            SoundBuffer_concat,           -1);
+  rb_define_method(cSoundBuffer, "splice!",           SoundBuffer_splice_bang,      -1);
+  rb_define_method(cSoundBuffer, "fill_silence",      SoundBuffer_fill_silence,     -1);
+  rb_define_method(cSoundBuffer, "copy_from",         SoundBuffer_copy_from,        -1);
+  rb_define_method(cSoundBuffer, "read_into",         SoundBuffer_read_into,        -1);
   rb_define_method(cSoundBuffer, "get_effect",        SoundBuffer_get_effect,        0);
   rb_define_method(cSoundBuffer, "set_effect",        SoundBuffer_set_effect,       -1);
   rb_define_method(cSoundBuffer, "get_effect_param",  SoundBuffer_get_effect_param,  1);
   rb_define_method(cSoundBuffer, "set_effect_param",  SoundBuffer_set_effect_param, -1);
+  rb_define_method(cSoundBuffer, "get_effect_bypass", SoundBuffer_get_effect_bypass, 1);
+  rb_define_method(cSoundBuffer, "effect_params_size", SoundBuffer_get_effect_params_size, 0);
+  rb_define_method(cSoundBuffer, "get_effect_params", SoundBuffer_get_effect_params, -1);
+  rb_define_method(cSoundBuffer, "set_effect_params", SoundBuffer_set_effect_params,  1);
+  rb_define_method(cSoundBuffer, "set_effect_bypass", SoundBuffer_set_effect_bypass, 2);
 
   rb_define_alias(cSoundBuffer, "volume",     "get_volume");
   rb_define_alias(cSoundBuffer, "volume=",    "set_volume");
@@ -1954,6 +5615,50 @@ Init_SoundBuffer(void)
   rb_define_alias(cSoundBuffer, "play_pos",   "pcm_pos");
   rb_define_alias(cSoundBuffer, "play_pos=",  "pcm_pos=");
 
+  cStream = rb_define_class_under(cSoundBuffer, "Stream", cSoundBuffer);
+  rb_define_method(cStream, "initialize",  Stream_initialize, -1);
+  rb_define_method(cStream, "push",        Stream_push,        1);
+  rb_define_method(cStream, "play",        Stream_play,        0);
+  rb_define_method(cStream, "stop",        Stream_stop,        0);
+  rb_define_method(cStream, "close",       Stream_close,       0);
+  rb_define_method(cStream, "closed?",     Stream_closed,      0);
+  rb_define_method(cStream, "queued",      Stream_queued,      0);
+  rb_define_method(cStream, "queue_size",  Stream_queue_size,  0);
+  rb_define_method(cStream, "segments",    Stream_segments,    0);
+  rb_define_method(cStream, "underruns",   Stream_underruns,   0);
+  rb_define_alias(cStream, "<<",     "push");
+  rb_define_alias(cStream, "repeat", "play");
+
+  cVoicePool = rb_define_class_under(cSoundBuffer, "VoicePool", rb_cObject);
+  rb_define_alloc_func(cVoicePool, VoicePool_allocate);
+  rb_define_method(cVoicePool, "initialize",  VoicePool_initialize,   2);
+  rb_define_method(cVoicePool, "acquire",     VoicePool_acquire,     -1);
+  rb_define_method(cVoicePool, "play",        VoicePool_play,        -1);
+  rb_define_method(cVoicePool, "release",     VoicePool_release,      1);
+  rb_define_method(cVoicePool, "stop_all",    VoicePool_stop_all,     0);
+  rb_define_method(cVoicePool, "dispose",     VoicePool_dispose,      0);
+  rb_define_method(cVoicePool, "source",      VoicePool_get_source,   0);
+  rb_define_method(cVoicePool, "voices",      VoicePool_get_voices,   0);
+  rb_define_method(cVoicePool, "size",        VoicePool_size,         0);
+  rb_define_method(cVoicePool, "free_count",  VoicePool_free_count,   0);
+  rb_define_method(cVoicePool, "steals",      VoicePool_steals,       0);
+  rb_define_const(cVoicePool, "PRIORITY_MAX", INT2NUM(VOICE_PRIORITY_LEVELS - 1));
+
+  cBufferPool = rb_define_class_under(cSoundBuffer, "Pool", rb_cObject);
+  rb_define_alloc_func(cBufferPool, BufferPool_allocate);
+  rb_define_method(cBufferPool, "initialize",  BufferPool_initialize,   -1);
+  rb_define_method(cBufferPool, "acquire",     BufferPool_acquire,      -1);
+  rb_define_method(cBufferPool, "release",     BufferPool_release,       1);
+  rb_define_method(cBufferPool, "clear",       BufferPool_clear,         0);
+  rb_define_method(cBufferPool, "size",        BufferPool_size,          0);
+  rb_define_method(cBufferPool, "bytes",       BufferPool_bytes,         0);
+  rb_define_method(cBufferPool, "max_bytes",   BufferPool_get_max_bytes, 0);
+  rb_define_method(cBufferPool, "max_bytes=",  BufferPool_set_max_bytes, 1);
+  rb_define_method(cBufferPool, "hits",        BufferPool_hits,          0);
+  rb_define_method(cBufferPool, "misses",      BufferPool_misses,        0);
+  rb_define_method(cBufferPool, "evictions",   BufferPool_evictions,     0);
+  rb_define_method(cBufferPool, "discards",    BufferPool_discards,      0);
+
   /*
    * Consts
    */
@@ -2139,82 +5844,71 @@ Init_SoundBuffer(void)
   rb_define_const(cSoundBuffer, "DSBSIZE_MAX",                                INT2NUM(DSBSIZE_MAX));
   rb_define_const(cSoundBuffer, "DSBSIZE_FX_MIN",                             INT2NUM(DSBSIZE_FX_MIN));
   rb_define_const(cSoundBuffer, "DSBNOTIFICATIONS_MAX",                       INT2NUM(DSBNOTIFICATIONS_MAX));
+  // SoundBuffer.applyのpackedで「変えない」
+  rb_define_const(cSoundBuffer, "PARAM_KEEP",                                 INT2NUM(PARAM_KEEP));
 }
 
 // 終了時に実行されるENDブロックに登録する関数
 static void SoundBuffer_shutdown(VALUE obj)
 {
-  g_pDSBuffer->lpVtbl->Release(g_pDSBuffer);
+  // shutduwn+すべてのSoundTestが解放されたらデバイス解放
   g_refcount--;
+  if (g_refcount == 0) g_pDevice->lpVtbl->Release(g_pDevice);
+}
 
-  // shutduwn+すべてのSoundTestが解放されたらDirectSound解放
-  g_refcount--;
-  if (g_refcount == 0) {
-    g_pDSound->lpVtbl->Release(g_pDSound);
-    CoUninitialize();
+/*
+ * バックエンドの選択
+ * 環境変数SOUNDBUFFER_BACKENDで指定する。指定が無ければDirectSoundが使えればDirectSound、
+ * 使えなければソフトウェアー・バックエンド（ヌル・シンク）を使う。
+ */
+static HRESULT
+create_device(LPSBDEVICE *device)
+{
+  const char *name = getenv("SOUNDBUFFER_BACKEND");
+
+  if (name == NULL || *name == '\0') {
+#ifdef HAVE_DSOUND_H
+    name = "dsound";
+#else
+    name = "soft";
+#endif
   }
+#ifdef HAVE_DSOUND_H
+  if (strcmp(name, "dsound") == 0) return SBDSoundCreate(device);
+  if (strcmp(name, "mix") == 0) {
+    LPSBSINK  sink;
+    HRESULT   hr;
+
+    hr = SBDSoundSinkCreate(&sink);
+    if (FAILED(hr)) return hr;
+    return SBSoftCreate(device, TRUE, sink);
+  }
+#endif
+  if (strcmp(name, "soft") == 0 || strcmp(name, "null") == 0) return SBSoftCreate(device, TRUE, NULL);
+  if (strcmp(name, "offline") == 0) return SBSoftCreate(device, FALSE, NULL);
+  rb_raise(eSoundBufferError, "unknown backend: %s", name);
+  return DSERR_NODRIVER;
 }
 
 void Init_soundbuffer(void)
 {
-  HWND          hWnd;
-  HINSTANCE     hInstance;
-  WNDCLASSEX    wcex;
-  DSBUFFERDESC  desc;
   HRESULT       hr;
 
-  // COM初期化
-  CoInitialize(NULL);
-
-  // ウィンドウクラス設定
-  hInstance = (HINSTANCE)GetModuleHandle(NULL);
-  wcex.cbSize        = sizeof(WNDCLASSEX);
-  wcex.style         = 0;
-  wcex.lpfnWndProc   = DefWindowProc;
-  wcex.cbClsExtra    = 0;
-  wcex.cbWndExtra    = 0;
-  wcex.hInstance     = hInstance;
-  wcex.hIcon         = 0;
-  wcex.hIconSm       = 0;
-  wcex.hCursor       = 0;
-  wcex.hbrBackground = 0;
-  wcex.lpszMenuName  = NULL;
-  wcex.lpszClassName = "SoundBuffer";
-
-  // ウィンドウ生成
-  RegisterClassEx(&wcex);
-  hWnd = CreateWindow("SoundBuffer", "", 0, 0, 0, 0, 0, 0, NULL, hInstance, NULL);
-
-  // DirectSoundオブジェクト生成
-  hr = DirectSoundCreate8(&DSDEVID_DefaultPlayback, &g_pDSound, NULL);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "DirectSoundCreate8 error");
-
-  // 協調レベル設定
-  hr = g_pDSound->lpVtbl->SetCooperativeLevel(g_pDSound, hWnd, DSSCL_PRIORITY);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "SetCooperativeLevel error");
-
-  g_refcount++;
+  // SoundTestクラス生成
+  Init_SoundBuffer();
 
-  /*
-   *  get primarybuffer
-   */
-  desc.dwSize           = sizeof(DSBUFFERDESC);
-  desc.dwFlags          = DSBCAPS_PRIMARYBUFFER | DSBCAPS_CTRLVOLUME;
-  desc.dwBufferBytes    = 0;
-  desc.dwReserved       = 0;
-  desc.lpwfxFormat      = NULL;
-  desc.guid3DAlgorithm  = DS3DALG_DEFAULT;
+  // ミキサーとフォーマット変換のカーネルを選ぶ
+  sb_mix_init(NULL);
+  sb_stats_init();
 
-  hr = g_pDSound->lpVtbl->CreateSoundBuffer(g_pDSound, &desc, &g_pDSBuffer, NULL);
-  if (FAILED(hr)) rb_raise(eSoundBufferError, "get PrimaryBuffer error");
+  // デバイス生成
+  hr = create_device(&g_pDevice);
+  if (FAILED(hr)) rb_raise(eSoundBufferError, "create device error");
 
   g_refcount++;
 
   // 終了時に実行する関数
   rb_set_end_proc(SoundBuffer_shutdown, Qnil);
-
-  // SoundTestクラス生成
-  Init_SoundBuffer();
 }
 
 static void
@@ -3,10 +3,25 @@ require_relative 'soundbuffer.so'
 module Beep
   extend self
 
-  @@beep = SoundBuffer.new(("\xff" * 24 + "\x00" * 24), 1, 48000, 8)
+  # 鳴らしっぱなしの音は波形ごとにTONE_HZで1秒ぶんだけSoundBuffer.toneで描いておき、
+  # 周波数を変えて使い回す。beep_onを続けて呼んでも描き直さないので、音程を動かしてもクリックが出ない
+  TONE_HZ = 1000
+
+  @@wave  = :square
+  @@tones = {}   # 波形 => ループするバッファー
+  @@beep  = nil
+
+  def beep_wave
+    @@wave
+  end
+
+  # :sine :square :saw :triangle :noise
+  def beep_wave=(wave)
+    @@wave = wave
+  end
 
   def beep(sec = 1, hz = 1000, vol = 0)
-    @@beep.stop_and_play { beep_on(hz, vol) }
+    beep_on(hz, vol)
     sleep sec
     beep_off
     self
@@ -24,26 +39,34 @@ module Beep
   end
 
   def beep_on(hz = 1000, vol = 0)
-    @@beep.set_frequency(hz * 48)
-    @@beep.set_volume(vol)
-    @@beep.repeat
+    sb = beep_tone
+    sb.set_frequency(beep_frequency(sb, hz))
+    sb.set_volume(vol)
+    beep_start(sb, true)
     self
   end
 
+  # from_hzからto_hzへsec秒で音程を滑らかに動かす。途中の周波数はネイティブ側で変わる
+  def beep_sweep(sec, from_hz, to_hz, vol = 0)
+    beep_on(from_hz, vol)
+    @@beep.ramp(:frequency, beep_frequency(@@beep, to_hz), sec, curve: :exponential)
+    sleep sec
+    beep_off
+  end
+
   def beep_off
-    @@beep.stop
+    @@beep.stop if @@beep
     self
   end
 
   def beeping?
-    @@beep.playing?
+    @@beep ? @@beep.playing? : false
   end
 
+  # 音符の並びは1本のバッファーに描くので、音の切り替わりはサンプル単位で正確になる
   def beeps(*args)
-    args.each_slice(3) { |(sec, hz, vol)|
-      beep_on(hz, vol)
-      sleep sec
-    }
+    beep_start(SoundBuffer.sequence(args, wave: @@wave))
+    sleep args.each_slice(3).sum { |(sec)| sec }
     beep_off
     self
   end
@@ -58,4 +81,28 @@ module Beep
     end
     self
   end
+
+  private
+
+  def beep_tone
+    @@tones[@@wave] ||= SoundBuffer.tone(@@wave, TONE_HZ, 1, loop: true)
+  end
+
+  def beep_frequency(sb, hz)
+    (sb.samples_per_sec * hz / TONE_HZ.to_f).round
+  end
+
+  # 鳴っていたものを止めて差し替える。beepsで描いたバッファーはここで解放する
+  def beep_start(sb, loop = false)
+    old, @@beep = @@beep, sb
+    if old && !old.equal?(sb)
+      old.stop
+      old.dispose unless @@tones.value?(old)
+    end
+    if loop
+      sb.repeat unless sb.playing?
+    else
+      sb.play
+    end
+  end
 end
@@ -0,0 +1,266 @@
+# 拡張ライブラリーのよく使う経路のベンチマーク。結果をJSONで出す。
+# サウンドカードはいらない（既定はsoftバックエンド）。
+#
+#   ruby extconf.rb && make && ruby bench/bench.rb > bench.json
+#   ruby bench/bench.rb --quick --only write
+#
+# 別の場所でビルドしたときはSOUNDBUFFER_BUILD_DIRにsoundbuffer.soのあるディレクトリーを指定する。
+require "json"
+require "optparse"
+
+opts = { scale: 1.0, only: nil, output: nil }
+OptionParser.new do |o|
+  o.banner = "usage: ruby bench/bench.rb [options]"
+  o.on("--quick", "回数を1/10にする")                  { opts[:scale] = 0.1 }
+  o.on("--scale N", Float, "回数をN倍にする")           { |v| opts[:scale] = v }
+  o.on("--only REGEXP", "名前が一致するものだけ測る")    { |v| opts[:only] = Regexp.new(v) }
+  o.on("-o", "--output FILE", "標準出力ではなくFILEに書く") { |v| opts[:output] = v }
+end.parse!
+
+ENV["SOUNDBUFFER_BACKEND"] ||= "soft"
+require File.join(ENV["SOUNDBUFFER_BUILD_DIR"] || File.expand_path("..", __dir__), "soundbuffer.so")
+
+RATE    = 48000
+CHANNEL = 2
+BITS    = 16
+ALIGN   = CHANNEL * BITS / 8
+SECOND  = RATE * ALIGN
+
+def now
+  Process.clock_gettime(Process::CLOCK_MONOTONIC)
+end
+
+$results = []
+
+def label(name, params)
+  params.empty? ? name : "#{name}(#{params.map { |k, v| "#{k}=#{v}" }.join(",")})"
+end
+
+# n回ブロックを呼んで測る。ブロックの戻り値はbytesに足す（スループット用）
+def bench(name, n, opts, **params)
+  return if opts[:only] && opts[:only] !~ name
+  n = [(n * opts[:scale]).round, 1].max
+  yield 1 # 暖機
+  GC.start
+  gc    = GC.count
+  bytes = 0
+  t0    = now
+  n.times { |i| bytes += yield(i).to_i }
+  sec   = now - t0
+  r = { name: name, params: params, iterations: n, seconds: sec.round(6),
+        ops_per_sec: (n / sec).round(1), ns_per_op: (sec * 1e9 / n).round(1), gc_runs: GC.count - gc }
+  r[:bytes_per_sec] = (bytes / sec).round if bytes > 0
+  $results << r
+  warn format("%-36s %12.1f ops/s %12.1f ns/op", label(name, params), r[:ops_per_sec], r[:ns_per_op])
+end
+
+# 実時間で測るもの。ブロックは経過秒数を渡されて、1回ぶんの処理をしたら真を返す
+def bench_for(name, seconds, opts, **params)
+  return if opts[:only] && opts[:only] !~ name
+  seconds = seconds * [opts[:scale], 1.0].min
+  r = { name: name, params: params }
+  count = 0
+  t0 = now
+  count += 1 while yield && now - t0 < seconds
+  sec = now - t0
+  r.merge!(iterations: count, seconds: sec.round(6), ops_per_sec: (count / sec).round(1))
+  $results << r
+  warn format("%-36s %12.1f ops/s", label(name, params), r[:ops_per_sec])
+  r
+end
+
+one_sec = "\0".b * SECOND
+
+# 生成と解放
+bench("initialize_dispose", 2000, opts, bytes: SECOND / 10) do
+  SoundBuffer.new(SECOND / 10, CHANNEL, RATE, BITS).dispose
+  0
+end
+
+bench("initialize_string_dispose", 500, opts, bytes: SECOND) do
+  SoundBuffer.new(one_sec, CHANNEL, RATE, BITS).dispose
+  0
+end
+
+# SoundBuffer::Poolから借りて返す。2回目からは作り直さない
+pool = SoundBuffer::Pool.new
+bench("pool_acquire_release", 2000, opts, bytes: SECOND / 10) do
+  pool.release(pool.acquire(SECOND / 10, CHANNEL, RATE, BITS))
+  0
+end
+pool.clear
+
+# 複製（DuplicateSoundBuffer）。メモリーは共有する
+src = SoundBuffer.new(one_sec, CHANNEL, RATE, BITS)
+bench("dup_dispose", 2000, opts, bytes: SECOND) do
+  src.dup.dispose
+  0
+end
+
+# 書き込みのスループット
+[64, 1024, 16384, SECOND].each do |chunk|
+  data  = "\1".b * chunk
+  slots = SECOND / chunk
+  bench("write", chunk >= 16384 ? 2000 : 20000, opts, chunk: chunk) do |i|
+    src.write(data, (i % slots) * chunk)
+  end
+end
+
+# 読み出し
+bench("to_s", 200, opts, bytes: SECOND) do
+  src.to_s.bytesize
+end
+
+scratch = "\0".b * 4096
+bench("read_into", 20000, opts, bytes: scratch.bytesize) do
+  src.read_into(scratch, 0)
+end
+
+# 通知位置の設定
+[1, 16, 256].each do |count|
+  frames = (0...count).map { |i| i * (RATE / count) }
+  bench("set_notify", count > 16 ? 500 : 2000, opts, offsets: count) do
+    src.set_notify(*frames)
+    0
+  end
+end
+src.set_notify
+
+# 音量・パン・周波数の呼び出し回数
+bench("volume=", 100000, opts) { |i| src.volume = -(i % 1000); 0 }
+bench("pan=",    100000, opts) { |i| src.pan = (i % 2000) - 1000; 0 }
+bench("frequency=", 100000, opts) { |i| src.frequency = 44100 + (i % 1000); 0 }
+bench("volume",  100000, opts) { src.volume; 0 }
+
+# 多くのバッファーの音量・周波数を1回で変える。同じ値は送らないので2通りの値を交互に使う
+# 止まっているバッファーは値を覚えるだけなので、鳴らしておいてデバイスへ送る分を測る
+voices = Array.new(256) { src.dup.repeat }
+updates = [0, 1].map { |j| voices.map { |v| [v, -1 - j, nil, 44100 + j] } }
+packed  = [0, 1].map { |j| ([-1 - j, SoundBuffer::PARAM_KEEP, 44100 + j] * voices.size).pack("l<*") }
+bench("apply", 2000, opts, buffers: voices.size) { |i| SoundBuffer.apply(updates[i & 1]); 0 }
+bench("apply_packed", 2000, opts, buffers: voices.size) { |i| SoundBuffer.apply(voices, packed[i & 1]); 0 }
+bench("volume=_frequency=_each", 2000, opts, buffers: voices.size) do |i|
+  voices.each { |v| v.volume = -1 - (i & 1); v.frequency = 44100 + (i & 1) }
+  0
+end
+voices.each(&:dispose)
+
+# 音を描く。1秒の和音と、beeps形式の音符を1秒ぶん
+%i[sine square triangle].each do |wave|
+  bench("tone", 200, opts, wave: wave, bytes: SECOND) do
+    SoundBuffer.tone(wave, [262, 330, 392], 1, channels: CHANNEL, samples_per_sec: RATE).dispose
+    SECOND
+  end
+end
+notes = (0...40).flat_map { |i| [0.025, 220 * 2**(i % 12 / 12.0), -(i % 4) * 300] }
+bench("sequence", 200, opts, notes: notes.size / 3, bytes: SECOND) do
+  SoundBuffer.sequence(notes, channels: CHANNEL, samples_per_sec: RATE).dispose
+  SECOND
+end
+
+# 予定を積んで取り消す。積むのはヒープで速いが、取り消しは積んである予定をすべて調べる
+target = src.dup
+[1, 1000].each do |queued|
+  far = SoundBuffer.sample_clock + RATE * 3600
+  (queued - 1).times { |i| SoundBuffer.schedule(at_sample: far + i, buffer: src, action: :volume, args: [0]) }
+  bench("schedule_unschedule", 20000, opts, queued: queued) do |i|
+    SoundBuffer.schedule(at_sample: far - i, buffer: target, action: :pan, args: [0])
+    SoundBuffer.unschedule(target)
+    0
+  end
+  SoundBuffer.unschedule
+end
+target.dispose
+
+# エフェクトをかけたバッファーを256フレームずつレンダリングする（soft・offline）。noneはエフェクト無し
+if %w[soft offline].include?(SoundBuffer.backend)
+  tone  = (0...RATE).flat_map { |i| [(Math.sin(i * 0.0576) * 8000).round] * CHANNEL }.pack("s<*")
+  block = "\0".b * 256 * ALIGN
+  fx_sb = SoundBuffer.new(tone, CHANNEL, RATE, BITS, effect: true)
+  [nil, :FX_GARGLE, :FX_CHORUS, :FX_FLANGER, :FX_ECHO, :FX_DISTORTION,
+   :FX_COMPRESSOR, :FX_PARAM_EQ, :FX_I3DL2_REVERB, :FX_WAVES_REVERB].each do |fx|
+    fx_sb.set_effect(*(fx ? [SoundBuffer.const_get(fx)] : []))
+    fx_sb.repeat
+    bench("render_effect", 20000, opts, fx: fx ? fx.to_s.sub("FX_", "").downcase : "none", frames: 256) do
+      fx_sb.render(256, block)
+      0
+    end
+    fx_sb.stop
+  end
+  # 再生したままバイパスを区切りごとに切り替える。bypassedは素通しにしたまま
+  fx_sb.set_effect(SoundBuffer::FX_WAVES_REVERB)
+  fx_sb.repeat
+  bench("render_effect_bypass", 20000, opts, mode: "toggle", frames: 256) do |i|
+    fx_sb.set_effect_bypass(0, i.odd?)
+    fx_sb.render(256, block)
+    0
+  end
+  fx_sb.set_effect_bypass(0, true)
+  bench("render_effect_bypass", 20000, opts, mode: "bypassed", frames: 256) do
+    fx_sb.render(256, block)
+    0
+  end
+  fx_sb.stop
+  # 3つ並べたエフェクトのパラメーターを毎回すべて送る。packedは1回で、io_bufferは中身を書き換えるだけ
+  # soundbuffer.rbは読まないので、FX*の既定値と詰め方（FX*::PACK）をここに書く
+  chain = [[SoundBuffer::FX_PARAM_EQ, [8000.0, 12.0, 0.0], "f3"],
+           [SoundBuffer::FX_ECHO, [50.0, 50.0, 500.0, 500.0, 0], "f4l"],
+           [SoundBuffer::FX_WAVES_REVERB, [0.0, 0.0, 1000.0, 0.001], "f4"]]
+  fx_sb.set_effect(*chain.map(&:first))
+  bench("effect_params", 20000, opts, mode: "per_slot", slots: chain.size) do
+    chain.each_with_index { |(_, values), idx| fx_sb.set_effect_param(idx, *values) }
+    0
+  end
+  packed = chain.map { |(_, values, pack)| values.pack(pack) }.join
+  bench("effect_params", 20000, opts, mode: "packed", slots: chain.size) do
+    fx_sb.set_effect_params(packed)
+    0
+  end
+  if defined?(IO::Buffer)
+    iob = IO::Buffer.new(fx_sb.effect_params_size)
+    fx_sb.get_effect_params(iob)
+    bench("effect_params", 20000, opts, mode: "io_buffer", slots: chain.size) do |i|
+      iob.set_value(:f32, 8, (i % 12).to_f) # ParamEqのGain
+      fx_sb.set_effect_params(iob)
+      0
+    end
+  end
+  fx_sb.dispose
+end
+
+# waitで起きる回数。100ミリ秒のバッファーに通知を並べてリピート再生する
+if SoundBuffer.backend != "offline"
+  [4, 32].each do |points|
+    frames = RATE / 10
+    sb = SoundBuffer.new(frames * ALIGN, CHANNEL, RATE, BITS)
+    sb.set_notify(*(0...points).map { |i| i * frames / points })
+    SoundBuffer.stats_enabled = true
+    sb.reset_stats
+    sb.repeat
+    r = bench_for("wait", 2.0, opts, notify_per_sec: points * 10) { sb.wait(1000) }
+    if r
+      latency = sb.stats[:wakeup_ns]
+      r[:wakeup_ns] = latency.slice(:p50, :p90, :p99, :max)
+    end
+    SoundBuffer.stats_enabled = false
+    sb.stop
+    sb.dispose
+  end
+end
+src.dispose
+
+report = {
+  suite:     "soundbuffer",
+  ruby:      RUBY_VERSION,
+  platform:  RUBY_PLATFORM,
+  backend:   SoundBuffer.backend,
+  mixer_isa: SoundBuffer.mixer_isa,
+  scale:     opts[:scale],
+  results:   $results,
+}
+json = JSON.pretty_generate(report)
+if opts[:output]
+  File.write(opts[:output], json + "\n")
+else
+  puts json
+end
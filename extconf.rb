@@ -10,10 +10,16 @@ SYSTEM_LIBRARIES = [
   "uuid" # for GUID_NULL
 ]
 
-SYSTEM_LIBRARIES.each do |lib|
-  have_library(lib)
-end
 #have_header("ks.h")
-have_header("dsound.h")
+if have_header("dsound.h")
+  SYSTEM_LIBRARIES.each do |lib|
+    have_library(lib)
+  end
+else
+  # DirectSoundが無い環境ではソフトウェアー・バックエンドのみ
+  have_library("pthread")
+end
+have_func("rb_obj_taint")
+have_header("ruby/io/buffer.h") # read_intoでIO::Bufferに書き込む
 
 create_makefile("soundbuffer")
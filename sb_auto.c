@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sb_backend.h"
+
+BOOL
+sb_auto_valid(DWORD param, DWORD count, LPCSBBREAKPOINT points)
+{
+  static const LONG lo[SBPARAM_COUNT] = { DSBVOLUME_MIN, DSBPAN_LEFT,  DSBFREQUENCY_MIN };
+  static const LONG hi[SBPARAM_COUNT] = { DSBVOLUME_MAX, DSBPAN_RIGHT, DSBFREQUENCY_MAX };
+  DWORD i;
+
+  if (param >= SBPARAM_COUNT) return FALSE;
+  for (i = 0; i < count; i++) {
+    if (points[i].lValue < lo[param] || hi[param] < points[i].lValue) return FALSE;
+    if (points[i].dwCurve > SBCURVE_SMOOTH) return FALSE;
+    if (points[i].dwCurve == SBCURVE_EXPONENTIAL && param != SBPARAM_FREQUENCY) return FALSE;
+  }
+  return TRUE;
+}
+
+BOOL
+sb_auto_set(SBAUTOMATION *a, double current, DWORD count, LPCSBBREAKPOINT points)
+{
+  SBBREAKPOINT *copy = NULL;
+
+  if (count) {
+    copy = malloc(sizeof(SBBREAKPOINT) * count);
+    if (!copy) return FALSE;
+    memcpy(copy, points, sizeof(SBBREAKPOINT) * count);
+  }
+  free(a->points);
+  a->points  = copy;
+  a->count   = count;
+  a->index   = 0;
+  a->elapsed = 0;
+  a->from    = current;
+  a->value   = current;
+  // 長さ0の折れ点はすぐに片付ける
+  sb_auto_advance(a, 0);
+  return TRUE;
+}
+
+void
+sb_auto_clear(SBAUTOMATION *a)
+{
+  free(a->points);
+  a->points = NULL;
+  a->count  = a->index = 0;
+}
+
+DWORD
+sb_auto_span(const SBAUTOMATION *a)
+{
+  return sb_auto_active(a) ? a->points[a->index].dwFrames - a->elapsed : 0;
+}
+
+DWORD
+sb_auto_remaining(const SBAUTOMATION *a)
+{
+  DWORD i, n = sb_auto_span(a);
+
+  for (i = a->index + 1; i < a->count; i++) n += a->points[i].dwFrames;
+  return n;
+}
+
+static double
+auto_curve(double from, double to, double t, DWORD curve)
+{
+  switch (curve) {
+  case SBCURVE_EXPONENTIAL:
+    if (from > 0.0 && to > 0.0) return from * pow(to / from, t);
+    break;
+  case SBCURVE_SMOOTH:
+    t = (1.0 - cos(t * 3.14159265358979323846)) * 0.5;
+    break;
+  }
+  return from + (to - from) * t;
+}
+
+double
+sb_auto_advance(SBAUTOMATION *a, DWORD frames)
+{
+  const SBBREAKPOINT *p;
+  DWORD k;
+
+  while (sb_auto_active(a)) {
+    p = &a->points[a->index];
+    k = p->dwFrames - a->elapsed;
+    if (frames < k) {
+      a->elapsed += frames;
+      a->value    = auto_curve(a->from, p->lValue, (double)a->elapsed / p->dwFrames, p->dwCurve);
+      break;
+    }
+    // この区間は終わり。端数は次の区間へ
+    frames    -= k;
+    a->value   = a->from = p->lValue;
+    a->elapsed = 0;
+    a->index++;
+  }
+  return a->value;
+}
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * パラメーターの自動変化（ランプとエンベロープ）。
+ * 折れ点を順にたどり、今の値から次の折れ点の値へ指定のフレーム数で曲線に沿って動かす。
+ * フレームはデバイスの出力のフレームで、進めるのはバックエンドのミキサーかサービス・スレッド。
+ * 排他は呼び出し側で行う。
+ */
+#ifndef SB_AUTO_H
+#define SB_AUTO_H
+
+#include "sb_os.h"
+
+// 動かすパラメーター
+#define SBPARAM_VOLUME      0
+#define SBPARAM_PAN         1
+#define SBPARAM_FREQUENCY   2
+#define SBPARAM_COUNT       3
+
+// 曲線
+#define SBCURVE_LINEAR      0   // パラメーターの単位で直線（音量は1/100dBなので振幅では指数）
+#define SBCURVE_EXPONENTIAL 1   // 比が一定。両端とも正の値のときだけ（周波数）
+#define SBCURVE_SMOOTH      2   // 両端でなめらかなS字（余弦）
+
+typedef struct SBBreakpoint {
+  DWORD   dwFrames;   // 前の折れ点からのフレーム数。0ならすぐにその値になる
+  LONG    lValue;
+  DWORD   dwCurve;
+} SBBREAKPOINT, *LPSBBREAKPOINT;
+typedef const SBBREAKPOINT *LPCSBBREAKPOINT;
+
+typedef struct SBAutomation {
+  SBBREAKPOINT *points;
+  DWORD         count;
+  DWORD         index;    // 今向かっている折れ点
+  DWORD         elapsed;  // 今の区間で進んだフレーム数
+  double        from;     // 今の区間の始まりの値
+  double        value;
+} SBAUTOMATION;
+
+// パラメーターの範囲と曲線を調べる
+BOOL    sb_auto_valid(DWORD param, DWORD count, LPCSBBREAKPOINT points);
+// 今の値currentから始める。countが0なら止めるだけ。メモリーが足りなければFALSE
+BOOL    sb_auto_set(SBAUTOMATION *, double current, DWORD count, LPCSBBREAKPOINT points);
+void    sb_auto_clear(SBAUTOMATION *);
+#define sb_auto_active(a) ((a)->index < (a)->count)
+// 今の区間が終わるまでのフレーム数。止まっていれば0
+DWORD   sb_auto_span(const SBAUTOMATION *);
+// 最後の折れ点までのフレーム数
+DWORD   sb_auto_remaining(const SBAUTOMATION *);
+// framesだけ進めて、その時点の値を返す。区間の終わりを越えたぶんは次の区間に持ち越す
+double  sb_auto_advance(SBAUTOMATION *, DWORD frames);
+
+#endif /* SB_AUTO_H */
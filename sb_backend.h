@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * オーディオ・バックエンドのインターフェース。
+ * SoundBuffer.cはDirectSoundを直接呼ばず、ここで定義したデバイスとバッファーの
+ * 仮想関数テーブルを通して操作する。呼び出し方はCOMと同じ形にしてある。
+ *
+ *   dsound  : DirectSound8（Windows）。sb_dsound.c
+ *   soft    : ソフトウェアー・ミキサー＋ヌル・シンク（全OS）。sb_soft.c
+ *   offline : softと同じだが実時間では進まず、Renderを呼んだぶんだけ進む。sb_soft.c
+ *   mix     : softのミックス結果をDirectSoundのバッファー1本で鳴らす（Windows）。sb_dsound.c
+ */
+#ifndef SB_BACKEND_H
+#define SB_BACKEND_H
+
+#ifdef HAVE_DSOUND_H
+/*
+ * DirectSoundではGUIDを引数に使用することがある。
+ * GUID_NULLの定義が必要になる。このためks.hファイルとlibuuidをリンクする必要がある。
+ */
+#include "ks.h"
+/*
+ * MSから配布されている開発キットをインストールしてdsound.hとsal.hを入手する必要がある。
+ * MinGW付属のdsound.hはDirectXで使用できる全ての機能をサポートしていない。
+ * また、MinGWが提供するdsound.hはWineプロジェクトのものであり、そのライセンスはGPLである。
+ *
+ * MSのsdound.hはsal.hを内部でインクルードしている。
+ * このままコンパイルすると__nullが定義されないためエラーが出る。
+ * そのため__nullを自前で定義する必要がある。
+ */
+#define __null
+#define DIRECTSOUND_VERSION 0x0900
+#include <dsound.h>
+#include <mmreg.h>  // WAVEFORMATEXTENSIBLE
+#endif
+
+#include "sb_os.h"
+#include "sb_stats.h"
+#include "sb_auto.h"
+#include "sb_sched.h"
+
+#ifndef HAVE_DSOUND_H
+#include "sb_dscompat.h"
+#endif
+
+// Ruby側のエフェクト指定用の定数
+// クラス定義のセクションでRuby定数定義を行っている。
+#define FX_GARGLE       0
+#define FX_CHORUS       1
+#define FX_FLANGER      2
+#define FX_ECHO         3
+#define FX_DISTORTION   4
+#define FX_COMPRESSOR   5
+#define FX_PARAM_EQ     6
+#define FX_I3DL2_REVERB 7
+#define FX_WAVES_REVERB 8
+
+// バッファー生成フラグ
+#define SBBCAPS_CTRLFX    0x00000001
+#define SBBCAPS_SEAMLESS  0x00000002  // ループ区間のつなぎ目をサンプル単位で合わせる
+
+// デバイスの能力フラグ
+#define SBCAPS_NATIVELOOP 0x00000001  // ループ区間をバックエンド自身が処理する
+#define SBCAPS_RENDER     0x00000002  // Renderでミックス結果を取り出せる
+#define SBCAPS_REVERSE    0x00000004  // SetDirectionで逆再生できる
+#define SBCAPS_LIVEFX     0x00000008  // 再生中にSetFXでき、前の並びからつなぎ目なしに切り替わる
+
+// ループ区間フラグ
+#define SBLOOP_ENABLE   0x00000001
+
+typedef struct SBDevice SBDevice, *LPSBDEVICE;
+typedef struct SBBuffer SBBuffer, *LPSBBUFFER;
+
+/*
+ * バッファーの形式はWAVEFORMATEXか、3チャンネル以上・24/32bit・floatのときは
+ * WAVEFORMATEXTENSIBLE（wFormatTagがWAVE_FORMAT_EXTENSIBLE）で渡す。
+ * SubFormatはKSDATAFORMAT_SUBTYPE_PCMかKSDATAFORMAT_SUBTYPE_IEEE_FLOATで、
+ * どちらもData1がWAVE_FORMAT_*の値になっている。
+ */
+typedef struct SBBufferDesc {
+  DWORD           dwFlags;
+  DWORD           dwBufferBytes;
+  LPCWAVEFORMATEX lpwfxFormat;
+} SBBUFFERDESC, *LPSBBUFFERDESC;
+typedef const SBBUFFERDESC *LPCSBBUFFERDESC;
+
+typedef struct SBPositionNotify {
+  DWORD   dwOffset;
+  SBEVENT hEventNotify;
+} SBPOSITIONNOTIFY, *LPSBPOSITIONNOTIFY;
+typedef const SBPOSITIONNOTIFY *LPCSBPOSITIONNOTIFY;
+
+/*
+ * ループ区間。位置はバイト単位。
+ * 回数の数え方はSoundBuffer.cのnotify_set_loopと同じ。
+ */
+typedef struct SBLoop {
+  DWORD   dwFlags;
+  DWORD   dwStart;
+  DWORD   dwEnd;
+  DWORD   dwCount;
+  DWORD   dwCounter;
+} SBLOOP, *LPSBLOOP;
+typedef const SBLOOP *LPCSBLOOP;
+
+/*
+ * デバイス（DirectSoundオブジェクト＋プライマリーバッファー相当）
+ */
+struct SBDeviceVtbl {
+  HRESULT (*CreateBuffer)(LPSBDEVICE, LPCSBBUFFERDESC, LPSBBUFFER *);
+  HRESULT (*DuplicateBuffer)(LPSBDEVICE, LPSBBUFFER, LPSBBUFFER *);
+  HRESULT (*GetFormat)(LPSBDEVICE, LPWAVEFORMATEX);
+  HRESULT (*SetFormat)(LPSBDEVICE, LPCWAVEFORMATEX);
+  HRESULT (*GetVolume)(LPSBDEVICE, LPLONG);
+  HRESULT (*SetVolume)(LPSBDEVICE, LONG);
+  HRESULT (*Render)(LPSBDEVICE, DWORD, LPSBBUFFER *, DWORD, LPCWAVEFORMATEX, LPVOID);
+  void    (*Release)(LPSBDEVICE);
+  // サンプル・クロック。出力したフレームの数で、形式を変えても戻らない
+  HRESULT (*GetClock)(LPSBDEVICE, uint64_t *);
+  // 予定を積む。過ぎた時刻のものは次の区切りで済ませる。バッファーを解放すると、その予定も消える
+  HRESULT (*Schedule)(LPSBDEVICE, LPCSBSCHEDULE);
+  // バッファーの予定を取り消して数を返す。NULLならすべて
+  HRESULT (*Unschedule)(LPSBDEVICE, LPSBBUFFER, LPDWORD);
+  HRESULT (*GetScheduled)(LPSBDEVICE, LPSBBUFFER, LPDWORD);
+};
+
+struct SBDevice {
+  const struct SBDeviceVtbl *lpVtbl;
+  const char                *name;
+  DWORD                      dwCaps;
+};
+
+/*
+ * セカンダリーバッファー（IDirectSoundBuffer8＋IDirectSoundNotify8相当）
+ * エフェクトはGUIDではなくFX_*の番号で指定し、パラメーターはDSFX*構造体で受け渡す。
+ */
+struct SBBufferVtbl {
+  void    (*Release)(LPSBBUFFER);
+  HRESULT (*Lock)(LPSBBUFFER, DWORD, DWORD, LPVOID *, LPDWORD, LPVOID *, LPDWORD, DWORD);
+  HRESULT (*Unlock)(LPSBBUFFER, LPVOID, DWORD, LPVOID, DWORD);
+  HRESULT (*Play)(LPSBBUFFER, DWORD);
+  HRESULT (*Stop)(LPSBBUFFER);
+  HRESULT (*GetStatus)(LPSBBUFFER, LPDWORD);
+  HRESULT (*GetCurrentPosition)(LPSBBUFFER, LPDWORD, LPDWORD);
+  HRESULT (*SetCurrentPosition)(LPSBBUFFER, DWORD);
+  HRESULT (*GetVolume)(LPSBBUFFER, LPLONG);
+  HRESULT (*SetVolume)(LPSBBUFFER, LONG);
+  HRESULT (*GetPan)(LPSBBUFFER, LPLONG);
+  HRESULT (*SetPan)(LPSBBUFFER, LONG);
+  HRESULT (*GetFrequency)(LPSBBUFFER, LPDWORD);
+  HRESULT (*SetFrequency)(LPSBBUFFER, DWORD);
+  HRESULT (*SetNotificationPositions)(LPSBBUFFER, DWORD, LPCSBPOSITIONNOTIFY);
+  HRESULT (*SetFX)(LPSBBUFFER, DWORD, const DWORD *);
+  HRESULT (*GetFXParameters)(LPSBBUFFER, DWORD, DWORD, LPVOID);
+  HRESULT (*SetFXParameters)(LPSBBUFFER, DWORD, DWORD, LPCVOID);
+  HRESULT (*SetLoop)(LPSBBUFFER, LPCSBLOOP);
+  HRESULT (*GetLoop)(LPSBBUFFER, LPSBLOOP);
+  HRESULT (*SetDirection)(LPSBBUFFER, LONG);  // 1なら順方向、-1なら逆方向
+  HRESULT (*GetDirection)(LPSBBUFFER, LPLONG);
+  // SBPARAM_*を折れ点に沿って動かす。再生中だけ進む。0個なら止める。Set*を呼ぶとそのパラメーターは止まる
+  HRESULT (*SetAutomation)(LPSBBUFFER, DWORD, DWORD, LPCSBBREAKPOINT);
+  HRESULT (*GetAutomation)(LPSBBUFFER, DWORD, LPDWORD);  // 最後の折れ点までのフレーム数。止まっていれば0
+  // 並びのidx番目を素通しにする（TRUE）か戻す（FALSE）。再生中でもよく、音は途切れない
+  HRESULT (*SetFXBypass)(LPSBBUFFER, DWORD, BOOL);
+};
+
+struct SBBuffer {
+  const struct SBBufferVtbl *lpVtbl;
+  LPSBSTATS                  lpStats;  // SoundBuffer.cが設定する。NULLなら全体の統計にだけ数える
+};
+
+/*
+ * ソフトウェアー・バックエンドのミックス結果の出力先（シンク）
+ * デバイス・スレッドがGetWritableで書けるフレーム数を聞き、ミックスしてWriteする。
+ */
+typedef struct SBSink SBSink, *LPSBSINK;
+
+struct SBSinkVtbl {
+  DWORD   (*GetWritable)(LPSBSINK);
+  HRESULT (*Write)(LPSBSINK, LPCVOID, DWORD);
+  HRESULT (*SetFormat)(LPSBSINK, LPCWAVEFORMATEX);
+  void    (*Release)(LPSBSINK);
+};
+
+struct SBSink {
+  const struct SBSinkVtbl *lpVtbl;
+};
+
+// バックエンド生成関数
+#ifdef HAVE_DSOUND_H
+HRESULT SBDSoundCreate(LPSBDEVICE *);
+HRESULT SBDSoundSinkCreate(LPSBSINK *);
+#endif
+HRESULT SBSoftCreate(LPSBDEVICE *, BOOL, LPSBSINK);
+
+#endif /* SB_BACKEND_H */
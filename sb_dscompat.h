@@ -0,0 +1,382 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * dsound.hが無い環境（Linuxなど）用の定義。
+ * SoundBufferクラスが公開している定数・エフェクトのパラメーター構造体・エラーコードは
+ * dsound.hと同じ名前、同じ値で定義する。これによりRuby側からはバックエンドの違いが見えない。
+ */
+#ifndef SB_DSCOMPAT_H
+#define SB_DSCOMPAT_H
+
+#include "sb_os.h"
+
+#ifndef _WIN32
+#define WAVE_FORMAT_PCM 1
+
+typedef struct tWAVEFORMATEX {
+  WORD  wFormatTag;
+  WORD  nChannels;
+  DWORD nSamplesPerSec;
+  DWORD nAvgBytesPerSec;
+  WORD  nBlockAlign;
+  WORD  wBitsPerSample;
+  WORD  cbSize;
+} WAVEFORMATEX, *LPWAVEFORMATEX;
+typedef const WAVEFORMATEX *LPCWAVEFORMATEX;
+
+#define WAVE_FORMAT_IEEE_FLOAT  0x0003
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
+
+typedef struct _GUID {
+  DWORD Data1;
+  WORD  Data2;
+  WORD  Data3;
+  BYTE  Data4[8];
+} GUID;
+
+typedef struct {
+  WAVEFORMATEX Format;
+  union {
+    WORD wValidBitsPerSample;
+    WORD wSamplesPerBlock;
+    WORD wReserved;
+  } Samples;
+  DWORD        dwChannelMask;
+  GUID         SubFormat;
+} WAVEFORMATEXTENSIBLE, *PWAVEFORMATEXTENSIBLE;
+
+#define SPEAKER_FRONT_LEFT            0x00000001
+#define SPEAKER_FRONT_RIGHT           0x00000002
+#define SPEAKER_FRONT_CENTER          0x00000004
+#define SPEAKER_LOW_FREQUENCY         0x00000008
+#define SPEAKER_BACK_LEFT             0x00000010
+#define SPEAKER_BACK_RIGHT            0x00000020
+#define SPEAKER_FRONT_LEFT_OF_CENTER  0x00000040
+#define SPEAKER_FRONT_RIGHT_OF_CENTER 0x00000080
+#define SPEAKER_BACK_CENTER           0x00000100
+#define SPEAKER_SIDE_LEFT             0x00000200
+#define SPEAKER_SIDE_RIGHT            0x00000400
+#endif
+
+/*
+ * Buffer
+ */
+#define DSBSIZE_MIN                 4
+#define DSBSIZE_MAX                 0x0FFFFFFF
+#define DSBSIZE_FX_MIN              150
+#define DSBFREQUENCY_ORIGINAL       0
+#define DSBFREQUENCY_MIN            100
+#define DSBFREQUENCY_MAX            200000
+#define DSBPAN_LEFT                 -10000
+#define DSBPAN_CENTER               0
+#define DSBPAN_RIGHT                10000
+#define DSBVOLUME_MIN               -10000
+#define DSBVOLUME_MAX               0
+#define DSBNOTIFICATIONS_MAX        100000UL
+#define DSBPN_OFFSETSTOP            0xFFFFFFFF
+
+#define DSBPLAY_LOOPING             0x00000001
+#define DSBSTATUS_PLAYING           0x00000001
+#define DSBSTATUS_BUFFERLOST        0x00000002
+#define DSBSTATUS_LOOPING           0x00000004
+#define DSBLOCK_FROMWRITECURSOR     0x00000001
+#define DSBLOCK_ENTIREBUFFER        0x00000002
+
+/*
+ * Return codes
+ */
+#define _FACDS                      0x878
+#define MAKE_DSHRESULT(code)        MAKE_HRESULT(1, _FACDS, code)
+
+#define DS_OK                       S_OK
+#define DS_NO_VIRTUALIZATION        MAKE_HRESULT(0, _FACDS, 10)
+#define DSERR_ALLOCATED             MAKE_DSHRESULT(10)
+#define DSERR_CONTROLUNAVAIL        MAKE_DSHRESULT(30)
+#define DSERR_INVALIDPARAM          E_INVALIDARG
+#define DSERR_INVALIDCALL           MAKE_DSHRESULT(50)
+#define DSERR_GENERIC               E_FAIL
+#define DSERR_PRIOLEVELNEEDED       MAKE_DSHRESULT(70)
+#define DSERR_OUTOFMEMORY           E_OUTOFMEMORY
+#define DSERR_BADFORMAT             MAKE_DSHRESULT(100)
+#define DSERR_UNSUPPORTED           E_NOTIMPL
+#define DSERR_NODRIVER              MAKE_DSHRESULT(120)
+#define DSERR_ALREADYINITIALIZED    MAKE_DSHRESULT(130)
+#define DSERR_NOAGGREGATION         CLASS_E_NOAGGREGATION
+#define DSERR_BUFFERLOST            MAKE_DSHRESULT(150)
+#define DSERR_OTHERAPPHASPRIO       MAKE_DSHRESULT(160)
+#define DSERR_UNINITIALIZED         MAKE_DSHRESULT(170)
+#define DSERR_NOINTERFACE           E_NOINTERFACE
+#define DSERR_ACCESSDENIED          E_ACCESSDENIED
+#define DSERR_BUFFERTOOSMALL        MAKE_DSHRESULT(180)
+#define DSERR_DS8_REQUIRED          MAKE_DSHRESULT(190)
+#define DSERR_SENDLOOP              MAKE_DSHRESULT(200)
+#define DSERR_BADSENDBUFFERGUID     MAKE_DSHRESULT(210)
+#define DSERR_OBJECTNOTFOUND        MAKE_DSHRESULT(4449)
+#define DSERR_FXUNAVAILABLE         MAKE_DSHRESULT(220)
+
+/*
+ * Gargle
+ */
+typedef struct _DSFXGargle {
+  DWORD dwRateHz;
+  DWORD dwWaveShape;
+} DSFXGargle, *LPDSFXGargle;
+
+#define DSFXGARGLE_WAVE_TRIANGLE    0
+#define DSFXGARGLE_WAVE_SQUARE      1
+#define DSFXGARGLE_RATEHZ_MIN       1
+#define DSFXGARGLE_RATEHZ_MAX       1000
+
+/*
+ * Chorus
+ */
+typedef struct _DSFXChorus {
+  FLOAT fWetDryMix;
+  FLOAT fDepth;
+  FLOAT fFeedback;
+  FLOAT fFrequency;
+  LONG  lWaveform;
+  FLOAT fDelay;
+  LONG  lPhase;
+} DSFXChorus, *LPDSFXChorus;
+
+#define DSFXCHORUS_WAVE_TRIANGLE    0
+#define DSFXCHORUS_WAVE_SIN         1
+#define DSFXCHORUS_WETDRYMIX_MIN    0.0f
+#define DSFXCHORUS_WETDRYMIX_MAX    100.0f
+#define DSFXCHORUS_DEPTH_MIN        0.0f
+#define DSFXCHORUS_DEPTH_MAX        100.0f
+#define DSFXCHORUS_FEEDBACK_MIN     -99.0f
+#define DSFXCHORUS_FEEDBACK_MAX     99.0f
+#define DSFXCHORUS_FREQUENCY_MIN    0.0f
+#define DSFXCHORUS_FREQUENCY_MAX    10.0f
+#define DSFXCHORUS_DELAY_MIN        0.0f
+#define DSFXCHORUS_DELAY_MAX        20.0f
+#define DSFXCHORUS_PHASE_MIN        0
+#define DSFXCHORUS_PHASE_MAX        4
+#define DSFXCHORUS_PHASE_NEG_180    0
+#define DSFXCHORUS_PHASE_NEG_90     1
+#define DSFXCHORUS_PHASE_ZERO       2
+#define DSFXCHORUS_PHASE_90         3
+#define DSFXCHORUS_PHASE_180        4
+
+/*
+ * Flanger
+ */
+typedef struct _DSFXFlanger {
+  FLOAT fWetDryMix;
+  FLOAT fDepth;
+  FLOAT fFeedback;
+  FLOAT fFrequency;
+  LONG  lWaveform;
+  FLOAT fDelay;
+  LONG  lPhase;
+} DSFXFlanger, *LPDSFXFlanger;
+
+#define DSFXFLANGER_WAVE_TRIANGLE   0
+#define DSFXFLANGER_WAVE_SIN        1
+#define DSFXFLANGER_WETDRYMIX_MIN   0.0f
+#define DSFXFLANGER_WETDRYMIX_MAX   100.0f
+#define DSFXFLANGER_FREQUENCY_MIN   0.0f
+#define DSFXFLANGER_FREQUENCY_MAX   10.0f
+#define DSFXFLANGER_DEPTH_MIN       0.0f
+#define DSFXFLANGER_DEPTH_MAX       100.0f
+#define DSFXFLANGER_PHASE_MIN       0
+#define DSFXFLANGER_PHASE_MAX       4
+#define DSFXFLANGER_FEEDBACK_MIN    -99.0f
+#define DSFXFLANGER_FEEDBACK_MAX    99.0f
+#define DSFXFLANGER_DELAY_MIN       0.0f
+#define DSFXFLANGER_DELAY_MAX       4.0f
+#define DSFXFLANGER_PHASE_NEG_180   0
+#define DSFXFLANGER_PHASE_NEG_90    1
+#define DSFXFLANGER_PHASE_ZERO      2
+#define DSFXFLANGER_PHASE_90        3
+#define DSFXFLANGER_PHASE_180       4
+
+/*
+ * Echo
+ */
+typedef struct _DSFXEcho {
+  FLOAT fWetDryMix;
+  FLOAT fFeedback;
+  FLOAT fLeftDelay;
+  FLOAT fRightDelay;
+  LONG  lPanDelay;
+} DSFXEcho, *LPDSFXEcho;
+
+#define DSFXECHO_WETDRYMIX_MIN      0.0f
+#define DSFXECHO_WETDRYMIX_MAX      100.0f
+#define DSFXECHO_FEEDBACK_MIN       0.0f
+#define DSFXECHO_FEEDBACK_MAX       100.0f
+#define DSFXECHO_LEFTDELAY_MIN      1.0f
+#define DSFXECHO_LEFTDELAY_MAX      2000.0f
+#define DSFXECHO_RIGHTDELAY_MIN     1.0f
+#define DSFXECHO_RIGHTDELAY_MAX     2000.0f
+#define DSFXECHO_PANDELAY_MIN       0
+#define DSFXECHO_PANDELAY_MAX       1
+
+/*
+ * Distortion
+ */
+typedef struct _DSFXDistortion {
+  FLOAT fGain;
+  FLOAT fEdge;
+  FLOAT fPostEQCenterFrequency;
+  FLOAT fPostEQBandwidth;
+  FLOAT fPreLowpassCutoff;
+} DSFXDistortion, *LPDSFXDistortion;
+
+#define DSFXDISTORTION_GAIN_MIN                   -60.0f
+#define DSFXDISTORTION_GAIN_MAX                   0.0f
+#define DSFXDISTORTION_EDGE_MIN                   0.0f
+#define DSFXDISTORTION_EDGE_MAX                   100.0f
+#define DSFXDISTORTION_POSTEQCENTERFREQUENCY_MIN  100.0f
+#define DSFXDISTORTION_POSTEQCENTERFREQUENCY_MAX  8000.0f
+#define DSFXDISTORTION_POSTEQBANDWIDTH_MIN        100.0f
+#define DSFXDISTORTION_POSTEQBANDWIDTH_MAX        8000.0f
+#define DSFXDISTORTION_PRELOWPASSCUTOFF_MIN       100.0f
+#define DSFXDISTORTION_PRELOWPASSCUTOFF_MAX       8000.0f
+
+/*
+ * Compressor
+ */
+typedef struct _DSFXCompressor {
+  FLOAT fGain;
+  FLOAT fAttack;
+  FLOAT fRelease;
+  FLOAT fThreshold;
+  FLOAT fRatio;
+  FLOAT fPredelay;
+} DSFXCompressor, *LPDSFXCompressor;
+
+#define DSFXCOMPRESSOR_GAIN_MIN       -60.0f
+#define DSFXCOMPRESSOR_GAIN_MAX       60.0f
+#define DSFXCOMPRESSOR_ATTACK_MIN     0.01f
+#define DSFXCOMPRESSOR_ATTACK_MAX     500.0f
+#define DSFXCOMPRESSOR_RELEASE_MIN    50.0f
+#define DSFXCOMPRESSOR_RELEASE_MAX    3000.0f
+#define DSFXCOMPRESSOR_THRESHOLD_MIN  -60.0f
+#define DSFXCOMPRESSOR_THRESHOLD_MAX  0.0f
+#define DSFXCOMPRESSOR_RATIO_MIN      1.0f
+#define DSFXCOMPRESSOR_RATIO_MAX      100.0f
+#define DSFXCOMPRESSOR_PREDELAY_MIN   0.0f
+#define DSFXCOMPRESSOR_PREDELAY_MAX   4.0f
+
+/*
+ * ParamEq
+ */
+typedef struct _DSFXParamEq {
+  FLOAT fCenter;
+  FLOAT fBandwidth;
+  FLOAT fGain;
+} DSFXParamEq, *LPDSFXParamEq;
+
+#define DSFXPARAMEQ_CENTER_MIN        80.0f
+#define DSFXPARAMEQ_CENTER_MAX        16000.0f
+#define DSFXPARAMEQ_BANDWIDTH_MIN     1.0f
+#define DSFXPARAMEQ_BANDWIDTH_MAX     36.0f
+#define DSFXPARAMEQ_GAIN_MIN          -15.0f
+#define DSFXPARAMEQ_GAIN_MAX          15.0f
+
+/*
+ * I3DL2Reverb
+ */
+typedef struct _DSFXI3DL2Reverb {
+  LONG  lRoom;
+  LONG  lRoomHF;
+  FLOAT flRoomRolloffFactor;
+  FLOAT flDecayTime;
+  FLOAT flDecayHFRatio;
+  LONG  lReflections;
+  FLOAT flReflectionsDelay;
+  LONG  lReverb;
+  FLOAT flReverbDelay;
+  FLOAT flDiffusion;
+  FLOAT flDensity;
+  FLOAT flHFReference;
+} DSFXI3DL2Reverb, *LPDSFXI3DL2Reverb;
+
+#define DSFX_I3DL2REVERB_ROOM_MIN                   (-10000)
+#define DSFX_I3DL2REVERB_ROOM_MAX                   0
+#define DSFX_I3DL2REVERB_ROOM_DEFAULT               (-1000)
+#define DSFX_I3DL2REVERB_ROOMHF_MIN                 (-10000)
+#define DSFX_I3DL2REVERB_ROOMHF_MAX                 0
+#define DSFX_I3DL2REVERB_ROOMHF_DEFAULT             (-100)
+#define DSFX_I3DL2REVERB_ROOMROLLOFFFACTOR_MIN      0.0f
+#define DSFX_I3DL2REVERB_ROOMROLLOFFFACTOR_MAX      10.0f
+#define DSFX_I3DL2REVERB_ROOMROLLOFFFACTOR_DEFAULT  0.0f
+#define DSFX_I3DL2REVERB_DECAYTIME_MIN              0.1f
+#define DSFX_I3DL2REVERB_DECAYTIME_MAX              20.0f
+#define DSFX_I3DL2REVERB_DECAYTIME_DEFAULT          1.49f
+#define DSFX_I3DL2REVERB_DECAYHFRATIO_MIN           0.1f
+#define DSFX_I3DL2REVERB_DECAYHFRATIO_MAX           2.0f
+#define DSFX_I3DL2REVERB_DECAYHFRATIO_DEFAULT       0.83f
+#define DSFX_I3DL2REVERB_REFLECTIONS_MIN            (-10000)
+#define DSFX_I3DL2REVERB_REFLECTIONS_MAX            1000
+#define DSFX_I3DL2REVERB_REFLECTIONS_DEFAULT        (-2602)
+#define DSFX_I3DL2REVERB_REFLECTIONSDELAY_MIN       0.0f
+#define DSFX_I3DL2REVERB_REFLECTIONSDELAY_MAX       0.3f
+#define DSFX_I3DL2REVERB_REFLECTIONSDELAY_DEFAULT   0.007f
+#define DSFX_I3DL2REVERB_REVERB_MIN                 (-10000)
+#define DSFX_I3DL2REVERB_REVERB_MAX                 2000
+#define DSFX_I3DL2REVERB_REVERB_DEFAULT             (200)
+#define DSFX_I3DL2REVERB_REVERBDELAY_MIN            0.0f
+#define DSFX_I3DL2REVERB_REVERBDELAY_MAX            0.1f
+#define DSFX_I3DL2REVERB_REVERBDELAY_DEFAULT        0.011f
+#define DSFX_I3DL2REVERB_DIFFUSION_MIN              0.0f
+#define DSFX_I3DL2REVERB_DIFFUSION_MAX              100.0f
+#define DSFX_I3DL2REVERB_DIFFUSION_DEFAULT          100.0f
+#define DSFX_I3DL2REVERB_DENSITY_MIN                0.0f
+#define DSFX_I3DL2REVERB_DENSITY_MAX                100.0f
+#define DSFX_I3DL2REVERB_DENSITY_DEFAULT            100.0f
+#define DSFX_I3DL2REVERB_HFREFERENCE_MIN            20.0f
+#define DSFX_I3DL2REVERB_HFREFERENCE_MAX            20000.0f
+#define DSFX_I3DL2REVERB_HFREFERENCE_DEFAULT        5000.0f
+#define DSFX_I3DL2REVERB_QUALITY_MIN                0
+#define DSFX_I3DL2REVERB_QUALITY_MAX                3
+#define DSFX_I3DL2REVERB_QUALITY_DEFAULT            2
+
+/*
+ * WavesReverb
+ */
+typedef struct _DSFXWavesReverb {
+  FLOAT fInGain;
+  FLOAT fReverbMix;
+  FLOAT fReverbTime;
+  FLOAT fHighFreqRTRatio;
+} DSFXWavesReverb, *LPDSFXWavesReverb;
+
+#define DSFX_WAVESREVERB_INGAIN_MIN               -96.0f
+#define DSFX_WAVESREVERB_INGAIN_MAX               0.0f
+#define DSFX_WAVESREVERB_INGAIN_DEFAULT           0.0f
+#define DSFX_WAVESREVERB_REVERBMIX_MIN            -96.0f
+#define DSFX_WAVESREVERB_REVERBMIX_MAX            0.0f
+#define DSFX_WAVESREVERB_REVERBMIX_DEFAULT        0.0f
+#define DSFX_WAVESREVERB_REVERBTIME_MIN           0.001f
+#define DSFX_WAVESREVERB_REVERBTIME_MAX           3000.0f
+#define DSFX_WAVESREVERB_REVERBTIME_DEFAULT       1000.0f
+#define DSFX_WAVESREVERB_HIGHFREQRTRATIO_MIN      0.001f
+#define DSFX_WAVESREVERB_HIGHFREQRTRATIO_MAX      0.999f
+#define DSFX_WAVESREVERB_HIGHFREQRTRATIO_DEFAULT  0.001f
+
+#endif /* SB_DSCOMPAT_H */
@@ -0,0 +1,1370 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * DirectSoundバックエンド
+ * 以前はSoundBuffer.cに直接書かれていたDirectSoundの呼び出しをここにまとめた。
+ */
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sb_backend.h"
+#include "sb_fx.h"
+
+#ifdef HAVE_DSOUND_H
+
+/*
+ * ループ区間
+ * バッファーごとにループ終端の通知イベントを持ち、デバイスのサービス・スレッドがまとめて待って
+ * SetCurrentPositionでループ始端へ戻す。Rubyのスレッドがwaitしていなくても、GVLが塞がっていてもループする。
+ *
+ * 自動変化（SetAutomation）も同じスレッドが受け持つ。DirectSoundのバッファーは値をサンプル単位では
+ * 変えられないので、自動変化中のバッファーがある間はDS_AUTO_PERIOD_MSごとに起きて、
+ * 経過時間をプライマリーのフレームに直して進め、SetVolumeなどで値を入れる。
+ *
+ * 予定表（Schedule）もこのスレッドが受け持つ。DirectSoundのミックスにはサンプル単位で割り込めないので、
+ * サンプル・クロックは経過時間をプライマリーのフレームに直したもので、予定はその時刻まで眠ってから
+ * バッファーの仮想関数で済ませる。ずれはタイマーの精度（1ms程度）になる。
+ * SBBCAPS_SEAMLESSのバッファーの予定はミキサーのクロックに直して渡すので、サンプル単位で合う。
+ */
+#define DS_AUTO_PERIOD_MS 5
+
+struct DSLoop {
+  struct DSLoop        *next;
+  struct DSBuffer      *buf;         // NULLなら解放済み。サービス・スレッドが後始末する
+  SBEVENT               event;
+  SBLOOP                loop;
+  SBAUTOMATION          autos[SBPARAM_COUNT];
+  uint64_t              auto_ns;     // 自動変化をここまで進めた時刻
+  DWORD                 auto_rate;   // プライマリーの周波数
+};
+
+struct DSDevice {
+  SBDevice              base;
+  LPDIRECTSOUND8        pDSound;
+  LPDIRECTSOUNDBUFFER   pDSBuffer;   // プライマリーバッファー
+  HWND                  hWnd;
+  sb_mutex_t            loop_lock;
+  struct DSLoop        *loops;
+  SBEVENT               loop_wake;   // loopsが変わったらサービス・スレッドに集め直させる
+  sb_thread_t           loop_thread;
+  BOOL                  loop_running;
+  BOOL                  loop_quit;
+  LPSBDEVICE            mix;         // SBBCAPS_SEAMLESSのバッファーを受け持つソフトウェアー・ミキサー
+  // ここから下はloop_lockで保護する
+  SBSCHEDQUEUE          sched;
+  uint64_t              clock_base;  // clock_nsの時点のサンプル・クロック
+  uint64_t              clock_ns;
+  DWORD                 clock_rate;  // プライマリーの周波数
+};
+
+/*
+ * エフェクトの並びの1つ。DMOにはバイパスが無いので、効きが無くなるパラメーターを入れて代わりにする。
+ * バイパス中は本来のパラメーターをsavedに取っておき、読み書きもこちらで受ける
+ */
+struct DSFXSlot {
+  DWORD                 fx;
+  LPUNKNOWN             iface;       // IDirectSoundFX*8。並びを替えるか解放するまで持つ
+  BOOL                  bypass;
+  union {
+    DSFXChorus          chorus;
+    DSFXFlanger         flanger;
+    DSFXEcho            echo;
+    DSFXCompressor      compressor;
+    DSFXParamEq         parameq;
+    DSFXI3DL2Reverb     i3dl2;
+    DSFXWavesReverb     waves;
+  } saved;
+};
+
+struct DSBuffer {
+  SBBuffer              base;
+  LPDIRECTSOUNDBUFFER8  pDSBuffer8;
+  struct DSDevice      *dev;
+  struct DSLoop        *loop;
+  LPSBPOSITIONNOTIFY    notify;      // SoundBuffer.cからの通知位置。ループ終端を足して設定し直すのに使う
+  DWORD                 notify_count;
+  DWORD                 block_align; // つなぎ目の誤差をフレームで数える
+  struct DSFXSlot      *fx;
+  DWORD                 fx_count;
+};
+
+static const struct SBBufferVtbl DSBuffer_vtbl;
+static HRESULT DSSink_new(LPSBDEVICE, BOOL, LPSBSINK *);
+static void    DSBuffer_fx_release(struct DSBuffer *);
+
+#define DSDEV(dev) ((struct DSDevice *)(dev))
+#define DSBUF(buf) (((struct DSBuffer *)(buf))->pDSBuffer8)
+
+static void
+DSLoop_service(struct DSLoop *l)
+{
+  SBLOOP *loop = &l->loop;
+  DWORD   play;
+  HRESULT hr;
+
+  // 数え方はSoundBuffer.cのnotify_set_loopと同じ
+  if (!(loop->dwFlags & SBLOOP_ENABLE)) return;
+  if ( loop->dwCount && loop->dwCount > loop->dwCounter) loop->dwCounter += 1;
+  if (!loop->dwCount || loop->dwCount > loop->dwCounter) {
+    if (SB_STATS_ON) {
+      // 戻す直前のカーソルが終端をどれだけ過ぎているか
+      hr = l->buf->pDSBuffer8->lpVtbl->GetCurrentPosition(l->buf->pDSBuffer8, &play, NULL);
+      if (SUCCEEDED(hr) && play >= loop->dwEnd) sb_stats_seam(l->buf->base.lpStats, (play - loop->dwEnd) / l->buf->block_align);
+    }
+    l->buf->pDSBuffer8->lpVtbl->SetCurrentPosition(l->buf->pDSBuffer8, loop->dwStart);
+  }
+}
+
+static BOOL
+DSLoop_auto_active(struct DSLoop *l)
+{
+  DWORD i;
+
+  for (i = 0; i < SBPARAM_COUNT; i++) {
+    if (sb_auto_active(&l->autos[i])) return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+DSLoop_auto_store(struct DSLoop *l, DWORD param, double value)
+{
+  LPDIRECTSOUNDBUFFER8 p = l->buf->pDSBuffer8;
+  LONG v = (LONG)floor(value + 0.5);
+
+  switch (param) {
+  case SBPARAM_VOLUME:    p->lpVtbl->SetVolume(p, v);           break;
+  case SBPARAM_PAN:       p->lpVtbl->SetPan(p, v);              break;
+  case SBPARAM_FREQUENCY: p->lpVtbl->SetFrequency(p, (DWORD)v); break;
+  }
+}
+
+// 前回からの経過時間だけ自動変化を進める。止まっている間は進めない
+static void
+DSLoop_auto_service(struct DSLoop *l)
+{
+  uint64_t now = sb_clock_ns();
+  DWORD    i, frames, status = 0;
+
+  l->buf->pDSBuffer8->lpVtbl->GetStatus(l->buf->pDSBuffer8, &status);
+  if (!(status & DSBSTATUS_PLAYING)) {
+    l->auto_ns = now;
+    return;
+  }
+  frames = (DWORD)((now - l->auto_ns) * l->auto_rate / 1000000000ULL);
+  if (!frames) return;
+  // 端数の時間は次に持ち越す
+  l->auto_ns += (uint64_t)frames * 1000000000ULL / l->auto_rate;
+  for (i = 0; i < SBPARAM_COUNT; i++) {
+    if (sb_auto_active(&l->autos[i])) DSLoop_auto_store(l, i, sb_auto_advance(&l->autos[i], frames));
+  }
+}
+
+static void
+DSLoop_free(struct DSLoop *l)
+{
+  DWORD i;
+
+  for (i = 0; i < SBPARAM_COUNT; i++) sb_auto_clear(&l->autos[i]);
+  sb_event_close(l->event);
+  free(l);
+}
+
+// サンプル・クロック。loop_lockを取ってから呼ぶ
+static uint64_t
+DSDevice_clock(struct DSDevice *d)
+{
+  uint64_t ns = sb_clock_ns() - d->clock_ns;
+
+  return d->clock_base + ns / 1000000000ULL * d->clock_rate + ns % 1000000000ULL * d->clock_rate / 1000000000ULL;
+}
+
+/*
+ * 時刻の来た予定を済ませ、次の予定までのミリ秒を返す。無ければINFINITE。loop_lockを取ってから呼ぶ。
+ * SetVolumeなどはloop_lockを取り直すが、CRITICAL_SECTIONは同じスレッドなら入れる
+ */
+static DWORD
+DSDevice_sched_service(struct DSDevice *d)
+{
+  LPCSBSCHEDULE next;
+  SBSCHEDULE    ev;
+  uint64_t      clock = DSDevice_clock(d);
+
+  while ((next = sb_sched_peek(&d->sched)) != NULL && next->qwFrame <= clock) {
+    sb_sched_pop(&d->sched, &ev);
+    sb_sched_apply(&ev);
+  }
+  if (!next) return INFINITE;
+  return (DWORD)(((next->qwFrame - clock) * 1000 + d->clock_rate - 1) / d->clock_rate);
+}
+
+static void*
+DSDevice_loop_thread(void *arg)
+{
+  struct DSDevice *d = arg;
+  struct DSLoop   *l, **pl, **owners = NULL;
+  SBEVENT         *handles = NULL;
+  LPDWORD          fired = NULL;
+  DWORD            i, n, count, capacity = 0, timeout, wait;
+
+  // 通知から巻き戻しまでの遅れを一定にしたい
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+  sb_mutex_lock(&d->loop_lock);
+  while (!d->loop_quit) {
+    // 解放済みのものを片付けて、待つイベントを集め直す
+    timeout = INFINITE;
+    for (pl = &d->loops, count = 1; *pl;) {
+      l = *pl;
+      if (!l->buf) {
+        *pl = l->next;
+        DSLoop_free(l);
+        continue;
+      }
+      if (DSLoop_auto_active(l)) timeout = DS_AUTO_PERIOD_MS;
+      count++;
+      pl = &l->next;
+    }
+    wait = DSDevice_sched_service(d);
+    if (wait < timeout) timeout = wait;
+    if (count > capacity) {
+      capacity = count * 2;
+      free(handles);
+      free(owners);
+      free(fired);
+      handles = malloc(sizeof(SBEVENT) * capacity);
+      owners  = malloc(sizeof(struct DSLoop *) * capacity);
+      fired   = malloc(sizeof(DWORD) * capacity);
+      if (!handles || !owners || !fired) break;
+    }
+    handles[0] = d->loop_wake;
+    owners[0]  = NULL;
+    for (l = d->loops, i = 1; l; l = l->next, i++) {
+      handles[i] = l->event;
+      owners[i]  = l;
+    }
+    sb_mutex_unlock(&d->loop_lock);
+    n = sb_event_wait_many(count, handles, timeout, fired);
+    sb_mutex_lock(&d->loop_lock);
+    if (n == WAIT_FAILED) break;
+    for (i = 0; i < n; i++) {
+      l = owners[fired[i]];
+      if (l && l->buf) DSLoop_service(l);
+    }
+    for (l = d->loops; l; l = l->next) {
+      if (l->buf && DSLoop_auto_active(l)) DSLoop_auto_service(l);
+    }
+  }
+  sb_mutex_unlock(&d->loop_lock);
+  free(handles);
+  free(owners);
+  free(fired);
+  return NULL;
+}
+
+static LPSBBUFFER
+DSBuffer_new(struct DSDevice *d, LPDIRECTSOUNDBUFFER8 pDSBuffer8, DWORD block_align)
+{
+  struct DSBuffer *b = calloc(1, sizeof(struct DSBuffer));
+  struct DSLoop   *l = calloc(1, sizeof(struct DSLoop));
+
+  if (b && l) l->event = sb_event_create(FALSE);
+  if (!b || !l || !l->event) {
+    free(b);
+    free(l);
+    return NULL;
+  }
+  b->base.lpVtbl = &DSBuffer_vtbl;
+  b->pDSBuffer8  = pDSBuffer8;
+  b->dev         = d;
+  b->block_align = block_align;
+  b->loop        = l;
+  l->buf         = b;
+
+  sb_mutex_lock(&d->loop_lock);
+  if (!d->loop_running) d->loop_running = sb_thread_create(&d->loop_thread, DSDevice_loop_thread, d) == 0;
+  l->next  = d->loops;
+  d->loops = l;
+  sb_mutex_unlock(&d->loop_lock);
+  sb_event_set(d->loop_wake);
+  return &b->base;
+}
+
+/*
+ * つなぎ目なしループ用のミキサー
+ * ループ区間の終端で位置を戻すのはサービス・スレッドがイベントを受けてからになるので、
+ * 少し行き過ぎる。SBBCAPS_SEAMLESSのバッファーはDirectSoundのバッファーにせず、
+ * このデバイスのプライマリーバッファーに出すソフトウェアー・ミキサーに持たせる。
+ * ミキサーはループ区間をサンプル単位で折り返しながら、再生カーソルの先へ書き足していく。
+ */
+static HRESULT
+DSDevice_get_mix(struct DSDevice *d, LPSBDEVICE *out)
+{
+  WAVEFORMATEX  wfx;
+  LPSBSINK      sink;
+  HRESULT       hr;
+
+  if (!d->mix) {
+    hr = d->base.lpVtbl->GetFormat(&d->base, &wfx);
+    if (FAILED(hr)) return hr;
+    hr = DSSink_new(&d->base, FALSE, &sink);
+    if (FAILED(hr)) return hr;
+    hr = SBSoftCreate(&d->mix, TRUE, sink);
+    if (FAILED(hr)) return hr;
+    // ミキサーの既定の形式で作られるので、プライマリーバッファーの形式に戻す
+    hr = d->mix->lpVtbl->SetFormat(d->mix, &wfx);
+    if (FAILED(hr)) {
+      d->mix->lpVtbl->Release(d->mix);
+      d->mix = NULL;
+      return hr;
+    }
+  }
+  *out = d->mix;
+  return DS_OK;
+}
+
+/*
+ * device
+ */
+static HRESULT
+DSDevice_CreateBuffer(LPSBDEVICE dev, LPCSBBUFFERDESC sbdesc, LPSBBUFFER *out)
+{
+  DSBUFFERDESC          desc;
+  WAVEFORMATEXTENSIBLE  pcmwf;
+  LPDIRECTSOUNDBUFFER   pDSBuffer;
+  LPDIRECTSOUNDBUFFER8  pDSBuffer8;
+  LPSBDEVICE            mix;
+  HRESULT               hr;
+
+  if (sbdesc->dwFlags & SBBCAPS_SEAMLESS) {
+    hr = DSDevice_get_mix(DSDEV(dev), &mix);
+    if (FAILED(hr)) return hr;
+    return mix->lpVtbl->CreateBuffer(mix, sbdesc, out);
+  }
+  // WAVEFORMATEXTENSIBLEならcbSizeのぶんも写す
+  if (sizeof(WAVEFORMATEX) + sbdesc->lpwfxFormat->cbSize > sizeof(pcmwf)) return DSERR_BADFORMAT;
+  memcpy(&pcmwf, sbdesc->lpwfxFormat, sizeof(WAVEFORMATEX) + sbdesc->lpwfxFormat->cbSize);
+  // DirectSoundバッファ設定
+  desc.dwSize           = sizeof(desc);
+  desc.dwFlags          = DSBCAPS_CTRLFREQUENCY | DSBCAPS_CTRLPAN | DSBCAPS_CTRLVOLUME | (sbdesc->dwFlags & SBBCAPS_CTRLFX ? DSBCAPS_CTRLFX : 0)
+                        | DSBCAPS_LOCSOFTWARE | DSBCAPS_CTRLPOSITIONNOTIFY | DSBCAPS_GETCURRENTPOSITION2 | DSBCAPS_GLOBALFOCUS;
+  desc.dwBufferBytes    = sbdesc->dwBufferBytes;
+  desc.dwReserved       = 0;
+  desc.lpwfxFormat      = &pcmwf.Format;
+  desc.guid3DAlgorithm  = DS3DALG_DEFAULT;
+
+  // DirectSoundバッファ生成
+  hr = DSDEV(dev)->pDSound->lpVtbl->CreateSoundBuffer(DSDEV(dev)->pDSound, &desc, &pDSBuffer, NULL);
+  if (FAILED(hr)) return hr;
+  hr = pDSBuffer->lpVtbl->QueryInterface(pDSBuffer, &IID_IDirectSoundBuffer8, (void**)&pDSBuffer8);
+  pDSBuffer->lpVtbl->Release(pDSBuffer);
+  if (FAILED(hr)) return hr;
+
+  *out = DSBuffer_new(DSDEV(dev), pDSBuffer8, pcmwf.Format.nBlockAlign);
+  if (!*out) {
+    pDSBuffer8->lpVtbl->Release(pDSBuffer8);
+    return DSERR_OUTOFMEMORY;
+  }
+  return DS_OK;
+}
+
+static HRESULT
+DSDevice_DuplicateBuffer(LPSBDEVICE dev, LPSBBUFFER src, LPSBBUFFER *out)
+{
+  LPDIRECTSOUNDBUFFER8  pDSBuffer8;
+  HRESULT               hr;
+
+  // ミキサーが持っているバッファーはミキサーで複製する
+  if (src->lpVtbl != &DSBuffer_vtbl) return DSDEV(dev)->mix->lpVtbl->DuplicateBuffer(DSDEV(dev)->mix, src, out);
+
+  hr = DSDEV(dev)->pDSound->lpVtbl->DuplicateSoundBuffer(DSDEV(dev)->pDSound, (LPDIRECTSOUNDBUFFER)DSBUF(src), (LPDIRECTSOUNDBUFFER *)&pDSBuffer8);
+  if (FAILED(hr)) return hr;
+
+  *out = DSBuffer_new(DSDEV(dev), pDSBuffer8, ((struct DSBuffer *)src)->block_align);
+  if (!*out) {
+    pDSBuffer8->lpVtbl->Release(pDSBuffer8);
+    return DSERR_OUTOFMEMORY;
+  }
+  return DS_OK;
+}
+
+static HRESULT
+DSDevice_GetFormat(LPSBDEVICE dev, LPWAVEFORMATEX pcmwf)
+{
+  DWORD   wSizeWritten;
+  HRESULT hr;
+  LPDIRECTSOUNDBUFFER g_pDSBuffer = DSDEV(dev)->pDSBuffer;
+
+  hr = g_pDSBuffer->lpVtbl->GetFormat(g_pDSBuffer, NULL, 0, &wSizeWritten);
+  if (FAILED(hr)) return hr;
+  if (wSizeWritten != sizeof(WAVEFORMATEX)) return DSERR_BADFORMAT;
+  return g_pDSBuffer->lpVtbl->GetFormat(g_pDSBuffer, pcmwf, sizeof(WAVEFORMATEX), NULL);
+}
+
+static HRESULT
+DSDevice_set_primary_format(LPSBDEVICE dev, LPCWAVEFORMATEX pcmwf)
+{
+  return DSDEV(dev)->pDSBuffer->lpVtbl->SetFormat(DSDEV(dev)->pDSBuffer, pcmwf);
+}
+
+static HRESULT
+DSDevice_SetFormat(LPSBDEVICE dev, LPCWAVEFORMATEX pcmwf)
+{
+  struct DSDevice *d = DSDEV(dev);
+  HRESULT hr;
+
+  // ミキサーがあればミキサーの形式も合わせる。プライマリーバッファーはシンク経由で設定される
+  if (d->mix) hr = d->mix->lpVtbl->SetFormat(d->mix, pcmwf);
+  else        hr = DSDevice_set_primary_format(dev, pcmwf);
+  if (FAILED(hr)) return hr;
+  // クロックはここまでの分を残して、新しい周波数で数え続ける
+  sb_mutex_lock(&d->loop_lock);
+  d->clock_base = DSDevice_clock(d);
+  d->clock_ns   = sb_clock_ns();
+  d->clock_rate = pcmwf->nSamplesPerSec;
+  sb_mutex_unlock(&d->loop_lock);
+  return hr;
+}
+
+static HRESULT
+DSDevice_GetVolume(LPSBDEVICE dev, LPLONG volume)
+{
+  return DSDEV(dev)->pDSBuffer->lpVtbl->GetVolume(DSDEV(dev)->pDSBuffer, volume);
+}
+
+static HRESULT
+DSDevice_SetVolume(LPSBDEVICE dev, LONG volume)
+{
+  return DSDEV(dev)->pDSBuffer->lpVtbl->SetVolume(DSDEV(dev)->pDSBuffer, volume);
+}
+
+static HRESULT
+DSDevice_Render(LPSBDEVICE dev, DWORD count, LPSBBUFFER *buffers, DWORD frames, LPCWAVEFORMATEX wfx, LPVOID out)
+{
+  // ミックス結果はサウンドカードに行くので取り出せない
+  return DSERR_UNSUPPORTED;
+}
+
+static HRESULT
+DSDevice_GetClock(LPSBDEVICE dev, uint64_t *clock)
+{
+  sb_mutex_lock(&DSDEV(dev)->loop_lock);
+  *clock = DSDevice_clock(DSDEV(dev));
+  sb_mutex_unlock(&DSDEV(dev)->loop_lock);
+  return DS_OK;
+}
+
+static HRESULT
+DSDevice_Schedule(LPSBDEVICE dev, LPCSBSCHEDULE ev)
+{
+  struct DSDevice *d = DSDEV(dev);
+  SBSCHEDULE  mixed;
+  uint64_t    clock, mix_clock;
+  BOOL        ok;
+  HRESULT     hr;
+
+  if (!ev->lpBuffer || ev->dwAction >= SBSCHED_COUNT) return DSERR_INVALIDPARAM;
+  // ミキサーが持っているバッファーは、ミキサーのクロックでの時刻に直して渡す
+  if (ev->lpBuffer->lpVtbl != &DSBuffer_vtbl) {
+    hr = d->mix->lpVtbl->GetClock(d->mix, &mix_clock);
+    if (FAILED(hr)) return hr;
+    sb_mutex_lock(&d->loop_lock);
+    clock = DSDevice_clock(d);
+    sb_mutex_unlock(&d->loop_lock);
+    mixed = *ev;
+    mixed.qwFrame = ev->qwFrame > clock ? mix_clock + (ev->qwFrame - clock) : mix_clock;
+    return d->mix->lpVtbl->Schedule(d->mix, &mixed);
+  }
+  sb_mutex_lock(&d->loop_lock);
+  ok = sb_sched_push(&d->sched, ev);
+  sb_mutex_unlock(&d->loop_lock);
+  if (!ok) return DSERR_OUTOFMEMORY;
+  // 眠る時間を決め直させる
+  sb_event_set(d->loop_wake);
+  return DS_OK;
+}
+
+static HRESULT
+DSDevice_Unschedule(LPSBDEVICE dev, LPSBBUFFER buf, LPDWORD cancelled)
+{
+  struct DSDevice *d = DSDEV(dev);
+  DWORD   n = 0, m = 0;
+  HRESULT hr = DS_OK;
+
+  if (buf && buf->lpVtbl != &DSBuffer_vtbl) return d->mix->lpVtbl->Unschedule(d->mix, buf, cancelled);
+  if (!buf && d->mix) hr = d->mix->lpVtbl->Unschedule(d->mix, NULL, &m);
+  sb_mutex_lock(&d->loop_lock);
+  n = sb_sched_remove(&d->sched, buf);
+  sb_mutex_unlock(&d->loop_lock);
+  if (cancelled) *cancelled = n + m;
+  return hr;
+}
+
+static HRESULT
+DSDevice_GetScheduled(LPSBDEVICE dev, LPSBBUFFER buf, LPDWORD count)
+{
+  struct DSDevice *d = DSDEV(dev);
+  DWORD   m = 0;
+  HRESULT hr = DS_OK;
+
+  if (buf && buf->lpVtbl != &DSBuffer_vtbl) return d->mix->lpVtbl->GetScheduled(d->mix, buf, count);
+  if (!buf && d->mix) hr = d->mix->lpVtbl->GetScheduled(d->mix, NULL, &m);
+  sb_mutex_lock(&d->loop_lock);
+  *count = sb_sched_count(&d->sched, buf) + m;
+  sb_mutex_unlock(&d->loop_lock);
+  return hr;
+}
+
+static void
+DSDevice_Release(LPSBDEVICE dev)
+{
+  struct DSDevice *d = DSDEV(dev);
+  struct DSLoop   *l;
+
+  // バッファーはすべて解放済み。ミキサーのシンクのバッファーはここで解放される
+  if (d->mix) d->mix->lpVtbl->Release(d->mix);
+  if (d->loop_running) {
+    sb_mutex_lock(&d->loop_lock);
+    d->loop_quit = TRUE;
+    sb_mutex_unlock(&d->loop_lock);
+    sb_event_set(d->loop_wake);
+    sb_thread_join(d->loop_thread);
+  }
+  while ((l = d->loops) != NULL) {
+    d->loops = l->next;
+    DSLoop_free(l);
+  }
+  sb_sched_clear(&d->sched);
+  if (d->loop_wake) sb_event_close(d->loop_wake);
+  sb_mutex_destroy(&d->loop_lock);
+  if (d->pDSBuffer) d->pDSBuffer->lpVtbl->Release(d->pDSBuffer);
+  if (d->pDSound)   d->pDSound->lpVtbl->Release(d->pDSound);
+  if (d->hWnd)      DestroyWindow(d->hWnd);
+  free(d);
+  CoUninitialize();
+}
+
+static const struct SBDeviceVtbl DSDevice_vtbl = {
+  DSDevice_CreateBuffer,
+  DSDevice_DuplicateBuffer,
+  DSDevice_GetFormat,
+  DSDevice_SetFormat,
+  DSDevice_GetVolume,
+  DSDevice_SetVolume,
+  DSDevice_Render,
+  DSDevice_Release,
+  DSDevice_GetClock,
+  DSDevice_Schedule,
+  DSDevice_Unschedule,
+  DSDevice_GetScheduled,
+};
+
+HRESULT
+SBDSoundCreate(LPSBDEVICE *out)
+{
+  HINSTANCE     hInstance;
+  WNDCLASSEX    wcex;
+  DSBUFFERDESC  desc;
+  WAVEFORMATEX  wfx;
+  HRESULT       hr;
+  struct DSDevice *d;
+
+  d = calloc(1, sizeof(struct DSDevice));
+  if (!d) return DSERR_OUTOFMEMORY;
+  d->base.lpVtbl = &DSDevice_vtbl;
+  d->base.name   = "dsound";
+  d->base.dwCaps = SBCAPS_NATIVELOOP;
+  sb_mutex_init(&d->loop_lock);
+  d->loop_wake   = sb_event_create(FALSE);
+  if (!d->loop_wake) {
+    sb_mutex_destroy(&d->loop_lock);
+    free(d);
+    return DSERR_OUTOFMEMORY;
+  }
+
+  // COM初期化
+  CoInitialize(NULL);
+
+  // ウィンドウクラス設定
+  hInstance = (HINSTANCE)GetModuleHandle(NULL);
+  wcex.cbSize        = sizeof(WNDCLASSEX);
+  wcex.style         = 0;
+  wcex.lpfnWndProc   = DefWindowProc;
+  wcex.cbClsExtra    = 0;
+  wcex.cbWndExtra    = 0;
+  wcex.hInstance     = hInstance;
+  wcex.hIcon         = 0;
+  wcex.hIconSm       = 0;
+  wcex.hCursor       = 0;
+  wcex.hbrBackground = 0;
+  wcex.lpszMenuName  = NULL;
+  wcex.lpszClassName = "SoundBuffer";
+
+  // ウィンドウ生成
+  RegisterClassEx(&wcex);
+  d->hWnd = CreateWindow("SoundBuffer", "", 0, 0, 0, 0, 0, 0, NULL, hInstance, NULL);
+
+  // DirectSoundオブジェクト生成
+  hr = DirectSoundCreate8(&DSDEVID_DefaultPlayback, &d->pDSound, NULL);
+  if (FAILED(hr)) goto error;
+
+  // 協調レベル設定
+  hr = d->pDSound->lpVtbl->SetCooperativeLevel(d->pDSound, d->hWnd, DSSCL_PRIORITY);
+  if (FAILED(hr)) goto error;
+
+  /*
+   *  get primarybuffer
+   */
+  desc.dwSize           = sizeof(DSBUFFERDESC);
+  desc.dwFlags          = DSBCAPS_PRIMARYBUFFER | DSBCAPS_CTRLVOLUME;
+  desc.dwBufferBytes    = 0;
+  desc.dwReserved       = 0;
+  desc.lpwfxFormat      = NULL;
+  desc.guid3DAlgorithm  = DS3DALG_DEFAULT;
+
+  hr = d->pDSound->lpVtbl->CreateSoundBuffer(d->pDSound, &desc, &d->pDSBuffer, NULL);
+  if (FAILED(hr)) goto error;
+
+  // サンプル・クロックはここから数える
+  hr = DSDevice_GetFormat(&d->base, &wfx);
+  if (FAILED(hr)) goto error;
+  d->clock_ns   = sb_clock_ns();
+  d->clock_rate = wfx.nSamplesPerSec;
+
+  *out = &d->base;
+  return DS_OK;
+
+error:
+  DSDevice_Release(&d->base);
+  return hr;
+}
+
+/*
+ * buffer
+ */
+static void
+DSBuffer_Release(LPSBBUFFER buf)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+
+  SB_STATS_CALL(buf);
+  // イベントはサービス・スレッドが待ち終わってから閉じる
+  sb_mutex_lock(&b->dev->loop_lock);
+  b->loop->buf = NULL;
+  sb_sched_remove(&b->dev->sched, buf);
+  sb_mutex_unlock(&b->dev->loop_lock);
+  sb_event_set(b->dev->loop_wake);
+  DSBUF(buf)->lpVtbl->Stop(DSBUF(buf));
+  DSBuffer_fx_release(b);
+  DSBUF(buf)->lpVtbl->Release(DSBUF(buf));
+  free(b->notify);
+  free(b->fx);
+  free(buf);
+}
+
+static HRESULT
+DSBuffer_Lock(LPSBBUFFER buf, DWORD offset, DWORD bytes, LPVOID *ptr1, LPDWORD size1, LPVOID *ptr2, LPDWORD size2, DWORD flags)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->Lock(DSBUF(buf), offset, bytes, ptr1, size1, ptr2, size2, flags);
+}
+
+static HRESULT
+DSBuffer_Unlock(LPSBBUFFER buf, LPVOID ptr1, DWORD size1, LPVOID ptr2, DWORD size2)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->Unlock(DSBUF(buf), ptr1, size1, ptr2, size2);
+}
+
+static HRESULT
+DSBuffer_Play(LPSBBUFFER buf, DWORD flags)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->Play(DSBUF(buf), 0, 0, flags);
+}
+
+static HRESULT
+DSBuffer_Stop(LPSBBUFFER buf)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->Stop(DSBUF(buf));
+}
+
+static HRESULT
+DSBuffer_GetStatus(LPSBBUFFER buf, LPDWORD status)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->GetStatus(DSBUF(buf), status);
+}
+
+static HRESULT
+DSBuffer_GetCurrentPosition(LPSBBUFFER buf, LPDWORD play, LPDWORD write)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->GetCurrentPosition(DSBUF(buf), play, write);
+}
+
+static HRESULT
+DSBuffer_SetCurrentPosition(LPSBBUFFER buf, DWORD pos)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->SetCurrentPosition(DSBUF(buf), pos);
+}
+
+// 直接の設定が来たら、そのパラメーターの自動変化は止める
+static void
+DSBuffer_auto_cancel(struct DSBuffer *b, DWORD param)
+{
+  sb_mutex_lock(&b->dev->loop_lock);
+  sb_auto_clear(&b->loop->autos[param]);
+  sb_mutex_unlock(&b->dev->loop_lock);
+}
+
+static HRESULT
+DSBuffer_GetVolume(LPSBBUFFER buf, LPLONG volume)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->GetVolume(DSBUF(buf), volume);
+}
+
+static HRESULT
+DSBuffer_SetVolume(LPSBBUFFER buf, LONG volume)
+{
+  SB_STATS_CALL(buf);
+  DSBuffer_auto_cancel((struct DSBuffer *)buf, SBPARAM_VOLUME);
+  return DSBUF(buf)->lpVtbl->SetVolume(DSBUF(buf), volume);
+}
+
+static HRESULT
+DSBuffer_GetPan(LPSBBUFFER buf, LPLONG pan)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->GetPan(DSBUF(buf), pan);
+}
+
+static HRESULT
+DSBuffer_SetPan(LPSBBUFFER buf, LONG pan)
+{
+  SB_STATS_CALL(buf);
+  DSBuffer_auto_cancel((struct DSBuffer *)buf, SBPARAM_PAN);
+  return DSBUF(buf)->lpVtbl->SetPan(DSBUF(buf), pan);
+}
+
+static HRESULT
+DSBuffer_GetFrequency(LPSBBUFFER buf, LPDWORD frequency)
+{
+  SB_STATS_CALL(buf);
+  return DSBUF(buf)->lpVtbl->GetFrequency(DSBUF(buf), frequency);
+}
+
+static HRESULT
+DSBuffer_SetFrequency(LPSBBUFFER buf, DWORD frequency)
+{
+  SB_STATS_CALL(buf);
+  DSBuffer_auto_cancel((struct DSBuffer *)buf, SBPARAM_FREQUENCY);
+  return DSBUF(buf)->lpVtbl->SetFrequency(DSBUF(buf), frequency);
+}
+
+// 先頭にループ終端の通知を足して設定する
+static HRESULT
+DSBuffer_apply_notify(struct DSBuffer *b, DWORD count, LPCSBPOSITIONNOTIFY notify, DWORD loop_end)
+{
+  LPDIRECTSOUNDNOTIFY8  lpDsNotify;
+  LPDSBPOSITIONNOTIFY   PositionNotify;
+  DWORD                 i;
+  HRESULT               hr;
+
+  hr = b->pDSBuffer8->lpVtbl->QueryInterface(b->pDSBuffer8, &IID_IDirectSoundNotify8, (LPVOID*)&lpDsNotify);
+  if (FAILED(hr)) return hr;
+  PositionNotify = _alloca(sizeof(DSBPOSITIONNOTIFY) * (count + 1));
+  PositionNotify[0].dwOffset     = loop_end;
+  PositionNotify[0].hEventNotify = b->loop->event;
+  for (i = 0; i < count; i++) {
+    PositionNotify[i + 1].dwOffset     = notify[i].dwOffset;
+    PositionNotify[i + 1].hEventNotify = notify[i].hEventNotify;
+  }
+  hr = lpDsNotify->lpVtbl->SetNotificationPositions(lpDsNotify, count + 1, PositionNotify);
+  lpDsNotify->lpVtbl->Release(lpDsNotify);
+  return hr;
+}
+
+static HRESULT
+DSBuffer_SetNotificationPositions(LPSBBUFFER buf, DWORD count, LPCSBPOSITIONNOTIFY notify)
+{
+  struct DSBuffer   *b = (struct DSBuffer *)buf;
+  LPSBPOSITIONNOTIFY copy = NULL;
+  DWORD              loop_end;
+  HRESULT            hr;
+
+  SB_STATS_CALL(buf);
+  if (count) {
+    copy = malloc(sizeof(SBPOSITIONNOTIFY) * count);
+    if (!copy) return DSERR_OUTOFMEMORY;
+    memcpy(copy, notify, sizeof(SBPOSITIONNOTIFY) * count);
+  }
+  sb_mutex_lock(&b->dev->loop_lock);
+  loop_end = b->loop->loop.dwEnd;
+  sb_mutex_unlock(&b->dev->loop_lock);
+  hr = DSBuffer_apply_notify(b, count, copy, loop_end);
+  if (FAILED(hr)) {
+    free(copy);
+    return hr;
+  }
+  free(b->notify);
+  b->notify       = copy;
+  b->notify_count = count;
+  return hr;
+}
+
+/*
+ * エフェクトのクラスとインターフェース。FX_*の順
+ */
+static const struct {
+  const GUID *guid;
+  const IID  *iid;
+} DSFX_CLASS[] = {
+  { &GUID_DSFX_STANDARD_GARGLE,      &IID_IDirectSoundFXGargle8      },
+  { &GUID_DSFX_STANDARD_CHORUS,      &IID_IDirectSoundFXChorus8      },
+  { &GUID_DSFX_STANDARD_FLANGER,     &IID_IDirectSoundFXFlanger8     },
+  { &GUID_DSFX_STANDARD_ECHO,        &IID_IDirectSoundFXEcho8        },
+  { &GUID_DSFX_STANDARD_DISTORTION,  &IID_IDirectSoundFXDistortion8  },
+  { &GUID_DSFX_STANDARD_COMPRESSOR,  &IID_IDirectSoundFXCompressor8  },
+  { &GUID_DSFX_STANDARD_PARAMEQ,     &IID_IDirectSoundFXParamEq8     },
+  { &GUID_DSFX_STANDARD_I3DL2REVERB, &IID_IDirectSoundFXI3DL2Reverb8 },
+  { &GUID_DSFX_WAVES_REVERB,         &IID_IDirectSoundFXWavesReverb8 },
+};
+
+/*
+ * 並びの各エフェクトのインターフェースをGetObjectInPathで取り、並びを替えるか解放するまで持っておく。
+ * GetObjectInPathの番号はクラスごとに数えるので、GUID_All_Objectsで並びの位置を指定する。
+ * 取れなかった枠はNULLのままで、パラメーターの読み書きはDSERR_OBJECTNOTFOUNDになる
+ */
+static HRESULT
+DSBuffer_fx_acquire(struct DSBuffer *b)
+{
+  DWORD   i;
+  LPVOID  pObject;
+  HRESULT hr, result = DS_OK;
+
+  for (i = 0; i < b->fx_count; i++) {
+    hr = b->pDSBuffer8->lpVtbl->GetObjectInPath(b->pDSBuffer8, &GUID_All_Objects, i, DSFX_CLASS[b->fx[i].fx].iid, &pObject);
+    if (FAILED(hr)) {
+      result = hr;
+      continue;
+    }
+    b->fx[i].iface = pObject;
+  }
+  return result;
+}
+
+static void
+DSBuffer_fx_release(struct DSBuffer *b)
+{
+  DWORD i;
+
+  for (i = 0; i < b->fx_count; i++) {
+    if (!b->fx[i].iface) continue;
+    b->fx[i].iface->lpVtbl->Release(b->fx[i].iface);
+    b->fx[i].iface = NULL;
+  }
+}
+
+/*
+ * DirectSoundが並びを作り直す前に、持っているインターフェースを手放す。
+ * 失敗したら並びは前のままなので、取り直す
+ */
+static HRESULT
+DSBuffer_SetFX(LPSBBUFFER buf, DWORD count, const DWORD *fx_nums)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+  struct DSFXSlot *slots = NULL;
+  DWORD            i;
+  LPDSEFFECTDESC   pDSFXDesc = NULL;
+  HRESULT          hr;
+
+  SB_STATS_CALL(buf);
+  if (count) {
+    pDSFXDesc = _alloca(sizeof(DSEFFECTDESC) * count);
+    for (i = 0; i < count; i++) {
+      if (fx_nums[i] > FX_WAVES_REVERB) return DSERR_INVALIDPARAM;
+      pDSFXDesc[i].dwSize        = sizeof(DSEFFECTDESC);
+      pDSFXDesc[i].dwFlags       = DSFX_LOCSOFTWARE;      // dwFlagは強制的にソフトウェアー配置
+      pDSFXDesc[i].guidDSFXClass = *DSFX_CLASS[fx_nums[i]].guid;
+      pDSFXDesc[i].dwReserved1   = 0;
+      pDSFXDesc[i].dwReserved2   = 0;
+    }
+    slots = calloc(count, sizeof(struct DSFXSlot));
+    if (!slots) return DSERR_OUTOFMEMORY;
+    for (i = 0; i < count; i++) slots[i].fx = fx_nums[i];
+  }
+  DSBuffer_fx_release(b);
+  hr = DSBUF(buf)->lpVtbl->SetFX(DSBUF(buf), count, pDSFXDesc, NULL);
+  if (FAILED(hr)) {
+    free(slots);
+    DSBuffer_fx_acquire(b);
+    return hr;
+  }
+  free(b->fx);
+  b->fx       = slots;
+  b->fx_count = count;
+  return DSBuffer_fx_acquire(b);
+}
+
+/*
+ * エフェクト・パラメーターの取得と設定
+ * 持っておいたインターフェースのGet/SetAllParametersを呼ぶ。
+ */
+#define DSFX_ALL_PARAMETERS(method, iface, type) \
+  return ((struct iface *)pObject)->lpVtbl->method((struct iface *)pObject, (type *)params)
+
+// idx番目がfxならそのインターフェース。違えばNULL（GetObjectInPathと同じくDSERR_OBJECTNOTFOUNDにする）
+static LPVOID
+DSBuffer_fx_object(LPSBBUFFER buf, DWORD idx, DWORD fx)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+
+  if (idx < b->fx_count && b->fx[idx].fx == fx) return b->fx[idx].iface;
+  return NULL;
+}
+
+static HRESULT
+DSBuffer_get_fx(LPSBBUFFER buf, DWORD idx, DWORD fx, LPVOID params)
+{
+  LPVOID pObject = DSBuffer_fx_object(buf, idx, fx);
+
+  if (!pObject) return DSERR_OBJECTNOTFOUND;
+  switch (fx) {
+    case FX_GARGLE:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXGargle8,      DSFXGargle);
+    case FX_CHORUS:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXChorus8,      DSFXChorus);
+    case FX_FLANGER:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXFlanger8,     DSFXFlanger);
+    case FX_ECHO:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXEcho8,        DSFXEcho);
+    case FX_DISTORTION:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXDistortion8,  DSFXDistortion);
+    case FX_COMPRESSOR:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXCompressor8,  DSFXCompressor);
+    case FX_PARAM_EQ:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXParamEq8,     DSFXParamEq);
+    case FX_I3DL2_REVERB:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXI3DL2Reverb8, DSFXI3DL2Reverb);
+    case FX_WAVES_REVERB:
+      DSFX_ALL_PARAMETERS(GetAllParameters, IDirectSoundFXWavesReverb8, DSFXWavesReverb);
+    default:
+      return DSERR_INVALIDPARAM;
+  }
+}
+
+static HRESULT
+DSBuffer_set_fx(LPSBBUFFER buf, DWORD idx, DWORD fx, LPCVOID params)
+{
+  LPVOID pObject = DSBuffer_fx_object(buf, idx, fx);
+
+  if (!pObject) return DSERR_OBJECTNOTFOUND;
+  switch (fx) {
+    case FX_GARGLE:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXGargle8,      const DSFXGargle);
+    case FX_CHORUS:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXChorus8,      const DSFXChorus);
+    case FX_FLANGER:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXFlanger8,     const DSFXFlanger);
+    case FX_ECHO:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXEcho8,        const DSFXEcho);
+    case FX_DISTORTION:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXDistortion8,  const DSFXDistortion);
+    case FX_COMPRESSOR:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXCompressor8,  const DSFXCompressor);
+    case FX_PARAM_EQ:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXParamEq8,     const DSFXParamEq);
+    case FX_I3DL2_REVERB:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXI3DL2Reverb8, const DSFXI3DL2Reverb);
+    case FX_WAVES_REVERB:
+      DSFX_ALL_PARAMETERS(SetAllParameters, IDirectSoundFXWavesReverb8, const DSFXWavesReverb);
+    default:
+      return DSERR_INVALIDPARAM;
+  }
+}
+
+// idx番目がバイパス中のfxならその枠を返す
+static struct DSFXSlot *
+DSBuffer_bypassed_slot(LPSBBUFFER buf, DWORD idx, DWORD fx)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+
+  if (idx < b->fx_count && b->fx[idx].bypass && b->fx[idx].fx == fx) return &b->fx[idx];
+  return NULL;
+}
+
+static HRESULT
+DSBuffer_GetFXParameters(LPSBBUFFER buf, DWORD idx, DWORD fx, LPVOID params)
+{
+  struct DSFXSlot *slot;
+
+  SB_STATS_CALL(buf);
+  slot = DSBuffer_bypassed_slot(buf, idx, fx);
+  if (slot) {
+    memcpy(params, &slot->saved, sb_fx_param_size(fx));
+    return DS_OK;
+  }
+  return DSBuffer_get_fx(buf, idx, fx, params);
+}
+
+static HRESULT
+DSBuffer_SetFXParameters(LPSBBUFFER buf, DWORD idx, DWORD fx, LPCVOID params)
+{
+  struct DSFXSlot *slot;
+
+  SB_STATS_CALL(buf);
+  slot = DSBuffer_bypassed_slot(buf, idx, fx);
+  if (slot) {
+    if (!sb_fx_valid(fx, params)) return DSERR_INVALIDPARAM;
+    memcpy(&slot->saved, params, sb_fx_param_size(fx));
+    return DS_OK;
+  }
+  return DSBuffer_set_fx(buf, idx, fx, params);
+}
+
+/*
+ * バイパスは効きが無くなるパラメーターに入れ替えて行う。DMOが値を滑らかに変えるかは実装しだい。
+ * ガーグルとディストーションには効きを無くすパラメーターが無いのでDSERR_UNSUPPORTED
+ */
+static HRESULT
+DSBuffer_SetFXBypass(LPSBBUFFER buf, DWORD idx, BOOL bypass)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+  struct DSFXSlot *slot;
+  struct DSFXSlot  neutral;
+  HRESULT          hr;
+
+  SB_STATS_CALL(buf);
+  if (idx >= b->fx_count) return DSERR_OBJECTNOTFOUND;
+  slot = &b->fx[idx];
+  if (!bypass == !slot->bypass) return DS_OK;
+  if (!bypass) {
+    hr = DSBuffer_set_fx(buf, idx, slot->fx, &slot->saved);
+    if (SUCCEEDED(hr)) slot->bypass = FALSE;
+    return hr;
+  }
+  if (slot->fx == FX_GARGLE || slot->fx == FX_DISTORTION) return DSERR_UNSUPPORTED;
+  hr = DSBuffer_get_fx(buf, idx, slot->fx, &slot->saved);
+  if (FAILED(hr)) return hr;
+  neutral = *slot;
+  switch (slot->fx) {
+    case FX_CHORUS:       neutral.saved.chorus.fWetDryMix  = DSFXCHORUS_WETDRYMIX_MIN;  break;
+    case FX_FLANGER:      neutral.saved.flanger.fWetDryMix = DSFXFLANGER_WETDRYMIX_MIN; break;
+    case FX_ECHO:         neutral.saved.echo.fWetDryMix    = DSFXECHO_WETDRYMIX_MIN;    break;
+    case FX_COMPRESSOR:
+      neutral.saved.compressor.fRatio = DSFXCOMPRESSOR_RATIO_MIN;
+      neutral.saved.compressor.fGain  = 0.0f;
+      break;
+    case FX_PARAM_EQ:     neutral.saved.parameq.fGain      = 0.0f;                      break;
+    case FX_I3DL2_REVERB: neutral.saved.i3dl2.lRoom        = DSFX_I3DL2REVERB_ROOM_MIN; break;
+    case FX_WAVES_REVERB:
+      neutral.saved.waves.fInGain    = 0.0f;
+      neutral.saved.waves.fReverbMix = DSFX_WAVESREVERB_REVERBMIX_MIN;
+      break;
+  }
+  hr = DSBuffer_set_fx(buf, idx, slot->fx, &neutral.saved);
+  if (SUCCEEDED(hr)) slot->bypass = TRUE;
+  return hr;
+}
+
+/*
+ * ループ区間はサービス・スレッドが処理する。
+ * 終端が変わったときだけ通知位置を設定し直す（DirectSoundでは止まっているときしかできない）。
+ */
+static HRESULT
+DSBuffer_SetLoop(LPSBBUFFER buf, LPCSBLOOP loop)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+  DWORD            old_end;
+  HRESULT          hr;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->loop_lock);
+  old_end = b->loop->loop.dwEnd;
+  sb_mutex_unlock(&b->dev->loop_lock);
+  if (loop->dwEnd != old_end) {
+    hr = DSBuffer_apply_notify(b, b->notify_count, b->notify, loop->dwEnd);
+    if (FAILED(hr)) return hr;
+  }
+  sb_mutex_lock(&b->dev->loop_lock);
+  b->loop->loop = *loop;
+  sb_mutex_unlock(&b->dev->loop_lock);
+  return DS_OK;
+}
+
+static HRESULT
+DSBuffer_GetLoop(LPSBBUFFER buf, LPSBLOOP loop)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->loop_lock);
+  *loop = b->loop->loop;
+  sb_mutex_unlock(&b->dev->loop_lock);
+  return DS_OK;
+}
+
+// DirectSoundは逆再生できない
+static HRESULT
+DSBuffer_SetDirection(LPSBBUFFER buf, LONG direction)
+{
+  SB_STATS_CALL(buf);
+  return direction == 1 ? DS_OK : DSERR_UNSUPPORTED;
+}
+
+static HRESULT
+DSBuffer_GetDirection(LPSBBUFFER buf, LPLONG direction)
+{
+  SB_STATS_CALL(buf);
+  *direction = 1;
+  return DS_OK;
+}
+
+static HRESULT
+DSBuffer_SetAutomation(LPSBBUFFER buf, DWORD param, DWORD count, LPCSBBREAKPOINT points)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+  struct DSLoop   *l = b->loop;
+  WAVEFORMATEX     wfx;
+  LONG             value;
+  DWORD            frequency;
+  HRESULT          hr;
+  BOOL             ok;
+
+  SB_STATS_CALL(buf);
+  if (!sb_auto_valid(param, count, points)) return DSERR_INVALIDPARAM;
+  hr = b->dev->base.lpVtbl->GetFormat(&b->dev->base, &wfx);
+  if (FAILED(hr)) return hr;
+  switch (param) {
+  case SBPARAM_VOLUME:    hr = b->pDSBuffer8->lpVtbl->GetVolume(b->pDSBuffer8, &value); break;
+  case SBPARAM_PAN:       hr = b->pDSBuffer8->lpVtbl->GetPan(b->pDSBuffer8, &value);    break;
+  default:
+    hr    = b->pDSBuffer8->lpVtbl->GetFrequency(b->pDSBuffer8, &frequency);
+    value = (LONG)frequency;
+    break;
+  }
+  if (FAILED(hr)) return hr;
+
+  sb_mutex_lock(&b->dev->loop_lock);
+  ok = sb_auto_set(&l->autos[param], value, count, points);
+  l->auto_ns   = sb_clock_ns();
+  l->auto_rate = wfx.nSamplesPerSec;
+  // 長さ0の折れ点はすぐに効く
+  if (ok && count) DSLoop_auto_store(l, param, l->autos[param].value);
+  sb_mutex_unlock(&b->dev->loop_lock);
+  // 待ち時間を決め直させる
+  sb_event_set(b->dev->loop_wake);
+  return ok ? DS_OK : DSERR_OUTOFMEMORY;
+}
+
+static HRESULT
+DSBuffer_GetAutomation(LPSBBUFFER buf, DWORD param, LPDWORD remaining)
+{
+  struct DSBuffer *b = (struct DSBuffer *)buf;
+
+  SB_STATS_CALL(buf);
+  if (param >= SBPARAM_COUNT) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->loop_lock);
+  *remaining = sb_auto_remaining(&b->loop->autos[param]);
+  sb_mutex_unlock(&b->dev->loop_lock);
+  return DS_OK;
+}
+
+static const struct SBBufferVtbl DSBuffer_vtbl = {
+  DSBuffer_Release,
+  DSBuffer_Lock,
+  DSBuffer_Unlock,
+  DSBuffer_Play,
+  DSBuffer_Stop,
+  DSBuffer_GetStatus,
+  DSBuffer_GetCurrentPosition,
+  DSBuffer_SetCurrentPosition,
+  DSBuffer_GetVolume,
+  DSBuffer_SetVolume,
+  DSBuffer_GetPan,
+  DSBuffer_SetPan,
+  DSBuffer_GetFrequency,
+  DSBuffer_SetFrequency,
+  DSBuffer_SetNotificationPositions,
+  DSBuffer_SetFX,
+  DSBuffer_GetFXParameters,
+  DSBuffer_SetFXParameters,
+  DSBuffer_SetLoop,
+  DSBuffer_GetLoop,
+  DSBuffer_SetDirection,
+  DSBuffer_GetDirection,
+  DSBuffer_SetAutomation,
+  DSBuffer_GetAutomation,
+  DSBuffer_SetFXBypass,
+};
+
+/*
+ * sink
+ * ソフトウェアー・ミキサーの出力先。DirectSoundのセカンダリーバッファーを1本だけ作って
+ * リピート再生し、再生カーソルから一定の先行量になるまで書き足していく。
+ * 同時発音がいくつあってもDirectSoundのバッファーはこの1本だけになる。
+ */
+#define DSSINK_BUFFER_MS    200
+#define DSSINK_LATENCY_MS   40
+
+struct DSSink {
+  SBSink        base;
+  LPSBDEVICE    dev;
+  LPSBBUFFER    buf;
+  WAVEFORMATEX  wfx;
+  DWORD         bytes;
+  DWORD         next;   // 次に書く位置
+  BOOL          owner;  // devを解放するか
+};
+
+#define DSSINK(sink) ((struct DSSink *)(sink))
+
+static void
+DSSink_close(struct DSSink *s)
+{
+  if (s->buf) {
+    s->buf->lpVtbl->Release(s->buf);
+    s->buf = NULL;
+  }
+}
+
+static DWORD
+DSSink_GetWritable(LPSBSINK sink)
+{
+  struct DSSink *s = DSSINK(sink);
+  DWORD   play, write, lead, target;
+  HRESULT hr;
+
+  if (!s->buf) return 0;
+  hr = s->buf->lpVtbl->GetCurrentPosition(s->buf, &play, &write);
+  if (FAILED(hr)) return 0;
+  target = s->wfx.nAvgBytesPerSec * DSSINK_LATENCY_MS / 1000;
+  lead   = (s->next + s->bytes - play) % s->bytes;
+  if (lead > target * 2) {
+    // 書き込みが追い越された。書き込みカーソルからやり直す
+    if (SB_STATS_ON) sb_stats_underrun(NULL);
+    s->next = write;
+    lead    = (s->next + s->bytes - play) % s->bytes;
+  }
+  return lead < target ? (target - lead) / s->wfx.nBlockAlign : 0;
+}
+
+static HRESULT
+DSSink_Write(LPSBSINK sink, LPCVOID pcm, DWORD frames)
+{
+  struct DSSink *s = DSSINK(sink);
+  LPVOID  ptr1, ptr2;
+  DWORD   size1, size2, bytes = frames * s->wfx.nBlockAlign;
+  HRESULT hr;
+
+  if (!s->buf || bytes == 0) return DS_OK;
+  hr = s->buf->lpVtbl->Lock(s->buf, s->next, bytes, &ptr1, &size1, &ptr2, &size2, 0);
+  if (FAILED(hr)) return hr;
+  memcpy(ptr1, pcm, size1);
+  if (ptr2) memcpy(ptr2, (const BYTE *)pcm + size1, size2);
+  hr = s->buf->lpVtbl->Unlock(s->buf, ptr1, size1, ptr2, size2);
+  s->next = (s->next + bytes) % s->bytes;
+  return hr;
+}
+
+static HRESULT
+DSSink_SetFormat(LPSBSINK sink, LPCWAVEFORMATEX wfx)
+{
+  struct DSSink *s = DSSINK(sink);
+  SBBUFFERDESC  desc;
+  LPVOID        ptr1, ptr2;
+  DWORD         size1, size2;
+  HRESULT       hr;
+
+  DSSink_close(s);
+  // プライマリーバッファーもミキサーの形式に合わせておく
+  hr = DSDevice_set_primary_format(s->dev, wfx);
+  if (FAILED(hr)) return hr;
+  s->wfx            = *wfx;
+  s->bytes          = wfx->nAvgBytesPerSec * DSSINK_BUFFER_MS / 1000 / wfx->nBlockAlign * wfx->nBlockAlign;
+  s->next           = 0;
+  desc.dwFlags      = 0;
+  desc.dwBufferBytes = s->bytes;
+  desc.lpwfxFormat  = wfx;
+  hr = s->dev->lpVtbl->CreateBuffer(s->dev, &desc, &s->buf);
+  if (FAILED(hr)) return hr;
+  hr = s->buf->lpVtbl->Lock(s->buf, 0, 0, &ptr1, &size1, &ptr2, &size2, DSBLOCK_ENTIREBUFFER);
+  if (SUCCEEDED(hr)) {
+    memset(ptr1, wfx->wBitsPerSample == 8 ? 0x80 : 0, size1);
+    s->buf->lpVtbl->Unlock(s->buf, ptr1, size1, NULL, 0);
+  }
+  return s->buf->lpVtbl->Play(s->buf, DSBPLAY_LOOPING);
+}
+
+static void
+DSSink_Release(LPSBSINK sink)
+{
+  struct DSSink *s = DSSINK(sink);
+
+  DSSink_close(s);
+  if (s->owner) s->dev->lpVtbl->Release(s->dev);
+  free(s);
+}
+
+static const struct SBSinkVtbl DSSink_vtbl = {
+  DSSink_GetWritable,
+  DSSink_Write,
+  DSSink_SetFormat,
+  DSSink_Release,
+};
+
+/*
+ * バッファーはSetFormatで作る
+ */
+static HRESULT
+DSSink_new(LPSBDEVICE dev, BOOL owner, LPSBSINK *out)
+{
+  struct DSSink *s;
+
+  s = calloc(1, sizeof(struct DSSink));
+  if (!s) {
+    if (owner) dev->lpVtbl->Release(dev);
+    return DSERR_OUTOFMEMORY;
+  }
+  s->base.lpVtbl = &DSSink_vtbl;
+  s->dev         = dev;
+  s->owner       = owner;
+  *out = &s->base;
+  return DS_OK;
+}
+
+HRESULT
+SBDSoundSinkCreate(LPSBSINK *out)
+{
+  LPSBDEVICE  dev;
+  HRESULT     hr;
+
+  hr = SBDSoundCreate(&dev);
+  if (FAILED(hr)) return hr;
+  return DSSink_new(dev, TRUE, out);
+}
+
+#endif /* HAVE_DSOUND_H */
@@ -0,0 +1,892 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sb_fx.h"
+#include "sb_mix.h"
+
+// 一度に処理するフレーム数。作業用の配列の大きさ
+#define FX_BLOCK    256
+
+#define FX_PI       3.14159265358979323846
+
+// 残響の遅延線の数と、初期反射のタップの数
+#define FX_LINES    4
+#define FX_TAPS     6
+
+/*
+ * 遅延線。大きさは2のべき乗で、posが次に書く位置
+ */
+typedef struct FxDelay {
+  float  *buf;
+  DWORD   mask;
+  DWORD   pos;
+} FXDELAY;
+
+/*
+ * 双2次フィルター（転置直接形II）。状態はチャンネルごと
+ */
+typedef struct FxBiquad {
+  float   b0, b1, b2, a1, a2;
+  float   z1[2], z2[2];
+} FXBIQUAD;
+
+struct FxGargle {
+  double  phase;
+};
+
+// コーラスとフランジャー
+struct FxMod {
+  FXDELAY line[2];
+  double  phase;
+  float   mix;
+  float   depth;
+  float   feedback;
+  float   delay;      // フレーム
+  double  inc;
+  double  offset;     // 右チャンネルのLFOの位相のずれ（周期を1とする）
+  LONG    wave;
+};
+
+struct FxEcho {
+  FXDELAY line[2];
+  DWORD   delay[2];
+  float   mix;
+  float   feedback;
+  LONG    pan;
+};
+
+struct FxDistortion {
+  FXBIQUAD pre;
+  FXBIQUAD post;      // 出力の音量も含む
+  float    drive;
+};
+
+struct FxCompressor {
+  FXDELAY line[2];
+  DWORD   delay;
+  float   env;
+  float   attack;
+  float   release;
+  float   slope;      // 閾値を越えたぶんを1 - 1/ratio倍だけ下げる
+  float   gain;       // 出力の音量（リニア）
+  float   level;      // 閾値（リニア）
+};
+
+struct FxParamEq {
+  FXBIQUAD eq;
+};
+
+/*
+ * 残響。I3DL2とWavesで共用する。
+ * 入力を遅延線（pre）に入れ、初期反射はそこからタップで、後部残響は拡散のオールパス2段を通して
+ * 4本の遅延線のフィードバック・ネットワーク（アダマール行列で混ぜる）に入れる。
+ * 遅延線ごとに、1周で残響時間ぶん減衰する音量と、高域を余計に落とす1次のローパスを持つ。
+ */
+struct FxReverb {
+  FXDELAY pre;
+  FXDELAY ap[2];
+  FXDELAY line[FX_LINES];
+  DWORD   ap_len[2];
+  DWORD   len[FX_LINES];
+  float   g[FX_LINES];
+  float   damp[FX_LINES];
+  float   lp[FX_LINES];
+  float   ap_gain;
+  float   in_damp;    // 入力の高域（RoomHF）
+  float   in_lp;
+  DWORD   tap[FX_TAPS];
+  float   tap_gain[FX_TAPS];
+  DWORD   late;       // preから後部残響へ入れる遅れ
+  float   dry;
+  float   wet;
+};
+
+struct SBFx {
+  DWORD   type;
+  DWORD   rate;
+  DWORD   channels;
+  float  *mem;        // 遅延線
+  DWORD   mem_count;
+  int     ready;      // 0なら素通し
+  int     bypass;
+  float   mix;        // 処理した音の割合。バイパスへ移る間は1から0へ動く
+  union {
+    DSFXGargle      gargle;
+    DSFXChorus      chorus;
+    DSFXFlanger     flanger;
+    DSFXEcho        echo;
+    DSFXDistortion  distortion;
+    DSFXCompressor  compressor;
+    DSFXParamEq     parameq;
+    DSFXI3DL2Reverb i3dl2;
+    DSFXWavesReverb waves;
+  } param;
+  union {
+    struct FxGargle     gargle;
+    struct FxMod        mod;
+    struct FxEcho       echo;
+    struct FxDistortion distortion;
+    struct FxCompressor compressor;
+    struct FxParamEq    parameq;
+    struct FxReverb     reverb;
+  } s;
+};
+
+static const DSFXGargle      fx_default_gargle      = { 20, DSFXGARGLE_WAVE_TRIANGLE };
+static const DSFXChorus      fx_default_chorus      = { 50.0f, 10.0f, 25.0f, 1.1f, DSFXCHORUS_WAVE_SIN, 16.0f, DSFXCHORUS_PHASE_90 };
+static const DSFXFlanger     fx_default_flanger     = { 50.0f, 100.0f, -50.0f, 0.25f, DSFXFLANGER_WAVE_SIN, 2.0f, DSFXFLANGER_PHASE_ZERO };
+static const DSFXEcho        fx_default_echo        = { 50.0f, 50.0f, 500.0f, 500.0f, 0 };
+static const DSFXDistortion  fx_default_distortion  = { -18.0f, 15.0f, 2400.0f, 2400.0f, 8000.0f };
+static const DSFXCompressor  fx_default_compressor  = { 0.0f, 10.0f, 200.0f, -20.0f, 3.0f, 4.0f };
+static const DSFXParamEq     fx_default_parameq     = { 8000.0f, 12.0f, 0.0f };
+static const DSFXI3DL2Reverb fx_default_i3dl2       = { -1000, -100, 0.0f, 1.49f, 0.83f, -2602, 0.007f, 200, 0.011f, 100.0f, 100.0f, 5000.0f };
+static const DSFXWavesReverb fx_default_waves       = { 0.0f, 0.0f, 1000.0f, 0.001f };
+
+/*
+ * 部品
+ */
+// framesフレームまで遅らせられる遅延線をmemのoffsetに置き、次のoffsetを返す。memがNULLなら数えるだけ
+static DWORD
+fx_delay_init(FXDELAY *d, float *mem, DWORD offset, double frames)
+{
+  DWORD size = 1;
+
+  while (size < frames + 2) size <<= 1;
+  d->buf  = mem ? mem + offset : NULL;
+  d->mask = size - 1;
+  d->pos  = 0;
+  return offset + size;
+}
+
+static void
+fx_delay_write(FXDELAY *d, float x)
+{
+  d->buf[d->pos] = x;
+  d->pos = (d->pos + 1) & d->mask;
+}
+
+// nフレーム前に書いた値。最後に書いた値は1
+static float
+fx_delay_read(const FXDELAY *d, DWORD n)
+{
+  return d->buf[(d->pos - n) & d->mask];
+}
+
+// 端数のある遅れは線形補間する。tは1以上
+static float
+fx_delay_read_frac(const FXDELAY *d, float t)
+{
+  DWORD n = (DWORD)t;
+  float a = fx_delay_read(d, n), b = fx_delay_read(d, n + 1);
+
+  return a + (b - a) * (t - (float)n);
+}
+
+// 非正規化数になりかけた状態を0にする。ブロックごとに呼ぶ
+static float
+fx_flush(float x)
+{
+  return fabsf(x) < 1e-15f ? 0.0f : x;
+}
+
+static double
+fx_db(double db)
+{
+  return pow(10.0, db / 20.0);
+}
+
+// 周波数をナイキスト周波数より下に収める
+static double
+fx_omega(double freq, DWORD rate)
+{
+  if (freq > rate * 0.45) freq = rate * 0.45;
+  return 2.0 * FX_PI * freq / rate;
+}
+
+// a0で割って係数を入れる。状態はそのまま
+static void
+fx_biquad_set(FXBIQUAD *f, double b0, double b1, double b2, double a0, double a1, double a2)
+{
+  f->b0 = (float)(b0 / a0);
+  f->b1 = (float)(b1 / a0);
+  f->b2 = (float)(b2 / a0);
+  f->a1 = (float)(a1 / a0);
+  f->a2 = (float)(a2 / a0);
+}
+
+// bufのチャンネルcをその場でフィルターにかける
+static void
+fx_biquad_run(FXBIQUAD *f, float *buf, DWORD channels, DWORD c, DWORD frames)
+{
+  float x, y, z1 = f->z1[c], z2 = f->z2[c];
+  DWORD i;
+
+  for (i = 0; i < frames; i++) {
+    x  = buf[i * channels + c];
+    y  = f->b0 * x + z1;
+    z1 = f->b1 * x - f->a1 * y + z2;
+    z2 = f->b2 * x - f->a2 * y;
+    buf[i * channels + c] = y;
+  }
+  f->z1[c] = fx_flush(z1);
+  f->z2[c] = fx_flush(z2);
+}
+
+/*
+ * 1次のローパス y = x + d(y - x) の係数dを、角周波数wでの音量がrになるように決める。
+ * rが1以上なら0（素通し）。
+ */
+static float
+fx_damp(double r, double w)
+{
+  double a, b, d;
+
+  if (r >= 0.9999) return 0.0f;
+  if (r < 0.0001) r = 0.0001;
+  a = 1.0 - r * r;
+  b = 1.0 - r * r * cos(w);
+  d = (b - sqrt(b * b - a * a)) / a;
+  return (float)(d > 0.99 ? 0.99 : d);
+}
+
+/*
+ * LFOのframesフレームぶんの値（-1〜1）をoutに書く。位相は周期を1とする0〜1の値。
+ * 正弦波はブロックの頭でsin・cosを求め、あとは回転で進める
+ */
+static void
+fx_lfo(float *out, LONG wave, double phase, double inc, DWORD frames)
+{
+  double s, c, ds, dc, t;
+  DWORD  i;
+
+  if (wave != DSFXCHORUS_WAVE_SIN) {
+    for (i = 0; i < frames; i++) {
+      out[i] = (float)(4.0 * fabs(phase - 0.5) - 1.0);
+      phase += inc;
+      if (phase >= 1.0) phase -= 1.0;
+    }
+    return;
+  }
+  s  = sin(2.0 * FX_PI * phase);
+  c  = cos(2.0 * FX_PI * phase);
+  ds = sin(2.0 * FX_PI * inc);
+  dc = cos(2.0 * FX_PI * inc);
+  for (i = 0; i < frames; i++) {
+    out[i] = (float)s;
+    t = s * dc + c * ds;
+    c = c * dc - s * ds;
+    s = t;
+  }
+}
+
+/*
+ * パラメーターの範囲
+ */
+#define FX_IN(v, name)  ((name##_MIN) <= (v) && (v) <= (name##_MAX))
+
+BOOL
+sb_fx_valid(DWORD type, LPCVOID params)
+{
+  switch (type) {
+  case FX_GARGLE: {
+    const DSFXGargle *p = params;
+    return FX_IN(p->dwRateHz, DSFXGARGLE_RATEHZ) && p->dwWaveShape <= DSFXGARGLE_WAVE_SQUARE;
+  }
+  case FX_CHORUS: {
+    const DSFXChorus *p = params;
+    return FX_IN(p->fWetDryMix, DSFXCHORUS_WETDRYMIX) && FX_IN(p->fDepth, DSFXCHORUS_DEPTH) &&
+           FX_IN(p->fFeedback, DSFXCHORUS_FEEDBACK) && FX_IN(p->fFrequency, DSFXCHORUS_FREQUENCY) &&
+           (p->lWaveform == DSFXCHORUS_WAVE_TRIANGLE || p->lWaveform == DSFXCHORUS_WAVE_SIN) &&
+           FX_IN(p->fDelay, DSFXCHORUS_DELAY) && FX_IN(p->lPhase, DSFXCHORUS_PHASE);
+  }
+  case FX_FLANGER: {
+    const DSFXFlanger *p = params;
+    return FX_IN(p->fWetDryMix, DSFXFLANGER_WETDRYMIX) && FX_IN(p->fDepth, DSFXFLANGER_DEPTH) &&
+           FX_IN(p->fFeedback, DSFXFLANGER_FEEDBACK) && FX_IN(p->fFrequency, DSFXFLANGER_FREQUENCY) &&
+           (p->lWaveform == DSFXFLANGER_WAVE_TRIANGLE || p->lWaveform == DSFXFLANGER_WAVE_SIN) &&
+           FX_IN(p->fDelay, DSFXFLANGER_DELAY) && FX_IN(p->lPhase, DSFXFLANGER_PHASE);
+  }
+  case FX_ECHO: {
+    const DSFXEcho *p = params;
+    return FX_IN(p->fWetDryMix, DSFXECHO_WETDRYMIX) && FX_IN(p->fFeedback, DSFXECHO_FEEDBACK) &&
+           FX_IN(p->fLeftDelay, DSFXECHO_LEFTDELAY) && FX_IN(p->fRightDelay, DSFXECHO_RIGHTDELAY) &&
+           FX_IN(p->lPanDelay, DSFXECHO_PANDELAY);
+  }
+  case FX_DISTORTION: {
+    const DSFXDistortion *p = params;
+    return FX_IN(p->fGain, DSFXDISTORTION_GAIN) && FX_IN(p->fEdge, DSFXDISTORTION_EDGE) &&
+           FX_IN(p->fPostEQCenterFrequency, DSFXDISTORTION_POSTEQCENTERFREQUENCY) &&
+           FX_IN(p->fPostEQBandwidth, DSFXDISTORTION_POSTEQBANDWIDTH) &&
+           FX_IN(p->fPreLowpassCutoff, DSFXDISTORTION_PRELOWPASSCUTOFF);
+  }
+  case FX_COMPRESSOR: {
+    const DSFXCompressor *p = params;
+    return FX_IN(p->fGain, DSFXCOMPRESSOR_GAIN) && FX_IN(p->fAttack, DSFXCOMPRESSOR_ATTACK) &&
+           FX_IN(p->fRelease, DSFXCOMPRESSOR_RELEASE) && FX_IN(p->fThreshold, DSFXCOMPRESSOR_THRESHOLD) &&
+           FX_IN(p->fRatio, DSFXCOMPRESSOR_RATIO) && FX_IN(p->fPredelay, DSFXCOMPRESSOR_PREDELAY);
+  }
+  case FX_PARAM_EQ: {
+    const DSFXParamEq *p = params;
+    return FX_IN(p->fCenter, DSFXPARAMEQ_CENTER) && FX_IN(p->fBandwidth, DSFXPARAMEQ_BANDWIDTH) &&
+           FX_IN(p->fGain, DSFXPARAMEQ_GAIN);
+  }
+  case FX_I3DL2_REVERB: {
+    const DSFXI3DL2Reverb *p = params;
+    return FX_IN(p->lRoom, DSFX_I3DL2REVERB_ROOM) && FX_IN(p->lRoomHF, DSFX_I3DL2REVERB_ROOMHF) &&
+           FX_IN(p->flRoomRolloffFactor, DSFX_I3DL2REVERB_ROOMROLLOFFFACTOR) &&
+           FX_IN(p->flDecayTime, DSFX_I3DL2REVERB_DECAYTIME) && FX_IN(p->flDecayHFRatio, DSFX_I3DL2REVERB_DECAYHFRATIO) &&
+           FX_IN(p->lReflections, DSFX_I3DL2REVERB_REFLECTIONS) &&
+           FX_IN(p->flReflectionsDelay, DSFX_I3DL2REVERB_REFLECTIONSDELAY) &&
+           FX_IN(p->lReverb, DSFX_I3DL2REVERB_REVERB) && FX_IN(p->flReverbDelay, DSFX_I3DL2REVERB_REVERBDELAY) &&
+           FX_IN(p->flDiffusion, DSFX_I3DL2REVERB_DIFFUSION) && FX_IN(p->flDensity, DSFX_I3DL2REVERB_DENSITY) &&
+           FX_IN(p->flHFReference, DSFX_I3DL2REVERB_HFREFERENCE);
+  }
+  case FX_WAVES_REVERB: {
+    const DSFXWavesReverb *p = params;
+    return FX_IN(p->fInGain, DSFX_WAVESREVERB_INGAIN) && FX_IN(p->fReverbMix, DSFX_WAVESREVERB_REVERBMIX) &&
+           FX_IN(p->fReverbTime, DSFX_WAVESREVERB_REVERBTIME) &&
+           FX_IN(p->fHighFreqRTRatio, DSFX_WAVESREVERB_HIGHFREQRTRATIO);
+  }
+  }
+  return FALSE;
+}
+
+DWORD
+sb_fx_param_size(DWORD type)
+{
+  switch (type) {
+  case FX_GARGLE:       return sizeof(DSFXGargle);
+  case FX_CHORUS:       return sizeof(DSFXChorus);
+  case FX_FLANGER:      return sizeof(DSFXFlanger);
+  case FX_ECHO:         return sizeof(DSFXEcho);
+  case FX_DISTORTION:   return sizeof(DSFXDistortion);
+  case FX_COMPRESSOR:   return sizeof(DSFXCompressor);
+  case FX_PARAM_EQ:     return sizeof(DSFXParamEq);
+  case FX_I3DL2_REVERB: return sizeof(DSFXI3DL2Reverb);
+  case FX_WAVES_REVERB: return sizeof(DSFXWavesReverb);
+  }
+  return 0;
+}
+
+/*
+ * 遅延線の割り当て。どれもパラメーターの最大値で取っておくので、値を変えても取り直さない。
+ * memがNULLなら必要なfloatの数を返すだけ
+ */
+// 残響の遅延線の長さ（ミリ秒）。互いに素に近い長さにして、共振が重ならないようにする
+static const double fx_line_ms[FX_LINES] = { 29.7, 37.1, 41.1, 43.7 };
+static const double fx_ap_ms[2]          = { 4.77, 1.61 };
+// 初期反射のタップ（ミリ秒）と音量。偶数番目は左、奇数番目は右に出す
+static const double fx_tap_ms[FX_TAPS]   = { 0.0, 4.3, 8.9, 13.7, 18.4, 22.1 };
+static const float  fx_tap_gain[FX_TAPS] = { 0.50f, 0.45f, 0.37f, 0.32f, 0.26f, 0.22f };
+
+static DWORD
+fx_layout(LPSBFX fx, float *mem)
+{
+  double ms = fx->rate / 1000.0;
+  DWORD  n = 0, c, j;
+
+  switch (fx->type) {
+  case FX_CHORUS:
+  case FX_FLANGER:
+    // 遅れは最大でDelayの2倍
+    for (c = 0; c < 2; c++) n = fx_delay_init(&fx->s.mod.line[c], mem, n, DSFXCHORUS_DELAY_MAX * 2 * ms);
+    break;
+  case FX_ECHO:
+    for (c = 0; c < 2; c++) n = fx_delay_init(&fx->s.echo.line[c], mem, n, DSFXECHO_LEFTDELAY_MAX * ms);
+    break;
+  case FX_COMPRESSOR:
+    for (c = 0; c < 2; c++) n = fx_delay_init(&fx->s.compressor.line[c], mem, n, DSFXCOMPRESSOR_PREDELAY_MAX * ms);
+    break;
+  case FX_I3DL2_REVERB:
+  case FX_WAVES_REVERB:
+    n = fx_delay_init(&fx->s.reverb.pre, mem, n,
+                      (DSFX_I3DL2REVERB_REFLECTIONSDELAY_MAX + DSFX_I3DL2REVERB_REVERBDELAY_MAX) * 1000.0 * ms +
+                      fx_tap_ms[FX_TAPS - 1] * ms);
+    for (j = 0; j < 2; j++)        n = fx_delay_init(&fx->s.reverb.ap[j],   mem, n, fx_ap_ms[j] * ms);
+    for (j = 0; j < FX_LINES; j++) n = fx_delay_init(&fx->s.reverb.line[j], mem, n, fx_line_ms[j] * ms);
+    break;
+  }
+  return n;
+}
+
+/*
+ * パラメーターから係数を求める。状態は変えない
+ */
+static void
+fx_update_mod(LPSBFX fx, float mix, float depth, float feedback, float freq, LONG wave, float delay, LONG phase)
+{
+  struct FxMod *m = &fx->s.mod;
+
+  m->mix      = mix / 100.0f;
+  m->depth    = depth / 100.0f;
+  m->feedback = feedback / 100.0f;
+  m->delay    = (float)(delay * fx->rate / 1000.0);
+  m->inc      = (double)freq / fx->rate;
+  m->wave     = wave;
+  // PHASE_NEG_180〜PHASE_180を-1/2〜1/2周期にする
+  m->offset   = (phase - DSFXCHORUS_PHASE_ZERO) * 0.25;
+  if (m->offset < 0.0) m->offset += 1.0;
+}
+
+static void
+fx_update_reverb(LPSBFX fx, double t60, double hf_ratio, double hf_ref, double density, double diffusion)
+{
+  struct FxReverb *r = &fx->s.reverb;
+  double w = fx_omega(hf_ref, fx->rate), len_s;
+  DWORD  j;
+
+  for (j = 0; j < 2; j++) r->ap_len[j] = (DWORD)(fx_ap_ms[j] * fx->rate / 1000.0) + 1;
+  r->ap_gain = (float)(0.7 * diffusion);
+  for (j = 0; j < FX_LINES; j++) {
+    // 密度が低いほど遅延線を短くして、反射がまばらに聞こえるようにする
+    r->len[j]  = (DWORD)(fx_line_ms[j] * (0.3 + 0.7 * density) * fx->rate / 1000.0) + 1;
+    len_s      = (double)r->len[j] / fx->rate;
+    r->g[j]    = (float)pow(10.0, -3.0 * len_s / t60);
+    r->damp[j] = hf_ratio >= 1.0 ? 0.0f : fx_damp(pow(10.0, -3.0 * len_s / (t60 * hf_ratio)) / r->g[j], w);
+  }
+}
+
+static void
+fx_update(LPSBFX fx)
+{
+  double w, alpha, a, c;
+  DWORD  j;
+
+  switch (fx->type) {
+  case FX_CHORUS: {
+    const DSFXChorus *p = &fx->param.chorus;
+    fx_update_mod(fx, p->fWetDryMix, p->fDepth, p->fFeedback, p->fFrequency, p->lWaveform, p->fDelay, p->lPhase);
+    break;
+  }
+  case FX_FLANGER: {
+    const DSFXFlanger *p = &fx->param.flanger;
+    fx_update_mod(fx, p->fWetDryMix, p->fDepth, p->fFeedback, p->fFrequency, p->lWaveform, p->fDelay, p->lPhase);
+    break;
+  }
+  case FX_ECHO: {
+    const DSFXEcho *p = &fx->param.echo;
+    struct FxEcho  *e = &fx->s.echo;
+    e->delay[0] = (DWORD)(p->fLeftDelay  * fx->rate / 1000.0) + 1;
+    e->delay[1] = (DWORD)(p->fRightDelay * fx->rate / 1000.0) + 1;
+    e->mix      = p->fWetDryMix / 100.0f;
+    e->feedback = p->fFeedback / 100.0f;
+    e->pan      = p->lPanDelay;
+    break;
+  }
+  case FX_DISTORTION: {
+    const DSFXDistortion *p = &fx->param.distortion;
+    struct FxDistortion  *d = &fx->s.distortion;
+    // 歪ませる前のローパス（Q = 1/√2）
+    w     = fx_omega(p->fPreLowpassCutoff, fx->rate);
+    alpha = sin(w) / sqrt(2.0);
+    c     = cos(w);
+    fx_biquad_set(&d->pre, (1.0 - c) / 2.0, 1.0 - c, (1.0 - c) / 2.0, 1.0 + alpha, -2.0 * c, 1.0 - alpha);
+    // 歪ませた後のバンドパス。出力の音量も掛けておく
+    w     = fx_omega(p->fPostEQCenterFrequency, fx->rate);
+    alpha = sin(w) * p->fPostEQBandwidth / (2.0 * p->fPostEQCenterFrequency);
+    c     = cos(w);
+    a     = fx_db(p->fGain);
+    fx_biquad_set(&d->post, alpha * a, 0.0, -alpha * a, 1.0 + alpha, -2.0 * c, 1.0 - alpha);
+    d->drive = 1.0f + p->fEdge * 0.3f;
+    break;
+  }
+  case FX_COMPRESSOR: {
+    const DSFXCompressor *p = &fx->param.compressor;
+    struct FxCompressor  *k = &fx->s.compressor;
+    k->delay     = (DWORD)(p->fPredelay * fx->rate / 1000.0);
+    k->attack    = (float)exp(-1000.0 / (p->fAttack  * fx->rate));
+    k->release   = (float)exp(-1000.0 / (p->fRelease * fx->rate));
+    k->level     = (float)fx_db(p->fThreshold);
+    k->slope     = 1.0f - 1.0f / p->fRatio;
+    k->gain      = (float)fx_db(p->fGain);
+    break;
+  }
+  case FX_PARAM_EQ: {
+    const DSFXParamEq *p = &fx->param.parameq;
+    // 帯域幅は半音単位なので、12で割ってオクターブにする
+    w     = fx_omega(p->fCenter, fx->rate);
+    a     = pow(10.0, p->fGain / 40.0);
+    alpha = sin(w) * sinh(log(2.0) / 2.0 * (p->fBandwidth / 12.0) * w / sin(w));
+    c     = cos(w);
+    fx_biquad_set(&fx->s.parameq.eq, 1.0 + alpha * a, -2.0 * c, 1.0 - alpha * a, 1.0 + alpha / a, -2.0 * c, 1.0 - alpha / a);
+    break;
+  }
+  case FX_I3DL2_REVERB: {
+    const DSFXI3DL2Reverb *p = &fx->param.i3dl2;
+    struct FxReverb       *r = &fx->s.reverb;
+    double room = pow(10.0, p->lRoom / 2000.0), er = room * pow(10.0, p->lReflections / 2000.0);
+    DWORD  base = (DWORD)(p->flReflectionsDelay * fx->rate);
+    fx_update_reverb(fx, p->flDecayTime, p->flDecayHFRatio, p->flHFReference, p->flDensity / 100.0, p->flDiffusion / 100.0);
+    for (j = 0; j < FX_TAPS; j++) {
+      r->tap[j]      = base + (DWORD)(fx_tap_ms[j] * fx->rate / 1000.0) + 1;
+      r->tap_gain[j] = (float)(er * fx_tap_gain[j]);
+    }
+    r->late    = base + (DWORD)(p->flReverbDelay * fx->rate) + 1;
+    r->in_damp = fx_damp(pow(10.0, p->lRoomHF / 2000.0), fx_omega(p->flHFReference, fx->rate));
+    r->dry     = 1.0f;
+    r->wet     = (float)(room * pow(10.0, p->lReverb / 2000.0));
+    break;
+  }
+  case FX_WAVES_REVERB: {
+    const DSFXWavesReverb *p = &fx->param.waves;
+    struct FxReverb       *r = &fx->s.reverb;
+    // 初期反射は無く、高域の基準は5kHzとする
+    fx_update_reverb(fx, p->fReverbTime / 1000.0, p->fHighFreqRTRatio, 5000.0, 1.0, 0.9);
+    memset(r->tap_gain, 0, sizeof(r->tap_gain));
+    for (j = 0; j < FX_TAPS; j++) r->tap[j] = 1;
+    r->late    = 1;
+    r->in_damp = 0.0f;
+    r->dry     = (float)fx_db(p->fInGain);
+    r->wet     = (float)fx_db(p->fInGain + p->fReverbMix);
+    break;
+  }
+  }
+}
+
+/*
+ * 処理。framesはFX_BLOCK以下
+ */
+static void
+fx_gargle(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxGargle *g = &fx->s.gargle;
+  double inc = (double)fx->param.gargle.dwRateHz / fx->rate;
+  float  mod[FX_BLOCK];
+  DWORD  i;
+
+  for (i = 0; i < frames; i++) {
+    if (fx->param.gargle.dwWaveShape == DSFXGARGLE_WAVE_SQUARE) mod[i] = g->phase < 0.5 ? 1.0f : 0.0f;
+    else mod[i] = (float)(g->phase < 0.5 ? 2.0 * g->phase : 2.0 - 2.0 * g->phase);
+    g->phase += inc;
+    if (g->phase >= 1.0) g->phase -= 1.0;
+  }
+  sb_mix_modulate(buf, (int)fx->channels, mod, frames);
+}
+
+static void
+fx_mod(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxMod *m = &fx->s.mod;
+  float  wet[FX_BLOCK * 2], lfo[FX_BLOCK], t, y;
+  double phase;
+  DWORD  i, c, ch = fx->channels;
+
+  for (c = 0; c < ch; c++) {
+    phase = m->phase + (c ? m->offset : 0.0);
+    if (phase >= 1.0) phase -= 1.0;
+    fx_lfo(lfo, m->wave, phase, m->inc, frames);
+    for (i = 0; i < frames; i++) {
+      // 遅れはDelayからDelay×(1 + Depth)まで揺れる
+      t = m->delay * (1.0f + m->depth * (lfo[i] + 1.0f) * 0.5f);
+      if (t < 1.0f) t = 1.0f;
+      y = fx_delay_read_frac(&m->line[c], t);
+      fx_delay_write(&m->line[c], buf[i * ch + c] + m->feedback * y);
+      wet[i * ch + c] = y;
+    }
+  }
+  m->phase += m->inc * frames;
+  m->phase -= floor(m->phase);
+  sb_mix_blend(buf, wet, 1.0f - m->mix, m->mix, frames * ch);
+}
+
+static void
+fx_echo(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxEcho *e = &fx->s.echo;
+  float  wet[FX_BLOCK * 2], l, r;
+  DWORD  i, ch = fx->channels;
+
+  for (i = 0; i < frames; i++) {
+    if (ch == 1) {
+      wet[i] = l = fx_delay_read(&e->line[0], e->delay[0]);
+      fx_delay_write(&e->line[0], buf[i] + e->feedback * l);
+      continue;
+    }
+    l = fx_delay_read(&e->line[0], e->delay[0]);
+    r = fx_delay_read(&e->line[1], e->delay[1]);
+    // PanDelayなら帰還を左右で入れ替えて、こだまが左右に跳ぶようにする
+    fx_delay_write(&e->line[0], buf[i * 2]     + e->feedback * (e->pan ? r : l));
+    fx_delay_write(&e->line[1], buf[i * 2 + 1] + e->feedback * (e->pan ? l : r));
+    wet[i * 2]     = l;
+    wet[i * 2 + 1] = r;
+  }
+  sb_mix_blend(buf, wet, 1.0f - e->mix, e->mix, frames * ch);
+}
+
+static void
+fx_distortion(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxDistortion *d = &fx->s.distortion;
+  DWORD c;
+
+  for (c = 0; c < fx->channels; c++) fx_biquad_run(&d->pre, buf, fx->channels, c, frames);
+  sb_mix_shape(buf, d->drive, frames * fx->channels);
+  for (c = 0; c < fx->channels; c++) fx_biquad_run(&d->post, buf, fx->channels, c, frames);
+}
+
+/*
+ * 左右の大きい方の絶対値を追いかけ、閾値を越えたぶんを下げる。
+ * dBで(env - threshold) × slopeだけ下げるのは、リニアで(level / env)^slopeを掛けるのと同じ。
+ * 検出は遅らせる前の入力で行うので、Predelayのぶんだけ先読みになる。
+ */
+static void
+fx_compressor(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxCompressor *k = &fx->s.compressor;
+  float  gain[FX_BLOCK], x, peak;
+  DWORD  i, c, ch = fx->channels;
+
+  for (i = 0; i < frames; i++) {
+    peak = 0.0f;
+    for (c = 0; c < ch; c++) {
+      x = buf[i * ch + c];
+      fx_delay_write(&k->line[c], x);
+      buf[i * ch + c] = fx_delay_read(&k->line[c], k->delay + 1);
+      if (fabsf(x) > peak) peak = fabsf(x);
+    }
+    k->env  = peak + (peak > k->env ? k->attack : k->release) * (k->env - peak);
+    gain[i] = k->env > k->level ? k->gain * powf(k->level / k->env, k->slope) : k->gain;
+  }
+  k->env = fx_flush(k->env);
+  sb_mix_modulate(buf, (int)ch, gain, frames);
+}
+
+static void
+fx_parameq(LPSBFX fx, float *buf, DWORD frames)
+{
+  DWORD c;
+
+  for (c = 0; c < fx->channels; c++) fx_biquad_run(&fx->s.parameq.eq, buf, fx->channels, c, frames);
+}
+
+static void
+fx_reverb(LPSBFX fx, float *buf, DWORD frames)
+{
+  struct FxReverb *r = &fx->s.reverb;
+  float  wet[FX_BLOCK * 2], v[FX_LINES], h[FX_LINES], x, d, l, rr;
+  DWORD  i, j, ch = fx->channels;
+
+  for (i = 0; i < frames; i++) {
+    x = ch == 2 ? (buf[i * 2] + buf[i * 2 + 1]) * 0.5f : buf[i];
+    r->in_lp = x + r->in_damp * (r->in_lp - x);
+    fx_delay_write(&r->pre, r->in_lp);
+    // 初期反射
+    l = rr = 0.0f;
+    for (j = 0; j < FX_TAPS; j += 2) {
+      l  += r->tap_gain[j]     * fx_delay_read(&r->pre, r->tap[j]);
+      rr += r->tap_gain[j + 1] * fx_delay_read(&r->pre, r->tap[j + 1]);
+    }
+    // 拡散
+    x = fx_delay_read(&r->pre, r->late);
+    for (j = 0; j < 2; j++) {
+      d = fx_delay_read(&r->ap[j], r->ap_len[j]);
+      fx_delay_write(&r->ap[j], x + r->ap_gain * d);
+      x = d - r->ap_gain * (x + r->ap_gain * d);
+    }
+    // 後部残響
+    for (j = 0; j < FX_LINES; j++) {
+      v[j] = fx_delay_read(&r->line[j], r->len[j]);
+      v[j] = r->lp[j] = v[j] + r->damp[j] * (r->lp[j] - v[j]);
+      v[j] *= r->g[j];
+    }
+    h[0] = (v[0] + v[1] + v[2] + v[3]) * 0.5f;
+    h[1] = (v[0] - v[1] + v[2] - v[3]) * 0.5f;
+    h[2] = (v[0] + v[1] - v[2] - v[3]) * 0.5f;
+    h[3] = (v[0] - v[1] - v[2] + v[3]) * 0.5f;
+    for (j = 0; j < FX_LINES; j++) fx_delay_write(&r->line[j], x * 0.5f + h[j]);
+    l  = (l  + (v[0] + v[2]) * 0.5f) * r->wet;
+    rr = (rr + (v[1] + v[3]) * 0.5f) * r->wet;
+    if (ch == 2) {
+      wet[i * 2]     = l;
+      wet[i * 2 + 1] = rr;
+    }
+    else wet[i] = (l + rr) * 0.5f;
+  }
+  r->in_lp = fx_flush(r->in_lp);
+  for (j = 0; j < FX_LINES; j++) r->lp[j] = fx_flush(r->lp[j]);
+  sb_mix_blend(buf, wet, r->dry, 1.0f, frames * ch);
+}
+
+// 遅延線と状態を消して、係数を求め直す
+static void
+fx_reset(LPSBFX fx)
+{
+  memset(&fx->s, 0, sizeof(fx->s));
+  if (fx->mem) memset(fx->mem, 0, fx->mem_count * sizeof(float));
+  fx_layout(fx, fx->mem);
+  fx_update(fx);
+}
+
+static void
+fx_run(LPSBFX fx, float *buf, DWORD frames)
+{
+  switch (fx->type) {
+  case FX_GARGLE:       fx_gargle(fx, buf, frames);      break;
+  case FX_CHORUS:
+  case FX_FLANGER:      fx_mod(fx, buf, frames);         break;
+  case FX_ECHO:         fx_echo(fx, buf, frames);        break;
+  case FX_DISTORTION:   fx_distortion(fx, buf, frames);  break;
+  case FX_COMPRESSOR:   fx_compressor(fx, buf, frames);  break;
+  case FX_PARAM_EQ:     fx_parameq(fx, buf, frames);     break;
+  case FX_I3DL2_REVERB:
+  case FX_WAVES_REVERB: fx_reverb(fx, buf, frames);      break;
+  }
+}
+
+/*
+ * 公開関数
+ */
+LPSBFX
+sb_fx_create(DWORD type, DWORD rate, DWORD channels)
+{
+  LPSBFX fx;
+
+  if (!sb_fx_param_size(type)) return NULL;
+  fx = calloc(1, sizeof(SBFX));
+  if (!fx) return NULL;
+  fx->type = type;
+  fx->mix  = 1.0f;
+  switch (type) {
+  case FX_GARGLE:       fx->param.gargle     = fx_default_gargle;     break;
+  case FX_CHORUS:       fx->param.chorus     = fx_default_chorus;     break;
+  case FX_FLANGER:      fx->param.flanger    = fx_default_flanger;    break;
+  case FX_ECHO:         fx->param.echo       = fx_default_echo;       break;
+  case FX_DISTORTION:   fx->param.distortion = fx_default_distortion; break;
+  case FX_COMPRESSOR:   fx->param.compressor = fx_default_compressor; break;
+  case FX_PARAM_EQ:     fx->param.parameq    = fx_default_parameq;    break;
+  case FX_I3DL2_REVERB: fx->param.i3dl2      = fx_default_i3dl2;      break;
+  case FX_WAVES_REVERB: fx->param.waves      = fx_default_waves;      break;
+  }
+  if (FAILED(sb_fx_format(fx, rate, channels))) {
+    sb_fx_free(fx);
+    return NULL;
+  }
+  return fx;
+}
+
+void
+sb_fx_free(LPSBFX fx)
+{
+  if (!fx) return;
+  free(fx->mem);
+  free(fx);
+}
+
+DWORD
+sb_fx_type(LPSBFX fx)
+{
+  return fx->type;
+}
+
+HRESULT
+sb_fx_set_params(LPSBFX fx, LPCVOID params)
+{
+  if (!sb_fx_valid(fx->type, params)) return DSERR_INVALIDPARAM;
+  memcpy(&fx->param, params, sb_fx_param_size(fx->type));
+  if (fx->ready) fx_update(fx);
+  return DS_OK;
+}
+
+void
+sb_fx_get_params(LPSBFX fx, LPVOID params)
+{
+  memcpy(params, &fx->param, sb_fx_param_size(fx->type));
+}
+
+HRESULT
+sb_fx_format(LPSBFX fx, DWORD rate, DWORD channels)
+{
+  DWORD n;
+
+  if (fx->ready && fx->rate == rate && fx->channels == channels) return DS_OK;
+  free(fx->mem);
+  fx->mem       = NULL;
+  fx->mem_count = 0;
+  fx->ready     = 0;
+  fx->rate      = rate;
+  fx->channels  = channels;
+  n = fx_layout(fx, NULL);
+  if (n) {
+    fx->mem = malloc(n * sizeof(float));
+    if (!fx->mem) return DSERR_OUTOFMEMORY;
+    fx->mem_count = n;
+  }
+  fx_reset(fx);
+  fx->ready = 1;
+  return DS_OK;
+}
+
+/*
+ * バイパスの途中は、処理する前の音を取っておいて混ぜる。
+ * バイパスし終わったエフェクトは処理しないので、何もかけていないのと同じ重さになる
+ */
+void
+sb_fx_process(LPSBFX fx, float *buf, DWORD frames)
+{
+  float  dry[FX_BLOCK * 2], target = fx->bypass ? 0.0f : 1.0f;
+  DWORD  n, k, ch = fx->channels;
+
+  if (!fx->ready) return;
+  if (fx->mix == 0.0f && target == 0.0f) return;
+  if (fx->mix == 0.0f) fx_reset(fx);
+  for (n = 0; n < frames; n += k, buf += k * ch) {
+    k = frames - n < FX_BLOCK ? frames - n : FX_BLOCK;
+    if (fx->mix == target) {
+      fx_run(fx, buf, k);
+      continue;
+    }
+    memcpy(dry, buf, sizeof(float) * k * ch);
+    fx_run(fx, buf, k);
+    fx->mix = sb_fx_fade(buf, dry, ch, fx->mix, target, 1000.0f / (SB_FX_FADE_MS * fx->rate), k);
+    if (fx->mix == 0.0f) break;
+  }
+}
+
+void
+sb_fx_set_bypass(LPSBFX fx, BOOL bypass)
+{
+  fx->bypass = bypass ? 1 : 0;
+}
+
+float
+sb_fx_fade(float *buf, float *other, DWORD channels, float g, float target, float step, DWORD frames)
+{
+  float  w[FX_BLOCK], v[FX_BLOCK];
+  DWORD  n, k, i;
+
+  for (n = 0; n < frames; n += k, buf += k * channels, other += k * channels) {
+    k = frames - n < FX_BLOCK ? frames - n : FX_BLOCK;
+    for (i = 0; i < k; i++) {
+      if (g < target) g = g + step < target ? g + step : target;
+      else            g = g - step > target ? g - step : target;
+      w[i] = g;
+      v[i] = 1.0f - g;
+    }
+    sb_mix_modulate(buf,   (int)channels, w, k);
+    sb_mix_modulate(other, (int)channels, v, k);
+    sb_mix_blend(buf, other, 1.0f, 1.0f, k * channels);
+  }
+  return g;
+}
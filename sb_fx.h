@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * ソフトウェアー・バックエンドのエフェクト。
+ * DirectSoundの標準エフェクト9種類を、同じパラメーター構造体（DSFX*）と同じ範囲で使えるように
+ * Cで書き直したもの。DMOと同じ音にはならないが、パラメーターの意味はそろえてある。
+ * 入出力はデバイスの出力形式（1か2チャンネル）のインターリーブされたfloatで、その場で書き換える。
+ * 前のサンプルによらない段（ミックス・飽和・音量）はsb_mix.cのベクトル版のカーネルで行う。
+ * 排他は呼び出し側で行う。
+ */
+#ifndef SB_FX_H
+#define SB_FX_H
+
+#include "sb_backend.h"
+
+// バイパスと並びの付け替えで、出力を切り替えるのにかける時間
+#define SB_FX_FADE_MS   10
+
+typedef struct SBFx SBFX, *LPSBFX;
+
+// fxはFX_*。パラメーターはDMOの既定値になる。メモリーが足りなければNULL
+LPSBFX  sb_fx_create(DWORD fx, DWORD rate, DWORD channels);
+void    sb_fx_free(LPSBFX);
+DWORD   sb_fx_type(LPSBFX);
+// 範囲外の値があればDSERR_INVALIDPARAMで、何も変えない
+HRESULT sb_fx_set_params(LPSBFX, LPCVOID);
+void    sb_fx_get_params(LPSBFX, LPVOID);
+// デバイスの形式が変わったら遅延線を作り直す。残響などは消える。失敗したエフェクトは素通しになる
+HRESULT sb_fx_format(LPSBFX, DWORD rate, DWORD channels);
+void    sb_fx_process(LPSBFX, float *buf, DWORD frames);
+/*
+ * バイパスすると、SB_FX_FADE_MSかけて素通しの音へ移ってから処理を止める。
+ * 戻すときは止まっていた間の状態（残響など）を消してから、同じ時間をかけて戻す。
+ */
+void    sb_fx_set_bypass(LPSBFX, BOOL);
+// パラメーター構造体の大きさと範囲。fxはFX_*。DirectSoundバックエンドも使う
+DWORD   sb_fx_param_size(DWORD fx);
+BOOL    sb_fx_valid(DWORD fx, LPCVOID);
+/*
+ * buf = buf × g + other × (1 - g)。gはフレームごとにstepずつtargetへ近づく。otherも書き換える。
+ * 最後のgを返す
+ */
+float   sb_fx_fade(float *buf, float *other, DWORD channels, float g, float target, float step, DWORD frames);
+
+#endif /* SB_FX_H */
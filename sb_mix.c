@@ -0,0 +1,1535 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sb_mix.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SB_MIX_X86
+#include <immintrin.h>
+#define SB_TARGET(isa)  __attribute__((target(isa)))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SB_MIX_X86
+#include <immintrin.h>
+#include <intrin.h>
+#define SB_TARGET(isa)
+#endif
+
+#define FIX_ONE     ((int64_t)1 << SB_MIX_FIX_SHIFT)
+#define FIX_MASK    (FIX_ONE - 1)
+
+void (*sb_mix_voice)(float *, int, LPCSBMIXVOICE, DWORD);
+void (*sb_mix_store_s16)(BYTE *, const float *, DWORD);
+void (*sb_mix_store_u8)(BYTE *, const float *, DWORD);
+void (*sb_conv_u8_s16)(BYTE *, const BYTE *, DWORD);
+void (*sb_conv_s16_u8)(BYTE *, const BYTE *, DWORD);
+void (*sb_conv_s32_s16)(BYTE *, const BYTE *, DWORD, LPSBDITHER);
+void (*sb_conv_f32_s16)(BYTE *, const BYTE *, DWORD, LPSBDITHER);
+void (*sb_conv_mono_stereo)(BYTE *, const BYTE *, DWORD, DWORD);
+void (*sb_conv_stereo_mono)(BYTE *, const BYTE *, DWORD, DWORD);
+void (*sb_conv_interleave)(BYTE *, const BYTE *const *, DWORD, DWORD, DWORD);
+void (*sb_conv_deinterleave)(BYTE *const *, const BYTE *, DWORD, DWORD, DWORD);
+void (*sb_reverse_frames)(BYTE *, DWORD, DWORD);
+void (*sb_mix_blend)(float *, const float *, float, float, DWORD);
+void (*sb_mix_shape)(float *, float, DWORD);
+void (*sb_mix_modulate)(float *, int, const float *, DWORD);
+void (*sb_mix_gain_add)(float *, int, const float *, float, float, DWORD);
+static const char *mix_isa = "scalar";
+
+/*
+ * スカラー版
+ */
+static const DWORD mix_sample_bytes[] = { 1, 2, 3, 4, 4 };
+
+static float
+mix_sample(LPCSBMIXVOICE v, DWORD frame, DWORD ch)
+{
+  const BYTE *p = v->data + (frame * v->channels + ch) * mix_sample_bytes[v->format];
+  int16_t     s;
+  int32_t     x;
+  float       f;
+
+  switch (v->format) {
+  case SB_SAMPLE_U8:
+    return ((int)*p - 128) * (1.0f / 128);
+  case SB_SAMPLE_S16:
+    memcpy(&s, p, sizeof(s));
+    return s * (1.0f / 32768);
+  case SB_SAMPLE_S24:
+    x = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    return (float)x * (1.0f / 2147483648.0f);
+  case SB_SAMPLE_S32:
+    memcpy(&x, p, sizeof(x));
+    return (float)x * (1.0f / 2147483648.0f);
+  default:
+    memcpy(&f, p, sizeof(f));
+    return f;
+  }
+}
+
+// 3チャンネル以上の素材をdownmixの係数で左右にまとめる
+static void
+mix_frame(LPCSBMIXVOICE v, DWORD frame, float *l, float *r)
+{
+  DWORD c;
+  float x;
+
+  if (v->channels <= 2) {
+    *l = mix_sample(v, frame, 0);
+    *r = v->channels == 2 ? mix_sample(v, frame, 1) : *l;
+    return;
+  }
+  *l = *r = 0.0f;
+  for (c = 0; c < v->channels; c++) {
+    x   = mix_sample(v, frame, c);
+    *l += x * v->downmix[c];
+    *r += x * v->downmix[v->channels + c];
+  }
+}
+
+static float
+mix_frac(int64_t pos)
+{
+  return (float)(pos & FIX_MASK) * (1.0f / 4294967296.0f);
+}
+
+static DWORD
+mix_next(LPCSBMIXVOICE v, DWORD i)
+{
+  return i + 1 == v->limit ? v->wrap : i + 1;
+}
+
+static void
+mix_voice_scalar(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  int64_t pos = v->pos;
+  DWORD   n, i, i1;
+  float   f, l, r, l1, r1;
+
+  for (n = 0; n < count; n++, pos += v->step) {
+    i  = (DWORD)(pos >> SB_MIX_FIX_SHIFT);
+    i1 = mix_next(v, i);
+    f  = mix_frac(pos);
+    mix_frame(v, i,  &l,  &r);
+    mix_frame(v, i1, &l1, &r1);
+    l += (l1 - l) * f;
+    r += (r1 - r) * f;
+    if (out_ch == 2) {
+      acc[n * 2]     += l * v->lgain;
+      acc[n * 2 + 1] += r * v->rgain;
+    }
+    else acc[n] += (l * v->lgain + r * v->rgain) * 0.5f;
+  }
+}
+
+// 残りのフレームをスカラー版で処理する
+static void
+mix_voice_tail(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD done, DWORD count)
+{
+  SBMIXVOICE rest = *v;
+
+  if (done >= count) return;
+  rest.pos = v->pos + v->step * done;
+  mix_voice_scalar(acc + done * out_ch, out_ch, &rest, count - done);
+}
+
+static float
+mix_clamp(float v)
+{
+  if      (v >  32767.0f) return  32767.0f;
+  else if (v < -32768.0f) return -32768.0f;
+  return v;
+}
+
+static void
+mix_store_s16_scalar(BYTE *out, const float *acc, DWORD n)
+{
+  DWORD   i;
+  int16_t s;
+
+  for (i = 0; i < n; i++) {
+    s = (int16_t)lrintf(mix_clamp(acc[i] * 32768.0f));
+    memcpy(out + i * 2, &s, sizeof(s));
+  }
+}
+
+static void
+mix_store_u8_scalar(BYTE *out, const float *acc, DWORD n)
+{
+  DWORD i;
+
+  for (i = 0; i < n; i++) out[i] = (BYTE)(((int)lrintf(mix_clamp(acc[i] * 32768.0f)) >> 8) + 128);
+}
+
+/*
+ * フォーマット変換（スカラー版）
+ * ディザーの乱数は4系統あり、i番目のサンプルはi % 4番目の系統を使う。
+ * SSE2版は4系統を1本のレジスターで回すので、どちらでも同じ結果になる。
+ */
+void
+sb_dither_init(LPSBDITHER dither, uint32_t seed)
+{
+  int k;
+
+  for (k = 0; k < 4; k++) {
+    dither->state[k] = seed ^ (0x9E3779B9u * (uint32_t)(k + 1));
+    if (!dither->state[k]) dither->state[k] = 1;
+  }
+}
+
+static uint32_t
+conv_xorshift(uint32_t x)
+{
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// [0, 1)の一様乱数2つの差（-1〜+1LSBの三角分布）
+static float
+conv_tpdf(LPSBDITHER dither, DWORD i)
+{
+  uint32_t *s = &dither->state[i & 3];
+  int32_t   a, b;
+
+  *s = conv_xorshift(*s);
+  a  = (int32_t)(*s >> 8);
+  *s = conv_xorshift(*s);
+  b  = (int32_t)(*s >> 8);
+  return ((float)a - (float)b) * (1.0f / 16777216);
+}
+
+// SSE2のmaxps/minpsと同じ比較にしてNaNの扱いもそろえる
+static int16_t
+conv_round_s16(float v)
+{
+  v = v > -32768.0f ? v : -32768.0f;
+  v = v <  32767.0f ? v :  32767.0f;
+  return (int16_t)lrintf(v);
+}
+
+static void
+conv_u8_s16_scalar(BYTE *out, const BYTE *in, DWORD n)
+{
+  DWORD   i;
+  int16_t s;
+
+  for (i = 0; i < n; i++) {
+    s = (int16_t)(((int)in[i] - 128) << 8);
+    memcpy(out + i * 2, &s, sizeof(s));
+  }
+}
+
+static void
+conv_s16_u8_scalar(BYTE *out, const BYTE *in, DWORD n)
+{
+  DWORD   i;
+  int16_t s;
+
+  for (i = 0; i < n; i++) {
+    memcpy(&s, in + i * 2, sizeof(s));
+    out[i] = (BYTE)((s >> 8) + 128);
+  }
+}
+
+static void
+conv_s32_s16_scalar(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither)
+{
+  DWORD   i;
+  int32_t x;
+  int16_t s;
+  float   v;
+
+  for (i = 0; i < n; i++) {
+    memcpy(&x, in + i * 4, sizeof(x));
+    v = (float)x * (1.0f / 65536);
+    if (dither) v += conv_tpdf(dither, i);
+    s = conv_round_s16(v);
+    memcpy(out + i * 2, &s, sizeof(s));
+  }
+}
+
+static void
+conv_f32_s16_scalar(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither)
+{
+  DWORD   i;
+  int16_t s;
+  float   v;
+
+  for (i = 0; i < n; i++) {
+    memcpy(&v, in + i * 4, sizeof(v));
+    v *= 32768.0f;
+    if (dither) v += conv_tpdf(dither, i);
+    s = conv_round_s16(v);
+    memcpy(out + i * 2, &s, sizeof(s));
+  }
+}
+
+// 24bitは32bitに広げてから、256サンプルずつ32bit版で変換する
+void
+sb_conv_s24_s16(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither)
+{
+  int32_t wide[256];
+  DWORD   i, j, len;
+
+  for (i = 0; i < n; i += len) {
+    len = n - i < 256 ? n - i : 256;
+    for (j = 0; j < len; j++) {
+      const BYTE *p = in + (i + j) * 3;
+      wide[j] = (int32_t)((uint32_t)p[0] << 8 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 24);
+    }
+    sb_conv_s32_s16(out + i * 2, (const BYTE *)wide, len, dither);
+  }
+}
+
+static void
+conv_mono_stereo_scalar(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes)
+{
+  DWORD i;
+
+  for (i = 0; i < frames; i++) {
+    memcpy(out + i * bytes * 2,         in + i * bytes, bytes);
+    memcpy(out + i * bytes * 2 + bytes, in + i * bytes, bytes);
+  }
+}
+
+static void
+conv_stereo_mono_scalar(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes)
+{
+  DWORD   i;
+  int16_t l, r, s;
+
+  for (i = 0; i < frames; i++) {
+    if (bytes == 1) {
+      out[i] = (BYTE)((in[i * 2] + in[i * 2 + 1] + 1) >> 1);
+      continue;
+    }
+    memcpy(&l, in + i * 4,     sizeof(l));
+    memcpy(&r, in + i * 4 + 2, sizeof(r));
+    s = (int16_t)((l + r) >> 1);
+    memcpy(out + i * 2, &s, sizeof(s));
+  }
+}
+
+static void
+conv_interleave_scalar(BYTE *out, const BYTE *const *planes, DWORD channels, DWORD frames, DWORD bytes)
+{
+  DWORD i, c;
+
+  for (i = 0; i < frames; i++)
+    for (c = 0; c < channels; c++) memcpy(out + (i * channels + c) * bytes, planes[c] + i * bytes, bytes);
+}
+
+static void
+conv_deinterleave_scalar(BYTE *const *planes, const BYTE *in, DWORD channels, DWORD frames, DWORD bytes)
+{
+  DWORD i, c;
+
+  for (i = 0; i < frames; i++)
+    for (c = 0; c < channels; c++) memcpy(planes[c] + i * bytes, in + (i * channels + c) * bytes, bytes);
+}
+
+static void
+reverse_frames_scalar(BYTE *data, DWORD frames, DWORD block)
+{
+  BYTE  tmp[32];
+  BYTE *lo = data, *hi = data + (size_t)(frames - 1) * block;
+
+  if (!frames) return;
+  for (; lo < hi; lo += block, hi -= block) {
+    memcpy(tmp, lo, block);
+    memcpy(lo,  hi, block);
+    memcpy(hi,  tmp, block);
+  }
+}
+
+/*
+ * オシレーター（スカラー版）
+ * ベクトル版と同じ順序で演算するので、どの版でも同じ値になる。
+ */
+#define OSC_TWO_PI  6.28318531f
+
+void (*sb_osc_render)(float *, LPSBOSC, float, float, DWORD);
+
+void
+sb_osc_init(LPSBOSC osc, DWORD wave, uint32_t seed)
+{
+  SBDITHER state;
+
+  sb_dither_init(&state, seed);
+  memcpy(osc->noise, state.state, sizeof(osc->noise));
+  osc->wave  = wave;
+  osc->phase = 0.0;
+  osc->inc   = 0.0;
+}
+
+static void
+osc_advance(LPSBOSC osc, DWORD n)
+{
+  osc->phase += osc->inc * n;
+  osc->phase -= floor(osc->phase);
+}
+
+// 0以上の値の小数部
+static float
+osc_frac(float t)
+{
+  return t - (float)(int32_t)t;
+}
+
+// -0.25〜0.25に折り返してから多項式で求める。テイラー展開の最後の係数は、1/4周期でちょうど1になるように直してある
+static float
+osc_sine(float t)
+{
+  float u = t - 0.5f, y, y2;
+
+  u  = u < 0.5f - u ? u : 0.5f - u;
+  u  = u > -0.5f - u ? u : -0.5f - u;
+  y  = u * OSC_TWO_PI;
+  y2 = y * y;
+  return -(y * (1.0f + y2 * (-1.0f / 6 + y2 * (1.0f / 120 + y2 * (-1.0f / 5040 + y2 * (1.0f / 371073))))));
+}
+
+/*
+ * 位相0にある段差・折れ目の前後1フレームの補正。高さ1の段差と、1フレームあたりの傾きが1変わる折れ目が基準
+ * hiは1 - dt、invは1 / dt
+ */
+static float
+osc_blep(float t, float dt, float hi, float inv)
+{
+  float x;
+
+  if (t < dt) {
+    x = 1.0f - t * inv;
+    return x * x * -0.5f;
+  }
+  if (t > hi) {
+    x = 1.0f + (t - 1.0f) * inv;
+    return x * x * 0.5f;
+  }
+  return 0.0f;
+}
+
+static float
+osc_blamp(float t, float dt, float hi, float inv)
+{
+  float x;
+
+  if (t < dt) {
+    x = 1.0f - t * inv;
+    return x * x * x * (1.0f / 6);
+  }
+  if (t > hi) {
+    x = 1.0f + (t - 1.0f) * inv;
+    return x * x * x * (1.0f / 6);
+  }
+  return 0.0f;
+}
+
+static float
+osc_wave(DWORD wave, float t, float dt, float hi, float inv)
+{
+  float t2 = osc_frac(t + 0.5f);
+
+  switch (wave) {
+  case SB_OSC_SQUARE:
+    return (t < 0.5f ? 1.0f : -1.0f) + (osc_blep(t, dt, hi, inv) - osc_blep(t2, dt, hi, inv)) * 2.0f;
+  case SB_OSC_SAW:
+    return (t + t - 1.0f) - osc_blep(t, dt, hi, inv) * 2.0f;
+  case SB_OSC_TRIANGLE:
+    return (1.0f - fabsf(t - 0.5f) * 4.0f) + (osc_blamp(t, dt, hi, inv) - osc_blamp(t2, dt, hi, inv)) * (dt * 8.0f);
+  default:
+    return osc_sine(t);
+  }
+}
+
+static float
+osc_noise(LPSBOSC osc, DWORD i)
+{
+  uint32_t *s = &osc->noise[i & 3];
+
+  *s = conv_xorshift(*s);
+  return (float)(int32_t)*s * (1.0f / 2147483648.0f);
+}
+
+// ブロックのfromからtoまでを計算する。ベクトル版の端数もこれで処理する
+static void
+osc_render_span(float *out, LPSBOSC osc, float gain, float dgain, DWORD base, float t0, DWORD from, DWORD to)
+{
+  float dt = (float)osc->inc, hi = 1.0f - dt, inv = 1.0f / dt;
+  DWORD j;
+
+  for (j = from; j < to; j++) {
+    out[j] += (gain + dgain * (float)(base + j)) * osc_wave(osc->wave, osc_frac(t0 + (float)j * dt), dt, hi, inv);
+  }
+}
+
+static void
+osc_render_scalar(float *out, LPSBOSC osc, float gain, float dgain, DWORD count)
+{
+  DWORD i, n;
+
+  if (osc->wave == SB_OSC_NOISE) {
+    for (i = 0; i < count; i++) out[i] += (gain + dgain * (float)i) * osc_noise(osc, i);
+    return;
+  }
+  for (i = 0; i < count; i += n) {
+    n = count - i < SB_OSC_BLOCK ? count - i : SB_OSC_BLOCK;
+    osc_render_span(out + i, osc, gain, dgain, i, (float)osc->phase, 0, n);
+    osc_advance(osc, n);
+  }
+}
+
+/*
+ * エフェクトの部品（スカラー版）
+ * ベクトル版の端数も、fromから先をこれで処理する。
+ */
+static void
+fx_blend_span(float *out, const float *wet, float dry, float wgain, DWORD from, DWORD n)
+{
+  DWORD i;
+
+  for (i = from; i < n; i++) out[i] = out[i] * dry + wet[i] * wgain;
+}
+
+static void
+fx_blend_scalar(float *out, const float *wet, float dry, float wgain, DWORD n)
+{
+  fx_blend_span(out, wet, dry, wgain, 0, n);
+}
+
+static void
+fx_shape_span(float *buf, float drive, DWORD from, DWORD n)
+{
+  DWORD i;
+  float x, x2;
+
+  for (i = from; i < n; i++) {
+    x = buf[i] * drive;
+    if      (x >  3.0f) x =  3.0f;
+    else if (x < -3.0f) x = -3.0f;
+    x2     = x * x;
+    buf[i] = x * (27.0f + x2) / (27.0f + 9.0f * x2);
+  }
+}
+
+static void
+fx_shape_scalar(float *buf, float drive, DWORD n)
+{
+  fx_shape_span(buf, drive, 0, n);
+}
+
+static void
+fx_modulate_span(float *buf, int channels, const float *gain, DWORD from, DWORD frames)
+{
+  DWORD i;
+
+  for (i = from; i < frames; i++) {
+    if (channels == 2) {
+      buf[i * 2]     *= gain[i];
+      buf[i * 2 + 1] *= gain[i];
+    }
+    else buf[i] *= gain[i];
+  }
+}
+
+static void
+fx_modulate_scalar(float *buf, int channels, const float *gain, DWORD frames)
+{
+  fx_modulate_span(buf, channels, gain, 0, frames);
+}
+
+static void
+fx_gain_add_span(float *acc, int out_ch, const float *src, float lgain, float rgain, DWORD from, DWORD frames)
+{
+  DWORD i;
+
+  for (i = from; i < frames; i++) {
+    if (out_ch == 2) {
+      acc[i * 2]     += src[i * 2]     * lgain;
+      acc[i * 2 + 1] += src[i * 2 + 1] * rgain;
+    }
+    else acc[i] += (src[i] * lgain + src[i] * rgain) * 0.5f;
+  }
+}
+
+static void
+fx_gain_add_scalar(float *acc, int out_ch, const float *src, float lgain, float rgain, DWORD frames)
+{
+  fx_gain_add_span(acc, out_ch, src, lgain, rgain, 0, frames);
+}
+
+#ifdef SB_MIX_X86
+/*
+ * SSE2版
+ * 補間するフレームの読み出しはスカラーで行い、補間・音量・足し込みを4フレームずつ行う。
+ * 16bitで等速かつ位置に端数が無いときは、読み出しもベクトルで行う。
+ */
+SB_TARGET("sse2") static void
+mix_accum4_sse2(float *acc, int out_ch, __m128 l, __m128 r, __m128 lg, __m128 rg)
+{
+  __m128 x = _mm_mul_ps(l, lg), y = _mm_mul_ps(r, rg);
+
+  if (out_ch == 2) {
+    _mm_storeu_ps(acc,     _mm_add_ps(_mm_loadu_ps(acc),     _mm_unpacklo_ps(x, y)));
+    _mm_storeu_ps(acc + 4, _mm_add_ps(_mm_loadu_ps(acc + 4), _mm_unpackhi_ps(x, y)));
+  }
+  else _mm_storeu_ps(acc, _mm_add_ps(_mm_loadu_ps(acc), _mm_mul_ps(_mm_add_ps(x, y), _mm_set1_ps(0.5f))));
+}
+
+// 16bit 8個を4個ずつfloatにする
+SB_TARGET("sse2") static void
+mix_load8_s16_sse2(const BYTE *p, __m128 *lo, __m128 *hi)
+{
+  __m128i s     = _mm_loadu_si128((const __m128i *)p);
+  __m128  scale = _mm_set1_ps(1.0f / 32768);
+
+  *lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16)), scale);
+  *hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16)), scale);
+}
+
+SB_TARGET("sse2") static DWORD
+mix_voice_unity_sse2(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  const BYTE *p  = v->data + (size_t)(v->pos >> SB_MIX_FIX_SHIFT) * v->channels * 2;
+  __m128      lg = _mm_set1_ps(v->lgain), rg = _mm_set1_ps(v->rgain);
+  __m128      a, b, l, r;
+  DWORD       n = 0;
+
+  if (v->channels == 1) {
+    for (; n + 8 <= count; n += 8, p += 16) {
+      mix_load8_s16_sse2(p, &a, &b);
+      mix_accum4_sse2(acc + n * out_ch,       out_ch, a, a, lg, rg);
+      mix_accum4_sse2(acc + (n + 4) * out_ch, out_ch, b, b, lg, rg);
+    }
+  }
+  else {
+    for (; n + 4 <= count; n += 4, p += 16) {
+      // L0 R0 L1 R1 | L2 R2 L3 R3 を L と R に分ける
+      mix_load8_s16_sse2(p, &a, &b);
+      l = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      r = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      mix_accum4_sse2(acc + n * out_ch, out_ch, l, r, lg, rg);
+    }
+  }
+  return n;
+}
+
+SB_TARGET("sse2") static DWORD
+mix_voice_unity_f32_sse2(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  const float *p  = (const float *)v->data + (size_t)(v->pos >> SB_MIX_FIX_SHIFT) * v->channels;
+  __m128       lg = _mm_set1_ps(v->lgain), rg = _mm_set1_ps(v->rgain);
+  __m128       a, b;
+  DWORD        n = 0;
+
+  if (v->channels == 1) {
+    for (; n + 4 <= count; n += 4, p += 4) {
+      a = _mm_loadu_ps(p);
+      mix_accum4_sse2(acc + n * out_ch, out_ch, a, a, lg, rg);
+    }
+  }
+  else {
+    for (; n + 4 <= count; n += 4, p += 8) {
+      a = _mm_loadu_ps(p);
+      b = _mm_loadu_ps(p + 4);
+      mix_accum4_sse2(acc + n * out_ch, out_ch, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)),
+                      _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)), lg, rg);
+    }
+  }
+  return n;
+}
+
+/*
+ * 16bitの線形補間。4フレーム目の次のフレームがlimitに届くまでは、
+ * フレームiとi+1が隣り合っているので1回の読み出しで両方取れる。
+ */
+SB_TARGET("sse2") static DWORD
+mix_voice_interp_sse2(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  int64_t pos = v->pos;
+  DWORD   n, j;
+  int32_t w[4];
+  int64_t q[4];
+  float   fr[4];
+  __m128  scale = _mm_set1_ps(1.0f / 32768), lg = _mm_set1_ps(v->lgain), rg = _mm_set1_ps(v->rgain);
+  __m128  f, a, b, l, r, x0, x1, x2, x3;
+  __m128i x, lo, hi;
+
+  for (n = 0; n + 4 <= count; n += 4) {
+    // 逆再生では歩幅が負なので、先頭のフレームが一番後ろになる
+    if ((DWORD)((v->step < 0 ? pos : pos + v->step * 3) >> SB_MIX_FIX_SHIFT) + 1 >= v->limit) break;
+    for (j = 0; j < 4; j++, pos += v->step) {
+      fr[j] = mix_frac(pos);
+      if (v->channels == 1) memcpy(&w[j], v->data + (size_t)(pos >> SB_MIX_FIX_SHIFT) * 2, sizeof(w[j]));
+      else                  memcpy(&q[j], v->data + (size_t)(pos >> SB_MIX_FIX_SHIFT) * 4, sizeof(q[j]));
+    }
+    f = _mm_loadu_ps(fr);
+    if (v->channels == 1) {
+      // 下位16bitがフレームi、上位16bitがフレームi+1
+      x = _mm_loadu_si128((const __m128i *)w);
+      a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(x, 16), 16)), scale);
+      b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(x, 16)), scale);
+      l = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), f));
+      r = l;
+    }
+    else {
+      // Li Ri Li+1 Ri+1 を4フレームぶん並べて転置する
+      lo = _mm_loadu_si128((const __m128i *)q);
+      hi = _mm_loadu_si128((const __m128i *)(q + 2));
+      x0 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)), scale);
+      x1 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)), scale);
+      x2 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)), scale);
+      x3 = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)), scale);
+      _MM_TRANSPOSE4_PS(x0, x1, x2, x3);
+      l = _mm_add_ps(x0, _mm_mul_ps(_mm_sub_ps(x2, x0), f));
+      r = _mm_add_ps(x1, _mm_mul_ps(_mm_sub_ps(x3, x1), f));
+    }
+    mix_accum4_sse2(acc + n * out_ch, out_ch, l, r, lg, rg);
+  }
+  return n;
+}
+
+/*
+ * 等速で端数が無ければ補間の係数は0なので、次のフレームを読まずにまとめて読む。
+ * 16bitとfloat（等速のみ）以外の素材はスカラー版で足し込む。
+ */
+SB_TARGET("sse2") static void
+mix_voice_sse2(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  DWORD n = 0;
+
+  // 3チャンネル以上はスカラー版で左右にまとめる
+  if (v->channels <= 2 && v->format == SB_SAMPLE_S16) {
+    if (v->step == FIX_ONE && !(v->pos & FIX_MASK)) n = mix_voice_unity_sse2(acc, out_ch, v, count);
+    else                                            n = mix_voice_interp_sse2(acc, out_ch, v, count);
+  }
+  else if (v->channels <= 2 && v->format == SB_SAMPLE_F32 && v->step == FIX_ONE && !(v->pos & FIX_MASK)) {
+    n = mix_voice_unity_f32_sse2(acc, out_ch, v, count);
+  }
+  mix_voice_tail(acc, out_ch, v, n, count);
+}
+
+SB_TARGET("sse2") static void
+mix_store_s16_sse2(BYTE *out, const float *acc, DWORD n)
+{
+  __m128 scale = _mm_set1_ps(32768.0f), lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+  __m128 a, b;
+  DWORD  i = 0;
+
+  for (; i + 8 <= n; i += 8) {
+    a = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(acc + i),     scale), lo), hi);
+    b = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(acc + i + 4), scale), lo), hi);
+    _mm_storeu_si128((__m128i *)(out + i * 2), _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+  }
+  mix_store_s16_scalar(out + i * 2, acc + i, n - i);
+}
+
+SB_TARGET("sse2") static void
+mix_store_u8_sse2(BYTE *out, const float *acc, DWORD n)
+{
+  __m128  scale = _mm_set1_ps(32768.0f), lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+  __m128i x[4], s0, s1;
+  DWORD   i = 0, j;
+
+  for (; i + 16 <= n; i += 16) {
+    for (j = 0; j < 4; j++) {
+      x[j] = _mm_cvtps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(acc + i + j * 4), scale), lo), hi));
+      x[j] = _mm_srai_epi32(x[j], 8);
+    }
+    s0 = _mm_packs_epi32(x[0], x[1]);
+    s1 = _mm_packs_epi32(x[2], x[3]);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi16(s0, s1), _mm_set1_epi8((char)0x80)));
+  }
+  mix_store_u8_scalar(out + i, acc + i, n - i);
+}
+
+/*
+ * フォーマット変換（SSE2版）
+ * 端数のサンプルはスカラー版で処理する。ディザーの系統がずれないように、
+ * ベクトルで処理するサンプル数は常に4の倍数にしてある。
+ */
+SB_TARGET("sse2") static __m128i
+conv_xorshift_sse2(__m128i x)
+{
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+SB_TARGET("sse2") static __m128
+conv_tpdf_sse2(__m128i *s)
+{
+  __m128 a, b;
+
+  *s = conv_xorshift_sse2(*s);
+  a  = _mm_cvtepi32_ps(_mm_srli_epi32(*s, 8));
+  *s = conv_xorshift_sse2(*s);
+  b  = _mm_cvtepi32_ps(_mm_srli_epi32(*s, 8));
+  return _mm_mul_ps(_mm_sub_ps(a, b), _mm_set1_ps(1.0f / 16777216));
+}
+
+// 8個の値を16bitに丸めて書き出す
+SB_TARGET("sse2") static void
+conv_round8_s16_sse2(BYTE *out, __m128 a, __m128 b, __m128i *state)
+{
+  __m128 lo = _mm_set1_ps(-32768.0f), hi = _mm_set1_ps(32767.0f);
+
+  if (state) {
+    a = _mm_add_ps(a, conv_tpdf_sse2(state));
+    b = _mm_add_ps(b, conv_tpdf_sse2(state));
+  }
+  a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+  b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+  _mm_storeu_si128((__m128i *)out, _mm_packs_epi32(_mm_cvtps_epi32(a), _mm_cvtps_epi32(b)));
+}
+
+SB_TARGET("sse2") static void
+conv_u8_s16_sse2(BYTE *out, const BYTE *in, DWORD n)
+{
+  __m128i x, zero = _mm_setzero_si128(), bias = _mm_set1_epi8((char)0x80);
+  DWORD   i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    // 符号を反転すると上位バイトに置くだけで16bitになる
+    x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + i)), bias);
+    _mm_storeu_si128((__m128i *)(out + i * 2),      _mm_unpacklo_epi8(zero, x));
+    _mm_storeu_si128((__m128i *)(out + i * 2 + 16), _mm_unpackhi_epi8(zero, x));
+  }
+  conv_u8_s16_scalar(out + i * 2, in + i, n - i);
+}
+
+SB_TARGET("sse2") static void
+conv_s16_u8_sse2(BYTE *out, const BYTE *in, DWORD n)
+{
+  __m128i a, b;
+  DWORD   i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    a = _mm_srai_epi16(_mm_loadu_si128((const __m128i *)(in + i * 2)),      8);
+    b = _mm_srai_epi16(_mm_loadu_si128((const __m128i *)(in + i * 2 + 16)), 8);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(_mm_packs_epi16(a, b), _mm_set1_epi8((char)0x80)));
+  }
+  conv_s16_u8_scalar(out + i, in + i * 2, n - i);
+}
+
+SB_TARGET("sse2") static void
+conv_s32_s16_sse2(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither)
+{
+  __m128  scale = _mm_set1_ps(1.0f / 65536), a, b;
+  __m128i state = _mm_setzero_si128();
+  DWORD   i = 0;
+
+  if (dither) state = _mm_loadu_si128((const __m128i *)dither->state);
+  for (; i + 8 <= n; i += 8) {
+    a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i * 4))),      scale);
+    b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i * 4 + 16))), scale);
+    conv_round8_s16_sse2(out + i * 2, a, b, dither ? &state : NULL);
+  }
+  if (dither) _mm_storeu_si128((__m128i *)dither->state, state);
+  conv_s32_s16_scalar(out + i * 2, in + i * 4, n - i, dither);
+}
+
+SB_TARGET("sse2") static void
+conv_f32_s16_sse2(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither)
+{
+  __m128  scale = _mm_set1_ps(32768.0f), a, b;
+  __m128i state = _mm_setzero_si128();
+  DWORD   i = 0;
+
+  if (dither) state = _mm_loadu_si128((const __m128i *)dither->state);
+  for (; i + 8 <= n; i += 8) {
+    a = _mm_mul_ps(_mm_loadu_ps((const float *)(in + i * 4)),      scale);
+    b = _mm_mul_ps(_mm_loadu_ps((const float *)(in + i * 4 + 16)), scale);
+    conv_round8_s16_sse2(out + i * 2, a, b, dither ? &state : NULL);
+  }
+  if (dither) _mm_storeu_si128((__m128i *)dither->state, state);
+  conv_f32_s16_scalar(out + i * 2, in + i * 4, n - i, dither);
+}
+
+SB_TARGET("sse2") static void
+conv_mono_stereo_sse2(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes)
+{
+  __m128i x;
+  DWORD   i = 0, step = 16 / bytes;
+
+  for (; i + step <= frames; i += step) {
+    x = _mm_loadu_si128((const __m128i *)(in + i * bytes));
+    if (bytes == 1) {
+      _mm_storeu_si128((__m128i *)(out + i * 2),      _mm_unpacklo_epi8(x, x));
+      _mm_storeu_si128((__m128i *)(out + i * 2 + 16), _mm_unpackhi_epi8(x, x));
+    }
+    else {
+      _mm_storeu_si128((__m128i *)(out + i * 4),      _mm_unpacklo_epi16(x, x));
+      _mm_storeu_si128((__m128i *)(out + i * 4 + 16), _mm_unpackhi_epi16(x, x));
+    }
+  }
+  conv_mono_stereo_scalar(out + i * bytes * 2, in + i * bytes, frames - i, bytes);
+}
+
+SB_TARGET("sse2") static void
+conv_stereo_mono_sse2(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes)
+{
+  __m128i a, b, mask = _mm_set1_epi16(0x00FF), one = _mm_set1_epi16(1);
+  DWORD   i = 0, step = 16 / bytes;
+
+  for (; i + step <= frames; i += step) {
+    a = _mm_loadu_si128((const __m128i *)(in + i * bytes * 2));
+    b = _mm_loadu_si128((const __m128i *)(in + i * bytes * 2 + 16));
+    if (bytes == 1) {
+      // 偶数バイトが左、奇数バイトが右。avgは切り上げの平均
+      a = _mm_avg_epu16(_mm_and_si128(a, mask), _mm_srli_epi16(a, 8));
+      b = _mm_avg_epu16(_mm_and_si128(b, mask), _mm_srli_epi16(b, 8));
+      _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(a, b));
+    }
+    else {
+      // maddで左右を32bitで足す
+      a = _mm_srai_epi32(_mm_madd_epi16(a, one), 1);
+      b = _mm_srai_epi32(_mm_madd_epi16(b, one), 1);
+      _mm_storeu_si128((__m128i *)(out + i * 2), _mm_packs_epi32(a, b));
+    }
+  }
+  conv_stereo_mono_scalar(out + i * bytes, in + i * bytes * 2, frames - i, bytes);
+}
+
+// 2チャンネルの8/16bitだけベクトルで行う
+SB_TARGET("sse2") static void
+conv_interleave_sse2(BYTE *out, const BYTE *const *planes, DWORD channels, DWORD frames, DWORD bytes)
+{
+  const BYTE *rest[2];
+  __m128i     l, r;
+  DWORD       i = 0, step = 16 / bytes;
+
+  if (channels != 2 || bytes > 2) {
+    conv_interleave_scalar(out, planes, channels, frames, bytes);
+    return;
+  }
+  for (; i + step <= frames; i += step) {
+    l = _mm_loadu_si128((const __m128i *)(planes[0] + i * bytes));
+    r = _mm_loadu_si128((const __m128i *)(planes[1] + i * bytes));
+    if (bytes == 1) {
+      _mm_storeu_si128((__m128i *)(out + i * 2),      _mm_unpacklo_epi8(l, r));
+      _mm_storeu_si128((__m128i *)(out + i * 2 + 16), _mm_unpackhi_epi8(l, r));
+    }
+    else {
+      _mm_storeu_si128((__m128i *)(out + i * 4),      _mm_unpacklo_epi16(l, r));
+      _mm_storeu_si128((__m128i *)(out + i * 4 + 16), _mm_unpackhi_epi16(l, r));
+    }
+  }
+  rest[0] = planes[0] + i * bytes;
+  rest[1] = planes[1] + i * bytes;
+  conv_interleave_scalar(out + i * bytes * 2, rest, 2, frames - i, bytes);
+}
+
+SB_TARGET("sse2") static void
+conv_deinterleave_sse2(BYTE *const *planes, const BYTE *in, DWORD channels, DWORD frames, DWORD bytes)
+{
+  BYTE   *rest[2];
+  __m128i a, b, mask = _mm_set1_epi16(0x00FF);
+  DWORD   i = 0, step = 16 / bytes;
+
+  if (channels != 2 || bytes > 2) {
+    conv_deinterleave_scalar(planes, in, channels, frames, bytes);
+    return;
+  }
+  for (; i + step <= frames; i += step) {
+    a = _mm_loadu_si128((const __m128i *)(in + i * bytes * 2));
+    b = _mm_loadu_si128((const __m128i *)(in + i * bytes * 2 + 16));
+    if (bytes == 1) {
+      _mm_storeu_si128((__m128i *)(planes[0] + i), _mm_packus_epi16(_mm_and_si128(a, mask), _mm_and_si128(b, mask)));
+      _mm_storeu_si128((__m128i *)(planes[1] + i), _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+    else {
+      // 32bitの下位16bitが左、上位16bitが右
+      _mm_storeu_si128((__m128i *)(planes[0] + i * 2),
+                       _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16), _mm_srai_epi32(_mm_slli_epi32(b, 16), 16)));
+      _mm_storeu_si128((__m128i *)(planes[1] + i * 2), _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16)));
+    }
+  }
+  rest[0] = planes[0] + i * bytes;
+  rest[1] = planes[1] + i * bytes;
+  conv_deinterleave_scalar(rest, in + i * bytes * 2, 2, frames - i, bytes);
+}
+
+/*
+ * 2・4バイトのフレームは、両端から16バイトずつ読んでレジスターの中で逆順にし、入れ替えて書く。
+ */
+SB_TARGET("sse2") static __m128i
+reverse16_sse2(__m128i x, DWORD block)
+{
+  if (block == 4) return _mm_shuffle_epi32(x, _MM_SHUFFLE(0, 1, 2, 3));
+  x = _mm_shufflelo_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+  x = _mm_shufflehi_epi16(x, _MM_SHUFFLE(0, 1, 2, 3));
+  return _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2));
+}
+
+SB_TARGET("sse2") static void
+reverse_frames_sse2(BYTE *data, DWORD frames, DWORD block)
+{
+  BYTE   *lo = data, *hi = data + (size_t)frames * block;
+  __m128i a, b;
+
+  if (block == 2 || block == 4) {
+    for (; hi - lo >= 32; lo += 16, hi -= 16) {
+      a = _mm_loadu_si128((const __m128i *)lo);
+      b = _mm_loadu_si128((const __m128i *)(hi - 16));
+      _mm_storeu_si128((__m128i *)lo,        reverse16_sse2(b, block));
+      _mm_storeu_si128((__m128i *)(hi - 16), reverse16_sse2(a, block));
+    }
+  }
+  reverse_frames_scalar(lo, (DWORD)((hi - lo) / block), block);
+}
+
+/*
+ * オシレーター（SSE2版）
+ * 4フレームずつ位相から波形を求める。分岐は比較のマスクで選ぶ。
+ */
+SB_TARGET("sse2") static __m128
+osc_select_sse2(__m128 mask, __m128 a, __m128 b)
+{
+  return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+SB_TARGET("sse2") static __m128
+osc_frac_sse2(__m128 t)
+{
+  return _mm_sub_ps(t, _mm_cvtepi32_ps(_mm_cvttps_epi32(t)));
+}
+
+SB_TARGET("sse2") static __m128
+osc_sine_sse2(__m128 t)
+{
+  __m128 half = _mm_set1_ps(0.5f), u = _mm_sub_ps(t, half), y, y2, p;
+
+  u  = _mm_min_ps(u, _mm_sub_ps(half, u));
+  u  = _mm_max_ps(u, _mm_sub_ps(_mm_set1_ps(-0.5f), u));
+  y  = _mm_mul_ps(u, _mm_set1_ps(OSC_TWO_PI));
+  y2 = _mm_mul_ps(y, y);
+  p  = _mm_add_ps(_mm_set1_ps(-1.0f / 5040), _mm_mul_ps(y2, _mm_set1_ps(1.0f / 371073)));
+  p  = _mm_add_ps(_mm_set1_ps(1.0f / 120), _mm_mul_ps(y2, p));
+  p  = _mm_add_ps(_mm_set1_ps(-1.0f / 6), _mm_mul_ps(y2, p));
+  p  = _mm_add_ps(_mm_set1_ps(1.0f), _mm_mul_ps(y2, p));
+  return _mm_xor_ps(_mm_mul_ps(y, p), _mm_set1_ps(-0.0f));
+}
+
+// PolyBLEP（cube == 0）かPolyBLAMP（cube != 0）の補正
+SB_TARGET("sse2") static __m128
+osc_blep_sse2(__m128 t, __m128 dt, __m128 hi, __m128 inv, int cube)
+{
+  __m128 one = _mm_set1_ps(1.0f), lo_mask, hi_mask, x1, x2;
+
+  lo_mask = _mm_cmplt_ps(t, dt);
+  hi_mask = _mm_andnot_ps(lo_mask, _mm_cmpgt_ps(t, hi));
+  x1 = _mm_sub_ps(one, _mm_mul_ps(t, inv));
+  x2 = _mm_add_ps(one, _mm_mul_ps(_mm_sub_ps(t, one), inv));
+  if (cube) {
+    x1 = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(x1, x1), x1), _mm_set1_ps(1.0f / 6));
+    x2 = _mm_mul_ps(_mm_mul_ps(_mm_mul_ps(x2, x2), x2), _mm_set1_ps(1.0f / 6));
+  }
+  else {
+    x1 = _mm_mul_ps(_mm_mul_ps(x1, x1), _mm_set1_ps(-0.5f));
+    x2 = _mm_mul_ps(_mm_mul_ps(x2, x2), _mm_set1_ps(0.5f));
+  }
+  return _mm_or_ps(_mm_and_ps(lo_mask, x1), _mm_and_ps(hi_mask, x2));
+}
+
+SB_TARGET("sse2") static __m128
+osc_wave_sse2(DWORD wave, __m128 t, __m128 dt, __m128 hi, __m128 inv)
+{
+  __m128 half = _mm_set1_ps(0.5f), one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f);
+  __m128 t2 = osc_frac_sse2(_mm_add_ps(t, half)), v;
+
+  switch (wave) {
+  case SB_OSC_SQUARE:
+    v = osc_select_sse2(_mm_cmplt_ps(t, half), one, _mm_set1_ps(-1.0f));
+    return _mm_add_ps(v, _mm_mul_ps(_mm_sub_ps(osc_blep_sse2(t, dt, hi, inv, 0), osc_blep_sse2(t2, dt, hi, inv, 0)), two));
+  case SB_OSC_SAW:
+    return _mm_sub_ps(_mm_sub_ps(_mm_add_ps(t, t), one), _mm_mul_ps(osc_blep_sse2(t, dt, hi, inv, 0), two));
+  case SB_OSC_TRIANGLE:
+    v = _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(t, half));
+    v = _mm_sub_ps(one, _mm_mul_ps(v, _mm_set1_ps(4.0f)));
+    return _mm_add_ps(v, _mm_mul_ps(_mm_sub_ps(osc_blep_sse2(t, dt, hi, inv, 1), osc_blep_sse2(t2, dt, hi, inv, 1)),
+                                    _mm_mul_ps(dt, _mm_set1_ps(8.0f))));
+  default:
+    return osc_sine_sse2(t);
+  }
+}
+
+SB_TARGET("sse2") static void
+osc_render_sse2(float *out, LPSBOSC osc, float gain, float dgain, DWORD count)
+{
+  float   fdt = (float)osc->inc, t0;
+  __m128  dt = _mm_set1_ps(fdt), hi = _mm_set1_ps(1.0f - fdt), inv = _mm_set1_ps(1.0f / fdt);
+  __m128  g0 = _mm_set1_ps(gain), dg = _mm_set1_ps(dgain), g, t;
+  __m128i lane = _mm_setr_epi32(0, 1, 2, 3), state, s;
+  DWORD   i, j, n;
+
+  if (osc->wave == SB_OSC_NOISE) {
+    state = _mm_loadu_si128((const __m128i *)osc->noise);
+    for (i = 0; i + 4 <= count; i += 4) {
+      state = conv_xorshift_sse2(state);
+      s = _mm_add_epi32(_mm_set1_epi32((int)i), lane);
+      g = _mm_add_ps(g0, _mm_mul_ps(dg, _mm_cvtepi32_ps(s)));
+      t = _mm_mul_ps(_mm_cvtepi32_ps(state), _mm_set1_ps(1.0f / 2147483648.0f));
+      _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), _mm_mul_ps(g, t)));
+    }
+    _mm_storeu_si128((__m128i *)osc->noise, state);
+    for (; i < count; i++) out[i] += (gain + dgain * (float)i) * osc_noise(osc, i);
+    return;
+  }
+  for (i = 0; i < count; i += n) {
+    n  = count - i < SB_OSC_BLOCK ? count - i : SB_OSC_BLOCK;
+    t0 = (float)osc->phase;
+    for (j = 0; j + 4 <= n; j += 4) {
+      s = _mm_add_epi32(_mm_set1_epi32((int)j), lane);
+      t = osc_frac_sse2(_mm_add_ps(_mm_set1_ps(t0), _mm_mul_ps(_mm_cvtepi32_ps(s), dt)));
+      g = _mm_add_ps(g0, _mm_mul_ps(dg, _mm_cvtepi32_ps(_mm_add_epi32(s, _mm_set1_epi32((int)i)))));
+      _mm_storeu_ps(out + i + j, _mm_add_ps(_mm_loadu_ps(out + i + j), _mm_mul_ps(g, osc_wave_sse2(osc->wave, t, dt, hi, inv))));
+    }
+    if (j < n) osc_render_span(out + i, osc, gain, dgain, i, t0, j, n);
+    osc_advance(osc, n);
+  }
+}
+
+/*
+ * エフェクトの部品（SSE2版）
+ */
+SB_TARGET("sse2") static void
+fx_blend_sse2(float *out, const float *wet, float dry, float wgain, DWORD n)
+{
+  __m128 d = _mm_set1_ps(dry), w = _mm_set1_ps(wgain);
+  DWORD  i;
+
+  for (i = 0; i + 4 <= n; i += 4) {
+    _mm_storeu_ps(out + i, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(out + i), d), _mm_mul_ps(_mm_loadu_ps(wet + i), w)));
+  }
+  fx_blend_span(out, wet, dry, wgain, i, n);
+}
+
+SB_TARGET("sse2") static __m128
+fx_shape4_sse2(__m128 x)
+{
+  __m128 c27 = _mm_set1_ps(27.0f), x2;
+
+  x  = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-3.0f)), _mm_set1_ps(3.0f));
+  x2 = _mm_mul_ps(x, x);
+  return _mm_div_ps(_mm_mul_ps(x, _mm_add_ps(c27, x2)), _mm_add_ps(c27, _mm_mul_ps(_mm_set1_ps(9.0f), x2)));
+}
+
+SB_TARGET("sse2") static void
+fx_shape_sse2(float *buf, float drive, DWORD n)
+{
+  __m128 d = _mm_set1_ps(drive);
+  DWORD  i;
+
+  for (i = 0; i + 4 <= n; i += 4) _mm_storeu_ps(buf + i, fx_shape4_sse2(_mm_mul_ps(_mm_loadu_ps(buf + i), d)));
+  fx_shape_span(buf, drive, i, n);
+}
+
+SB_TARGET("sse2") static void
+fx_modulate_sse2(float *buf, int channels, const float *gain, DWORD frames)
+{
+  __m128 g;
+  DWORD  i;
+
+  for (i = 0; i + 4 <= frames; i += 4) {
+    g = _mm_loadu_ps(gain + i);
+    if (channels == 2) {
+      _mm_storeu_ps(buf + i * 2,     _mm_mul_ps(_mm_loadu_ps(buf + i * 2),     _mm_unpacklo_ps(g, g)));
+      _mm_storeu_ps(buf + i * 2 + 4, _mm_mul_ps(_mm_loadu_ps(buf + i * 2 + 4), _mm_unpackhi_ps(g, g)));
+    }
+    else _mm_storeu_ps(buf + i, _mm_mul_ps(_mm_loadu_ps(buf + i), g));
+  }
+  fx_modulate_span(buf, channels, gain, i, frames);
+}
+
+SB_TARGET("sse2") static void
+fx_gain_add_sse2(float *acc, int out_ch, const float *src, float lgain, float rgain, DWORD frames)
+{
+  __m128 lg = _mm_set1_ps(lgain), rg = _mm_set1_ps(rgain), g = _mm_setr_ps(lgain, rgain, lgain, rgain), x;
+  DWORD  i;
+
+  for (i = 0; i + 4 <= frames; i += 4) {
+    if (out_ch == 2) {
+      _mm_storeu_ps(acc + i * 2,     _mm_add_ps(_mm_loadu_ps(acc + i * 2),     _mm_mul_ps(_mm_loadu_ps(src + i * 2),     g)));
+      _mm_storeu_ps(acc + i * 2 + 4, _mm_add_ps(_mm_loadu_ps(acc + i * 2 + 4), _mm_mul_ps(_mm_loadu_ps(src + i * 2 + 4), g)));
+    }
+    else {
+      x = _mm_loadu_ps(src + i);
+      _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+                                        _mm_mul_ps(_mm_add_ps(_mm_mul_ps(x, lg), _mm_mul_ps(x, rg)), _mm_set1_ps(0.5f))));
+    }
+  }
+  fx_gain_add_span(acc, out_ch, src, lgain, rgain, i, frames);
+}
+
+/*
+ * AVX2版
+ * 等速の読み出しと16bitの書き出しを8個ずつ行う。それ以外はSSE2版を使う。
+ */
+SB_TARGET("avx2") static void
+mix_accum8_avx2(float *acc, int out_ch, __m256 l, __m256 r, __m256 lg, __m256 rg)
+{
+  __m256 x = _mm256_mul_ps(l, lg), y = _mm256_mul_ps(r, rg), a, b;
+
+  if (out_ch == 2) {
+    a = _mm256_unpacklo_ps(x, y);
+    b = _mm256_unpackhi_ps(x, y);
+    _mm256_storeu_ps(acc,     _mm256_add_ps(_mm256_loadu_ps(acc),     _mm256_permute2f128_ps(a, b, 0x20)));
+    _mm256_storeu_ps(acc + 8, _mm256_add_ps(_mm256_loadu_ps(acc + 8), _mm256_permute2f128_ps(a, b, 0x31)));
+  }
+  else _mm256_storeu_ps(acc, _mm256_add_ps(_mm256_loadu_ps(acc), _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(0.5f))));
+}
+
+SB_TARGET("avx2") static __m256
+mix_load8_s16_avx2(const BYTE *p)
+{
+  __m256i s = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p));
+
+  return _mm256_mul_ps(_mm256_cvtepi32_ps(s), _mm256_set1_ps(1.0f / 32768));
+}
+
+SB_TARGET("avx2") static void
+mix_voice_avx2(float *acc, int out_ch, LPCSBMIXVOICE v, DWORD count)
+{
+  const BYTE *p;
+  __m256      lg, rg, a, b, l, r;
+  DWORD       n = 0;
+
+  if (!(v->format == SB_SAMPLE_S16 && v->channels <= 2 && v->step == FIX_ONE && !(v->pos & FIX_MASK))) {
+    mix_voice_sse2(acc, out_ch, v, count);
+    return;
+  }
+  p  = v->data + (size_t)(v->pos >> SB_MIX_FIX_SHIFT) * v->channels * 2;
+  lg = _mm256_set1_ps(v->lgain);
+  rg = _mm256_set1_ps(v->rgain);
+  if (v->channels == 1) {
+    for (; n + 8 <= count; n += 8, p += 16) {
+      a = mix_load8_s16_avx2(p);
+      mix_accum8_avx2(acc + n * out_ch, out_ch, a, a, lg, rg);
+    }
+  }
+  else {
+    for (; n + 8 <= count; n += 8, p += 32) {
+      // 8フレーム（16サンプル）をLとRに分ける
+      a = mix_load8_s16_avx2(p);
+      b = mix_load8_s16_avx2(p + 16);
+      l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+      r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+      // shuffleは128bitごとなので、フレーム順 0 1 4 5 2 3 6 7 を並べ直す
+      l = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(l), _MM_SHUFFLE(3, 1, 2, 0)));
+      r = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(r), _MM_SHUFFLE(3, 1, 2, 0)));
+      mix_accum8_avx2(acc + n * out_ch, out_ch, l, r, lg, rg);
+    }
+  }
+  mix_voice_tail(acc, out_ch, v, n, count);
+}
+
+SB_TARGET("avx2") static void
+mix_store_s16_avx2(BYTE *out, const float *acc, DWORD n)
+{
+  __m256  scale = _mm256_set1_ps(32768.0f), lo = _mm256_set1_ps(-32768.0f), hi = _mm256_set1_ps(32767.0f);
+  __m256  a, b;
+  __m256i s;
+  DWORD   i = 0;
+
+  for (; i + 16 <= n; i += 16) {
+    a = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(acc + i),     scale), lo), hi);
+    b = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(_mm256_loadu_ps(acc + i + 8), scale), lo), hi);
+    s = _mm256_packs_epi32(_mm256_cvtps_epi32(a), _mm256_cvtps_epi32(b));
+    _mm256_storeu_si256((__m256i *)(out + i * 2), _mm256_permute4x64_epi64(s, _MM_SHUFFLE(3, 1, 2, 0)));
+  }
+  mix_store_s16_sse2(out + i * 2, acc + i, n - i);
+}
+
+/*
+ * オシレーター（AVX2版）
+ * 8フレームずつ求める。ノイズは系統の数がそろわないのでSSE2版を使う。
+ */
+SB_TARGET("avx2") static __m256
+osc_frac_avx2(__m256 t)
+{
+  return _mm256_sub_ps(t, _mm256_cvtepi32_ps(_mm256_cvttps_epi32(t)));
+}
+
+SB_TARGET("avx2") static __m256
+osc_sine_avx2(__m256 t)
+{
+  __m256 half = _mm256_set1_ps(0.5f), u = _mm256_sub_ps(t, half), y, y2, p;
+
+  u  = _mm256_min_ps(u, _mm256_sub_ps(half, u));
+  u  = _mm256_max_ps(u, _mm256_sub_ps(_mm256_set1_ps(-0.5f), u));
+  y  = _mm256_mul_ps(u, _mm256_set1_ps(OSC_TWO_PI));
+  y2 = _mm256_mul_ps(y, y);
+  p  = _mm256_add_ps(_mm256_set1_ps(-1.0f / 5040), _mm256_mul_ps(y2, _mm256_set1_ps(1.0f / 371073)));
+  p  = _mm256_add_ps(_mm256_set1_ps(1.0f / 120), _mm256_mul_ps(y2, p));
+  p  = _mm256_add_ps(_mm256_set1_ps(-1.0f / 6), _mm256_mul_ps(y2, p));
+  p  = _mm256_add_ps(_mm256_set1_ps(1.0f), _mm256_mul_ps(y2, p));
+  return _mm256_xor_ps(_mm256_mul_ps(y, p), _mm256_set1_ps(-0.0f));
+}
+
+SB_TARGET("avx2") static __m256
+osc_blep_avx2(__m256 t, __m256 dt, __m256 hi, __m256 inv, int cube)
+{
+  __m256 one = _mm256_set1_ps(1.0f), lo_mask, hi_mask, x1, x2;
+
+  lo_mask = _mm256_cmp_ps(t, dt, _CMP_LT_OQ);
+  hi_mask = _mm256_andnot_ps(lo_mask, _mm256_cmp_ps(t, hi, _CMP_GT_OQ));
+  x1 = _mm256_sub_ps(one, _mm256_mul_ps(t, inv));
+  x2 = _mm256_add_ps(one, _mm256_mul_ps(_mm256_sub_ps(t, one), inv));
+  if (cube) {
+    x1 = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(x1, x1), x1), _mm256_set1_ps(1.0f / 6));
+    x2 = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(x2, x2), x2), _mm256_set1_ps(1.0f / 6));
+  }
+  else {
+    x1 = _mm256_mul_ps(_mm256_mul_ps(x1, x1), _mm256_set1_ps(-0.5f));
+    x2 = _mm256_mul_ps(_mm256_mul_ps(x2, x2), _mm256_set1_ps(0.5f));
+  }
+  return _mm256_or_ps(_mm256_and_ps(lo_mask, x1), _mm256_and_ps(hi_mask, x2));
+}
+
+SB_TARGET("avx2") static __m256
+osc_wave_avx2(DWORD wave, __m256 t, __m256 dt, __m256 hi, __m256 inv)
+{
+  __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f);
+  __m256 t2 = osc_frac_avx2(_mm256_add_ps(t, half)), v;
+
+  switch (wave) {
+  case SB_OSC_SQUARE:
+    v = _mm256_blendv_ps(_mm256_set1_ps(-1.0f), one, _mm256_cmp_ps(t, half, _CMP_LT_OQ));
+    return _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(osc_blep_avx2(t, dt, hi, inv, 0), osc_blep_avx2(t2, dt, hi, inv, 0)), two));
+  case SB_OSC_SAW:
+    return _mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(t, t), one), _mm256_mul_ps(osc_blep_avx2(t, dt, hi, inv, 0), two));
+  case SB_OSC_TRIANGLE:
+    v = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(t, half));
+    v = _mm256_sub_ps(one, _mm256_mul_ps(v, _mm256_set1_ps(4.0f)));
+    return _mm256_add_ps(v, _mm256_mul_ps(_mm256_sub_ps(osc_blep_avx2(t, dt, hi, inv, 1), osc_blep_avx2(t2, dt, hi, inv, 1)),
+                                          _mm256_mul_ps(dt, _mm256_set1_ps(8.0f))));
+  default:
+    return osc_sine_avx2(t);
+  }
+}
+
+SB_TARGET("avx2") static void
+osc_render_avx2(float *out, LPSBOSC osc, float gain, float dgain, DWORD count)
+{
+  float   fdt = (float)osc->inc, t0;
+  __m256  dt = _mm256_set1_ps(fdt), hi = _mm256_set1_ps(1.0f - fdt), inv = _mm256_set1_ps(1.0f / fdt);
+  __m256  g0 = _mm256_set1_ps(gain), dg = _mm256_set1_ps(dgain), g, t;
+  __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), s;
+  DWORD   i, j, n;
+
+  if (osc->wave == SB_OSC_NOISE) {
+    osc_render_sse2(out, osc, gain, dgain, count);
+    return;
+  }
+  for (i = 0; i < count; i += n) {
+    n  = count - i < SB_OSC_BLOCK ? count - i : SB_OSC_BLOCK;
+    t0 = (float)osc->phase;
+    for (j = 0; j + 8 <= n; j += 8) {
+      s = _mm256_add_epi32(_mm256_set1_epi32((int)j), lane);
+      t = osc_frac_avx2(_mm256_add_ps(_mm256_set1_ps(t0), _mm256_mul_ps(_mm256_cvtepi32_ps(s), dt)));
+      g = _mm256_add_ps(g0, _mm256_mul_ps(dg, _mm256_cvtepi32_ps(_mm256_add_epi32(s, _mm256_set1_epi32((int)i)))));
+      _mm256_storeu_ps(out + i + j, _mm256_add_ps(_mm256_loadu_ps(out + i + j), _mm256_mul_ps(g, osc_wave_avx2(osc->wave, t, dt, hi, inv))));
+    }
+    // 端数はSSEの命令で計算するので、切り替えの遅れが出ないようにYMMの上位を消しておく
+    if (j < n) {
+      _mm256_zeroupper();
+      osc_render_span(out + i, osc, gain, dgain, i, t0, j, n);
+    }
+    osc_advance(osc, n);
+  }
+}
+
+/*
+ * エフェクトの部品（AVX2版）
+ */
+SB_TARGET("avx2") static void
+fx_blend_avx2(float *out, const float *wet, float dry, float wgain, DWORD n)
+{
+  __m256 d = _mm256_set1_ps(dry), w = _mm256_set1_ps(wgain);
+  DWORD  i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(out + i), d), _mm256_mul_ps(_mm256_loadu_ps(wet + i), w)));
+  }
+  _mm256_zeroupper();
+  fx_blend_span(out, wet, dry, wgain, i, n);
+}
+
+SB_TARGET("avx2") static void
+fx_shape_avx2(float *buf, float drive, DWORD n)
+{
+  __m256 d = _mm256_set1_ps(drive), c27 = _mm256_set1_ps(27.0f), x, x2;
+  DWORD  i;
+
+  for (i = 0; i + 8 <= n; i += 8) {
+    x  = _mm256_mul_ps(_mm256_loadu_ps(buf + i), d);
+    x  = _mm256_min_ps(_mm256_max_ps(x, _mm256_set1_ps(-3.0f)), _mm256_set1_ps(3.0f));
+    x2 = _mm256_mul_ps(x, x);
+    _mm256_storeu_ps(buf + i, _mm256_div_ps(_mm256_mul_ps(x, _mm256_add_ps(c27, x2)),
+                                            _mm256_add_ps(c27, _mm256_mul_ps(_mm256_set1_ps(9.0f), x2))));
+  }
+  _mm256_zeroupper();
+  fx_shape_span(buf, drive, i, n);
+}
+
+SB_TARGET("avx2") static void
+fx_modulate_avx2(float *buf, int channels, const float *gain, DWORD frames)
+{
+  __m256 g, a, b;
+  DWORD  i;
+
+  for (i = 0; i + 8 <= frames; i += 8) {
+    g = _mm256_loadu_ps(gain + i);
+    if (channels == 2) {
+      a = _mm256_unpacklo_ps(g, g);
+      b = _mm256_unpackhi_ps(g, g);
+      _mm256_storeu_ps(buf + i * 2,     _mm256_mul_ps(_mm256_loadu_ps(buf + i * 2),     _mm256_permute2f128_ps(a, b, 0x20)));
+      _mm256_storeu_ps(buf + i * 2 + 8, _mm256_mul_ps(_mm256_loadu_ps(buf + i * 2 + 8), _mm256_permute2f128_ps(a, b, 0x31)));
+    }
+    else _mm256_storeu_ps(buf + i, _mm256_mul_ps(_mm256_loadu_ps(buf + i), g));
+  }
+  _mm256_zeroupper();
+  fx_modulate_span(buf, channels, gain, i, frames);
+}
+
+SB_TARGET("avx2") static void
+fx_gain_add_avx2(float *acc, int out_ch, const float *src, float lgain, float rgain, DWORD frames)
+{
+  __m256 lg = _mm256_set1_ps(lgain), rg = _mm256_set1_ps(rgain), x;
+  __m256 g  = _mm256_setr_ps(lgain, rgain, lgain, rgain, lgain, rgain, lgain, rgain);
+  DWORD  i;
+
+  for (i = 0; i + 8 <= frames; i += 8) {
+    if (out_ch == 2) {
+      _mm256_storeu_ps(acc + i * 2,     _mm256_add_ps(_mm256_loadu_ps(acc + i * 2),     _mm256_mul_ps(_mm256_loadu_ps(src + i * 2),     g)));
+      _mm256_storeu_ps(acc + i * 2 + 8, _mm256_add_ps(_mm256_loadu_ps(acc + i * 2 + 8), _mm256_mul_ps(_mm256_loadu_ps(src + i * 2 + 8), g)));
+    }
+    else {
+      x = _mm256_loadu_ps(src + i);
+      _mm256_storeu_ps(acc + i, _mm256_add_ps(_mm256_loadu_ps(acc + i),
+                                              _mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(x, lg), _mm256_mul_ps(x, rg)), _mm256_set1_ps(0.5f))));
+    }
+  }
+  _mm256_zeroupper();
+  fx_gain_add_span(acc, out_ch, src, lgain, rgain, i, frames);
+}
+
+static int
+cpu_has_sse2(void)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  return 1;
+#elif defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#else
+  int info[4];
+
+  __cpuid(info, 1);
+  return (info[3] >> 26) & 1;
+#endif
+}
+
+static int
+cpu_has_avx2(void)
+{
+#if defined(__GNUC__)
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#else
+  int info[4];
+
+  __cpuid(info, 1);
+  // OSがYMMレジスターを保存するか（OSXSAVEとXCR0）
+  if (!((info[2] >> 27) & 1) || (_xgetbv(0) & 6) != 6) return 0;
+  __cpuidex(info, 7, 0);
+  return (info[1] >> 5) & 1;
+#endif
+}
+#endif /* SB_MIX_X86 */
+
+void
+sb_mix_init(const char *isa)
+{
+  if (!isa) isa = getenv("SOUNDBUFFER_SIMD");
+  if (!isa) isa = "";
+
+  sb_mix_voice     = mix_voice_scalar;
+  sb_mix_store_s16 = mix_store_s16_scalar;
+  sb_mix_store_u8  = mix_store_u8_scalar;
+  mix_isa          = "scalar";
+  sb_conv_u8_s16       = conv_u8_s16_scalar;
+  sb_conv_s16_u8       = conv_s16_u8_scalar;
+  sb_conv_s32_s16      = conv_s32_s16_scalar;
+  sb_conv_f32_s16      = conv_f32_s16_scalar;
+  sb_conv_mono_stereo  = conv_mono_stereo_scalar;
+  sb_conv_stereo_mono  = conv_stereo_mono_scalar;
+  sb_conv_interleave   = conv_interleave_scalar;
+  sb_conv_deinterleave = conv_deinterleave_scalar;
+  sb_reverse_frames    = reverse_frames_scalar;
+  sb_osc_render        = osc_render_scalar;
+  sb_mix_blend         = fx_blend_scalar;
+  sb_mix_shape         = fx_shape_scalar;
+  sb_mix_modulate      = fx_modulate_scalar;
+  sb_mix_gain_add      = fx_gain_add_scalar;
+#ifdef SB_MIX_X86
+  if (strcmp(isa, "scalar") == 0 || !cpu_has_sse2()) return;
+  sb_mix_voice     = mix_voice_sse2;
+  sb_mix_store_s16 = mix_store_s16_sse2;
+  sb_mix_store_u8  = mix_store_u8_sse2;
+  sb_conv_u8_s16       = conv_u8_s16_sse2;
+  sb_conv_s16_u8       = conv_s16_u8_sse2;
+  sb_conv_s32_s16      = conv_s32_s16_sse2;
+  sb_conv_f32_s16      = conv_f32_s16_sse2;
+  sb_conv_mono_stereo  = conv_mono_stereo_sse2;
+  sb_conv_stereo_mono  = conv_stereo_mono_sse2;
+  sb_conv_interleave   = conv_interleave_sse2;
+  sb_conv_deinterleave = conv_deinterleave_sse2;
+  sb_reverse_frames    = reverse_frames_sse2;
+  sb_osc_render        = osc_render_sse2;
+  sb_mix_blend         = fx_blend_sse2;
+  sb_mix_shape         = fx_shape_sse2;
+  sb_mix_modulate      = fx_modulate_sse2;
+  sb_mix_gain_add      = fx_gain_add_sse2;
+  mix_isa          = "sse2";
+  if (strcmp(isa, "sse2") == 0 || !cpu_has_avx2()) return;
+  sb_mix_voice     = mix_voice_avx2;
+  sb_mix_store_s16 = mix_store_s16_avx2;
+  sb_osc_render    = osc_render_avx2;
+  sb_mix_blend     = fx_blend_avx2;
+  sb_mix_shape     = fx_shape_avx2;
+  sb_mix_modulate  = fx_modulate_avx2;
+  sb_mix_gain_add  = fx_gain_add_avx2;
+  mix_isa          = "avx2";
+#endif
+}
+
+const char *
+sb_mix_isa(void)
+{
+  return mix_isa;
+}
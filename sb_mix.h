@@ -0,0 +1,140 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * ソフトウェアー・ミキサーのカーネル。
+ * ボイスを浮動小数点のバッファーに足し込み、最後に8/16bitへ飽和させて書き出す。
+ * SSE2/AVX2版とスカラー版があり、sb_mix_initでCPUを調べて選ぶ。
+ * どの版でも結果は同じになるように、演算の順序をそろえてある。
+ */
+#ifndef SB_MIX_H
+#define SB_MIX_H
+
+#include "sb_os.h"
+
+// 再生位置は32.32の固定小数点（フレーム単位）
+#define SB_MIX_FIX_SHIFT  32
+
+// サンプルの形式
+#define SB_SAMPLE_U8    0   // 8bit符号なし
+#define SB_SAMPLE_S16   1
+#define SB_SAMPLE_S24   2   // 3バイト詰め
+#define SB_SAMPLE_S32   3
+#define SB_SAMPLE_F32   4   // -1.0〜1.0のfloat
+
+#define SB_MIX_MAX_CHANNELS 8
+
+typedef struct SBMixVoice {
+  const BYTE  *data;      // インターリーブされたPCM
+  DWORD        channels;  // 1〜SB_MIX_MAX_CHANNELS
+  DWORD        format;    // SB_SAMPLE_*
+  const float *downmix;   // channelsが3以上のとき、左への係数channels個と右への係数channels個
+  int64_t     pos;        // 先頭フレームの位置
+  int64_t     step;       // 1出力フレームあたりの進み
+  DWORD       limit;      // このフレームの次はwrapを読む
+  DWORD       wrap;
+  float       lgain;
+  float       rgain;
+} SBMIXVOICE;
+typedef const SBMIXVOICE *LPCSBMIXVOICE;
+
+// countフレームぶんaccに足し込む。accはout_ch（1 or 2）チャンネルのインターリーブ
+extern void (*sb_mix_voice)(float *acc, int out_ch, LPCSBMIXVOICE voice, DWORD count);
+// n個のサンプルを飽和させて書き出す
+extern void (*sb_mix_store_s16)(BYTE *out, const float *acc, DWORD n);
+extern void (*sb_mix_store_u8)(BYTE *out, const float *acc, DWORD n);
+
+/*
+ * PCMのフォーマット変換
+ * 入出力はアラインメント不要のバイト列で、nはサンプル数、framesはフレーム数。
+ * 16bitへ丸める関数はditherがNULLでなければ、丸める前に±1LSBのTPDFディザーを加える。
+ */
+typedef struct SBDither {
+  uint32_t state[4];
+} SBDITHER, *LPSBDITHER;
+
+void sb_dither_init(LPSBDITHER dither, uint32_t seed);
+
+extern void (*sb_conv_u8_s16)(BYTE *out, const BYTE *in, DWORD n);
+extern void (*sb_conv_s16_u8)(BYTE *out, const BYTE *in, DWORD n);
+extern void (*sb_conv_s32_s16)(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither);
+extern void (*sb_conv_f32_s16)(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither);
+void        sb_conv_s24_s16(BYTE *out, const BYTE *in, DWORD n, LPSBDITHER dither);
+// bytesはサンプルのバイト数。ステレオからモノラルへは左右の平均
+extern void (*sb_conv_mono_stereo)(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes);
+extern void (*sb_conv_stereo_mono)(BYTE *out, const BYTE *in, DWORD frames, DWORD bytes);
+// チャンネルごとの配列planesとインターリーブされた列の相互変換
+extern void (*sb_conv_interleave)(BYTE *out, const BYTE *const *planes, DWORD channels, DWORD frames, DWORD bytes);
+extern void (*sb_conv_deinterleave)(BYTE *const *planes, const BYTE *in, DWORD channels, DWORD frames, DWORD bytes);
+
+// framesフレームの並びをその場で逆順にする。blockはフレームのバイト数（1〜32）
+extern void (*sb_reverse_frames)(BYTE *data, DWORD frames, DWORD block);
+
+/*
+ * 帯域制限オシレーター
+ * 位相は1周期を1とした0〜1の値で、1フレームごとにincずつ進む。
+ * 矩形波とのこぎり波は段差をPolyBLEPで、三角波は折れ目をPolyBLAMPでならして折り返しを抑える。
+ * 位相はSB_OSC_BLOCKフレームごとにdoubleから取り直すので、長く鳴らしてもずれない。
+ * ノイズは4系統のxorshiftで、i番目のサンプルはi % 4番目の系統を使う（ディザーと同じ）。
+ */
+#define SB_OSC_SINE     0
+#define SB_OSC_SQUARE   1
+#define SB_OSC_SAW      2
+#define SB_OSC_TRIANGLE 3
+#define SB_OSC_NOISE    4
+
+#define SB_OSC_BLOCK    64
+
+typedef struct SBOsc {
+  DWORD    wave;      // SB_OSC_*
+  double   phase;     // 0〜1
+  double   inc;       // 周波数÷サンプリング周波数。0より大きく0.5より小さい
+  uint32_t noise[4];
+} SBOSC, *LPSBOSC;
+
+void sb_osc_init(LPSBOSC osc, DWORD wave, uint32_t seed);
+// countフレームぶんoutに足し込み、位相を進める。i番目のフレームの音量はgain + dgain * i
+extern void (*sb_osc_render)(float *out, LPSBOSC osc, float gain, float dgain, DWORD count);
+
+/*
+ * エフェクトの部品（sb_fx.c）
+ * 前のサンプルによらない段だけをここで行う。nはサンプル数、framesはフレーム数。
+ * bufはchannels（1 or 2）チャンネルのインターリーブ。
+ */
+// out = out * dry + wet * wgain
+extern void (*sb_mix_blend)(float *out, const float *wet, float dry, float wgain, DWORD n);
+// x = buf * driveを-3〜3に収め、x(27 + x^2) / (27 + 9x^2)で丸く飽和させる。±3でちょうど±1になる
+extern void (*sb_mix_shape)(float *buf, float drive, DWORD n);
+// i番目のフレームにgain[i]を掛ける
+extern void (*sb_mix_modulate)(float *buf, int channels, const float *gain, DWORD frames);
+// acc += src * 音量。モノラルはsb_mix_voiceと同じく(x * lgain + x * rgain) * 0.5
+extern void (*sb_mix_gain_add)(float *acc, int out_ch, const float *src, float lgain, float rgain, DWORD frames);
+
+/*
+ * isaがNULLなら環境変数SOUNDBUFFER_SIMD、それも無ければCPUで選ぶ。
+ * "scalar" "sse2" "avx2"。使えない指定は無視される。
+ * フォーマット変換はメモリーの速さで頭打ちになるので、avx2でもSSE2版を使う。
+ */
+void        sb_mix_init(const char *isa);
+const char *sb_mix_isa(void);
+
+#endif /* SB_MIX_H */
@@ -0,0 +1,603 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sb_os.h"
+
+#ifdef _WIN32
+/*
+ * Win32: そのままAPIに渡す
+ */
+SBEVENT
+sb_event_create(BOOL manual_reset)
+{
+  return CreateEvent(NULL, manual_reset, FALSE, NULL);
+}
+
+void
+sb_event_close(SBEVENT ev)
+{
+  CloseHandle(ev);
+}
+
+SBEVENT
+sb_event_retain(SBEVENT ev)
+{
+  HANDLE dup = NULL;
+
+  if (!DuplicateHandle(GetCurrentProcess(), ev, GetCurrentProcess(), &dup, 0, FALSE, DUPLICATE_SAME_ACCESS)) return NULL;
+  return dup;
+}
+
+void
+sb_event_set(SBEVENT ev)
+{
+  SetEvent(ev);
+}
+
+void
+sb_event_reset(SBEVENT ev)
+{
+  ResetEvent(ev);
+}
+
+void
+sb_event_pulse(SBEVENT ev)
+{
+  PulseEvent(ev);
+}
+
+DWORD
+sb_event_wait(DWORD count, const SBEVENT *events, DWORD timeout)
+{
+  return WaitForMultipleObjects(count, events, FALSE, timeout);
+}
+
+void sb_mutex_init(sb_mutex_t *m)    { InitializeCriticalSection(m); }
+void sb_mutex_destroy(sb_mutex_t *m) { DeleteCriticalSection(m); }
+void sb_mutex_lock(sb_mutex_t *m)    { EnterCriticalSection(m); }
+void sb_mutex_unlock(sb_mutex_t *m)  { LeaveCriticalSection(m); }
+
+void sb_cond_init(sb_cond_t *c)      { InitializeConditionVariable(c); }
+void sb_cond_destroy(sb_cond_t *c)   { (void)c; }
+void sb_cond_signal(sb_cond_t *c)    { WakeConditionVariable(c); }
+void sb_cond_broadcast(sb_cond_t *c) { WakeAllConditionVariable(c); }
+
+int
+sb_cond_wait(sb_cond_t *c, sb_mutex_t *m, DWORD timeout)
+{
+  return SleepConditionVariableCS(c, m, timeout) ? 1 : 0;
+}
+
+struct ThreadStart {
+  void *(*func)(void *);
+  void   *arg;
+};
+
+static DWORD WINAPI
+thread_start(LPVOID data)
+{
+  struct ThreadStart ts = *(struct ThreadStart *)data;
+
+  free(data);
+  ts.func(ts.arg);
+  return 0;
+}
+
+int
+sb_thread_create(sb_thread_t *th, void *(*func)(void *), void *arg)
+{
+  struct ThreadStart *ts = malloc(sizeof(struct ThreadStart));
+
+  if (!ts) return -1;
+  ts->func = func;
+  ts->arg  = arg;
+  *th = CreateThread(NULL, 0, thread_start, ts, 0, NULL);
+  if (*th == NULL) {
+    free(ts);
+    return -1;
+  }
+  return 0;
+}
+
+void
+sb_thread_join(sb_thread_t th)
+{
+  WaitForSingleObject(th, INFINITE);
+  CloseHandle(th);
+}
+
+uint64_t
+sb_clock_ns(void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER now;
+
+  if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&now);
+  return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000000ULL
+       + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000000ULL / freq.QuadPart;
+}
+
+int
+sb_map_open(sb_map_t *map, const char *path)
+{
+  LARGE_INTEGER size;
+  WCHAR        *wpath;
+  int           len;
+
+  map->ptr     = NULL;
+  map->size    = 0;
+  map->mapping = NULL;
+  len = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  if (len <= 0) return -1;
+  wpath = malloc(sizeof(WCHAR) * len);
+  if (!wpath) return -1;
+  MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, len);
+  map->file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  free(wpath);
+  if (map->file == INVALID_HANDLE_VALUE) return -1;
+  if (!GetFileSizeEx(map->file, &size) || (uint64_t)size.QuadPart > (size_t)-1) {
+    CloseHandle(map->file);
+    return -1;
+  }
+  map->size = (size_t)size.QuadPart;
+  if (map->size == 0) return 0;
+  map->mapping = CreateFileMappingW(map->file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (map->mapping) map->ptr = MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!map->ptr) {
+    sb_map_close(map);
+    return -1;
+  }
+  return 0;
+}
+
+void
+sb_map_close(sb_map_t *map)
+{
+  if (map->ptr)     UnmapViewOfFile(map->ptr);
+  if (map->mapping) CloseHandle(map->mapping);
+  CloseHandle(map->file);
+  map->ptr  = NULL;
+  map->size = 0;
+}
+
+#else /* !_WIN32 */
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+/*
+ * pthread版のイベント
+ * すべてのイベントで1つのミューテックスと条件変数を共有する。
+ * 待ち合わせの数は少ないので、誰かがSetしたら全員起こして各自で確認させる。
+ * PulseEventは世代番号を進めることで、その時点で待っていた者だけを起こす。
+ * closeは参照を1つ返すだけで、retainした者がみな返したときに解放する。
+ */
+struct sb_event {
+  BOOL          manual_reset;
+  BOOL          signaled;
+  unsigned long pulse;
+  unsigned long refs;
+};
+
+static pthread_mutex_t  event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   event_cond;
+static pthread_once_t   event_once = PTHREAD_ONCE_INIT;
+
+static void
+cond_init_monotonic(pthread_cond_t *c)
+{
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(c, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+static void
+event_init(void)
+{
+  cond_init_monotonic(&event_cond);
+}
+
+static void
+timeout_to_abstime(struct timespec *ts, DWORD timeout)
+{
+  clock_gettime(CLOCK_MONOTONIC, ts);
+  ts->tv_sec  += timeout / 1000;
+  ts->tv_nsec += (long)(timeout % 1000) * 1000000L;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec  += 1;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+SBEVENT
+sb_event_create(BOOL manual_reset)
+{
+  SBEVENT ev;
+
+  pthread_once(&event_once, event_init);
+  ev = malloc(sizeof(struct sb_event));
+  if (!ev) return NULL;
+  ev->manual_reset = manual_reset;
+  ev->signaled     = FALSE;
+  ev->pulse        = 0;
+  ev->refs         = 1;
+  return ev;
+}
+
+void
+sb_event_close(SBEVENT ev)
+{
+  unsigned long refs;
+
+  pthread_mutex_lock(&event_lock);
+  refs = --ev->refs;
+  pthread_mutex_unlock(&event_lock);
+  if (refs == 0) free(ev);
+}
+
+SBEVENT
+sb_event_retain(SBEVENT ev)
+{
+  pthread_mutex_lock(&event_lock);
+  ev->refs++;
+  pthread_mutex_unlock(&event_lock);
+  return ev;
+}
+
+void
+sb_event_set(SBEVENT ev)
+{
+  pthread_mutex_lock(&event_lock);
+  ev->signaled = TRUE;
+  pthread_cond_broadcast(&event_cond);
+  pthread_mutex_unlock(&event_lock);
+}
+
+void
+sb_event_reset(SBEVENT ev)
+{
+  pthread_mutex_lock(&event_lock);
+  ev->signaled = FALSE;
+  pthread_mutex_unlock(&event_lock);
+}
+
+void
+sb_event_pulse(SBEVENT ev)
+{
+  pthread_mutex_lock(&event_lock);
+  ev->pulse++;
+  ev->signaled = FALSE;
+  pthread_cond_broadcast(&event_cond);
+  pthread_mutex_unlock(&event_lock);
+}
+
+DWORD
+sb_event_wait(DWORD count, const SBEVENT *events, DWORD timeout)
+{
+  unsigned long   pulse_buf[64], *pulse;
+  struct timespec abstime;
+  DWORD           i, result = WAIT_TIMEOUT;
+  int             rc = 0;
+
+  if (count == 0) return WAIT_FAILED;
+  pulse = count <= 64 ? pulse_buf : malloc(sizeof(unsigned long) * count);
+  if (!pulse) return WAIT_FAILED;
+  if (timeout != INFINITE) timeout_to_abstime(&abstime, timeout);
+
+  pthread_mutex_lock(&event_lock);
+  for (i = 0; i < count; i++) pulse[i] = events[i]->pulse;
+  while (1) {
+    for (i = 0; i < count; i++) {
+      if (events[i]->signaled) {
+        if (!events[i]->manual_reset) events[i]->signaled = FALSE;
+        break;
+      }
+      if (events[i]->pulse != pulse[i]) break;
+    }
+    if (i < count) {
+      result = WAIT_OBJECT_0 + i;
+      break;
+    }
+    if (timeout == 0 || rc == ETIMEDOUT) break;
+    if (timeout == INFINITE) rc = pthread_cond_wait(&event_cond, &event_lock);
+    else                     rc = pthread_cond_timedwait(&event_cond, &event_lock, &abstime);
+  }
+  pthread_mutex_unlock(&event_lock);
+
+  if (pulse != pulse_buf) free(pulse);
+  return result;
+}
+
+void sb_mutex_init(sb_mutex_t *m)    { pthread_mutex_init(m, NULL); }
+void sb_mutex_destroy(sb_mutex_t *m) { pthread_mutex_destroy(m); }
+void sb_mutex_lock(sb_mutex_t *m)    { pthread_mutex_lock(m); }
+void sb_mutex_unlock(sb_mutex_t *m)  { pthread_mutex_unlock(m); }
+
+void sb_cond_init(sb_cond_t *c)      { cond_init_monotonic(c); }
+void sb_cond_destroy(sb_cond_t *c)   { pthread_cond_destroy(c); }
+void sb_cond_signal(sb_cond_t *c)    { pthread_cond_signal(c); }
+void sb_cond_broadcast(sb_cond_t *c) { pthread_cond_broadcast(c); }
+
+int
+sb_cond_wait(sb_cond_t *c, sb_mutex_t *m, DWORD timeout)
+{
+  struct timespec abstime;
+
+  if (timeout == INFINITE) return pthread_cond_wait(c, m) == 0;
+  timeout_to_abstime(&abstime, timeout);
+  return pthread_cond_timedwait(c, m, &abstime) != ETIMEDOUT;
+}
+
+int
+sb_thread_create(sb_thread_t *th, void *(*func)(void *), void *arg)
+{
+  return pthread_create(th, NULL, func, arg) == 0 ? 0 : -1;
+}
+
+void
+sb_thread_join(sb_thread_t th)
+{
+  pthread_join(th, NULL);
+}
+
+uint64_t
+sb_clock_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int
+sb_map_open(sb_map_t *map, const char *path)
+{
+  struct stat st;
+  void       *ptr;
+  int         fd;
+
+  map->ptr  = NULL;
+  map->size = 0;
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  if (st.st_size > 0) {
+    ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (ptr == MAP_FAILED) {
+      close(fd);
+      return -1;
+    }
+    // 先頭から一度だけ読むので先読みさせる
+    madvise(ptr, (size_t)st.st_size, MADV_SEQUENTIAL);
+    map->ptr  = ptr;
+    map->size = (size_t)st.st_size;
+  }
+  // マッピングはfdを閉じても残る
+  close(fd);
+  return 0;
+}
+
+void
+sb_map_close(sb_map_t *map)
+{
+  if (map->ptr) munmap((void *)map->ptr, map->size);
+  map->ptr  = NULL;
+  map->size = 0;
+}
+
+#endif /* _WIN32 */
+
+/*
+ * sb_event_wait_many
+ * WaitForMultipleObjectsは一度に64個までしか待てないので、それを越えたら
+ * SB_WAIT_GROUP個ずつに分けて待機スレッドに待たせる。待機スレッドは終わってもプールに残して使い回す。
+ * pthread版のsb_event_waitには上限がないので、SB_WAIT_GROUPを定義しなければそのまま待つ。
+ */
+#if !defined(SB_WAIT_GROUP) && defined(_WIN32)
+#define SB_WAIT_GROUP   (MAXIMUM_WAIT_OBJECTS - 1)  // 1つは中止用のイベントに使う
+#endif
+
+#ifdef SB_WAIT_GROUP
+struct sb_wait_call {
+  sb_mutex_t  lock;
+  sb_cond_t   cond;
+  SBEVENT     cancel;
+  DWORD       pending;
+  DWORD       nfired;
+  LPDWORD     fired;
+};
+
+struct sb_waiter {
+  struct sb_waiter    *next;
+  SBEVENT              start;
+  struct sb_wait_call *call;
+  const SBEVENT       *events;
+  DWORD                count;
+  DWORD                base;
+  SBEVENT              handles[SB_WAIT_GROUP + 1];
+};
+
+static sb_mutex_t         waiter_lock;
+static struct sb_waiter  *waiter_free;
+
+static void
+waiter_init(void)
+{
+  sb_mutex_init(&waiter_lock);
+}
+
+#ifdef _WIN32
+static INIT_ONCE waiter_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK
+waiter_init_once(PINIT_ONCE once, PVOID param, PVOID *context)
+{
+  waiter_init();
+  return TRUE;
+}
+#define WAITER_ONCE() InitOnceExecuteOnce(&waiter_once, waiter_init_once, NULL, NULL)
+#else
+static pthread_once_t waiter_once = PTHREAD_ONCE_INIT;
+#define WAITER_ONCE() pthread_once(&waiter_once, waiter_init)
+#endif
+
+static void *
+waiter_thread(void *arg)
+{
+  struct sb_waiter    *w = arg;
+  struct sb_wait_call *call;
+  DWORD                r;
+
+  while (1) {
+    sb_event_wait(1, &w->start, INFINITE);
+    call = w->call;
+    memcpy(w->handles, w->events, sizeof(SBEVENT) * w->count);
+    w->handles[w->count] = call->cancel;
+    r = sb_event_wait(w->count + 1, w->handles, INFINITE);
+    // callは呼び出し側のスタックにある。pendingを減らしたあとは触らない
+    sb_mutex_lock(&call->lock);
+    if (r < w->count) call->fired[call->nfired++] = w->base + r;
+    call->pending--;
+    sb_cond_broadcast(&call->cond);
+    sb_mutex_unlock(&call->lock);
+
+    sb_mutex_lock(&waiter_lock);
+    w->next     = waiter_free;
+    waiter_free = w;
+    sb_mutex_unlock(&waiter_lock);
+  }
+  return NULL;
+}
+
+static struct sb_waiter *
+waiter_get(void)
+{
+  struct sb_waiter *w;
+  sb_thread_t       th;
+
+  WAITER_ONCE();
+  sb_mutex_lock(&waiter_lock);
+  w = waiter_free;
+  if (w) waiter_free = w->next;
+  sb_mutex_unlock(&waiter_lock);
+  if (w) return w;
+
+  w = malloc(sizeof(struct sb_waiter));
+  if (!w) return NULL;
+  w->start = sb_event_create(FALSE);
+  if (!w->start || sb_thread_create(&th, waiter_thread, w) != 0) {
+    if (w->start) sb_event_close(w->start);
+    free(w);
+    return NULL;
+  }
+#ifdef _WIN32
+  CloseHandle(th);  // 終了を待つことはない
+#else
+  pthread_detach(th);
+#endif
+  return w;
+}
+
+DWORD
+sb_event_wait_many(DWORD count, const SBEVENT *events, DWORD timeout, LPDWORD fired)
+{
+  struct sb_wait_call call;
+  struct sb_waiter   *w;
+  uint64_t            deadline = 0, now;
+  DWORD               base, result;
+
+  if (count <= SB_WAIT_GROUP + 1) {
+    result = sb_event_wait(count, events, timeout);
+    if (result == WAIT_FAILED)  return WAIT_FAILED;
+    if (result == WAIT_TIMEOUT) return 0;
+    fired[0] = result - WAIT_OBJECT_0;
+    return 1;
+  }
+  call.cancel = sb_event_create(TRUE);
+  if (!call.cancel) return WAIT_FAILED;
+  sb_mutex_init(&call.lock);
+  sb_cond_init(&call.cond);
+  call.pending = 0;
+  call.nfired  = 0;
+  call.fired   = fired;
+  result       = 0;
+  for (base = 0; base < count; base += SB_WAIT_GROUP) {
+    w = waiter_get();
+    if (!w) {
+      result = WAIT_FAILED;
+      break;
+    }
+    w->call   = &call;
+    w->events = events + base;
+    w->count  = count - base < SB_WAIT_GROUP ? count - base : SB_WAIT_GROUP;
+    w->base   = base;
+    sb_mutex_lock(&call.lock);
+    call.pending++;
+    sb_mutex_unlock(&call.lock);
+    sb_event_set(w->start);
+  }
+  if (timeout != INFINITE) deadline = sb_clock_ns() + (uint64_t)timeout * 1000000ULL;
+
+  sb_mutex_lock(&call.lock);
+  while (result != WAIT_FAILED && call.nfired == 0) {
+    if (timeout == INFINITE) {
+      sb_cond_wait(&call.cond, &call.lock, INFINITE);
+      continue;
+    }
+    now = sb_clock_ns();
+    if (now >= deadline) break;
+    sb_cond_wait(&call.cond, &call.lock, (DWORD)((deadline - now + 999999ULL) / 1000000ULL));
+  }
+  // 残りの待機スレッドを止めて、全員がcallから手を離すまで待つ
+  sb_event_set(call.cancel);
+  while (call.pending > 0) sb_cond_wait(&call.cond, &call.lock, INFINITE);
+  if (result != WAIT_FAILED) result = call.nfired;
+  sb_mutex_unlock(&call.lock);
+
+  sb_cond_destroy(&call.cond);
+  sb_mutex_destroy(&call.lock);
+  sb_event_close(call.cancel);
+  return result;
+}
+#else
+DWORD
+sb_event_wait_many(DWORD count, const SBEVENT *events, DWORD timeout, LPDWORD fired)
+{
+  DWORD result = sb_event_wait(count, events, timeout);
+
+  if (result == WAIT_FAILED)  return WAIT_FAILED;
+  if (result == WAIT_TIMEOUT) return 0;
+  fired[0] = result - WAIT_OBJECT_0;
+  return 1;
+}
+#endif /* SB_WAIT_GROUP */
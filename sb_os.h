@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * OS依存部分（イベント、スレッド、ミューテックス、時計）の薄いラッパー。
+ * Windowsでは Win32 API をそのまま使い、それ以外では pthread で同じ意味論を実装する。
+ * Windows以外では、コードが使用する最小限の Win32 型もここで定義する。
+ */
+#ifndef SB_OS_H
+#define SB_OS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE              SBEVENT;
+typedef CRITICAL_SECTION    sb_mutex_t;
+typedef CONDITION_VARIABLE  sb_cond_t;
+typedef HANDLE              sb_thread_t;
+
+#else /* !_WIN32 */
+#include <pthread.h>
+
+typedef uint8_t             BYTE;
+typedef uint16_t            WORD;
+typedef uint32_t            DWORD;
+typedef int32_t             LONG;
+typedef uint32_t            ULONG;
+typedef int32_t             HRESULT;
+typedef int                 BOOL;
+typedef float               FLOAT;
+typedef void               *LPVOID;
+typedef const void         *LPCVOID;
+typedef BYTE               *LPBYTE;
+typedef WORD               *LPWORD;
+typedef DWORD              *LPDWORD;
+typedef LONG               *LPLONG;
+
+#ifndef TRUE
+#define TRUE                1
+#endif
+#ifndef FALSE
+#define FALSE               0
+#endif
+
+#define MAKE_HRESULT(sev, fac, code) \
+  ((HRESULT)(((uint32_t)(sev) << 31) | ((uint32_t)(fac) << 16) | ((uint32_t)(code))))
+#define SUCCEEDED(hr)       ((HRESULT)(hr) >= 0)
+#define FAILED(hr)          ((HRESULT)(hr) <  0)
+
+#define S_OK                  ((HRESULT)0x00000000L)
+#define E_NOTIMPL             ((HRESULT)0x80004001L)
+#define E_NOINTERFACE         ((HRESULT)0x80004002L)
+#define E_FAIL                ((HRESULT)0x80004005L)
+#define E_ACCESSDENIED        ((HRESULT)0x80070005L)
+#define E_OUTOFMEMORY         ((HRESULT)0x8007000EL)
+#define E_INVALIDARG          ((HRESULT)0x80070057L)
+#define CLASS_E_NOAGGREGATION ((HRESULT)0x80040110L)
+#define CO_E_NOTINITIALIZED   ((HRESULT)0x800401F0L)
+
+#define INFINITE            0xFFFFFFFF
+#define WAIT_OBJECT_0       0x00000000
+#define WAIT_TIMEOUT        0x00000102
+#define WAIT_FAILED         0xFFFFFFFF
+
+typedef struct sb_event    *SBEVENT;
+typedef pthread_mutex_t     sb_mutex_t;
+typedef pthread_cond_t      sb_cond_t;
+typedef pthread_t           sb_thread_t;
+
+#endif /* _WIN32 */
+
+// イベント（Win32のCreateEvent相当）
+SBEVENT   sb_event_create(BOOL manual_reset);
+void      sb_event_close(SBEVENT);
+void      sb_event_set(SBEVENT);
+void      sb_event_reset(SBEVENT);
+void      sb_event_pulse(SBEVENT);
+// 参照を増やしたイベントを返す（Win32ではDuplicateHandle）。使い終わったらsb_event_closeする。
+// 待っている間にほかのスレッドが元のイベントを閉じても、参照が残っていれば消えない
+SBEVENT   sb_event_retain(SBEVENT);
+// WaitForMultipleObjects(count, events, FALSE, timeout)相当
+DWORD     sb_event_wait(DWORD count, const SBEVENT *events, DWORD timeout);
+// 数の制限なしで待つ。firedにシグナルになったイベントの番号を入れて、その数を返す（タイムアウトなら0）。
+// 64個を越えると複数がいっぺんに返ることがあるので、firedはcount個ぶん用意する。
+DWORD     sb_event_wait_many(DWORD count, const SBEVENT *events, DWORD timeout, LPDWORD fired);
+
+void      sb_mutex_init(sb_mutex_t *);
+void      sb_mutex_destroy(sb_mutex_t *);
+void      sb_mutex_lock(sb_mutex_t *);
+void      sb_mutex_unlock(sb_mutex_t *);
+
+void      sb_cond_init(sb_cond_t *);
+void      sb_cond_destroy(sb_cond_t *);
+void      sb_cond_signal(sb_cond_t *);
+void      sb_cond_broadcast(sb_cond_t *);
+// 戻り値はタイムアウトしたら0、起こされたら1
+int       sb_cond_wait(sb_cond_t *, sb_mutex_t *, DWORD timeout);
+
+int       sb_thread_create(sb_thread_t *, void *(*func)(void *), void *arg);
+void      sb_thread_join(sb_thread_t);
+
+// 単調増加する時計（ナノ秒）
+uint64_t  sb_clock_ns(void);
+
+// 読み取り専用のファイル・マッピング
+typedef struct sb_map {
+  const void *ptr;
+  size_t      size;
+#ifdef _WIN32
+  HANDLE      file;
+  HANDLE      mapping;
+#endif
+} sb_map_t;
+
+// pathはUTF-8。成功したら0、失敗したら-1。空のファイルはptrがNULLでsizeが0
+int       sb_map_open(sb_map_t *, const char *path);
+void      sb_map_close(sb_map_t *);
+
+#endif /* SB_OS_H */
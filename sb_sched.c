@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sb_backend.h"
+
+struct SBScheduleItem {
+  SBSCHEDULE  ev;
+  uint64_t    seq;
+};
+
+static int
+sched_before(const struct SBScheduleItem *a, const struct SBScheduleItem *b)
+{
+  return a->ev.qwFrame < b->ev.qwFrame || (a->ev.qwFrame == b->ev.qwFrame && a->seq < b->seq);
+}
+
+static void
+sched_up(SBSCHEDQUEUE *q, DWORD i)
+{
+  struct SBScheduleItem item = q->items[i];
+  DWORD parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (!sched_before(&item, &q->items[parent])) break;
+    q->items[i] = q->items[parent];
+    i = parent;
+  }
+  q->items[i] = item;
+}
+
+static void
+sched_down(SBSCHEDQUEUE *q, DWORD i)
+{
+  struct SBScheduleItem item = q->items[i];
+  DWORD child;
+
+  while ((child = i * 2 + 1) < q->count) {
+    if (child + 1 < q->count && sched_before(&q->items[child + 1], &q->items[child])) child++;
+    if (!sched_before(&q->items[child], &item)) break;
+    q->items[i] = q->items[child];
+    i = child;
+  }
+  q->items[i] = item;
+}
+
+BOOL
+sb_sched_push(SBSCHEDQUEUE *q, LPCSBSCHEDULE ev)
+{
+  struct SBScheduleItem *items;
+  DWORD capacity;
+
+  if (q->count == q->capacity) {
+    capacity = q->capacity ? q->capacity * 2 : 16;
+    items    = realloc(q->items, sizeof(struct SBScheduleItem) * capacity);
+    if (!items) return FALSE;
+    q->items    = items;
+    q->capacity = capacity;
+  }
+  q->items[q->count].ev  = *ev;
+  q->items[q->count].seq = q->seq++;
+  sched_up(q, q->count++);
+  return TRUE;
+}
+
+LPCSBSCHEDULE
+sb_sched_peek(const SBSCHEDQUEUE *q)
+{
+  return q->count ? &q->items[0].ev : NULL;
+}
+
+void
+sb_sched_pop(SBSCHEDQUEUE *q, LPSBSCHEDULE ev)
+{
+  *ev = q->items[0].ev;
+  q->items[0] = q->items[--q->count];
+  if (q->count) sched_down(q, 0);
+}
+
+DWORD
+sb_sched_count(const SBSCHEDQUEUE *q, const struct SBBuffer *buf)
+{
+  DWORD i, n = 0;
+
+  if (!buf) return q->count;
+  for (i = 0; i < q->count; i++) {
+    if (q->items[i].ev.lpBuffer == buf) n++;
+  }
+  return n;
+}
+
+DWORD
+sb_sched_remove(SBSCHEDQUEUE *q, const struct SBBuffer *buf)
+{
+  DWORD i, j, n = q->count;
+
+  // 残すものを詰めてからヒープを組み直す
+  for (i = j = 0; i < q->count; i++) {
+    if (buf && q->items[i].ev.lpBuffer != buf) q->items[j++] = q->items[i];
+  }
+  q->count = j;
+  for (i = j / 2; i-- > 0;) sched_down(q, i);
+  return n - j;
+}
+
+void
+sb_sched_clear(SBSCHEDQUEUE *q)
+{
+  free(q->items);
+  q->items    = NULL;
+  q->count    = q->capacity = 0;
+}
+
+HRESULT
+sb_sched_apply(LPCSBSCHEDULE ev)
+{
+  LPSBBUFFER buf = ev->lpBuffer;
+  SBLOOP     loop;
+  HRESULT    hr;
+
+  switch (ev->dwAction) {
+  case SBSCHED_PLAY:      return buf->lpVtbl->Play(buf, (DWORD)ev->lValue);
+  case SBSCHED_PAUSE:     return buf->lpVtbl->Stop(buf);
+  case SBSCHED_VOLUME:    return buf->lpVtbl->SetVolume(buf, ev->lValue);
+  case SBSCHED_PAN:       return buf->lpVtbl->SetPan(buf, ev->lValue);
+  case SBSCHED_FREQUENCY: return buf->lpVtbl->SetFrequency(buf, (DWORD)ev->lValue);
+  case SBSCHED_POSITION:  return buf->lpVtbl->SetCurrentPosition(buf, (DWORD)ev->lValue);
+  case SBSCHED_STOP:
+    hr = buf->lpVtbl->Stop(buf);
+    if (SUCCEEDED(hr)) hr = buf->lpVtbl->SetCurrentPosition(buf, 0);
+    if (SUCCEEDED(hr)) hr = buf->lpVtbl->GetLoop(buf, &loop);
+    if (SUCCEEDED(hr)) {
+      loop.dwCounter = 0;
+      hr = buf->lpVtbl->SetLoop(buf, &loop);
+    }
+    return hr;
+  }
+  return DSERR_INVALIDPARAM;
+}
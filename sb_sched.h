@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * サンプル・クロックの予定表。
+ * 再生・停止・パラメーターの変更を、デバイスのサンプル・クロック（出力のフレーム数）で
+ * 時刻を決めて積んでおき、バックエンドがその時刻になったら済ませる。
+ * 時刻の早い順に取り出す二分ヒープで、同じ時刻のものは積んだ順に出す。
+ * 排他は呼び出し側で行う。
+ */
+#ifndef SB_SCHED_H
+#define SB_SCHED_H
+
+#include "sb_os.h"
+
+struct SBBuffer;
+
+// 予定の種類
+#define SBSCHED_PLAY        0   // lValueはPlayのフラグ（DSBPLAY_LOOPING）
+#define SBSCHED_STOP        1   // 止めて先頭に戻し、ループ回数を0にする
+#define SBSCHED_PAUSE       2   // 止めるだけ
+#define SBSCHED_VOLUME      3
+#define SBSCHED_PAN         4
+#define SBSCHED_FREQUENCY   5
+#define SBSCHED_POSITION    6   // lValueは再生位置（バイト）
+#define SBSCHED_COUNT       7
+
+typedef struct SBSchedule {
+  uint64_t          qwFrame;    // この時刻のフレームを出す前に済ませる
+  struct SBBuffer  *lpBuffer;
+  DWORD             dwAction;
+  LONG              lValue;
+} SBSCHEDULE, *LPSBSCHEDULE;
+typedef const SBSCHEDULE *LPCSBSCHEDULE;
+
+typedef struct SBScheduleQueue {
+  struct SBScheduleItem *items;
+  DWORD                  count;
+  DWORD                  capacity;
+  uint64_t               seq;       // 同じ時刻のものを積んだ順に並べる
+} SBSCHEDQUEUE;
+
+// メモリーが足りなければFALSE
+BOOL    sb_sched_push(SBSCHEDQUEUE *, LPCSBSCHEDULE);
+// 一番早い予定。空ならNULL
+LPCSBSCHEDULE sb_sched_peek(const SBSCHEDQUEUE *);
+void    sb_sched_pop(SBSCHEDQUEUE *, LPSBSCHEDULE);
+// bufの予定を数える・取り消す。bufがNULLならすべて
+DWORD   sb_sched_count(const SBSCHEDQUEUE *, const struct SBBuffer *buf);
+DWORD   sb_sched_remove(SBSCHEDQUEUE *, const struct SBBuffer *buf);
+void    sb_sched_clear(SBSCHEDQUEUE *);
+// バッファーの仮想関数で済ませる。バッファーが自分で排他をとるバックエンド用
+HRESULT sb_sched_apply(LPCSBSCHEDULE);
+
+#endif /* SB_SCHED_H */
@@ -0,0 +1,1373 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * ソフトウェアー・バックエンド
+ * サウンドカードを使わずにDirectSoundのセカンダリーバッファーの振る舞いを再現する。
+ * 出力はヌル・シンク（捨てる）で、デバイス・スレッドが実時間でカーソルを進め、
+ * 通知位置・OFFSETSTOP・ループ再生をDirectSoundと同じようにイベントで知らせる。
+ * ループ区間（loop_start〜loop_end）もここで処理する。
+ *
+ * offlineデバイスはスレッドを持たず、Renderで要求されたフレーム数だけ進めて
+ * ミックス結果をプライマリーバッファーの形式で返す。
+ * シンクを与えたデバイス（mix）は、全バッファーをミックスしてシンクに書き出す。
+ * 足し込みと書き出しはsb_mix.cのカーネルで行う。
+ *
+ * 予定表（Schedule）の予定は、ミックスをその時刻のフレームで区切って済ませるので、
+ * どのデバイスでもサンプル単位で合う。
+ *
+ * エフェクト（sb_fx.c）は、DirectSoundと同じく音量・パンを掛ける前にバッファーごとにかける。
+ * 周波数変換した後のデバイスの形式で処理する。
+ * DirectSoundと違って再生中でもSetFXでき、前の並びからSB_FX_FADE_MSかけて移る。
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "sb_backend.h"
+#include "sb_mix.h"
+#include "sb_fx.h"
+
+// デバイス・スレッドの周期
+#define SOFT_PERIOD_MS  10
+
+// Renderで一度にミックスするフレーム数
+#define SOFT_RENDER_FRAMES 1024
+
+// 自動変化中のパラメーターを更新する間隔（フレーム）。折れ点ではこれより短く区切る
+#define SOFT_AUTO_FRAMES   16
+
+// 再生位置は32.32の固定小数点（フレーム単位）で持つ
+#define FIX_SHIFT       SB_MIX_FIX_SHIFT
+#define FIX_ONE         ((int64_t)1 << FIX_SHIFT)
+
+// PCMデータ本体。DuplicateBufferしたバッファー同士で共有する
+struct SoftData {
+  LONG    refcount;
+  DWORD   bytes;
+  LPBYTE  ptr;
+};
+
+struct SoftBuffer {
+  SBBuffer            base;
+  struct SoftDevice  *dev;
+  struct SoftData    *data;
+  WAVEFORMATEX        wfx;
+  DWORD               flags;
+  DWORD               sample;     // SB_SAMPLE_*
+  float               downmix[SB_MIX_MAX_CHANNELS * 2];
+  // ここから下はdev->lockで保護する
+  DWORD               status;
+  int64_t             pos;
+  LONG                volume;
+  LONG                pan;
+  DWORD               frequency;
+  int                 reverse;    // 逆再生
+  SBLOOP              loop;
+  SBAUTOMATION        autos[SBPARAM_COUNT];
+  DWORD               fx_count;
+  LPSBFX             *fx;
+  DWORD               fx_old_count;  // 再生中のSetFXで外した並び。次のSetFXかReleaseで解放する
+  LPSBFX             *fx_old;
+  float               fx_fade;       // 新しい並びの割合。1未満なら前の並びから移っている途中
+  DWORD               notify_count;
+  LPSBPOSITIONNOTIFY  notify;
+  struct SoftBuffer  *prev;
+  struct SoftBuffer  *next;
+};
+
+struct SoftDevice {
+  SBDevice            base;
+  sb_mutex_t          lock;
+  sb_cond_t           cond;
+  sb_thread_t         thread;
+  int                 realtime;
+  int                 running;
+  WAVEFORMATEX        wfx;
+  LONG                volume;
+  LPSBSINK            sink;
+  struct SoftBuffer  *head;
+  uint64_t            origin_ns;
+  uint64_t            frames;
+  uint64_t            clock;      // サンプル・クロック。soft_reset_clockでは戻さない
+  SBSCHEDQUEUE        sched;
+};
+
+static const struct SBBufferVtbl SoftBuffer_vtbl;
+
+#define SOFTDEV(dev) ((struct SoftDevice *)(dev))
+#define SOFTBUF(buf) ((struct SoftBuffer *)(buf))
+
+/*
+ * 通知とカーソル
+ */
+static int64_t
+soft_total(struct SoftBuffer *b)
+{
+  return (int64_t)(b->data->bytes / b->wfx.nBlockAlign) << FIX_SHIFT;
+}
+
+static int64_t
+soft_step(struct SoftBuffer *b)
+{
+  DWORD rate = b->frequency ? b->frequency : b->wfx.nSamplesPerSec;
+
+  return ((int64_t)rate << FIX_SHIFT) / b->dev->wfx.nSamplesPerSec;
+}
+
+// [from, to)を通過した通知位置のイベントをセットする
+static void
+soft_notify_range(struct SoftBuffer *b, int64_t from, int64_t to)
+{
+  DWORD   i;
+  int64_t pos;
+
+  for (i = 0; i < b->notify_count; i++) {
+    if (b->notify[i].dwOffset == DSBPN_OFFSETSTOP) continue;
+    pos = (int64_t)(b->notify[i].dwOffset / b->wfx.nBlockAlign) << FIX_SHIFT;
+    if (from <= pos && pos < to) sb_event_set(b->notify[i].hEventNotify);
+  }
+}
+
+static void
+soft_notify_stop(struct SoftBuffer *b)
+{
+  DWORD i;
+
+  for (i = 0; i < b->notify_count; i++) {
+    if (b->notify[i].dwOffset == DSBPN_OFFSETSTOP) sb_event_set(b->notify[i].hEventNotify);
+  }
+}
+
+// ループ区間で折り返すか。dev->lockを取ってから呼ぶ
+static int
+soft_loop_active(struct SoftBuffer *b)
+{
+  return (b->loop.dwFlags & SBLOOP_ENABLE) && b->loop.dwEnd > b->loop.dwStart
+      && (!b->loop.dwCount || b->loop.dwCount > b->loop.dwCounter);
+}
+
+static int64_t
+soft_offset(struct SoftBuffer *b, DWORD offset)
+{
+  return (int64_t)(offset / b->wfx.nBlockAlign) << FIX_SHIFT;
+}
+
+/*
+ * ミキサー
+ * DirectSoundと同じく音量は1/100dB、パンは反対側だけを減衰させる。
+ */
+static void
+soft_gain(struct SoftBuffer *b, float *left, float *right)
+{
+  LONG   volume = b->volume + b->dev->volume;
+  double gain;
+
+  if (volume <= DSBVOLUME_MIN) {
+    *left = *right = 0.0f;
+    return;
+  }
+  gain   = pow(10.0, volume / 2000.0);
+  *left  = (float)(b->pan > 0 ? gain * pow(10.0, -b->pan / 2000.0) : gain);
+  *right = (float)(b->pan < 0 ? gain * pow(10.0,  b->pan / 2000.0) : gain);
+}
+
+// limitを越えた端数を持ち越してstartへ折り返す
+static void
+soft_wrap(struct SoftBuffer *b, int64_t start, int64_t limit)
+{
+  b->pos = start + (b->pos - limit) % (limit - start);
+  soft_notify_range(b, start, b->pos);
+}
+
+// startより前に出た端数を持ち越してendの手前へ折り返す（逆再生）
+static void
+soft_wrap_reverse(struct SoftBuffer *b, int64_t start, int64_t end)
+{
+  int64_t over = (start - b->pos) % (end - start);
+
+  b->pos = over ? end - over : start;
+  soft_notify_range(b, b->pos + 1, end);
+}
+
+/*
+ * 逆再生。soft_processを裏返したもので、ループ区間の始まり・バッファーの先頭で区切る。
+ * ループは再生位置が区間の始まりより後ろにあれば有効で、始まりを過ぎると終わりの手前へ戻る。
+ * 通知は再生したフレーム(新しい位置, 古い位置]に対して行う。
+ */
+static void
+soft_process_reverse(struct SoftBuffer *b, float *acc, int out_ch, DWORD frames, float lgain, float rgain)
+{
+  int64_t     total, step, floor, end, from, k;
+  DWORD       n;
+  int         loop;
+  SBMIXVOICE  voice;
+
+  total = soft_total(b);
+  step  = soft_step(b);
+  if (acc) {
+    voice.data     = b->data->ptr;
+    voice.channels = b->wfx.nChannels;
+    voice.format   = b->sample;
+    voice.downmix  = b->downmix;
+    voice.step     = -step;
+    voice.lgain    = lgain;
+    voice.rgain    = rgain;
+  }
+  for (n = 0; n < frames && (b->status & DSBSTATUS_PLAYING); n += (DWORD)k) {
+    loop  = soft_loop_active(b) && b->pos >= soft_offset(b, b->loop.dwStart);
+    floor = loop ? soft_offset(b, b->loop.dwStart) : 0;
+    end   = loop ? soft_offset(b, b->loop.dwEnd)   : total;
+    k     = (b->pos - floor) / step + 1;
+    if (k > frames - n) k = frames - n;
+    if (acc) {
+      // 最後のフレームの次は、同じフレームを読む
+      voice.pos   = b->pos;
+      voice.limit = (DWORD)(total >> FIX_SHIFT);
+      voice.wrap  = voice.limit - 1;
+      sb_mix_voice(acc + n * out_ch, out_ch, &voice, (DWORD)k);
+    }
+    from    = b->pos;
+    b->pos -= step * k;
+    soft_notify_range(b, b->pos + 1, from + 1);
+    if (b->pos >= floor) continue;
+    if (loop) {
+      if (b->loop.dwCount) b->loop.dwCounter++;
+      if (!b->loop.dwCount || b->loop.dwCount > b->loop.dwCounter) {
+        soft_wrap_reverse(b, floor, end);
+        // 区間の中で折り返すので行き過ぎは無い
+        if (SB_STATS_ON) sb_stats_seam(b->base.lpStats, 0);
+        continue;
+      }
+      // 最後の周回はそのまま区間を抜ける
+      if (b->pos >= 0) continue;
+    }
+    if (!(b->status & DSBSTATUS_LOOPING)) {
+      // 先頭まで再生したら停止する。カーソルは先頭のまま
+      b->status = 0;
+      b->pos    = 0;
+      soft_notify_stop(b);
+      break;
+    }
+    soft_wrap_reverse(b, 0, total);
+  }
+}
+
+/*
+ * デバイスのフレーム数だけ再生位置を進める。accを与えるとlgain・rgainの音量でミックスもする。
+ * 区間の終わり・バッファーの終わりで区切り、その間は同じ歩幅で進める。
+ * dev->lockを取ってから呼ぶ
+ */
+static void
+soft_process_voice(struct SoftBuffer *b, float *acc, int out_ch, DWORD frames, float lgain, float rgain)
+{
+  int64_t     total, step, limit, start, from, k;
+  DWORD       n;
+  int         loop;
+  SBMIXVOICE  voice;
+
+  if (b->reverse) {
+    soft_process_reverse(b, acc, out_ch, frames, lgain, rgain);
+    return;
+  }
+  total = soft_total(b);
+  step  = soft_step(b);
+  if (acc) {
+    voice.data     = b->data->ptr;
+    voice.channels = b->wfx.nChannels;
+    voice.format   = b->sample;
+    voice.downmix  = b->downmix;
+    voice.step     = step;
+    voice.lgain    = lgain;
+    voice.rgain    = rgain;
+  }
+  for (n = 0; n < frames && (b->status & DSBSTATUS_PLAYING); n += (DWORD)k) {
+    loop  = soft_loop_active(b) && b->pos < soft_offset(b, b->loop.dwEnd);
+    limit = loop ? soft_offset(b, b->loop.dwEnd) : total;
+    start = loop ? soft_offset(b, b->loop.dwStart) : 0;
+    k     = (limit - b->pos + step - 1) / step;
+    if (k > frames - n) k = frames - n;
+    if (acc) {
+      voice.pos   = b->pos;
+      voice.limit = (DWORD)(limit >> FIX_SHIFT);
+      if      (loop)                            voice.wrap = (DWORD)(start >> FIX_SHIFT);
+      else if (b->status & DSBSTATUS_LOOPING)   voice.wrap = 0;
+      else                                      voice.wrap = voice.limit - 1;
+      sb_mix_voice(acc + n * out_ch, out_ch, &voice, (DWORD)k);
+    }
+    from    = b->pos;
+    b->pos += step * k;
+    soft_notify_range(b, from, b->pos);
+    if (b->pos < limit) continue;
+    if (loop) {
+      // 回数の数え方はSoundBuffer.cのnotify_set_loopと同じ
+      if (b->loop.dwCount) b->loop.dwCounter++;
+      if (!b->loop.dwCount || b->loop.dwCount > b->loop.dwCounter) {
+        soft_wrap(b, start, limit);
+        // 区間の中で折り返すので行き過ぎは無い
+        if (SB_STATS_ON) sb_stats_seam(b->base.lpStats, 0);
+        continue;
+      }
+      // 最後の周回はそのまま区間を抜ける
+      if (b->pos < total) continue;
+      limit = total;
+    }
+    if (!(b->status & DSBSTATUS_LOOPING)) {
+      // 末尾まで再生したら停止してカーソルを先頭に戻す
+      b->status = 0;
+      b->pos    = 0;
+      soft_notify_stop(b);
+      break;
+    }
+    soft_wrap(b, 0, limit);
+  }
+}
+
+/*
+ * エフェクトがあれば、音量1で作業用の配列にミックスしてエフェクトをかけ、
+ * それから音量・パンを掛けてaccに足す。
+ * 並びを移っている途中なら、前の並びにも同じ音を通して混ぜる。dev->lockを取ってから呼ぶ
+ */
+static void
+soft_process_span(struct SoftBuffer *b, float *acc, int out_ch, DWORD frames)
+{
+  float dry[SOFT_RENDER_FRAMES * 2], old[SOFT_RENDER_FRAMES * 2], lgain = 0.0f, rgain = 0.0f;
+  DWORD i, n, k;
+
+  if (!(b->status & DSBSTATUS_PLAYING)) return;
+  if (acc) soft_gain(b, &lgain, &rgain);
+  if (!acc || (!b->fx_count && b->fx_fade >= 1.0f)) {
+    soft_process_voice(b, acc, out_ch, frames, lgain, rgain);
+    return;
+  }
+  for (n = 0; n < frames; n += k) {
+    k = frames - n < SOFT_RENDER_FRAMES ? frames - n : SOFT_RENDER_FRAMES;
+    memset(dry, 0, sizeof(float) * k * out_ch);
+    // 途中で止まっても、この区切りの残りはエフェクトの余韻を出す
+    if (b->status & DSBSTATUS_PLAYING) soft_process_voice(b, dry, out_ch, k, 1.0f, 1.0f);
+    if (b->fx_fade < 1.0f) {
+      memcpy(old, dry, sizeof(float) * k * out_ch);
+      for (i = 0; i < b->fx_old_count; i++) sb_fx_process(b->fx_old[i], old, k);
+    }
+    for (i = 0; i < b->fx_count; i++) sb_fx_process(b->fx[i], dry, k);
+    if (b->fx_fade < 1.0f) {
+      b->fx_fade = sb_fx_fade(dry, old, out_ch, b->fx_fade, 1.0f, 1000.0f / (SB_FX_FADE_MS * b->dev->wfx.nSamplesPerSec), k);
+    }
+    sb_mix_gain_add(acc + n * out_ch, out_ch, dry, lgain, rgain, k);
+  }
+}
+
+/*
+ * 自動変化
+ */
+// 自動変化の値をパラメーターに入れる。dev->lockを取ってから呼ぶ
+static void
+soft_auto_store(struct SoftBuffer *b, DWORD param, double value)
+{
+  LONG v = (LONG)floor(value + 0.5);
+
+  switch (param) {
+  case SBPARAM_VOLUME:    b->volume    = v;        break;
+  case SBPARAM_PAN:       b->pan       = v;        break;
+  case SBPARAM_FREQUENCY: b->frequency = (DWORD)v; break;
+  }
+}
+
+/*
+ * 自動変化中のパラメーターがあれば、SOFT_AUTO_FRAMESごとと折れ点で区切って進め、
+ * 区切りごとに値を更新する。折れ点はフレーム単位で合う。dev->lockを取ってから呼ぶ
+ */
+static void
+soft_process(struct SoftBuffer *b, float *acc, int out_ch, DWORD frames)
+{
+  DWORD n, k, i, span;
+  int   active = 0;
+
+  if (!(b->status & DSBSTATUS_PLAYING)) return;
+  for (i = 0; i < SBPARAM_COUNT; i++) active |= sb_auto_active(&b->autos[i]);
+  if (!active) {
+    soft_process_span(b, acc, out_ch, frames);
+    return;
+  }
+  for (n = 0; n < frames && (b->status & DSBSTATUS_PLAYING); n += k) {
+    k = frames - n < SOFT_AUTO_FRAMES ? frames - n : SOFT_AUTO_FRAMES;
+    for (i = 0; i < SBPARAM_COUNT; i++) {
+      span = sb_auto_span(&b->autos[i]);
+      if (span && span < k) k = span;
+    }
+    soft_process_span(b, acc ? acc + n * out_ch : NULL, out_ch, k);
+    for (i = 0; i < SBPARAM_COUNT; i++) {
+      if (sb_auto_active(&b->autos[i])) soft_auto_store(b, i, sb_auto_advance(&b->autos[i], k));
+    }
+  }
+}
+
+/*
+ * 予定をバッファーに入れる。Set*・Play・Stopと同じことをする。dev->lockを取ってから呼ぶ
+ */
+static void
+soft_sched_apply(LPCSBSCHEDULE ev)
+{
+  struct SoftBuffer *b = SOFTBUF(ev->lpBuffer);
+
+  switch (ev->dwAction) {
+  case SBSCHED_PLAY:
+    b->status = DSBSTATUS_PLAYING | (ev->lValue & DSBPLAY_LOOPING ? DSBSTATUS_LOOPING : 0);
+    break;
+  case SBSCHED_STOP:
+  case SBSCHED_PAUSE:
+    if (b->status & DSBSTATUS_PLAYING) {
+      b->status = 0;
+      soft_notify_stop(b);
+    }
+    if (ev->dwAction == SBSCHED_PAUSE) break;
+    b->pos = 0;
+    b->loop.dwCounter = 0;
+    break;
+  case SBSCHED_VOLUME:
+    sb_auto_clear(&b->autos[SBPARAM_VOLUME]);
+    b->volume = ev->lValue;
+    break;
+  case SBSCHED_PAN:
+    sb_auto_clear(&b->autos[SBPARAM_PAN]);
+    b->pan = ev->lValue;
+    break;
+  case SBSCHED_FREQUENCY:
+    sb_auto_clear(&b->autos[SBPARAM_FREQUENCY]);
+    b->frequency = (DWORD)ev->lValue;
+    break;
+  case SBSCHED_POSITION:
+    b->pos = soft_offset(b, (DWORD)ev->lValue);
+    if (b->pos >= soft_total(b)) b->pos = 0;
+    break;
+  }
+}
+
+/*
+ * framesフレーム進める。予定の時刻で区切り、その時刻までの予定を済ませてから続きを進める。
+ * accがNULLならミックスしない。buffersがNULLなら、デバイスのすべてのバッファーを進める。
+ * dev->lockを取ってから呼ぶ
+ */
+static void
+soft_advance(struct SoftDevice *d, DWORD count, LPSBBUFFER *buffers, float *acc, DWORD frames)
+{
+  LPCSBSCHEDULE next;
+  SBSCHEDULE    ev;
+  DWORD   i, n, k, ch = d->wfx.nChannels;
+  float  *p;
+  struct SoftBuffer *b;
+
+  for (n = 0; n < frames; n += k) {
+    while ((next = sb_sched_peek(&d->sched)) != NULL && next->qwFrame <= d->clock) {
+      sb_sched_pop(&d->sched, &ev);
+      soft_sched_apply(&ev);
+    }
+    k = frames - n;
+    if (next && next->qwFrame - d->clock < k) k = (DWORD)(next->qwFrame - d->clock);
+    p = acc ? acc + n * ch : NULL;
+    if (buffers) {
+      for (i = 0; i < count; i++) soft_process(SOFTBUF(buffers[i]), p, ch, k);
+    }
+    else {
+      for (b = d->head; b; b = b->next) soft_process(b, p, ch, k);
+    }
+    d->clock += k;
+  }
+}
+
+/*
+ * SOFT_RENDER_FRAMES以下のフレーム数をミックスしてoutに書く。
+ * buffersがNULLなら、デバイスのすべてのバッファーをミックスする。dev->lockを取ってから呼ぶ
+ */
+static void
+soft_mix_chunk(struct SoftDevice *d, DWORD count, LPSBBUFFER *buffers, DWORD frames, LPBYTE out)
+{
+  float   acc[SOFT_RENDER_FRAMES * 2];
+  DWORD   n = frames * d->wfx.nChannels;
+
+  memset(acc, 0, sizeof(float) * n);
+  soft_advance(d, count, buffers, acc, frames);
+  if (d->wfx.wBitsPerSample == 8) sb_mix_store_u8(out, acc, n);
+  else                            sb_mix_store_s16(out, acc, n);
+}
+
+/*
+ * シンクがあれば書ける分だけミックスして渡す。
+ * 無ければ（ヌル・シンク）実時間に合わせてカーソルだけ進める。
+ */
+static void *
+soft_thread(void *arg)
+{
+  struct SoftDevice *d = arg;
+  uint64_t elapsed, target;
+  DWORD    frames, k;
+  BYTE     pcm[SOFT_RENDER_FRAMES * 4];
+
+  sb_mutex_lock(&d->lock);
+  while (d->running) {
+    sb_cond_wait(&d->cond, &d->lock, SOFT_PERIOD_MS);
+    if (!d->running) break;
+    if (d->sink) {
+      frames = d->sink->lpVtbl->GetWritable(d->sink);
+      for (; frames; frames -= k) {
+        k = frames < SOFT_RENDER_FRAMES ? frames : SOFT_RENDER_FRAMES;
+        soft_mix_chunk(d, 0, NULL, k, pcm);
+        if (FAILED(d->sink->lpVtbl->Write(d->sink, pcm, k))) break;
+      }
+      continue;
+    }
+    elapsed = sb_clock_ns() - d->origin_ns;
+    target  = elapsed / 1000000000ULL * d->wfx.nSamplesPerSec
+            + elapsed % 1000000000ULL * d->wfx.nSamplesPerSec / 1000000000ULL;
+    frames  = (DWORD)(target - d->frames);
+    d->frames = target;
+    soft_advance(d, 0, NULL, NULL, frames);
+  }
+  sb_mutex_unlock(&d->lock);
+  return NULL;
+}
+
+static void
+soft_reset_clock(struct SoftDevice *d)
+{
+  d->origin_ns = sb_clock_ns();
+  d->frames    = 0;
+}
+
+/*
+ * device
+ */
+// プライマリー（ミックス結果）の形式。8/16bitのモノラルかステレオ
+static HRESULT
+soft_check_format(LPCWAVEFORMATEX wfx)
+{
+  if (wfx->wFormatTag != WAVE_FORMAT_PCM) return DSERR_BADFORMAT;
+  if (wfx->nChannels != 1 && wfx->nChannels != 2) return DSERR_BADFORMAT;
+  if (wfx->wBitsPerSample != 8 && wfx->wBitsPerSample != 16) return DSERR_BADFORMAT;
+  if (wfx->nBlockAlign != wfx->nChannels * wfx->wBitsPerSample / 8) return DSERR_BADFORMAT;
+  if (wfx->nSamplesPerSec < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < wfx->nSamplesPerSec) return DSERR_BADFORMAT;
+  return DS_OK;
+}
+
+/*
+ * バッファーの形式。WAVEFORMATEXTENSIBLEも受け付け、サンプルの形式とスピーカー配置を返す。
+ */
+static HRESULT
+soft_buffer_format(LPCWAVEFORMATEX wfx, LPDWORD sample, LPDWORD mask)
+{
+  const WAVEFORMATEXTENSIBLE *ext = (const WAVEFORMATEXTENSIBLE *)wfx;
+  WORD tag = wfx->wFormatTag;
+
+  *mask = 0;
+  if (tag == WAVE_FORMAT_EXTENSIBLE) {
+    if (wfx->cbSize < sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)) return DSERR_BADFORMAT;
+    if (ext->Samples.wValidBitsPerSample != wfx->wBitsPerSample) return DSERR_BADFORMAT;
+    tag   = (WORD)ext->SubFormat.Data1;
+    *mask = ext->dwChannelMask;
+  }
+  if (wfx->nChannels < 1 || SB_MIX_MAX_CHANNELS < wfx->nChannels) return DSERR_BADFORMAT;
+  if (tag == WAVE_FORMAT_IEEE_FLOAT && wfx->wBitsPerSample == 32) *sample = SB_SAMPLE_F32;
+  else if (tag == WAVE_FORMAT_PCM) {
+    switch (wfx->wBitsPerSample) {
+    case 8:  *sample = SB_SAMPLE_U8;  break;
+    case 16: *sample = SB_SAMPLE_S16; break;
+    case 24: *sample = SB_SAMPLE_S24; break;
+    case 32: *sample = SB_SAMPLE_S32; break;
+    default: return DSERR_BADFORMAT;
+    }
+  }
+  else return DSERR_BADFORMAT;
+  if (wfx->nBlockAlign != wfx->nChannels * wfx->wBitsPerSample / 8) return DSERR_BADFORMAT;
+  if (wfx->nSamplesPerSec < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < wfx->nSamplesPerSec) return DSERR_BADFORMAT;
+  return DS_OK;
+}
+
+/*
+ * 3チャンネル以上の素材を左右にまとめる係数。
+ * 配置が指定されていなければ、チャンネル数から一般的な配置を選ぶ。LFEは捨てる。
+ */
+static void
+soft_downmix(struct SoftBuffer *b, DWORD mask)
+{
+  static const DWORD defaults[SB_MIX_MAX_CHANNELS + 1] = {
+    0, 0x4, 0x3, 0x7, 0x33, 0x37, 0x3F, 0x13F, 0x63F
+  };
+  const float half = 0.70710678f;
+  DWORD ch = b->wfx.nChannels, c = 0, bit;
+  float l, r;
+
+  if (ch <= 2) return;
+  if (!mask) mask = defaults[ch];
+  for (bit = 1; bit && c < ch; bit <<= 1) {
+    if (!(mask & bit)) continue;
+    switch (bit) {
+    case SPEAKER_FRONT_LEFT:
+    case SPEAKER_FRONT_LEFT_OF_CENTER:  l = 1.0f; r = 0.0f; break;
+    case SPEAKER_FRONT_RIGHT:
+    case SPEAKER_FRONT_RIGHT_OF_CENTER: l = 0.0f; r = 1.0f; break;
+    case SPEAKER_BACK_LEFT:
+    case SPEAKER_SIDE_LEFT:             l = half; r = 0.0f; break;
+    case SPEAKER_BACK_RIGHT:
+    case SPEAKER_SIDE_RIGHT:            l = 0.0f; r = half; break;
+    case SPEAKER_LOW_FREQUENCY:         l = 0.0f; r = 0.0f; break;
+    default:                            l = half; r = half; break;
+    }
+    b->downmix[c]      = l;
+    b->downmix[ch + c] = r;
+    c++;
+  }
+  // マスクのビットが足りないチャンネルは中央に置く
+  for (; c < ch; c++) b->downmix[c] = b->downmix[ch + c] = half;
+}
+
+static struct SoftBuffer *
+SoftBuffer_new(struct SoftDevice *d, struct SoftData *data, LPCWAVEFORMATEX wfx, DWORD flags)
+{
+  struct SoftBuffer *b = calloc(1, sizeof(struct SoftBuffer));
+
+  if (!b) return NULL;
+  b->base.lpVtbl = &SoftBuffer_vtbl;
+  b->dev         = d;
+  b->data        = data;
+  b->wfx         = *wfx;
+  b->flags       = flags;
+  b->volume      = DSBVOLUME_MAX;
+  b->pan         = DSBPAN_CENTER;
+  b->frequency   = DSBFREQUENCY_ORIGINAL;
+  b->fx_fade     = 1.0f;
+
+  sb_mutex_lock(&d->lock);
+  data->refcount++;
+  b->next = d->head;
+  if (d->head) d->head->prev = b;
+  d->head = b;
+  sb_mutex_unlock(&d->lock);
+  return b;
+}
+
+static HRESULT
+SoftDevice_CreateBuffer(LPSBDEVICE dev, LPCSBBUFFERDESC desc, LPSBBUFFER *out)
+{
+  struct SoftData   *data;
+  struct SoftBuffer *b;
+  HRESULT hr;
+  DWORD   sample, mask;
+
+  hr = soft_buffer_format(desc->lpwfxFormat, &sample, &mask);
+  if (FAILED(hr)) return hr;
+  if (desc->dwBufferBytes < DSBSIZE_MIN || DSBSIZE_MAX < desc->dwBufferBytes) return DSERR_INVALIDPARAM;
+
+  data = malloc(sizeof(struct SoftData));
+  if (!data) return DSERR_OUTOFMEMORY;
+  data->refcount = 0;
+  data->bytes    = desc->dwBufferBytes;
+  data->ptr      = malloc(data->bytes);
+  if (!data->ptr) {
+    free(data);
+    return DSERR_OUTOFMEMORY;
+  }
+  // 無音で初期化する。8bitは符号なしなので0x80が無音
+  memset(data->ptr, desc->lpwfxFormat->wBitsPerSample == 8 ? 0x80 : 0, data->bytes);
+
+  b = SoftBuffer_new(SOFTDEV(dev), data, desc->lpwfxFormat, desc->dwFlags);
+  if (!b) {
+    free(data->ptr);
+    free(data);
+    return DSERR_OUTOFMEMORY;
+  }
+  // 停止中のバッファーはデバイス・スレッドから読まれない
+  b->sample = sample;
+  soft_downmix(b, mask);
+  *out = &b->base;
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_DuplicateBuffer(LPSBDEVICE dev, LPSBBUFFER src, LPSBBUFFER *out)
+{
+  struct SoftBuffer *s = SOFTBUF(src), *b;
+
+  b = SoftBuffer_new(SOFTDEV(dev), s->data, &s->wfx, s->flags);
+  if (!b) return DSERR_OUTOFMEMORY;
+  b->sample = s->sample;
+  memcpy(b->downmix, s->downmix, sizeof(b->downmix));
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  b->volume    = s->volume;
+  b->pan       = s->pan;
+  b->frequency = s->frequency;
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  *out = &b->base;
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_GetFormat(LPSBDEVICE dev, LPWAVEFORMATEX wfx)
+{
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  *wfx = SOFTDEV(dev)->wfx;
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_SetFormat(LPSBDEVICE dev, LPCWAVEFORMATEX wfx)
+{
+  struct SoftBuffer *b;
+  HRESULT hr;
+  DWORD   i;
+
+  hr = soft_check_format(wfx);
+  if (FAILED(hr)) return hr;
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  if (SOFTDEV(dev)->sink) hr = SOFTDEV(dev)->sink->lpVtbl->SetFormat(SOFTDEV(dev)->sink, wfx);
+  if (SUCCEEDED(hr)) {
+    SOFTDEV(dev)->wfx = *wfx;
+    soft_reset_clock(SOFTDEV(dev));
+    // エフェクトの遅延線を新しい周波数で取り直す。取れなかったエフェクトは素通しになる
+    // 前の並びから移っている途中なら、そこで移り終える
+    for (b = SOFTDEV(dev)->head; b; b = b->next) {
+      for (i = 0; i < b->fx_count; i++) sb_fx_format(b->fx[i], wfx->nSamplesPerSec, wfx->nChannels);
+      b->fx_fade = 1.0f;
+    }
+  }
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  return hr;
+}
+
+static HRESULT
+SoftDevice_GetVolume(LPSBDEVICE dev, LPLONG volume)
+{
+  *volume = SOFTDEV(dev)->volume;
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_SetVolume(LPSBDEVICE dev, LONG volume)
+{
+  if (volume < DSBVOLUME_MIN || DSBVOLUME_MAX < volume) return DSERR_INVALIDPARAM;
+  SOFTDEV(dev)->volume = volume;
+  return DS_OK;
+}
+
+/*
+ * buffersだけをframesフレーム進め、ミックスした結果をoutに書く。
+ * サンプル・クロックも進み、その間の予定はbuffersに無いバッファーのものも済ませる。
+ * 出力形式wfxはプライマリーバッファーと同じでなければならない。
+ */
+static HRESULT
+SoftDevice_Render(LPSBDEVICE dev, DWORD count, LPSBBUFFER *buffers, DWORD frames, LPCWAVEFORMATEX wfx, LPVOID out)
+{
+  struct SoftDevice *d = SOFTDEV(dev);
+  LPBYTE  dst = out;
+  DWORD   i, n, k;
+  HRESULT hr = DS_OK;
+
+  for (i = 0; i < count; i++) {
+    if (SOFTBUF(buffers[i])->dev != d) return DSERR_INVALIDPARAM;
+  }
+  sb_mutex_lock(&d->lock);
+  if (wfx->nChannels != d->wfx.nChannels || wfx->nSamplesPerSec != d->wfx.nSamplesPerSec || wfx->wBitsPerSample != d->wfx.wBitsPerSample) {
+    hr = DSERR_BADFORMAT;
+  }
+  for (n = 0; SUCCEEDED(hr) && n < frames; n += k) {
+    k = frames - n < SOFT_RENDER_FRAMES ? frames - n : SOFT_RENDER_FRAMES;
+    soft_mix_chunk(d, count, buffers, k, dst);
+    dst += k * d->wfx.nBlockAlign;
+  }
+  sb_mutex_unlock(&d->lock);
+  return hr;
+}
+
+static void
+SoftDevice_Release(LPSBDEVICE dev)
+{
+  struct SoftDevice *d = SOFTDEV(dev);
+
+  if (d->realtime) {
+    sb_mutex_lock(&d->lock);
+    d->running = 0;
+    sb_cond_signal(&d->cond);
+    sb_mutex_unlock(&d->lock);
+    sb_thread_join(d->thread);
+  }
+  if (d->sink) d->sink->lpVtbl->Release(d->sink);
+  sb_sched_clear(&d->sched);
+  sb_cond_destroy(&d->cond);
+  sb_mutex_destroy(&d->lock);
+  free(d);
+}
+
+static HRESULT
+SoftDevice_GetClock(LPSBDEVICE dev, uint64_t *clock)
+{
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  *clock = SOFTDEV(dev)->clock;
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_Schedule(LPSBDEVICE dev, LPCSBSCHEDULE ev)
+{
+  struct SoftDevice *d = SOFTDEV(dev);
+  BOOL ok;
+
+  if (!ev->lpBuffer || SOFTBUF(ev->lpBuffer)->dev != d || ev->dwAction >= SBSCHED_COUNT) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&d->lock);
+  ok = sb_sched_push(&d->sched, ev);
+  sb_mutex_unlock(&d->lock);
+  return ok ? DS_OK : DSERR_OUTOFMEMORY;
+}
+
+static HRESULT
+SoftDevice_Unschedule(LPSBDEVICE dev, LPSBBUFFER buf, LPDWORD cancelled)
+{
+  DWORD n;
+
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  n = sb_sched_remove(&SOFTDEV(dev)->sched, buf);
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  if (cancelled) *cancelled = n;
+  return DS_OK;
+}
+
+static HRESULT
+SoftDevice_GetScheduled(LPSBDEVICE dev, LPSBBUFFER buf, LPDWORD count)
+{
+  sb_mutex_lock(&SOFTDEV(dev)->lock);
+  *count = sb_sched_count(&SOFTDEV(dev)->sched, buf);
+  sb_mutex_unlock(&SOFTDEV(dev)->lock);
+  return DS_OK;
+}
+
+static const struct SBDeviceVtbl SoftDevice_vtbl = {
+  SoftDevice_CreateBuffer,
+  SoftDevice_DuplicateBuffer,
+  SoftDevice_GetFormat,
+  SoftDevice_SetFormat,
+  SoftDevice_GetVolume,
+  SoftDevice_SetVolume,
+  SoftDevice_Render,
+  SoftDevice_Release,
+  SoftDevice_GetClock,
+  SoftDevice_Schedule,
+  SoftDevice_Unschedule,
+  SoftDevice_GetScheduled,
+};
+
+/*
+ * realtimeが偽ならデバイス・スレッドを作らない（offline）。
+ * sinkを渡すとミックス結果をそこに書き出す。sinkの解放はデバイスが行う。
+ */
+HRESULT
+SBSoftCreate(LPSBDEVICE *out, BOOL realtime, LPSBSINK sink)
+{
+  struct SoftDevice *d;
+  HRESULT hr;
+
+  d = calloc(1, sizeof(struct SoftDevice));
+  if (!d) {
+    if (sink) sink->lpVtbl->Release(sink);
+    return DSERR_OUTOFMEMORY;
+  }
+  d->base.lpVtbl          = &SoftDevice_vtbl;
+  d->base.name            = sink ? "mix" : realtime ? "soft" : "offline";
+  d->base.dwCaps          = SBCAPS_NATIVELOOP | SBCAPS_RENDER | SBCAPS_REVERSE | SBCAPS_LIVEFX;
+  d->wfx.wFormatTag       = WAVE_FORMAT_PCM;
+  d->wfx.nChannels        = 2;
+  d->wfx.nSamplesPerSec   = 48000;
+  d->wfx.wBitsPerSample   = 16;
+  d->wfx.nBlockAlign      = 4;
+  d->wfx.nAvgBytesPerSec  = 48000 * 4;
+  d->wfx.cbSize           = 0;
+  d->volume               = DSBVOLUME_MAX;
+  d->realtime             = realtime || sink;
+  d->running              = d->realtime;
+  d->sink                 = sink;
+  if (sink) {
+    hr = sink->lpVtbl->SetFormat(sink, &d->wfx);
+    if (FAILED(hr)) {
+      sink->lpVtbl->Release(sink);
+      free(d);
+      return hr;
+    }
+  }
+  sb_mutex_init(&d->lock);
+  sb_cond_init(&d->cond);
+  soft_reset_clock(d);
+  if (d->realtime && sb_thread_create(&d->thread, soft_thread, d)) {
+    if (sink) sink->lpVtbl->Release(sink);
+    sb_cond_destroy(&d->cond);
+    sb_mutex_destroy(&d->lock);
+    free(d);
+    return DSERR_GENERIC;
+  }
+  *out = &d->base;
+  return DS_OK;
+}
+
+/*
+ * buffer
+ */
+static void
+soft_free_fx(LPSBFX *fx, DWORD count)
+{
+  DWORD i;
+
+  for (i = 0; i < count; i++) sb_fx_free(fx[i]);
+  free(fx);
+}
+
+static void
+SoftBuffer_Release(LPSBBUFFER buf)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  struct SoftDevice *d = b->dev;
+  DWORD i;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&d->lock);
+  sb_sched_remove(&d->sched, buf);
+  if (b->prev) b->prev->next = b->next;
+  else         d->head       = b->next;
+  if (b->next) b->next->prev = b->prev;
+  if (--b->data->refcount == 0) {
+    free(b->data->ptr);
+    free(b->data);
+  }
+  sb_mutex_unlock(&d->lock);
+  for (i = 0; i < SBPARAM_COUNT; i++) sb_auto_clear(&b->autos[i]);
+  soft_free_fx(b->fx, b->fx_count);
+  soft_free_fx(b->fx_old, b->fx_old_count);
+  free(b->notify);
+  free(b);
+}
+
+static DWORD
+soft_write_cursor(struct SoftBuffer *b, DWORD play)
+{
+  DWORD ahead;
+
+  if (!(b->status & DSBSTATUS_PLAYING)) return play;
+  // 書き込みカーソルは1周期ぶん先行させる
+  ahead = (b->frequency ? b->frequency : b->wfx.nSamplesPerSec) * SOFT_PERIOD_MS / 1000 * b->wfx.nBlockAlign;
+  return (play + ahead) % b->data->bytes;
+}
+
+static HRESULT
+SoftBuffer_Lock(LPSBBUFFER buf, DWORD offset, DWORD bytes, LPVOID *ptr1, LPDWORD size1, LPVOID *ptr2, LPDWORD size2, DWORD flags)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  DWORD size = b->data->bytes;
+
+  SB_STATS_CALL(buf);
+  if (flags & DSBLOCK_FROMWRITECURSOR) {
+    sb_mutex_lock(&b->dev->lock);
+    offset = soft_write_cursor(b, (DWORD)(b->pos >> FIX_SHIFT) * b->wfx.nBlockAlign);
+    sb_mutex_unlock(&b->dev->lock);
+  }
+  if (flags & DSBLOCK_ENTIREBUFFER) bytes = size;
+  if (offset >= size || bytes > size || bytes == 0) return DSERR_INVALIDPARAM;
+
+  *ptr1  = b->data->ptr + offset;
+  *size1 = bytes < size - offset ? bytes : size - offset;
+  if (ptr2)  *ptr2  = bytes > *size1 ? b->data->ptr : NULL;
+  if (size2) *size2 = bytes - *size1;
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_Unlock(LPSBBUFFER buf, LPVOID ptr1, DWORD size1, LPVOID ptr2, DWORD size2)
+{
+  SB_STATS_CALL(buf);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_Play(LPSBBUFFER buf, DWORD flags)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  b->status = DSBSTATUS_PLAYING | (flags & DSBPLAY_LOOPING ? DSBSTATUS_LOOPING : 0);
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_Stop(LPSBBUFFER buf)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  if (b->status & DSBSTATUS_PLAYING) {
+    b->status = 0;
+    soft_notify_stop(b);
+  }
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetStatus(LPSBBUFFER buf, LPDWORD status)
+{
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&SOFTBUF(buf)->dev->lock);
+  *status = SOFTBUF(buf)->status;
+  sb_mutex_unlock(&SOFTBUF(buf)->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetCurrentPosition(LPSBBUFFER buf, LPDWORD play, LPDWORD write)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  DWORD pos;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  pos = (DWORD)(b->pos >> FIX_SHIFT) * b->wfx.nBlockAlign;
+  if (play)  *play  = pos;
+  if (write) *write = soft_write_cursor(b, pos);
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetCurrentPosition(LPSBBUFFER buf, DWORD pos)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  if (pos > b->data->bytes) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  b->pos = (int64_t)(pos / b->wfx.nBlockAlign) << FIX_SHIFT;
+  if (b->pos >= soft_total(b)) b->pos = 0;
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetVolume(LPSBBUFFER buf, LPLONG volume)
+{
+  SB_STATS_CALL(buf);
+  *volume = SOFTBUF(buf)->volume;
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetVolume(LPSBBUFFER buf, LONG volume)
+{
+  SB_STATS_CALL(buf);
+  if (volume < DSBVOLUME_MIN || DSBVOLUME_MAX < volume) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&SOFTBUF(buf)->dev->lock);
+  sb_auto_clear(&SOFTBUF(buf)->autos[SBPARAM_VOLUME]);
+  SOFTBUF(buf)->volume = volume;
+  sb_mutex_unlock(&SOFTBUF(buf)->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetPan(LPSBBUFFER buf, LPLONG pan)
+{
+  SB_STATS_CALL(buf);
+  *pan = SOFTBUF(buf)->pan;
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetPan(LPSBBUFFER buf, LONG pan)
+{
+  SB_STATS_CALL(buf);
+  if (pan < DSBPAN_LEFT || DSBPAN_RIGHT < pan) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&SOFTBUF(buf)->dev->lock);
+  sb_auto_clear(&SOFTBUF(buf)->autos[SBPARAM_PAN]);
+  SOFTBUF(buf)->pan = pan;
+  sb_mutex_unlock(&SOFTBUF(buf)->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetFrequency(LPSBBUFFER buf, LPDWORD frequency)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  *frequency = b->frequency ? b->frequency : b->wfx.nSamplesPerSec;
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetFrequency(LPSBBUFFER buf, DWORD frequency)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  if (frequency != DSBFREQUENCY_ORIGINAL && (frequency < DSBFREQUENCY_MIN || DSBFREQUENCY_MAX < frequency)) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  sb_auto_clear(&b->autos[SBPARAM_FREQUENCY]);
+  b->frequency = frequency;
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetNotificationPositions(LPSBBUFFER buf, DWORD count, LPCSBPOSITIONNOTIFY notify)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  LPSBPOSITIONNOTIFY copy = NULL, old;
+  DWORD i;
+
+  SB_STATS_CALL(buf);
+  if (count > DSBNOTIFICATIONS_MAX) return DSERR_INVALIDPARAM;
+  for (i = 0; i < count; i++) {
+    if (notify[i].dwOffset != DSBPN_OFFSETSTOP && notify[i].dwOffset >= b->data->bytes) return DSERR_INVALIDPARAM;
+  }
+  if (count) {
+    copy = malloc(sizeof(SBPOSITIONNOTIFY) * count);
+    if (!copy) return DSERR_OUTOFMEMORY;
+    memcpy(copy, notify, sizeof(SBPOSITIONNOTIFY) * count);
+  }
+  sb_mutex_lock(&b->dev->lock);
+  old             = b->notify;
+  b->notify       = copy;
+  b->notify_count = count;
+  sb_mutex_unlock(&b->dev->lock);
+  free(old);
+  return DS_OK;
+}
+
+/*
+ * エフェクトはデバイスの今の形式で作る。作り直しはロックの外で行い、入れ替えだけをロックの中で行う。
+ * 再生中なら外した並びをfx_oldに残し、デバイス・スレッドがそこから移る。
+ * fx_oldはデバイス・スレッドでは解放しない。移っている途中で次のSetFXが来たら、
+ * それまでのfx_oldを捨てて今の並びから移る
+ */
+static HRESULT
+SoftBuffer_SetFX(LPSBBUFFER buf, DWORD count, const DWORD *fx_nums)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  LPSBFX *fx = NULL, *old, *drop;
+  DWORD   i, old_count, drop_count, rate, channels;
+
+  SB_STATS_CALL(buf);
+  if (!(b->flags & SBBCAPS_CTRLFX)) return DSERR_CONTROLUNAVAIL;
+  for (i = 0; i < count; i++) {
+    if (fx_nums[i] > FX_WAVES_REVERB) return DSERR_INVALIDPARAM;
+  }
+  sb_mutex_lock(&b->dev->lock);
+  rate     = b->dev->wfx.nSamplesPerSec;
+  channels = b->dev->wfx.nChannels;
+  sb_mutex_unlock(&b->dev->lock);
+  if (count) {
+    fx = calloc(count, sizeof(LPSBFX));
+    if (!fx) return DSERR_OUTOFMEMORY;
+    for (i = 0; i < count; i++) {
+      fx[i] = sb_fx_create(fx_nums[i], rate, channels);
+      if (!fx[i]) {
+        soft_free_fx(fx, i);
+        return DSERR_OUTOFMEMORY;
+      }
+    }
+  }
+  sb_mutex_lock(&b->dev->lock);
+  old         = b->fx;
+  old_count   = b->fx_count;
+  drop        = b->fx_old;
+  drop_count  = b->fx_old_count;
+  b->fx       = fx;
+  b->fx_count = count;
+  if (b->status & DSBSTATUS_PLAYING) {
+    b->fx_old       = old;
+    b->fx_old_count = old_count;
+    b->fx_fade      = 0.0f;
+    old             = NULL;
+    old_count       = 0;
+  }
+  else {
+    b->fx_old       = NULL;
+    b->fx_old_count = 0;
+    b->fx_fade      = 1.0f;
+  }
+  // 作っている間に形式が変わっていれば合わせる
+  for (i = 0; i < count; i++) sb_fx_format(fx[i], b->dev->wfx.nSamplesPerSec, b->dev->wfx.nChannels);
+  sb_mutex_unlock(&b->dev->lock);
+  soft_free_fx(old, old_count);
+  soft_free_fx(drop, drop_count);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetFXBypass(LPSBBUFFER buf, DWORD idx, BOOL bypass)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  HRESULT hr = DSERR_OBJECTNOTFOUND;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  if (idx < b->fx_count) {
+    sb_fx_set_bypass(b->fx[idx], bypass);
+    hr = DS_OK;
+  }
+  sb_mutex_unlock(&b->dev->lock);
+  return hr;
+}
+
+// idx番目のエフェクトがfxでなければDSERR_OBJECTNOTFOUND（GetObjectInPathと同じ）
+static HRESULT
+SoftBuffer_GetFXParameters(LPSBBUFFER buf, DWORD idx, DWORD fx, LPVOID params)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  HRESULT hr = DSERR_OBJECTNOTFOUND;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  if (idx < b->fx_count && sb_fx_type(b->fx[idx]) == fx) {
+    sb_fx_get_params(b->fx[idx], params);
+    hr = DS_OK;
+  }
+  sb_mutex_unlock(&b->dev->lock);
+  return hr;
+}
+
+static HRESULT
+SoftBuffer_SetFXParameters(LPSBBUFFER buf, DWORD idx, DWORD fx, LPCVOID params)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  HRESULT hr = DSERR_OBJECTNOTFOUND;
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  if (idx < b->fx_count && sb_fx_type(b->fx[idx]) == fx) hr = sb_fx_set_params(b->fx[idx], params);
+  sb_mutex_unlock(&b->dev->lock);
+  return hr;
+}
+
+static HRESULT
+SoftBuffer_SetLoop(LPSBBUFFER buf, LPCSBLOOP loop)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  if (loop->dwStart > b->data->bytes || loop->dwEnd > b->data->bytes) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  b->loop = *loop;
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetLoop(LPSBBUFFER buf, LPSBLOOP loop)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  sb_mutex_lock(&b->dev->lock);
+  *loop = b->loop;
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetDirection(LPSBBUFFER buf, LONG direction)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  if (direction != 1 && direction != -1) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  b->reverse = direction < 0;
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_GetDirection(LPSBBUFFER buf, LPLONG direction)
+{
+  SB_STATS_CALL(buf);
+  *direction = SOFTBUF(buf)->reverse ? -1 : 1;
+  return DS_OK;
+}
+
+static HRESULT
+SoftBuffer_SetAutomation(LPSBBUFFER buf, DWORD param, DWORD count, LPCSBBREAKPOINT points)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+  double  current;
+  BOOL    ok;
+
+  SB_STATS_CALL(buf);
+  if (!sb_auto_valid(param, count, points)) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  switch (param) {
+  case SBPARAM_VOLUME: current = b->volume; break;
+  case SBPARAM_PAN:    current = b->pan;    break;
+  default:             current = b->frequency ? b->frequency : b->wfx.nSamplesPerSec; break;
+  }
+  ok = sb_auto_set(&b->autos[param], current, count, points);
+  // 長さ0の折れ点はすぐに効く
+  if (ok && count) soft_auto_store(b, param, b->autos[param].value);
+  sb_mutex_unlock(&b->dev->lock);
+  return ok ? DS_OK : DSERR_OUTOFMEMORY;
+}
+
+static HRESULT
+SoftBuffer_GetAutomation(LPSBBUFFER buf, DWORD param, LPDWORD remaining)
+{
+  struct SoftBuffer *b = SOFTBUF(buf);
+
+  SB_STATS_CALL(buf);
+  if (param >= SBPARAM_COUNT) return DSERR_INVALIDPARAM;
+  sb_mutex_lock(&b->dev->lock);
+  *remaining = sb_auto_remaining(&b->autos[param]);
+  sb_mutex_unlock(&b->dev->lock);
+  return DS_OK;
+}
+
+static const struct SBBufferVtbl SoftBuffer_vtbl = {
+  SoftBuffer_Release,
+  SoftBuffer_Lock,
+  SoftBuffer_Unlock,
+  SoftBuffer_Play,
+  SoftBuffer_Stop,
+  SoftBuffer_GetStatus,
+  SoftBuffer_GetCurrentPosition,
+  SoftBuffer_SetCurrentPosition,
+  SoftBuffer_GetVolume,
+  SoftBuffer_SetVolume,
+  SoftBuffer_GetPan,
+  SoftBuffer_SetPan,
+  SoftBuffer_GetFrequency,
+  SoftBuffer_SetFrequency,
+  SoftBuffer_SetNotificationPositions,
+  SoftBuffer_SetFX,
+  SoftBuffer_GetFXParameters,
+  SoftBuffer_SetFXParameters,
+  SoftBuffer_SetLoop,
+  SoftBuffer_GetLoop,
+  SoftBuffer_SetDirection,
+  SoftBuffer_GetDirection,
+  SoftBuffer_SetAutomation,
+  SoftBuffer_GetAutomation,
+  SoftBuffer_SetFXBypass,
+};
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <string.h>
+#include "sb_stats.h"
+
+volatile int sb_stats_enabled = 0;
+
+// 記録はどのスレッドからも来る（Ruby、フィーダー、ループ・サービス、ミキサー）。有効なときだけ取る
+static sb_mutex_t stats_lock;
+static SBSTATS    stats_global;
+
+void
+sb_stats_init(void)
+{
+  sb_mutex_init(&stats_lock);
+}
+
+static DWORD
+histogram_bucket(uint64_t v)
+{
+  DWORD i = 0;
+
+  while (v && i < SB_STATS_BUCKETS - 1) {
+    v >>= 1;
+    i++;
+  }
+  return i;
+}
+
+static void
+histogram_add(SBHISTOGRAM *h, uint64_t v)
+{
+  if (h->count == 0 || v < h->min) h->min = v;
+  if (v > h->max) h->max = v;
+  h->count++;
+  h->sum += v;
+  h->buckets[histogram_bucket(v)]++;
+}
+
+void
+sb_stats_write(LPSBSTATS s, DWORD bytes, uint64_t ns)
+{
+  sb_mutex_lock(&stats_lock);
+  stats_global.write_bytes += bytes;
+  histogram_add(&stats_global.write_ns, ns);
+  if (s) {
+    s->write_bytes += bytes;
+    histogram_add(&s->write_ns, ns);
+  }
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_wakeup(LPSBSTATS s, uint64_t ns)
+{
+  sb_mutex_lock(&stats_lock);
+  histogram_add(&stats_global.wakeup_ns, ns);
+  if (s) histogram_add(&s->wakeup_ns, ns);
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_seam(LPSBSTATS s, uint64_t frames)
+{
+  sb_mutex_lock(&stats_lock);
+  histogram_add(&stats_global.seam_frames, frames);
+  if (s) histogram_add(&s->seam_frames, frames);
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_underrun(LPSBSTATS s)
+{
+  sb_mutex_lock(&stats_lock);
+  stats_global.underruns++;
+  if (s) s->underruns++;
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_call(LPSBSTATS s)
+{
+  sb_mutex_lock(&stats_lock);
+  stats_global.calls++;
+  if (s) s->calls++;
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_snapshot(LPSBSTATS s, LPSBSTATS out)
+{
+  sb_mutex_lock(&stats_lock);
+  *out = s ? *s : stats_global;
+  sb_mutex_unlock(&stats_lock);
+}
+
+void
+sb_stats_reset(LPSBSTATS s)
+{
+  sb_mutex_lock(&stats_lock);
+  memset(s ? s : &stats_global, 0, sizeof(SBSTATS));
+  sb_mutex_unlock(&stats_lock);
+}
+
+uint64_t
+sb_histogram_percentile(const SBHISTOGRAM *h, double p)
+{
+  uint64_t rank, seen = 0, upper;
+  DWORD    i;
+
+  if (h->count == 0) return 0;
+  rank = (uint64_t)(h->count * p / 100.0 + 0.5);
+  if (rank < 1)        rank = 1;
+  if (rank > h->count) rank = h->count;
+  for (i = 0; i < SB_STATS_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) break;
+  }
+  if (i == 0) return 0;
+  upper = i >= 64 ? UINT64_MAX : ((uint64_t)1 << i) - 1;
+  return upper < h->max && i < SB_STATS_BUCKETS - 1 ? upper : h->max;
+}
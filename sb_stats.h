@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * 遅延とタイミングの統計。
+ * 書き込み時間、通知から起床までの遅れ、ループのつなぎ目の誤差、アンダーラン、
+ * バックエンドの呼び出し回数を数え、時間などは2のべき乗の区切りのヒストグラムにする。
+ * sb_stats_enabledが0のときは、呼び出し側がこのフラグを見るだけで何もしない。
+ * 記録はバッファーごとの統計（NULLなら無し）と全体の統計の両方に足す。
+ */
+#ifndef SB_STATS_H
+#define SB_STATS_H
+
+#include "sb_os.h"
+
+// buckets[0]は0、buckets[i]は2^(i-1)以上2^i未満。最後のバケットはそれ以上すべて
+#define SB_STATS_BUCKETS 40
+
+typedef struct SBHistogram {
+  uint64_t  count;
+  uint64_t  sum;
+  uint64_t  min;
+  uint64_t  max;
+  uint64_t  buckets[SB_STATS_BUCKETS];
+} SBHISTOGRAM;
+
+typedef struct SBStats {
+  uint64_t    write_bytes;
+  SBHISTOGRAM write_ns;     // Lockから書き込んでUnlockするまで
+  SBHISTOGRAM wakeup_ns;    // 通知位置を再生カーソルが過ぎてから、待っていたスレッドが起きるまで
+  SBHISTOGRAM seam_frames;  // ループ区間の終端を過ぎてから始端に戻るまでに行き過ぎたフレーム数
+  uint64_t    underruns;    // 書き込みが間に合わず無音を鳴らした回数
+  uint64_t    calls;        // バックエンド（DirectSoundならCOM）のバッファー・メソッドの呼び出し回数
+} SBSTATS, *LPSBSTATS;
+
+extern volatile int sb_stats_enabled;
+
+#define SB_STATS_ON (sb_stats_enabled)
+// バックエンドのバッファー・メソッドの入り口で呼ぶ
+#define SB_STATS_CALL(buf) do { if (SB_STATS_ON) sb_stats_call((buf)->lpStats); } while (0)
+
+void      sb_stats_init(void);
+void      sb_stats_write(LPSBSTATS, DWORD bytes, uint64_t ns);
+void      sb_stats_wakeup(LPSBSTATS, uint64_t ns);
+void      sb_stats_seam(LPSBSTATS, uint64_t frames);
+void      sb_stats_underrun(LPSBSTATS);
+void      sb_stats_call(LPSBSTATS);
+// 一貫した写しを取る。NULLなら全体の統計
+void      sb_stats_snapshot(LPSBSTATS, LPSBSTATS out);
+void      sb_stats_reset(LPSBSTATS);
+// p（0〜100）パーセンタイルが入るバケットの上限。maxを越えない
+uint64_t  sb_histogram_percentile(const SBHISTOGRAM *, double p);
+
+#endif /* SB_STATS_H */
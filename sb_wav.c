@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+#include <string.h>
+#include "sb_wav.h"
+
+static WORD
+le16(const BYTE *p)
+{
+  return (WORD)(p[0] | p[1] << 8);
+}
+
+static DWORD
+le32(const BYTE *p)
+{
+  return (DWORD)p[0] | (DWORD)p[1] << 8 | (DWORD)p[2] << 16 | (DWORD)p[3] << 24;
+}
+
+// KSDATAFORMAT_SUBTYPE_*の共通部分（Data2以降）
+static const BYTE ks_subtype_tail[12] = {
+  0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71
+};
+
+static const char *
+wav_fmt(LPSBWAV wav, const BYTE *p, DWORD size)
+{
+  if (size < 16) return "broken fmt chunk";
+  wav->wFormatTag     = le16(p);
+  wav->nChannels      = le16(p + 2);
+  wav->nSamplesPerSec = le32(p + 4);
+  wav->nBlockAlign    = le16(p + 12);
+  wav->wBitsPerSample = le16(p + 14);
+  wav->dwChannelMask  = 0;
+  if (wav->wFormatTag == WAVE_FORMAT_EXTENSIBLE) {
+    if (size < 40 || le16(p + 16) < 22) return "broken fmt chunk";
+    // 有効ビット数が少ないだけなら、コンテナのビット数で扱ってかまわない
+    if (le16(p + 18) > wav->wBitsPerSample) return "broken fmt chunk";
+    wav->dwChannelMask = le32(p + 20);
+    if (memcmp(p + 28, ks_subtype_tail, sizeof(ks_subtype_tail)) != 0) return "unsupported WAV format";
+    wav->wFormatTag    = (WORD)le32(p + 24);
+  }
+  if (wav->wFormatTag == WAVE_FORMAT_IEEE_FLOAT) {
+    if (wav->wBitsPerSample != 32) return "unsupported WAV format";
+  }
+  else if (wav->wFormatTag == WAVE_FORMAT_PCM) {
+    if (wav->wBitsPerSample != 8 && wav->wBitsPerSample != 16 && wav->wBitsPerSample != 24 && wav->wBitsPerSample != 32) {
+      return "unsupported WAV format";
+    }
+  }
+  else return "unsupported WAV format";
+  if (wav->nChannels == 0) return "broken fmt chunk";
+  if (wav->nBlockAlign != wav->nChannels * wav->wBitsPerSample / 8) return "broken fmt chunk";
+  return NULL;
+}
+
+static void
+wav_smpl(LPSBWAV wav, const BYTE *p, DWORD size)
+{
+  DWORD end;
+
+  if (size < 36) return;
+  wav->dwLoops = le32(p + 28);
+  if (wav->dwLoops > (size - 36) / 24) wav->dwLoops = (size - 36) / 24;
+  if (!wav->dwLoops) return;
+  // smplのendはループに含まれる最後のフレーム
+  end = le32(p + 36 + 12);
+  wav->loop.dwStart     = le32(p + 36 + 8);
+  wav->loop.dwEnd       = end == 0xFFFFFFFF ? end : end + 1;
+  wav->loop.dwPlayCount = le32(p + 36 + 20);
+}
+
+static void
+wav_cue(LPSBWAV wav, const BYTE *p, DWORD size)
+{
+  if (size < 4) return;
+  wav->dwCues = le32(p);
+  if (wav->dwCues > (size - 4) / 24) wav->dwCues = (size - 4) / 24;
+  wav->pCues  = p + 4;
+}
+
+const char *
+sb_wav_parse(LPSBWAV wav, const BYTE *file, size_t size)
+{
+  const BYTE *p, *end;
+  const char *err;
+  DWORD       id_size;
+  int         has_fmt = 0;
+
+  memset(wav, 0, sizeof(*wav));
+  if (size < 12 || memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "WAVE", 4) != 0) return "not a WAV file";
+  // RIFFのサイズが実際より大きいファイルもあるので、ファイルの終わりで止める
+  end = file + size;
+  if ((size_t)le32(file + 4) + 8 < size) end = file + le32(file + 4) + 8;
+  for (p = file + 12; end - p >= 8; p += 8 + id_size + (id_size & 1)) {
+    id_size = le32(p + 4);
+    if ((size_t)(end - p - 8) < id_size) {
+      // 途中で切れたdataは読めたところまで使う
+      if (memcmp(p, "data", 4) != 0) break;
+      id_size = (DWORD)(end - p - 8);
+    }
+    if (memcmp(p, "fmt ", 4) == 0) {
+      err = wav_fmt(wav, p + 8, id_size);
+      if (err) return err;
+      has_fmt = 1;
+    }
+    else if (memcmp(p, "data", 4) == 0 && !wav->pData) {
+      wav->pData       = p + 8;
+      wav->dwDataBytes = id_size;
+    }
+    else if (memcmp(p, "smpl", 4) == 0) wav_smpl(wav, p + 8, id_size);
+    else if (memcmp(p, "cue ", 4) == 0) wav_cue(wav, p + 8, id_size);
+    else if (memcmp(p, "LIST", 4) == 0 && id_size >= 4 && memcmp(p + 8, "INFO", 4) == 0) {
+      wav->pInfo       = p + 12;
+      wav->dwInfoBytes = id_size - 4;
+    }
+  }
+  if (!has_fmt)    return "fmt chunk not found";
+  if (!wav->pData) return "data chunk not found";
+  wav->dwDataBytes -= wav->dwDataBytes % wav->nBlockAlign;
+  return NULL;
+}
+
+void
+sb_wav_cue(LPCSBWAV wav, DWORD i, LPDWORD id, LPDWORD frame)
+{
+  const BYTE *p = wav->pCues + i * 24;
+
+  *id    = le32(p);
+  *frame = le32(p + 20);  // dwSampleOffset
+}
+
+const char *
+sb_wav_info(LPCSBWAV wav, DWORD *pos, char id[5], LPDWORD len)
+{
+  const BYTE *p;
+  DWORD       size;
+
+  if (!wav->pInfo || *pos + 8 > wav->dwInfoBytes) return NULL;
+  p    = wav->pInfo + *pos;
+  size = le32(p + 4);
+  if (size > wav->dwInfoBytes - *pos - 8) size = wav->dwInfoBytes - *pos - 8;
+  memcpy(id, p, 4);
+  id[4] = '\0';
+  *len  = size;
+  while (*len && p[8 + *len - 1] == '\0') (*len)--;
+  *pos += 8 + size + (size & 1);
+  return (const char *)p + 8;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) <2015> <shinokaro>
+ *
+ * This software is provided 'as-is', without any express or implied
+ * warranty. In no event will the authors be held liable for any damages
+ * arising from the use of this software.
+ *
+ * Permission is granted to anyone to use this software for any purpose,
+ * including commercial applications, and to alter it and redistribute it
+ * freely, subject to the following restrictions:
+ *
+ *    1. The origin of this software must not be misrepresented; you must not
+ *    claim that you wrote the original software. If you use this software
+ *    in a product, an acknowledgment in the product documentation would be
+ *    appreciated but is not required.
+ *
+ *    2. Altered source versions must be plainly marked as such, and must not be
+ *    misrepresented as being the original software.
+ *
+ *    3. This notice may not be removed or altered from any source
+ *    distribution.
+ */
+/*
+ * WAVファイル（RIFF）のチャンクを読む。
+ * ファイルはメモリーに割り当てたまま読み、PCMはコピーせずにファイル中の位置を返す。
+ * 読むチャンクはfmt、data、cue、smpl、LIST（INFO）。それ以外は読み飛ばす。
+ */
+#ifndef SB_WAV_H
+#define SB_WAV_H
+
+#include "sb_backend.h"
+
+// smplのループ。位置はフレーム単位で、endはループに含まれない最初のフレーム
+typedef struct SBWavLoop {
+  DWORD dwStart;
+  DWORD dwEnd;
+  DWORD dwPlayCount;  // 0なら無限
+} SBWAVLOOP;
+
+typedef struct SBWav {
+  WORD        wFormatTag;       // WAVE_FORMAT_PCM or WAVE_FORMAT_IEEE_FLOAT
+  WORD        nChannels;
+  DWORD       nSamplesPerSec;
+  WORD        wBitsPerSample;
+  WORD        nBlockAlign;
+  DWORD       dwChannelMask;    // WAVE_FORMAT_EXTENSIBLEで無ければ0
+  const BYTE *pData;
+  DWORD       dwDataBytes;      // nBlockAlignの倍数に切り詰めてある
+  DWORD       dwLoops;          // smplのループの数
+  SBWAVLOOP   loop;             // 最初のループ
+  DWORD       dwCues;
+  const BYTE *pCues;            // cueの中身（24バイトずつ）
+  const BYTE *pInfo;            // LIST INFOの中身
+  DWORD       dwInfoBytes;
+} SBWAV, *LPSBWAV;
+typedef const SBWAV *LPCSBWAV;
+
+// 成功したらNULL、失敗したらエラーの説明を返す
+const char *sb_wav_parse(LPSBWAV wav, const BYTE *file, size_t size);
+// i番目のキュー・ポイントのIDと位置（フレーム）
+void        sb_wav_cue(LPCSBWAV wav, DWORD i, LPDWORD id, LPDWORD frame);
+/*
+ * INFOのサブチャンクを順に取り出す。*posは0から始め、終わったらNULLを返す。
+ * idは4文字のチャンクID、lenは末尾のNULを除いた文字列の長さ。
+ */
+const char *sb_wav_info(LPCSBWAV wav, DWORD *pos, char id[5], LPDWORD len);
+
+#endif /* SB_WAV_H */
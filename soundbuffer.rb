@@ -1,24 +1,35 @@
 require_relative 'soundbuffer.so'
 
 class SoundBuffer
+  # 最後の列はDSFX*構造体の詰め方（get_effect_params/set_effect_params用）。FLOATはf、LONGはl、DWORDはL
   FXList = [
-    [FX_GARGLE,       :FXGargle,      %w(RateHz WaveShape)],
-    [FX_CHORUS,       :FXChorus,      %w(WetDryMix Depth Feedback Frequency Waveform Delay Phase)],
-    [FX_FLANGER,      :FXFlanger,     %w(WetDryMix Depth Feedback Frequency Waveform Delay Phase)],
-    [FX_ECHO,         :FXEcho,        %w(WetDryMix Feedback LeftDelay RightDelay PanDelay)],
-    [FX_DISTORTION,   :FXDistortion,  %w(Gain Edge PostEQCenterFrequency PostEQBandwidth PreLowpassCutoff)],
-    [FX_COMPRESSOR,   :FXCompressor,  %w(Gain Attack Release Threshold Ratio Predelay)],
-    [FX_PARAM_EQ,     :FXParamEq,     %w(Center Bandwidth Gain)],
+    [FX_GARGLE,       :FXGargle,      %w(RateHz WaveShape), "L2"],
+    [FX_CHORUS,       :FXChorus,      %w(WetDryMix Depth Feedback Frequency Waveform Delay Phase), "f4lfl"],
+    [FX_FLANGER,      :FXFlanger,     %w(WetDryMix Depth Feedback Frequency Waveform Delay Phase), "f4lfl"],
+    [FX_ECHO,         :FXEcho,        %w(WetDryMix Feedback LeftDelay RightDelay PanDelay), "f4l"],
+    [FX_DISTORTION,   :FXDistortion,  %w(Gain Edge PostEQCenterFrequency PostEQBandwidth PreLowpassCutoff), "f5"],
+    [FX_COMPRESSOR,   :FXCompressor,  %w(Gain Attack Release Threshold Ratio Predelay), "f6"],
+    [FX_PARAM_EQ,     :FXParamEq,     %w(Center Bandwidth Gain), "f3"],
     [FX_I3DL2_REVERB, :FXI3DL2Reverb, %w(Room RoomHF RoomRolloffFactor DecayTime DecayHFRatio Reflections
-                                        ReflectionsDelay Reverb ReverbDelay Diffusion Density HFReference)],
-    [FX_WAVES_REVERB, :FXWavesReverb, %w(InGain ReverbMix ReverbTime HighFreqRTRatio)]
-  ].map { |(const, name, accessors)|
+                                        ReflectionsDelay Reverb ReverbDelay Diffusion Density HFReference), "l2f3lflf4"],
+    [FX_WAVES_REVERB, :FXWavesReverb, %w(InGain ReverbMix ReverbTime HighFreqRTRatio), "f4"]
+  ].map { |(const, name, accessors, pack)|
     const_set(name, Struct.new(*accessors.map!(&:to_sym)) {
+      const_set(:PACK, pack)
+      const_set(:SIZE, accessors.size * 4) # どのメンバーも4バイト
       eval "
         def self.to_i
           #{const}
         end
 
+        def self.unpack(str, offset = 0)
+          new(*str.unpack('@' + offset.to_s + self::PACK))
+        end
+
+        def pack(buffer = ''.b)
+          to_a.pack(self.class::PACK, buffer: buffer)
+        end
+
         def initialize(*args)
           args.empty? ? super(*#{name}_Default) : super ;
         end
@@ -40,33 +51,32 @@ class SoundBuffer
   FXWavesReverb_Default = [0.0, 0.0, 1000.0, 0.001].freeze
 
   def effect
-    get_effect.each_with_index.map { |fx_num, idx| FXList.find { |fx| fx.to_i == fx_num }.new(*get_effect_param(idx)) }
+    params = get_effect_params
+    offset = 0
+    get_effect.map { |fx_num|
+      klass = FXList.find { |fx| fx.to_i == fx_num }
+      klass.unpack(params, offset).tap { offset += klass::SIZE }
+    }
   end
 
+  # 並びが同じならパラメーターだけ入れ替え、バイパスもそのまま残す。
+  # 並びが変わるときは、再生中に変えられるバックエンド（live_effect?）なら止めずに移る
   def effect=(fx_lst)
-    stop_and_play{
-      set_effect(*fx_lst.map(&:to_i))
-      fx_lst.each_with_index { |fx, idx| set_effect_param(idx, *fx.to_a) }
+    nums   = fx_lst.map(&:to_i)
+    params = fx_lst.each_with_object("".b) { |fx, buf| fx.pack(buf) }
+    apply  = -> {
+      set_effect(*nums) unless get_effect == nums
+      set_effect_params(params)
     }
+    get_effect == nums || SoundBuffer.live_effect? ? apply.call : stop_and_play(&apply)
   end
 
   def jump(nth)
     self.pcm_pos = get_notify[nth]
   end
 
+  # ループ区間はバックエンド（dsoundはサービス・スレッド）が処理するので、waitするスレッドはいらない
   def loop=(flag)
-    @__thread = nil unless instance_variable_defined?(:@__thread)
-    if flag
-      set_loop(true)
-      if @__thread.nil? || !@__thread.alive?
-        @__thread = Thread.new { loop { wait; p :stop } while true }
-      end
-    else
-      set_loop(false)
-      if !@__thread.nil? || @__thread.alive?
-        @__thread.kill
-        @__thread = nil
-      end
-    end
+    set_loop(flag)
   end
 end
@@ -0,0 +1,99 @@
+# ループ区間のつなぎ目の誤差をサンプル単位で測る。
+# offlineバックエンドでレンダリングするのでサウンドカードはいらない。
+#
+#   ruby extconf.rb && make && ruby test/seam_test.rb
+#
+# 別の場所でビルドしたときはSOUNDBUFFER_BUILD_DIRにsoundbuffer.soのあるディレクトリーを指定する。
+ENV["SOUNDBUFFER_BACKEND"] = "offline"
+require File.join(ENV["SOUNDBUFFER_BUILD_DIR"] || File.expand_path("..", __dir__), "soundbuffer.so")
+require "minitest/autorun"
+
+class SeamTest < Minitest::Test
+  RATE   = 48000
+  FRAMES = 2000
+  SCALE  = 16     # 1フレーム進むごとに値がSCALE増えるランプ。1/SCALEサンプルまで位置がわかる
+  LIMIT  = 0.125  # 許容する誤差（サンプル）
+
+  def setup
+    SoundBuffer.set_format(2, RATE, 16)
+    pcm = (0...FRAMES).flat_map { |i| [i * SCALE] * 2 }.pack("s<*")
+    @sb = SoundBuffer.new(pcm, 2, RATE, 16, seamless: true)
+  end
+
+  def teardown
+    @sb.dispose
+  end
+
+  # 再生位置posの値。ループ中ならloop_endの手前のフレームはloop_startとの間を補間する
+  def expected(pos, lend, lstart)
+    i = pos.floor
+    a = i * SCALE
+    b = (i + 1 == lend ? lstart : i + 1) * SCALE
+    a + (b - a) * (pos - i)
+  end
+
+  # 出力のn番目に対する再生位置（ループで折り返したあと）
+  def position(n, step, lstart, lend)
+    pos = n * step
+    pos = lstart + (pos - lend) % (lend - lstart) if pos >= lend
+    pos
+  end
+
+  # つなぎ目の直後のサンプルでの位置のずれ（サンプル）の最大値
+  def seam_error(frequency, lstart, lend, frames)
+    @sb.loop_start = lstart
+    @sb.loop_end   = lend
+    @sb.set_loop(true)
+    @sb.frequency  = frequency
+    @sb.play
+    out  = @sb.render(frames).unpack("s<*").each_slice(2).map(&:first)
+    step = Rational(frequency, RATE)
+    seams = 0
+    error = 0.0
+    out.each_with_index do |v, n|
+      pos  = position(n, step, lstart, lend)
+      prev = n.zero? ? 0 : position(n - 1, step, lstart, lend)
+      next unless pos < prev || (pos.floor + 1 == lend)
+      # 折り返した直後と、折り返しをまたいで補間しているサンプル
+      seams += 1 if pos < prev
+      error = [error, (v - expected(pos, lend, lstart)).abs.to_f / SCALE].max
+    end
+    # つなぎ目以外も含めてどこにもずれがないこと
+    drift = out.each_with_index.map { |v, n| (v - expected(position(n, step, lstart, lend), lend, lstart)).abs.to_f / SCALE }.max
+    [seams, error, drift]
+  end
+
+  def check(frequency, lstart, lend, frames = 8000)
+    seams, error, drift = seam_error(frequency, lstart, lend, frames)
+    puts format("  %6d Hz  loop %4d...%4d  seams %2d  seam error %.4f samples  max error %.4f samples", frequency, lstart, lend, seams, error, drift) if $VERBOSE
+    assert_operator seams, :>, 1
+    assert_operator error, :<=, LIMIT
+    assert_operator drift, :<=, LIMIT
+  end
+
+  def test_seamless_flag
+    assert @sb.seamless?
+    assert @sb.dup.seamless?
+    refute SoundBuffer.new(FRAMES * 4, 2, RATE, 16).seamless?
+  end
+
+  def test_unity_rate
+    check(RATE, 500, 1500)
+  end
+
+  def test_slow_rate
+    check(RATE * 3 / 4, 500, 1500)
+  end
+
+  def test_fast_rate
+    check(RATE * 3 / 2, 100, 1900)
+  end
+
+  def test_uneven_rate
+    check(44100, 333, 1001)
+  end
+
+  def test_short_loop
+    check(RATE, 1000, 1007, 4000)
+  end
+end
@@ -0,0 +1,74 @@
+# 待っている間にほかのスレッドがdisposeやset_notifyをしても、
+# 待っている側が閉じたイベントを触らずに起きることを確かめる。
+# offlineバックエンドなのでサウンドカードはいらない。
+#
+#   ruby extconf.rb && make && ruby test/wait_test.rb
+#
+# 別の場所でビルドしたときはSOUNDBUFFER_BUILD_DIRにsoundbuffer.soのあるディレクトリーを指定する。
+ENV["SOUNDBUFFER_BACKEND"] = "offline"
+require File.join(ENV["SOUNDBUFFER_BUILD_DIR"] || File.expand_path("..", __dir__), "soundbuffer.so")
+require "minitest/autorun"
+
+class WaitTest < Minitest::Test
+  TIMEOUT = 3000  # ミリ秒。起こされなければこれだけ待ってnilになる
+
+  def new_buffer(*offsets)
+    SoundBuffer.new(4800, 1, 48000, 16).tap { |sb| sb.set_notify(*offsets) }
+  end
+
+  # 待ち始めるまで待ってから、起こされるまでの結果と時間を返す
+  def wake(thread)
+    sleep 0.05 until thread.status == "sleep"
+    sleep 0.05
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+    [thread.value, Process.clock_gettime(Process::CLOCK_MONOTONIC) - start]
+  end
+
+  def test_dispose_during_wait_any
+    5.times do
+      bufs = Array.new(3) { new_buffer(100, 200) }
+      th = Thread.new { SoundBuffer.wait_any(bufs, TIMEOUT) rescue $! }
+      result, time = wake(th) { bufs[1].dispose }
+      assert_kind_of SoundBufferError, result
+      assert_operator time, :<, 1
+      # 閉じたイベントを待つ側が返したあとも、ほかのバッファーはそのまま使える
+      bufs[0].play
+      bufs[0].render(300)
+      assert_equal [bufs[0], 0], SoundBuffer.wait_any([bufs[0], bufs[2]], TIMEOUT)
+      bufs.each { |sb| sb.dispose unless sb.disposed? }
+    end
+  end
+
+  def test_dispose_during_wait
+    sb = new_buffer(100)
+    th = Thread.new { sb.wait(TIMEOUT) rescue $! }
+    result, time = wake(th) { sb.dispose }
+    assert_kind_of SoundBufferError, result
+    assert_operator time, :<, 1
+  end
+
+  # 割り込みで起こしても、ほかの待ち合わせが空回りしない
+  def test_wait_any_after_interrupted_wait
+    sb = new_buffer(100)
+    th = Thread.new { sb.wait rescue $! }
+    result, = wake(th) { th.raise("stop") }
+    assert_equal "stop", result.message
+    start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    assert_nil SoundBuffer.wait_any([sb], 100)
+    assert_operator Process.clock_gettime(Process::CLOCK_MONOTONIC) - start, :>=, 0.09
+    sb.dispose
+  end
+
+  def test_set_notify_during_wait_any
+    bufs = Array.new(2) { new_buffer(100) }
+    th = Thread.new { SoundBuffer.wait_any(bufs, TIMEOUT) }
+    result, = wake(th) do
+      bufs[1].set_notify(50, 150)
+      bufs[1].play
+      bufs[1].render(100)
+    end
+    assert_equal [bufs[1], 0], result
+    bufs.each(&:dispose)
+  end
+end